@@ -0,0 +1,135 @@
+/**
+ * @author Rostislav Kral
+ * @brief Contains the fast path of the most common response: one question of type A or AAAA answered by a few
+ * addresses, maybe behind a CNAME chain. The decoder is specialized for the type at compile time and copies the binary
+ * addresses and TTLs into a fixed structure without any allocation, every other shape of the message is refused,
+ * so the caller falls back to the generic getAnswer() or validateMessage().
+ * @file address-answer.h
+ * */
+
+#ifndef ADDRESS_ANSWER_H
+#define ADDRESS_ANSWER_H
+
+#include "dns-resolver.h"
+#include <cstdint>
+#include <cstring>
+
+#define ADDRESS_ANSWER_MAX 16 // Addresses of the fast path, longer answers go the generic path
+#define ADDRESS_CNAME_MAX 8 // CNAME records before the addresses
+
+/**
+ * @brief Size and family of the address of the type, only A and AAAA are specialized
+ * */
+template <uint16_t QTYPE>
+struct ADDRESS_TYPE;
+
+template <>
+struct ADDRESS_TYPE<T_A> {
+    enum { size = 4, family = AF_INET };
+};
+
+template <>
+struct ADDRESS_TYPE<T_AAAA> {
+    enum { size = 16, family = AF_INET6 };
+};
+
+/**
+ * @brief Answer decoded by the fast path, RCODE is always NOERROR
+ * */
+template <uint16_t QTYPE>
+struct ADDRESS_ANSWER {
+    uint16_t id;
+    bool authoritative;
+    bool direct; // Every owner is a pointer to the question name, the records need no name decoding
+    uint8_t cnames; // CNAME records before the addresses
+    uint8_t count; // Addresses
+    uint32_t ttl; // Minimal TTL of all answers including the CNAME records
+    uint32_t ttls[ADDRESS_ANSWER_MAX];
+    unsigned char addresses[ADDRESS_ANSWER_MAX][ADDRESS_TYPE<QTYPE>::size]; // Network byte order
+};
+
+/**
+ * @brief Cheap check of the header selecting the fast path: response to a standard query without truncation,
+ * NOERROR, one question and at most the answers the fixed structure holds
+ * @param msg
+ * @param len
+ * @return bool
+ * */
+inline bool addressShape(const unsigned char *msg, size_t len)
+{
+    if (len < sizeof(DNS_HEADER))
+        return false;
+    const DNS_HEADER *header = reinterpret_cast<const DNS_HEADER *>(msg);
+    uint16_t ancount = ntohs(header->ancount);
+    return header->qr && header->opcode == 0 && !header->tc && header->rcode == RCODE_NOERROR &&
+           ntohs(header->qdcount) == 1 && ancount > 0 && ancount <= ADDRESS_ANSWER_MAX + ADDRESS_CNAME_MAX;
+}
+
+/**
+ * @brief Decodes the answer of the shape checked by addressShape(). The question must be uncompressed and of type
+ * QTYPE, every owner name a compression pointer (as written by nearly all servers), the answer section only CNAME
+ * records followed by QTYPE records. Owner names and CNAME targets are skipped, not read, and the authority and
+ * additional sections are ignored.
+ * @param msg Start of the DNS message
+ * @param len Length of the DNS message
+ * @param answer Output, undefined when false is returned
+ * @return false if the message has other shape, the generic path has to decode it
+ * */
+template <uint16_t QTYPE>
+bool decodeAddressAnswer(const unsigned char *msg, size_t len, ADDRESS_ANSWER<QTYPE> &answer)
+{
+    typedef ADDRESS_TYPE<QTYPE> Type;
+
+    if (!addressShape(msg, len))
+        return false;
+    const DNS_HEADER *header = reinterpret_cast<const DNS_HEADER *>(msg);
+
+    size_t pos = sizeof(DNS_HEADER);
+    while (pos < len && msg[pos] != 0)
+    {
+        if (msg[pos] > 63)
+            return false;
+        pos += msg[pos] + 1;
+    }
+    if (pos + 1 + sizeof(QUESTION) > len || ((msg[pos + 1] << 8) | msg[pos + 2]) != QTYPE)
+        return false;
+    pos += 1 + sizeof(QUESTION);
+
+    answer.id = ntohs(header->id);
+    answer.authoritative = header->aa;
+    answer.direct = true;
+    answer.cnames = answer.count = 0;
+    answer.ttl = UINT32_MAX;
+
+    uint16_t ancount = ntohs(header->ancount);
+    for (int i = 0; i < ancount; i++)
+    {
+        // Pointer owner and the fixed fields
+        if (pos + 12 > len || (msg[pos] & 0xC0) != 0xC0)
+            return false;
+        answer.direct = answer.direct && msg[pos] == 0xC0 && msg[pos + 1] == sizeof(DNS_HEADER);
+        const unsigned char *record = msg + pos + 2;
+        uint16_t type = (record[0] << 8) | record[1];
+        uint32_t ttl = ((uint32_t)record[4] << 24) | (record[5] << 16) | (record[6] << 8) | record[7];
+        uint16_t rdlength = (record[8] << 8) | record[9];
+        pos += 12;
+        if (pos + rdlength > len)
+            return false;
+
+        if (type == QTYPE && rdlength == Type::size && answer.count < ADDRESS_ANSWER_MAX)
+        {
+            answer.ttls[answer.count] = ttl;
+            memcpy(answer.addresses[answer.count++], msg + pos, Type::size);
+        }
+        else if (type == T_CNAME && answer.count == 0 && answer.cnames < ADDRESS_CNAME_MAX)
+            answer.cnames++;
+        else
+            return false;
+
+        answer.ttl = std::min(answer.ttl, ttl);
+        pos += rdlength;
+    }
+    return answer.count > 0;
+}
+
+#endif // ADDRESS_ANSWER_H
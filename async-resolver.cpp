@@ -0,0 +1,336 @@
+/**
+ * @author Rostislav Kral
+ * @brief Implementation of the AsyncResolver class.
+ * @file async-resolver.cpp
+ * */
+
+#include "async-resolver.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+AsyncResolver::AsyncResolver(Args args) : args(args), pending(65536), running(false), errorCount(0), lastErrno(0)
+{
+    nextId = (uint16_t)getpid();
+}
+
+AsyncResolver::~AsyncResolver()
+{
+    stop();
+
+    // Nobody waits in vain, the futures get the result too
+    std::vector<std::pair<Callback, BULK_RESULT>> finished;
+    for (PENDING &query : pending)
+    {
+        if (query.active)
+            finished.emplace_back(std::move(query.request.callback), result(query, RCODE_CANCELLED));
+    }
+    for (REQUEST &request : queue)
+    {
+        PENDING query;
+        query.request = request;
+        finished.emplace_back(std::move(request.callback), result(query, RCODE_CANCELLED));
+    }
+    for (auto &done : finished)
+        done.first(done.second);
+
+    for (int descriptor : {sock, epollFd, eventFd})
+    {
+        if (descriptor != -1)
+            close(descriptor);
+    }
+}
+
+bool AsyncResolver::open(std::string &error)
+{
+    try
+    {
+        sock = connectSocket(args, SOCK_DGRAM);
+    }
+    catch (const TransportError &failure)
+    {
+        error = failure.what();
+        return false;
+    }
+
+    int bufferSize = 4 * 1024 * 1024;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epollFd == -1 || eventFd == -1)
+    {
+        error = std::string("Cannot create the event loop: ") + strerror(errno);
+        return false;
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = sock;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, sock, &event);
+    event.data.fd = eventFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, eventFd, &event);
+    return true;
+}
+
+void AsyncResolver::failed(int error)
+{
+    lastErrno = error;
+    errorCount++;
+}
+
+void AsyncResolver::wake()
+{
+    uint64_t one = 1;
+    if (eventFd != -1 && write(eventFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        failed(errno);
+}
+
+void AsyncResolver::resolve(const std::string &name, uint16_t qtype, Callback callback)
+{
+    resolve(name, qtype, std::move(callback), Deadline::after(args.budget));
+}
+
+void AsyncResolver::resolve(const std::string &name, uint16_t qtype, Callback callback, Deadline deadline)
+{
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        queue.push_back(REQUEST{name, qtype, std::move(callback), std::move(deadline)});
+    }
+    wake();
+}
+
+std::future<BULK_RESULT> AsyncResolver::resolve(const std::string &name, uint16_t qtype)
+{
+    return resolve(name, qtype, Deadline::after(args.budget));
+}
+
+std::future<BULK_RESULT> AsyncResolver::resolve(const std::string &name, uint16_t qtype, Deadline deadline)
+{
+    std::shared_ptr<std::promise<BULK_RESULT>> promise = std::make_shared<std::promise<BULK_RESULT>>();
+    resolve(name, qtype, [promise](const BULK_RESULT &result) { promise->set_value(result); }, std::move(deadline));
+    return promise->get_future();
+}
+
+BULK_RESULT AsyncResolver::result(const PENDING &query, int rcode) const
+{
+    BULK_RESULT result;
+    result.name = query.request.name;
+    result.qtype = query.request.qtype;
+    result.rcode = rcode;
+    if (query.tries > 0)
+        result.rtt = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - query.first).count();
+    return result;
+}
+
+void AsyncResolver::transmit(uint16_t id)
+{
+    unsigned char buf[MAX_DNS_SIZE];
+    PENDING &query = pending[id];
+    size_t length = buildQuery(buf, id, query.request.name, query.request.qtype, args.recursion);
+
+    query.sequence = ++sequence;
+    query.sent = Clock::now();
+    query.tries++;
+
+    // Full socket buffer loses only this datagram, the timeout sends it again
+    if (send(sock, buf, length, 0) < 0 && errno != EAGAIN && errno != ECONNREFUSED)
+        failed(errno);
+    timeouts.emplace_back(id, sequence);
+
+    // Timer of the try covers the deadline when it comes later
+    const Deadline &deadline = query.request.deadline;
+    if (deadline.at() < query.sent + std::chrono::milliseconds(args.timeout))
+        deadlines.push(DEADLINE_ENTRY{deadline.at(), id, sequence});
+    if (deadline.cancellation().cancellable())
+        cancellable.emplace_back(id, sequence);
+}
+
+void AsyncResolver::finish(uint16_t id, int rcode, std::vector<std::pair<Callback, BULK_RESULT>> &finished)
+{
+    PENDING &query = pending[id];
+    query.active = false;
+    active--;
+    finished.emplace_back(std::move(query.request.callback), result(query, rcode));
+}
+
+void AsyncResolver::submit()
+{
+    std::vector<std::pair<Callback, BULK_RESULT>> invalid;
+
+    std::unique_lock<std::mutex> lock(queueMutex);
+    while (!queue.empty() && active < pending.size() - 1)
+    {
+        REQUEST request = std::move(queue.front());
+        queue.pop_front();
+
+        if (!request.name.empty() && request.name.back() == '.' && request.name.size() > 1)
+            request.name.pop_back();
+        unsigned char wire[MAX_DNS_SIZE];
+        bool expired = request.deadline.expired(Clock::now());
+        if (request.name.empty() || encodeName(request.name, wire) == 0 || expired)
+        {
+            PENDING query;
+            query.request = std::move(request);
+            invalid.emplace_back(query.request.callback,
+                                 result(query, expired ? deadlineRcode(query.request.deadline) : RCODE_INVALID));
+            continue;
+        }
+
+        // IDs in flight are skipped, the queue waits when all of them are used
+        while (pending[nextId].active)
+            nextId++;
+        uint16_t id = nextId++;
+        PENDING &query = pending[id];
+        query = PENDING();
+        query.active = true;
+        query.first = Clock::now();
+        query.request = std::move(request);
+        active++;
+        transmit(id);
+    }
+    lock.unlock();
+
+    for (auto &done : invalid)
+        done.first(done.second);
+}
+
+void AsyncResolver::receive(std::vector<std::pair<Callback, BULK_RESULT>> &finished)
+{
+    unsigned char buf[MAX_DNS_SIZE];
+    ssize_t received;
+
+    while ((received = recv(sock, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+    {
+        if (received < (ssize_t)sizeof(DNS_HEADER))
+            continue;
+
+        PENDING &query = pending[ntohs(reinterpret_cast<DNS_HEADER *>(buf)->id)];
+        if (!query.active)
+            continue;
+        BULK_RESULT answer = result(query, RCODE_TIMEOUT);
+        if (!parseResult(buf, received, answer))
+            continue; // Late, spoofed or broken answer
+
+        query.active = false;
+        active--;
+        finished.emplace_back(std::move(query.request.callback), std::move(answer));
+    }
+}
+
+void AsyncResolver::expire(std::vector<std::pair<Callback, BULK_RESULT>> &finished)
+{
+    Clock::time_point now = Clock::now();
+
+    while (!timeouts.empty())
+    {
+        uint16_t id = timeouts.front().first;
+        PENDING &query = pending[id];
+        if (!query.active || query.sequence != timeouts.front().second)
+        {
+            timeouts.pop_front();
+            continue;
+        }
+        if (now - query.sent < std::chrono::milliseconds(args.timeout))
+            break;
+
+        timeouts.pop_front();
+        if (query.request.deadline.expired(now))
+            finish(id, deadlineRcode(query.request.deadline), finished); // No budget for one more try
+        else if (query.tries < args.tries)
+            transmit(id);
+        else
+            finish(id, RCODE_TIMEOUT, finished);
+    }
+
+    // The budget ends during the try
+    while (!deadlines.empty() && deadlines.top().at <= now)
+    {
+        DEADLINE_ENTRY entry = deadlines.top();
+        deadlines.pop();
+        if (pending[entry.id].active && pending[entry.id].sequence == entry.sequence)
+            finish(entry.id, deadlineRcode(pending[entry.id].request.deadline), finished);
+    }
+
+    // Cancelled tokens, the entries of finished queries are dropped on the way
+    size_t kept = 0;
+    for (const std::pair<uint16_t, uint32_t> &entry : cancellable)
+    {
+        PENDING &query = pending[entry.first];
+        if (!query.active || query.sequence != entry.second)
+            continue;
+        if (query.request.deadline.cancelled())
+            finish(entry.first, RCODE_CANCELLED, finished);
+        else
+            cancellable[kept++] = entry;
+    }
+    cancellable.resize(kept);
+}
+
+int AsyncResolver::nextTimeout()
+{
+    // Skipping the entries of the answered queries, so the loop doesn't wake for nothing
+    while (!timeouts.empty() && (!pending[timeouts.front().first].active ||
+                                 pending[timeouts.front().first].sequence != timeouts.front().second))
+        timeouts.pop_front();
+    if (timeouts.empty())
+        return -1;
+
+    Clock::time_point next = pending[timeouts.front().first].sent + std::chrono::milliseconds(args.timeout);
+    if (!deadlines.empty())
+        next = std::min(next, deadlines.top().at);
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(next - Clock::now());
+    int wait = std::max(0, (int)left.count() + 1);
+    return cancellable.empty() ? wait : std::min(wait, DEADLINE_SLICE_MS);
+}
+
+size_t AsyncResolver::poll(int timeout)
+{
+    std::vector<std::pair<Callback, BULK_RESULT>> finished;
+    struct epoll_event events[ASYNC_MAX_EVENTS];
+
+    if (epollFd == -1)
+        return 0;
+
+    submit();
+
+    int deadline = nextTimeout();
+    int wait = deadline < 0 ? timeout : (timeout < 0 ? deadline : std::min(timeout, deadline));
+    int count = epoll_wait(epollFd, events, ASYNC_MAX_EVENTS, wait);
+    for (int i = 0; i < count; i++)
+    {
+        if (events[i].data.fd == eventFd)
+        {
+            uint64_t value;
+            if (read(eventFd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+                failed(errno);
+        }
+    }
+
+    receive(finished);
+    expire(finished);
+    submit(); // Queued while waiting
+
+    // Callbacks may queue more queries, no lock is held here
+    for (auto &done : finished)
+        done.first(done.second);
+    return finished.size();
+}
+
+void AsyncResolver::start()
+{
+    if (running.exchange(true))
+        return;
+    thread = std::thread([this]() {
+        while (running.load())
+            poll(-1);
+    });
+}
+
+void AsyncResolver::stop()
+{
+    if (!running.exchange(false))
+        return;
+    wake();
+    thread.join();
+}
@@ -0,0 +1,234 @@
+/**
+ * @author Rostislav Kral
+ * @brief Contains AsyncResolver class, library interface resolving many names at once over one UDP socket driven
+ * by epoll, the results come back by callbacks, futures or C++20 coroutines.
+ * @file async-resolver.h
+ * */
+
+#ifndef ASYNC_RESOLVER_H
+#define ASYNC_RESOLVER_H
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include "bulk-resolver.h"
+
+#ifdef __cpp_impl_coroutine
+#include <coroutine>
+#endif
+
+#define ASYNC_MAX_EVENTS 16 // Events taken from epoll at once
+
+/**
+ * @brief Resolver for embedding, no call blocks, exits or prints. Every query ends with exactly one BULK_RESULT,
+ * failures are values in its rcode (RCODE_TIMEOUT, RCODE_INVALID, RCODE_CANCELLED or the RCODE of the server).
+ * Query ends with RCODE_TIMEOUT at its deadline (args.budget by default) and with RCODE_CANCELLED when its token
+ * is cancelled, without waiting for the retransmission timer.
+ *
+ * The loop is driven either by the application (poll() when fd() is readable or the timeout from nextTimeout()
+ * passes) or by the internal thread started by start(). resolve() may be called from any thread and from the
+ * callbacks, the callbacks run on the thread of the loop.
+ * */
+class AsyncResolver {
+public:
+    typedef std::function<void(const BULK_RESULT &result)> Callback;
+
+    /**
+     * @brief Constructor of the AsyncResolver, args select the server, the timeout and the number of tries
+     * @param args
+     * */
+    explicit AsyncResolver(Args args);
+
+    /**
+     * @brief Stops the loop, queries without answer are finished with RCODE_CANCELLED
+     * */
+    ~AsyncResolver();
+
+    /**
+     * @brief Connects the socket and creates the epoll instance
+     * @param error Output, reason of the failure
+     * @return false if the server can't be used
+     * */
+    bool open(std::string &error);
+
+    /**
+     * @brief Queues the query, the callback gets the result on the thread of the loop
+     * @param name
+     * @param qtype
+     * @param callback
+     * @return
+     * */
+    void resolve(const std::string &name, uint16_t qtype, Callback callback);
+
+    /**
+     * @brief Queues the query with its own deadline and cancellation token
+     * @param name
+     * @param qtype
+     * @param callback
+     * @param deadline
+     * @return
+     * */
+    void resolve(const std::string &name, uint16_t qtype, Callback callback, Deadline deadline);
+
+    /**
+     * @brief Queues the query, the future is ready when the result arrives
+     * @param name
+     * @param qtype
+     * @return std::future<BULK_RESULT>
+     * */
+    std::future<BULK_RESULT> resolve(const std::string &name, uint16_t qtype);
+
+    std::future<BULK_RESULT> resolve(const std::string &name, uint16_t qtype, Deadline deadline);
+
+#ifdef __cpp_impl_coroutine
+    /**
+     * @brief Awaitable of one query, the coroutine continues on the thread of the loop
+     * */
+    struct ResolveAwaiter {
+        AsyncResolver &resolver;
+        std::string name;
+        uint16_t qtype;
+        Deadline deadline;
+        BULK_RESULT result;
+
+        bool await_ready() const noexcept { return false; }
+
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            resolver.resolve(name, qtype, [this, handle](const BULK_RESULT &answer) {
+                result = answer;
+                handle.resume();
+            }, deadline);
+        }
+
+        BULK_RESULT await_resume() { return std::move(result); }
+    };
+
+    /**
+     * @brief co_await resolver.lookup(name, type) gives the BULK_RESULT
+     * @param name
+     * @param qtype
+     * @return ResolveAwaiter
+     * */
+    ResolveAwaiter lookup(const std::string &name, uint16_t qtype)
+    {
+        return ResolveAwaiter{*this, name, qtype, Deadline::after(args.budget), {}};
+    }
+
+    ResolveAwaiter lookup(const std::string &name, uint16_t qtype, Deadline deadline)
+    {
+        return ResolveAwaiter{*this, name, qtype, std::move(deadline), {}};
+    }
+#endif
+
+    /**
+     * @brief One iteration of the loop: sends the queued queries, waits for the answers, retransmits the lost ones
+     * @param timeout Milliseconds to wait at most, 0 only handles what is ready
+     * @return size_t number of finished queries
+     * */
+    size_t poll(int timeout);
+
+    /**
+     * @brief Epoll descriptor for the loop of the application, readable when poll() has work
+     * @return int
+     * */
+    int fd() const { return epollFd; }
+
+    /**
+     * @brief Milliseconds until poll() has to be called even without any event, -1 when nothing is in flight
+     * @return int
+     * */
+    int nextTimeout();
+
+    /**
+     * @brief Runs the loop on the internal thread until stop()
+     * @return
+     * */
+    void start();
+
+    /**
+     * @brief Stops the internal thread, the queries stay queued for the next start() or poll()
+     * @return
+     * */
+    void stop();
+
+    size_t inFlight() const { return active; }
+
+    /**
+     * @brief Failed system calls of the loop (send, wake), the lost datagram is sent again by the timeout
+     * @return uint64_t
+     * */
+    uint64_t errors() const { return errorCount; }
+
+    /**
+     * @brief errno of the last failed system call, 0 when none failed
+     * @return int
+     * */
+    int lastError() const { return lastErrno; }
+
+    /**
+     * @brief Makes the waiting poll() return, may be called from any thread
+     * @return
+     * */
+    void wake();
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct REQUEST {
+        std::string name;
+        uint16_t qtype;
+        Callback callback;
+        Deadline deadline;
+    };
+
+    struct PENDING {
+        bool active = false;
+        uint32_t sequence = 0;
+        int tries = 0;
+        Clock::time_point first;
+        Clock::time_point sent;
+        REQUEST request;
+    };
+
+    void submit();
+
+    void transmit(uint16_t id);
+
+    void receive(std::vector<std::pair<Callback, BULK_RESULT>> &finished);
+
+    void expire(std::vector<std::pair<Callback, BULK_RESULT>> &finished);
+
+    void finish(uint16_t id, int rcode, std::vector<std::pair<Callback, BULK_RESULT>> &finished);
+
+    BULK_RESULT result(const PENDING &query, int rcode) const;
+
+    void failed(int error);
+
+    Args args;
+    int sock = -1;
+    int epollFd = -1;
+    int eventFd = -1;
+
+    std::mutex queueMutex; // Guards only the queue, the rest belongs to the thread of the loop
+    std::deque<REQUEST> queue;
+
+    std::vector<PENDING> pending;
+    std::deque<std::pair<uint16_t, uint32_t>> timeouts; // (ID, sequence) in the order of transmission
+    DeadlineQueue deadlines; // Queries with a deadline before their last timeout
+    std::vector<std::pair<uint16_t, uint32_t>> cancellable; // Queries with a token, checked by every poll()
+    size_t active = 0;
+    uint16_t nextId = 0;
+    uint32_t sequence = 0;
+
+    std::thread thread;
+    std::atomic<bool> running;
+    std::atomic<uint64_t> errorCount; // wake() runs on any thread
+    std::atomic<int> lastErrno;
+};
+
+#endif // ASYNC_RESOLVER_H
@@ -0,0 +1,766 @@
+/**
+ * @author Rostislav Kral
+ * @brief Micro benchmarks of the resolver hot paths, every optimized variant is measured against its reference.
+ * @file bench.cpp
+ * */
+
+#include <chrono>
+#include <random>
+#include "dns-resolver.h"
+#include "name-utils.h"
+#include "stub-server.h"
+#include "packet-log.h"
+#include "resolver-session.h"
+#include "name-input.h"
+#include "message-index.h"
+#include "address-answer.h"
+#include <fstream>
+
+// Result of the benchmarked function is accumulated here, so the compiler can't drop the call
+static volatile uint64_t sink;
+
+/**
+ * @brief Runs the body rounds times and prints the time per item
+ * @param label Name of the measured variant
+ * @param items Number of items processed by one round
+ * @param rounds Number of repetitions
+ * @param body Function processing all items once
+ * @return double nanoseconds per item
+ * */
+template <typename Body>
+static double measure(const char *label, size_t items, int rounds, Body body)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int round = 0; round < rounds; round++)
+        body();
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    double perItem = ns / ((double)items * rounds);
+
+    std::cout << "  " << std::left << std::setw(32) << label << std::right << std::setw(10) << std::fixed
+              << std::setprecision(2) << perItem << " ns/op" << std::endl;
+    return perItem;
+}
+
+static void printSpeedup(double reference, double optimized)
+{
+    std::cout << "  speedup " << std::setprecision(2) << reference / optimized << "x" << std::endl << std::endl;
+}
+
+// Random mixed case names of typical length (most of them between 10 and 40 bytes)
+static std::vector<std::string> generateNames(size_t count)
+{
+    std::mt19937 random(42);
+    std::vector<std::string> names;
+    const char alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-";
+
+    names.reserve(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        std::string name;
+        int labels = 2 + random() % 3;
+        for (int label = 0; label < labels; label++)
+        {
+            int labelLength = 1 + random() % 14;
+            if (label > 0)
+                name += '.';
+            for (int j = 0; j < labelLength; j++)
+                name += alphabet[random() % (sizeof(alphabet) - 2)];
+        }
+        names.push_back(name);
+    }
+    return names;
+}
+
+static void benchNames()
+{
+    std::vector<std::string> names = generateNames(200000);
+    std::vector<std::string> upper(names);
+    std::vector<char> out(256);
+    const int rounds = 20;
+    double reference, optimized;
+
+    for (std::string &name : upper)
+        std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+
+    std::cout << "Name utilities (" << names.size() << " names, implementation " << nameUtilsImplementation() << ")"
+              << std::endl;
+
+    reference = measure("nameToLower scalar", names.size(), rounds, [&] {
+        for (const std::string &name : names)
+            nameToLowerScalar(name.data(), out.data(), name.size());
+        sink += out[0];
+    });
+    optimized = measure("nameToLower", names.size(), rounds, [&] {
+        for (const std::string &name : names)
+            nameToLower(name.data(), out.data(), name.size());
+        sink += out[0];
+    });
+    printSpeedup(reference, optimized);
+
+    reference = measure("nameEquals scalar", names.size(), rounds, [&] {
+        for (size_t i = 0; i < names.size(); i++)
+            sink += nameEqualsScalar(names[i].data(), names[i].size(), upper[i].data(), upper[i].size());
+    });
+    optimized = measure("nameEquals", names.size(), rounds, [&] {
+        for (size_t i = 0; i < names.size(); i++)
+            sink += nameEquals(names[i].data(), names[i].size(), upper[i].data(), upper[i].size());
+    });
+    printSpeedup(reference, optimized);
+
+    reference = measure("nameHash scalar", names.size(), rounds, [&] {
+        for (const std::string &name : names)
+            sink += nameHashScalar(name.data(), name.size());
+    });
+    optimized = measure("nameHash", names.size(), rounds, [&] {
+        for (const std::string &name : names)
+            sink += nameHash(name.data(), name.size());
+    });
+    printSpeedup(reference, optimized);
+
+    reference = measure("validateName scalar", names.size(), rounds, [&] {
+        for (const std::string &name : names)
+            sink += validateNameScalar(name.data(), name.size());
+    });
+    optimized = measure("validateName", names.size(), rounds, [&] {
+        for (const std::string &name : names)
+            sink += validateName(name.data(), name.size());
+    });
+    printSpeedup(reference, optimized);
+}
+
+// Stub zone answers, compared with the query rate the client can reach
+static void benchStub()
+{
+    std::vector<std::string> names = generateNames(10000);
+    std::ostringstream text;
+    StubZone zone;
+    std::string error;
+
+    text << "$ORIGIN bench.\n@ SOA ns1 hostmaster 1 3600 600 86400 300\n";
+    for (size_t i = 0; i < names.size(); i++)
+        text << names[i] << " A 10.0." << (i >> 8) % 256 << "." << i % 256 << "\n";
+    std::istringstream input(text.str());
+    zone.load(input, error);
+
+    // Every second query misses the zone and gets NXDOMAIN
+    std::vector<std::vector<unsigned char>> queries;
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        std::vector<unsigned char> query(MAX_DNS_SIZE);
+        query.resize(buildQuery(query.data(), i, names[i] + (i % 2 ? ".bench" : ".nx.bench"), T_A, true));
+        queries.push_back(query);
+    }
+
+    std::cout << "stub server, " << zone.records() << " records" << std::endl;
+    unsigned char out[MAX_DNS_SIZE];
+    double ns = measure("StubZone::answer", queries.size(), 200, [&]() {
+        for (const std::vector<unsigned char> &query : queries)
+            sink += zone.answer(query.data(), query.size(), out);
+    });
+    std::cout << "  " << std::setprecision(1) << 1000 / ns << " M answers/s per thread" << std::endl << std::endl;
+}
+
+// Cost of logging one response on the resolver thread, the hex dump is the reference
+static void benchLog()
+{
+    StubZone zone;
+    std::string error;
+    std::istringstream input("$ORIGIN bench.\nwww CNAME web\nweb A 10.0.0.1\n");
+    zone.load(input, error);
+
+    unsigned char query[MAX_DNS_SIZE], response[MAX_DNS_SIZE];
+    size_t length = zone.answer(query, buildQuery(query, 1, "www.bench", T_A, true), response);
+    const size_t messages = 10000;
+
+    std::cout << "packet log, " << length << " B responses" << std::endl;
+    std::ostringstream discard;
+    std::streambuf *console = std::cout.rdbuf(discard.rdbuf());
+    DnsResolver dnsResolver((Args()));
+    dnsResolver.useMessage(response, length);
+    double reference = measure("DnsResolver::printData", messages, 5, [&]() {
+        for (size_t i = 0; i < messages; i++)
+            dnsResolver.printData();
+        discard.str("");
+    });
+    std::cout.rdbuf(console);
+    std::cout.fill(' '); // The hex dump leaves '0' there
+
+    PacketLogger logger("/tmp/dns-bench.log");
+    PACKET_LOG_ENTRY entry;
+    // One round fits into the ring, so the writer thread never makes the producer drop
+    double optimized = measure("PacketLogger::log", messages, 1, [&]() {
+        for (size_t i = 0; i < messages; i++)
+            logger.log(entry, response, length);
+    });
+    logger.close();
+    unlink("/tmp/dns-bench.log");
+    std::cout << "  " << logger.dropped() << " of " << logger.logged() + logger.dropped() << " dropped" << std::endl;
+    printSpeedup(reference, optimized);
+}
+
+// Input of the bulk run, getline() per name against the mapped file split ahead, every fourth name repeats
+static void benchInput()
+{
+    std::vector<std::string> names = generateNames(2000000);
+    const char *path = "/tmp/dns-bench-names.txt";
+    {
+        std::ofstream file(path);
+        for (size_t i = 0; i < names.size(); i++)
+            file << names[i % 4 == 3 ? i / 2 : i] << "\n";
+    }
+    std::string text;
+    {
+        std::ifstream file(path);
+        std::ostringstream content;
+        content << file.rdbuf();
+        text = content.str();
+    }
+
+    std::cout << "input, " << names.size() << " names, " << text.size() / (1 << 20) << " MB" << std::endl;
+    std::vector<uint32_t> offsets;
+    offsets.reserve(names.size());
+    double reference = measure("findNewlinesScalar", names.size(), 5, [&]() {
+        offsets.clear();
+        findNewlinesScalar(text.data(), text.size(), offsets);
+        sink += offsets.size();
+    });
+    double optimized = measure("findNewlines", names.size(), 5, [&]() {
+        offsets.clear();
+        findNewlines(text.data(), text.size(), offsets);
+        sink += offsets.size();
+    });
+    printSpeedup(reference, optimized);
+
+    std::string name;
+    for (bool unique : {false, true})
+    {
+        reference = measure(unique ? "StreamNameSource unique" : "StreamNameSource", names.size(), 1, [&]() {
+            std::ifstream file(path);
+            StreamNameSource source(file, unique);
+            while (source.next(name))
+                sink += name.size();
+        });
+        optimized = measure(unique ? "MappedNameSource unique" : "MappedNameSource", names.size(), 1, [&]() {
+            MappedNameSource source(path, unique);
+            while (source.next(name))
+                sink += name.size();
+        });
+        printSpeedup(reference, optimized);
+    }
+    unlink(path);
+}
+
+// Round trips to the local stub server, setup of every DnsResolver against one ResolverSession
+static void benchSession()
+{
+    StubZone zone;
+    std::string error;
+    std::istringstream input("$ORIGIN bench.\nwww A 10.0.0.1\n");
+    zone.load(input, error);
+    StubUdpServer server(zone);
+
+    Args args;
+    args.server = (char *)"localhost"; // Name of the server, like -s with a hostname
+    args.port = server.start();
+    args.domain = "www.bench";
+    const size_t queries = 2000;
+
+    std::cout << "session, " << queries << " queries over loopback" << std::endl;
+    double reference = measure("DnsResolver per query", queries, 1, [&]() {
+        for (size_t i = 0; i < queries; i++)
+        {
+            DnsResolver dnsResolver(args);
+            dnsResolver.connectToDNSServer();
+            dnsResolver.query();
+            sink += dnsResolver.getAnswer().ancount;
+        }
+    });
+    ResolverSession session(args);
+    double optimized = measure("ResolverSession::resolve", queries, 1, [&]() {
+        for (size_t i = 0; i < queries; i++)
+            sink += session.resolve(args.domain, T_A).answers.size();
+    });
+    printSpeedup(reference, optimized);
+}
+
+// getAnswer() before the validation pass, unchecked reads trusting the counts and RDLENGTH, kept as the reference
+static DNS_INFO legacyGetAnswer(const unsigned char *buf, int packetSize)
+{
+    const QUESTION *qinfo = reinterpret_cast<const QUESTION *>(buf + sizeof(DNS_HEADER) + strlen((const char *)buf + sizeof(DNS_HEADER)) + 1);
+
+    DNS_INFO dnsInfo;
+
+    // ---------------------------------------------- DNS HEADER PARSING ---------------------------------------------------------
+    const DNS_HEADER *dnsHeader = reinterpret_cast<const DNS_HEADER *>(buf);
+    //    uint16_t id = ntohs(dnsHeader->id);
+    uint16_t qdcount = ntohs(dnsHeader->qdcount);
+    uint16_t ancount = ntohs(dnsHeader->ancount);
+    uint16_t arcount = ntohs(dnsHeader->arcount);
+    uint16_t nscount = ntohs(dnsHeader->nscount);
+
+    dnsInfo.qdcount = qdcount;
+    dnsInfo.ancount = ancount;
+    dnsInfo.arcount = arcount;
+    dnsInfo.nscount = nscount;
+
+    std::string aa, rd, tc;
+    aa = (ntohs(dnsHeader->aa) ? "Yes" : "No");
+    rd = (ntohs(dnsHeader->rd) ? "Yes" : "No");
+    tc = (ntohs(dnsHeader->tc) ? "Yes" : "No");
+
+    dnsInfo.aa = aa;
+    dnsInfo.rd = rd;
+    dnsInfo.tc = tc;
+    dnsInfo.rcode = dnsHeader->rcode;
+
+    int offset = 12; // RFC1035 DNS header packet structure
+    const unsigned char *questionPtr = buf + sizeof(DNS_HEADER);
+
+    // ---------------------------------------------- END OF DNS HEADER PARSING ---------------------------------------------------------
+
+    // ---------------------------------------------- DNS QUESTION PARSING --------------------------------------------------------------
+    // Parse QNAME
+    int questionLength = 0;
+    std::string questionName;
+    while (questionPtr[questionLength] != 0)
+    {
+        int labelLength = questionPtr[questionLength];
+        for (int i = 0; i < labelLength; i++)
+        {
+            questionName += questionPtr[questionLength + i + 1];
+        }
+        questionLength += labelLength + 1;
+        questionName += ".";
+    }
+
+    dnsInfo.questionName = questionName;
+
+    std::string type;
+    if (ntohs(qinfo->qtype) == T_A)
+        type = "A";
+    else if (ntohs(qinfo->qtype) == T_AAAA)
+        type = "AAAA";
+    else if (ntohs(qinfo->qtype) == T_PTR)
+        type = "PTR";
+
+    questionPtr += questionLength + 5;
+
+    dnsInfo.type = type;
+
+    // ---------------------------------------------- END OF DNS QUESTION PARSING --------------------------------------------------------------
+
+    // ----------------------------------------------- DNS ANSWERS SECTION PARSING -------------------------------------------------------------
+    const unsigned char *answerPtr = questionPtr;
+    uint16_t rdlength;
+    for (int i = 0; i < ancount; i++)
+    {
+        uint16_t type;
+        uint32_t ttl;
+        DNS_REC record;
+        std::string parsedName;
+
+        // Parse TYPE
+        memcpy(&type, answerPtr + 2, sizeof(uint16_t));
+        type = ntohs(type);
+        // Parse TTL
+        memcpy(&ttl, answerPtr + 6, sizeof(uint32_t));
+        ttl = ntohl(ttl);
+        record.ttl = ttl;
+
+        // Parse RDLENGTH
+        memcpy(&rdlength, answerPtr + 10, sizeof(uint16_t));
+        rdlength = ntohs(rdlength);
+
+        // Parse NAME
+        if (type != T_CNAME)
+        {
+            parseName(answerPtr, buf, parsedName);
+
+            if (*answerPtr != 192)
+            {
+                answerPtr = answerPtr + (parsedName.length() - 1);
+            }
+
+            record.name = parsedName;
+        }
+
+        // Parse RDATA
+        if (type == T_A)
+        {
+            std::ostringstream stringStream;
+            stringStream << (int)*(answerPtr + offset) << "." << (int)*(answerPtr + offset + 1) << "."
+                         << (int)*(answerPtr + offset + 2) << "." << (int)*(answerPtr + offset + 3);
+            record.value = stringStream.str();
+            record.type = "A";
+        }
+        else if (type == T_AAAA)
+        {
+
+            std::ostringstream stringStream;
+            std::ostringstream temp;
+            int len;
+
+            for(int i = 0; i < 16; i+=2)
+            {
+
+                temp << std::hex << ntohs(*reinterpret_cast<const uint16_t *>(answerPtr + offset + i));
+
+                len = temp.str().length();
+               if(len != 4) {
+                    for(int i = 0; i < 4 - len; i++) temp << std::hex << "0";
+                }
+
+                stringStream << std::hex << temp.str();
+                if(i != 14) stringStream << ":";
+                temp.str("");
+
+            }
+
+            record.value = stringStream.str();
+            record.type = "AAAA";
+        }
+        else if (type == T_CNAME)
+        {
+            std::string parsedName, parsedCName;
+
+            parseName(answerPtr, buf, parsedCName);
+            if (*answerPtr != 192)
+            {
+                answerPtr = answerPtr + (parsedCName.length() - 1);
+            }
+            parseName(answerPtr + offset, buf, parsedName);
+
+            record.value = parsedName;
+            record.name = parsedCName;
+
+            record.type = "CNAME";
+        }
+        else if (type == T_PTR)
+        {
+            int labelLength = 0;
+            std::ostringstream stringStream;
+
+            while (answerPtr[labelLength + offset] != 0)
+            {
+                int currentLabelLength = answerPtr[labelLength + offset];
+                for (int j = 0; j < currentLabelLength; j++)
+                {
+                    stringStream << answerPtr[labelLength + offset + j + 1];
+                }
+                labelLength += currentLabelLength + 1;
+                if (answerPtr[labelLength + offset] != 0)
+                    stringStream << ".";
+            }
+
+            record.value = stringStream.str();
+            record.type = "PTR";
+        }
+        else
+            record.type = "UNSUPPORTED";
+        answerPtr += offset + rdlength;
+
+        dnsInfo.answers.push_back(record);
+    }
+    // ------------------------------------------------------------------- END OF DNS ANSWERS SECTION PARSING ---------------------------------------------------------------------
+
+    const unsigned char *authorityPtr = answerPtr;
+    for (int i = 0; i < nscount; i++)
+    {
+        // Parse NAME
+        uint16_t type;
+        uint32_t ttl;
+        DNS_REC record;
+        std::string parsedName, parsedCName;
+        size_t recordStart = authorityPtr - buf;
+
+        parseName(authorityPtr, buf, parsedCName);
+
+        if (*authorityPtr != 192)
+        {
+            authorityPtr = authorityPtr + (parsedCName.length() - 1);
+        }
+
+        parseName(authorityPtr + offset, buf, parsedName);
+
+        // Parse RDLENGTH
+        memcpy(&rdlength, authorityPtr + 10, sizeof(uint16_t));
+        rdlength = ntohs(rdlength);
+        // Parse TYPE
+        memcpy(&type, authorityPtr + 2, sizeof(uint16_t));
+        type = ntohs(type);
+        // Parse TTL
+        memcpy(&ttl, authorityPtr + 6, sizeof(uint32_t));
+        ttl = ntohl(ttl);
+        if (type == T_NS)
+        {
+            record.ttl = ttl;
+            record.name = parsedCName;
+            record.value = parsedName;
+            record.ttl = ttl;
+            record.type = "NS";
+        }
+        else if (type == T_SOA && decodeRecord(buf, packetSize, recordStart, record))
+        {
+            // SOA of the negative answer, its MINIMUM limits the caching of NXDOMAIN and NODATA
+            record.name = parsedCName;
+        }
+        else
+        {
+            record.type = "UNSUPPORTED";
+        }
+
+        dnsInfo.authorities.push_back(record);
+        authorityPtr += offset + rdlength;
+    }
+
+    /* ----------------------------------------------------------- ADDITIONAL SECTION ANSWERS PARSING ------------------------------------------------------------- */
+    const unsigned char *additionalPtr = authorityPtr;
+    for (int i = 0; i < arcount; i++)
+    {
+        uint16_t type;
+        // uint16_t _class; We do not need it for this project
+        uint32_t ttl;
+        DNS_REC record;
+        std::string parsedName;
+        // Parse TYPE
+
+        memcpy(&type, additionalPtr + 2, sizeof(uint16_t));
+        type = ntohs(type);
+        // Parse TTL
+        memcpy(&ttl, additionalPtr + 6, sizeof(uint32_t));
+        ttl = ntohl(ttl);
+        record.ttl = ttl;
+
+        // Parse RDLENGTH
+        memcpy(&rdlength, additionalPtr + 10, sizeof(uint16_t));
+        rdlength = ntohs(rdlength);
+        // Parse NAME
+        if (type != T_CNAME)
+        {
+            parseName(additionalPtr, buf, parsedName);
+            if (*answerPtr != 192)
+            {
+                answerPtr = answerPtr + (parsedName.length() - 1);
+            }
+
+            record.name = parsedName;
+        }
+
+        //  std::cout << "TYPE::::::::      " << type << std::endl;
+
+        // Parse RDATA
+        if (type == T_A)
+        {
+
+            std::ostringstream stringStream;
+            stringStream << (int)(*(additionalPtr + offset)) << "." << (int)(*(additionalPtr + offset + 1)) << "."
+                         << (int)(*(additionalPtr + offset + 2)) << "." << (int)(*(additionalPtr + offset + 3));
+            record.value = stringStream.str();
+            record.type = "A";
+        }
+        else if (type == T_AAAA)
+        {
+            std::ostringstream stringStream;
+            std::ostringstream temp;
+            int len;
+
+            for(int i = 0; i < 16; i+=2)
+            {
+
+                temp << std::hex << ntohs(*reinterpret_cast<const uint16_t *>(additionalPtr + offset + i));
+
+                len = temp.str().length();
+               if(len != 4) {
+                    for(int i = 0; i < 4 - len; i++) temp << std::hex << "0";
+                }
+
+                stringStream << std::hex << temp.str();
+                if(i != 14) stringStream << ":";
+                temp.str("");
+
+            }
+            record.value = stringStream.str();
+            record.type = "AAAA";
+        }
+        else if (type == T_CNAME)
+        {
+
+            std::string parsedName, parsedCName;
+            parseName(additionalPtr + offset, buf, parsedName);
+
+            parseName(additionalPtr, buf, parsedCName);
+            record.name = parsedCName;
+            record.value = parsedName;
+            record.type = "CNAME";
+        }
+        else if (type == T_PTR)
+        {
+            std::ostringstream stringStream;
+
+            int labelLength = 0;
+            while (additionalPtr[labelLength + offset] != 0)
+            {
+                int currentLabelLength = additionalPtr[labelLength + offset];
+                for (int j = 0; j < currentLabelLength; j++)
+                {
+                    stringStream << additionalPtr[labelLength + offset + j + 1];
+                }
+                labelLength += currentLabelLength + 1;
+                if (additionalPtr[labelLength + offset] != 0)
+                    stringStream << ".";
+            }
+            record.value = stringStream.str();
+            record.type = "PTR";
+        }
+        else
+        {
+            record.type = "UNSUPPORTED";
+        }
+
+        dnsInfo.additionals.push_back(record);
+        additionalPtr += offset + rdlength; // Next answer
+    }
+
+    /* ----------------------------------------------------------- END OF ADDITIONAL SECTION ANSWERS PARSING ------------------------------------------------------------- */
+
+    return dnsInfo;
+}
+
+// Decoding of the responses: getAnswer() and the checked decodeRecord() loop of the bulk run, both against the
+// validation pass followed by the unchecked decoders
+static void benchParse()
+{
+    StubZone zone;
+    std::string error;
+    std::ifstream input("stub.zone");
+    zone.load(input, error);
+
+    struct {
+        const char *name;
+        uint16_t qtype;
+    } queries[] = {{"www.github.com", T_A}, {"fit.vut.cz", T_AAAA}, {"26.9.229.147.in-addr.arpa", T_PTR}};
+    std::vector<std::vector<unsigned char>> messages;
+    std::vector<std::unique_ptr<DnsResolver>> resolvers;
+    for (auto &query : queries)
+    {
+        unsigned char request[MAX_DNS_SIZE], out[MAX_DNS_SIZE];
+        size_t len = zone.answer(request, buildQuery(request, 1, query.name, query.qtype, true), out);
+        messages.emplace_back(out, out + len);
+        resolvers.emplace_back(new DnsResolver(Args()));
+        resolvers.back()->useMessage(out, len);
+    }
+    const size_t rounds = 200000;
+
+    std::cout << "parse, " << messages.size() << " responses (CNAME + A, AAAA, PTR)" << std::endl;
+    double reference = measure("getAnswer unchecked", messages.size(), rounds, [&]() {
+        for (const std::vector<unsigned char> &message : messages)
+            sink += legacyGetAnswer(message.data(), message.size()).answers.size();
+    });
+    double optimized = measure("getAnswer validated", messages.size(), rounds, [&]() {
+        for (std::unique_ptr<DnsResolver> &resolver : resolvers)
+            sink += resolver->getAnswer().answers.size();
+    });
+    printSpeedup(reference, optimized);
+
+    reference = measure("decodeRecord per field", messages.size(), rounds, [&]() {
+        for (const std::vector<unsigned char> &message : messages)
+        {
+            size_t pos = sizeof(DNS_HEADER);
+            std::string name;
+            readName(message.data(), message.size(), pos, name);
+            pos += sizeof(QUESTION);
+            uint16_t ancount = ntohs(reinterpret_cast<const DNS_HEADER *>(message.data())->ancount);
+            for (int i = 0; i < ancount; i++)
+            {
+                DNS_REC record;
+                decodeRecord(message.data(), message.size(), pos, record);
+                sink += record.value.size();
+            }
+        }
+    });
+    optimized = measure("validateMessage + indexed", messages.size(), rounds, [&]() {
+        MESSAGE_INDEX index;
+        for (const std::vector<unsigned char> &message : messages)
+        {
+            validateMessage(message.data(), message.size(), index);
+            for (int i = 0; i < index.sections[SECTION_ANSWER]; i++)
+            {
+                DNS_REC record;
+                indexedRecord(message.data(), index.records[i], record);
+                sink += record.value.size();
+            }
+        }
+    });
+    printSpeedup(reference, optimized);
+}
+
+// The common answers of the addresses: generic getAnswer() and the indexed decoding against the fast path of the type
+static void benchAddresses()
+{
+    StubZone zone;
+    std::string error;
+    std::ifstream input("stub.zone");
+    zone.load(input, error);
+
+    struct {
+        const char *name;
+        uint16_t qtype;
+    } queries[] = {{"github.com", T_A}, {"www.github.com", T_A}, {"fit.vut.cz", T_AAAA}};
+    std::vector<std::vector<unsigned char>> messages;
+    std::vector<std::unique_ptr<DnsResolver>> resolvers;
+    for (auto &query : queries)
+    {
+        unsigned char request[MAX_DNS_SIZE], out[MAX_DNS_SIZE];
+        size_t len = zone.answer(request, buildQuery(request, 1, query.name, query.qtype, true), out);
+        messages.emplace_back(out, out + len);
+        resolvers.emplace_back(new DnsResolver(Args()));
+        resolvers.back()->useMessage(out, len);
+    }
+    const size_t rounds = 500000;
+
+    std::cout << "addresses, " << messages.size() << " responses (A, CNAME + A, AAAA)" << std::endl;
+    double reference = measure("getAnswer", messages.size(), rounds, [&]() {
+        for (std::unique_ptr<DnsResolver> &resolver : resolvers)
+            sink += resolver->getAnswer().answers.size();
+    });
+    double generic = measure("validateMessage + indexed", messages.size(), rounds, [&]() {
+        MESSAGE_INDEX index;
+        for (const std::vector<unsigned char> &message : messages)
+        {
+            validateMessage(message.data(), message.size(), index);
+            for (int i = 0; i < index.sections[SECTION_ANSWER]; i++)
+            {
+                DNS_REC record;
+                indexedRecord(message.data(), index.records[i], record);
+                sink += record.value.size();
+            }
+        }
+    });
+    double optimized = measure("decodeAddressAnswer", messages.size(), rounds, [&]() {
+        ADDRESS_ANSWER<T_A> a;
+        ADDRESS_ANSWER<T_AAAA> aaaa;
+        for (size_t i = 0; i < messages.size(); i++)
+        {
+            const std::vector<unsigned char> &message = messages[i];
+            if (queries[i].qtype == T_A && decodeAddressAnswer(message.data(), message.size(), a))
+                sink += a.count + a.addresses[0][0];
+            else if (decodeAddressAnswer(message.data(), message.size(), aaaa))
+                sink += aaaa.count + aaaa.addresses[0][0];
+        }
+    });
+    printSpeedup(reference, optimized);
+    printSpeedup(generic, optimized);
+}
+
+int main()
+{
+    benchNames();
+    benchStub();
+    benchLog();
+    benchInput();
+    benchSession();
+    benchParse();
+    benchAddresses();
+
+    return 0;
+}
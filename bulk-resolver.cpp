@@ -0,0 +1,746 @@
+/**
+ * @author Rostislav Kral
+ * @brief Implementation of the BulkResolver class, pipelining queries over one UDP socket.
+ * @file bulk-resolver.cpp
+ * */
+
+#include "bulk-resolver.h"
+#include "address-answer.h"
+#include "message-index.h"
+#include "name-utils.h"
+#include <thread>
+
+/**
+ * @brief Fast path of the answer made only of the addresses of the question name (address-answer.h), the records are
+ * built from the fixed structure without validateMessage(), CNAME chains and other shapes go the generic path
+ * @param name Queried name, the question must match it
+ * @param answer Output, the binary addresses and their TTLs
+ * @param records Output, the same records as indexedRecord() decodes
+ * @return false if the generic path has to decode the message
+ * */
+template <uint16_t QTYPE>
+static bool decodeAddressRecords(const unsigned char *msg, size_t len, const std::string &name,
+                                 ADDRESS_ANSWER<QTYPE> &answer, std::vector<DNS_REC> &records)
+{
+    std::string questionName;
+
+    if (!decodeAddressAnswer(msg, len, answer) || answer.cnames > 0 || !answer.direct)
+        return false;
+    // Labels of the question were checked by decodeAddressAnswer(), it is never compressed
+    indexedName(msg, sizeof(DNS_HEADER), questionName);
+    if (!nameEquals(questionName, name))
+        return false;
+
+    records.resize(answer.count);
+    for (size_t i = 0; i < answer.count; i++)
+    {
+        DNS_REC &record = records[i];
+        record.name = questionName;
+        record.ttl = answer.ttls[i];
+        record.type = typeToString(QTYPE);
+        if (ADDRESS_TYPE<QTYPE>::family == AF_INET)
+            indexedAddress(answer.addresses[i], record.value);
+        else
+        {
+            char text[INET6_ADDRSTRLEN];
+            inet_ntop(AF_INET6, answer.addresses[i], text, sizeof(text));
+            record.value = text;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Fast path of parseResult(), the addresses and the TTL come straight from ADDRESS_ANSWER
+ * @return false if the generic path has to decode the message, the result is unchanged then
+ * */
+template <uint16_t QTYPE>
+static bool parseAddressResult(const unsigned char *msg, size_t len, BULK_RESULT &result)
+{
+    ADDRESS_ANSWER<QTYPE> answer;
+    std::vector<DNS_REC> records;
+
+    if (!decodeAddressRecords(msg, len, result.name, answer, records))
+        return false;
+
+    result.rcode = RCODE_NOERROR;
+    result.authoritative = answer.authoritative;
+    result.answers = std::move(records);
+    result.ttl = answer.ttl > INT32_MAX ? 0 : answer.ttl; // Like the negative TTL of summarizeResult()
+    result.addresses.assign(answer.count, BULK_ADDRESS());
+    for (size_t i = 0; i < answer.count; i++)
+    {
+        // IPv4 is mapped to IPv6
+        BULK_ADDRESS &address = result.addresses[i];
+        if (ADDRESS_TYPE<QTYPE>::family == AF_INET)
+            address[10] = address[11] = 0xFF;
+        memcpy(address.data() + 16 - ADDRESS_TYPE<QTYPE>::size, answer.addresses[i], ADDRESS_TYPE<QTYPE>::size);
+    }
+    return true;
+}
+
+/**
+ * @brief Answer of the bulk query by the fast path, grouped to the only RRset
+ * @return false if the generic path has to decode the message
+ * */
+template <uint16_t QTYPE>
+static bool parseAddressResponse(const unsigned char *msg, size_t len, const std::string &name, RRSETS &rrsets)
+{
+    ADDRESS_ANSWER<QTYPE> answer;
+    std::vector<DNS_REC> records;
+
+    if (!decodeAddressRecords(msg, len, name, answer, records))
+        return false;
+    rrsets[std::make_pair(nameToLower(records.front().name), QTYPE)] = std::move(records);
+    return true;
+}
+
+/**
+ * @brief Checks that the response belongs to the query, groups the answer section to RRsets and finds SOA of negative answer
+ * @param soa Output, SOA from the authority section decoded straight from the message
+ * @param hasSoa Output, false when the authority section has no SOA
+ * @param fast Output, true when the A/AAAA fast path decoded the response
+ * @return false if the response is malformed or doesn't answer the question
+ * */
+static bool parseBulkResponse(const unsigned char *msg, size_t len, const std::string &name, uint16_t qtype, int &rcode,
+                              RRSETS &rrsets, SOA_RECORD &soa, bool &hasSoa, bool &fast)
+{
+    const DNS_HEADER *header = reinterpret_cast<const DNS_HEADER *>(msg);
+    MESSAGE_INDEX index;
+    std::string questionName;
+
+    // Positive answer has no use for the authority section, so the SOA isn't needed
+    fast = addressShape(msg, len) && ((qtype == T_A && parseAddressResponse<T_A>(msg, len, name, rrsets)) ||
+                                      (qtype == T_AAAA && parseAddressResponse<T_AAAA>(msg, len, name, rrsets)));
+    if (fast)
+    {
+        rcode = RCODE_NOERROR;
+        hasSoa = false;
+        return true;
+    }
+
+    // Broken authority or additional section leaves the answer section usable, only negative caching is lost
+    validateMessage(msg, len, index);
+    if (index.questions != 1 || !header->qr || ntohs(header->qdcount) != 1 || index.qtype != qtype)
+        return false;
+    indexedName(msg, index.question, questionName);
+    if (!nameEquals(questionName, name) || index.sections[SECTION_ANSWER] != ntohs(header->ancount))
+        return false;
+
+    rcode = header->rcode;
+    hasSoa = false;
+
+    size_t position = 0;
+    for (int i = 0; i < index.sections[SECTION_ANSWER]; i++)
+    {
+        const RECORD_INDEX &entry = index.records[position++];
+        DNS_REC record;
+
+        indexedRecord(msg, entry, record);
+        rrsets[std::make_pair(nameToLower(record.name), entry.type)].push_back(record);
+    }
+
+    for (int i = 0; i < index.sections[SECTION_AUTHORITY]; i++)
+    {
+        const RECORD_INDEX &entry = index.records[position++];
+        if (entry.type == T_SOA && !hasSoa)
+        {
+            indexedSoa(msg, entry, soa);
+            hasSoa = true;
+        }
+    }
+
+    return true;
+}
+
+BulkResolver::BulkResolver(Args args, BULK_OPTIONS options)
+    : args(args), options(options), congestion(options.window), pacer(options.qps, Clock::now()), pending(65536)
+{
+    nextId = (uint16_t)getpid();
+}
+
+void BulkResolver::connectToDNSServer()
+{
+    // One capture file and one log for the whole run, every transport records its own upstream
+    TRANSPORT_SINKS sinks;
+    useTransport(openTransport(args, SOCK_DGRAM, sinks));
+    for (const std::string &server : args.upstreams)
+    {
+        Args upstream = args;
+        upstream.server = const_cast<char *>(server.c_str());
+        addTransport(openTransport(upstream, SOCK_DGRAM, sinks));
+    }
+}
+
+void BulkResolver::useTransport(std::unique_ptr<Transport> transport)
+{
+    transports.clear();
+    latency.clear();
+    addTransport(std::move(transport));
+}
+
+void BulkResolver::addTransport(std::unique_ptr<Transport> transport)
+{
+    transports.push_back(std::move(transport));
+    latency.emplace_back(options.hedgeQuantile);
+}
+
+uint16_t BulkResolver::allocateId()
+{
+    // The window is much smaller than 65536, so a free ID is found quickly
+    while (pending[nextId].active)
+        nextId++;
+    return nextId++;
+}
+
+void BulkResolver::transmit(PENDING query)
+{
+    unsigned char buf[MAX_DNS_SIZE];
+    uint16_t id = allocateId();
+    uint64_t trace = traceId(query.index, query.qtype);
+    size_t length;
+    {
+        TraceSpan span("encode", trace);
+        length = buildQuery(buf, id, query.name, query.qtype, args.recursion);
+    }
+
+    query.active = true;
+    query.hedged = false;
+    query.sequence = ++sequence;
+    query.sent = Clock::now();
+    if (sharding())
+    {
+        // Retransmission is hashed again, so it leaves an upstream marked down in the meantime
+        bool remapped;
+        query.upstream = ring.acquire(shardHash(query.name, options.shard), query.sent, remapped);
+        stats.remapped += remapped;
+    }
+    size_t upstream = query.upstream;
+    pending[id] = std::move(query);
+
+    {
+        TraceSpan span("send", trace);
+        transports[upstream]->send(buf, length);
+    }
+    pacer.spend();
+
+    timeouts.emplace_back(id, sequence);
+    // Keyed by the threshold of its own upstream, so a slow upstream doesn't hold back the hedges of the others
+    uint32_t threshold = hedging() ? latency[upstream].value() : 0;
+    if (threshold > 0) // 0 = the upstream has no RTTs yet to judge a slow answer
+        hedgeQueue.push(DEADLINE_ENTRY{pending[id].sent + std::chrono::microseconds(threshold), id, sequence});
+    if (pending[id].deadline < pending[id].sent + std::chrono::milliseconds(options.timeout))
+        deadlines.push(DEADLINE_ENTRY{pending[id].deadline, id, sequence});
+    inFlight++;
+    stats.sent++;
+}
+
+bool BulkResolver::answerLocally(PENDING &query, ResultCallback &callback)
+{
+    unsigned char request[MAX_DNS_SIZE], response[MAX_DNS_SIZE];
+    size_t length = buildQuery(request, 0, query.name, query.qtype, args.recursion);
+    int rcode;
+    RRSETS rrsets;
+    SOA_RECORD soa;
+    bool hasSoa, fast;
+
+    if (length == 0 || (length = local->answer(request, length, response)) == 0 ||
+        !parseBulkResponse(response, length, query.name, query.qtype, rcode, rrsets, soa, hasSoa, fast))
+        return false;
+
+    stats.local++;
+    query.local = true;
+    resolve(std::move(query), &rrsets, rcode, nullptr, callback);
+    return true;
+}
+
+void BulkResolver::finish(const PENDING &query, int rcode, const std::vector<DNS_REC> &chain,
+                          const std::vector<DNS_REC> &answers, ResultCallback &callback)
+{
+    // Server failed, the local table gets the original name
+    if (local && args.upstreamFirst && !query.local && rcode != RCODE_INVALID && (rcode != RCODE_NOERROR || answers.empty()))
+    {
+        PENDING fallback = query;
+        fallback.name = query.origin;
+        fallback.chain.clear();
+        if (answerLocally(fallback, callback))
+            return;
+    }
+
+    BULK_RESULT result;
+    result.index = query.index;
+    result.name = query.origin;
+    result.qtype = query.qtype;
+    result.rcode = rcode;
+    if (query.tries > 0)
+        result.rtt = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - query.first).count();
+
+    result.answers = chain;
+    result.answers.insert(result.answers.end(), answers.begin(), answers.end());
+    summarizeResult(result);
+
+    // Whole query from the first transmission, its tries nest inside
+    if (query.tries > 0 && Tracer::enabled())
+        Tracer::record("query", TRACE_ASYNC, traceId(query.index, query.qtype), Tracer::at(query.first), Tracer::now());
+    callback(result);
+}
+
+void BulkResolver::resolve(PENDING query, const RRSETS *message, int rcode, const SOA_RECORD *soa, ResultCallback &callback)
+{
+    std::vector<DNS_REC> chain = query.chain, answers;
+    std::string next;
+    Clock::time_point now = Clock::now();
+    CHAIN_STATE state;
+    {
+        TraceSpan span("cache", traceId(query.index, query.qtype));
+        state = cache.follow(query.name, query.qtype, now, chain, answers, next, message);
+    }
+
+    bool done = state != CHAIN_QUERY || (message != nullptr && (rcode != 0 || nameEquals(next, query.name)));
+    if (done && message == nullptr)
+        stats.cached++;
+
+    // RCODE belongs to the last name of the chain (RFC 6604)
+    if (state == CHAIN_QUERY && done && soa != nullptr &&
+        (rcode == RCODE_NXDOMAIN || rcode == RCODE_NOERROR))
+        cache.storeNegative(next, query.qtype, rcode, *soa, now);
+
+    if (state == CHAIN_LOOP || state == CHAIN_TOO_DEEP)
+        finish(query, RCODE_SERVFAIL, chain, answers, callback); // Like a recursive resolver would answer
+    else if (state == CHAIN_NXDOMAIN)
+        finish(query, RCODE_NXDOMAIN, chain, answers, callback);
+    else if (state == CHAIN_NODATA)
+        finish(query, RCODE_NOERROR, chain, answers, callback);
+    else if (done)
+        finish(query, rcode, chain, answers, callback); // Complete, or the queried name itself has no data
+    else
+    {
+        // Target outside of the message and the cache, one more round trip
+        if (message != nullptr)
+            stats.followups++;
+        query.name = next;
+        query.chain = chain;
+        query.tries = 1;
+        if (now >= query.deadline)
+        {
+            stats.expired++;
+            finish(query, RCODE_TIMEOUT, chain, answers, callback); // The chain so far is the partial result
+            return;
+        }
+        if (local && !args.upstreamFirst && answerLocally(query, callback))
+            return;
+        transmit(std::move(query));
+    }
+}
+
+void BulkResolver::receive(ResultCallback &callback)
+{
+    unsigned char buf[MAX_DNS_SIZE];
+    size_t received;
+
+    for (size_t upstream = 0; upstream < transports.size(); upstream++)
+    {
+        while ((received = receiveTraced(upstream, buf, sizeof(buf))) > 0)
+        {
+            if (received < sizeof(DNS_HEADER))
+                continue;
+
+            uint16_t id = ntohs(reinterpret_cast<DNS_HEADER *>(buf)->id);
+            PENDING &query = pending[id];
+            if (!query.active)
+                continue; // Late answer to the retransmitted or already answered query
+
+            int rcode;
+            RRSETS rrsets;
+            SOA_RECORD soa;
+            bool hasSoa, fast;
+            uint64_t trace = traceId(query.index, query.qtype);
+            bool parsed;
+            {
+                TraceSpan span("parse", trace);
+                parsed = parseBulkResponse(buf, received, query.name, query.qtype, rcode, rrsets, soa, hasSoa, fast);
+            }
+            if (!parsed)
+                continue; // Spoofed or broken answer, the query stays in flight
+            stats.fastPath += fast;
+
+            // The first answer wins, the other upstream's answer finds the query inactive
+            Clock::time_point now = Clock::now();
+            bool won = query.hedged && upstream != query.upstream;
+            uint32_t rtt = std::chrono::duration_cast<std::chrono::microseconds>(now - (won ? query.hedgeSent : query.sent)).count();
+            congestion.answered(query.tries == 1 ? std::max<uint32_t>(1, rtt) : 0, now);
+            if (query.tries == 1)
+                latency[upstream].add(std::max<uint32_t>(1, rtt)); // 0 would mean no threshold
+            if (won)
+                stats.hedgesWon++;
+            if (sharding())
+            {
+                ring.release(query.upstream);
+                if (query.hedged)
+                    ring.release(query.hedgeUpstream);
+                ring.answered(upstream);
+            }
+
+            if (Tracer::enabled())
+                Tracer::record("wait", TRACE_ASYNC, trace, Tracer::at(query.sent), Tracer::at(now));
+
+            query.active = false;
+            inFlight--;
+            stats.answered++;
+            {
+                TraceSpan span("cache", trace);
+                cache.store(rrsets, now);
+            }
+            resolve(std::move(query), &rrsets, rcode, hasSoa ? &soa : nullptr, callback);
+        }
+    }
+}
+
+size_t BulkResolver::receiveTraced(size_t upstream, unsigned char *buf, size_t size)
+{
+    TraceSpan span("receive");
+    return transports[upstream]->receive(buf, size);
+}
+
+void BulkResolver::expire(ResultCallback &callback)
+{
+    Clock::time_point now = Clock::now();
+
+    while (!timeouts.empty())
+    {
+        PENDING &query = pending[timeouts.front().first];
+        if (!query.active || query.sequence != timeouts.front().second)
+        {
+            timeouts.pop_front(); // Answered in the meantime
+            continue;
+        }
+        if (now - query.sent < std::chrono::milliseconds(options.timeout))
+            break;
+
+        timeouts.pop_front();
+        abandon(query);
+        congestion.lost(now);
+        if (sharding())
+            stats.downs += ring.lost(query.upstream, now);
+
+        if (now >= query.deadline)
+        {
+            stats.expired++; // No budget for one more try
+            finish(query, RCODE_TIMEOUT, query.chain, std::vector<DNS_REC>(), callback);
+        }
+        else if (query.tries <= options.retries)
+        {
+            stats.retransmits++;
+            query.tries++;
+            Tracer::instant("retry", traceId(query.index, query.qtype));
+            transmit(std::move(query));
+        }
+        else
+        {
+            stats.timeouts++;
+            finish(query, RCODE_TIMEOUT, query.chain, std::vector<DNS_REC>(), callback);
+        }
+    }
+}
+
+void BulkResolver::abandon(PENDING &query)
+{
+    query.active = false;
+    inFlight--;
+    if (Tracer::enabled())
+        Tracer::record("wait", TRACE_ASYNC, traceId(query.index, query.qtype), Tracer::at(query.sent), Tracer::now());
+    if (sharding())
+    {
+        ring.release(query.upstream);
+        if (query.hedged)
+            ring.release(query.hedgeUpstream);
+    }
+}
+
+void BulkResolver::overdue(Clock::time_point now, ResultCallback &callback)
+{
+    // The budget ends during the try, the server isn't blamed for it
+    while (!deadlines.empty() && deadlines.top().at <= now)
+    {
+        DEADLINE_ENTRY entry = deadlines.top();
+        deadlines.pop();
+        PENDING &query = pending[entry.id];
+        if (!query.active || query.sequence != entry.sequence)
+            continue;
+        abandon(query);
+        stats.expired++;
+        finish(query, RCODE_TIMEOUT, query.chain, std::vector<DNS_REC>(), callback);
+    }
+}
+
+void BulkResolver::cancelAll(ResultCallback &callback)
+{
+    // Every query in flight has its entry in the timeout queue
+    for (const std::pair<uint16_t, uint32_t> &entry : timeouts)
+    {
+        PENDING &query = pending[entry.first];
+        if (!query.active || query.sequence != entry.second)
+            continue;
+        abandon(query);
+        stats.cancelled++;
+        finish(query, RCODE_CANCELLED, query.chain, std::vector<DNS_REC>(), callback);
+    }
+    timeouts.clear();
+}
+
+void BulkResolver::hedge(Clock::time_point now)
+{
+    while (!hedgeQueue.empty() && hedgeQueue.top().at <= now)
+    {
+        DEADLINE_ENTRY entry = hedgeQueue.top();
+        hedgeQueue.pop();
+        PENDING &query = pending[entry.id];
+        if (!query.active || query.sequence != entry.sequence)
+            continue; // Answered or retransmitted in the meantime
+
+        // Sharded name goes to the next live upstream of its ring, the others to the upstream after
+        size_t target = sharding() ? ring.next(shardHash(query.name, options.shard), query.upstream)
+                                   : (query.upstream + 1) % transports.size();
+        if (target == query.upstream)
+            continue; // No other upstream is up
+
+        // Answer of the next upstream would come after the budget of the name
+        if (query.deadline - now < std::chrono::microseconds(latency[target].value()))
+            continue;
+
+        // Extra traffic is capped, the query waits for its timeout otherwise
+        if (stats.hedges + 1 > stats.sent * options.hedgePercent / 100)
+            continue;
+
+        unsigned char buf[MAX_DNS_SIZE];
+        size_t length = buildQuery(buf, entry.id, query.name, query.qtype, args.recursion);
+        query.hedged = true;
+        query.hedgeUpstream = target;
+        query.hedgeSent = now;
+        if (sharding())
+            ring.hold(target);
+        transports[target]->send(buf, length);
+        pacer.spend();
+        stats.hedges++;
+        Tracer::instant("hedge", traceId(query.index, query.qtype));
+    }
+}
+
+int BulkResolver::hedgeDelay(Clock::time_point now)
+{
+    // Stale entries on the top are removed by hedge(), the delay may be shorter than needed but never longer
+    if (hedgeQueue.empty())
+        return -1;
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(hedgeQueue.top().at - now);
+    return std::max(0, (int)left.count() + 1);
+}
+
+BULK_STATS BulkResolver::run(std::istream &input, ResultCallback callback, ProgressCallback progress)
+{
+    StreamNameSource names(input);
+    return run(names, callback, progress);
+}
+
+BULK_STATS BulkResolver::run(NameSource &names, ResultCallback callback, ProgressCallback progress)
+{
+    Clock::time_point start = Clock::now(), reported = start;
+    std::vector<uint16_t> qtypes = queryTypes(args);
+    bool inputDone = false;
+    std::string name;
+    uint64_t reportedSent = 0;
+
+    stats = BULK_STATS();
+    hedgeQueue = DeadlineQueue();
+    deadlines = DeadlineQueue();
+    ring = UpstreamRing(sharding() ? transports.size() : 0, options.shardLoad);
+    congestion = AimdWindow(options.window);
+    pacer = TokenBucket(options.qps, start);
+
+    while (!inputDone || inFlight > 0)
+    {
+        // Names not read yet get no result, the caller asked to stop
+        if (options.cancel.cancelled())
+        {
+            cancelAll(callback);
+            break;
+        }
+
+        while (!inputDone && inFlight < window() && pacer.ready(Clock::now()))
+        {
+            if (!names.next(name))
+            {
+                inputDone = true;
+                break;
+            }
+            stats.names++;
+
+            std::string queryName = name; // The source dropped the trailing dot already
+            unsigned char check[sizeof(struct in6_addr)];
+            if (args.reverse)
+            {
+                if (inet_pton(AF_INET, name.c_str(), check) == 1 || inet_pton(AF_INET6, name.c_str(), check) == 1)
+                    queryName = buildPTRQuery(name);
+                else
+                    queryName.clear();
+            }
+
+            // All types of the name go out together, the name waits only for the slowest answer
+            unsigned char wire[MAX_DNS_SIZE];
+            bool invalid = queryName.empty() || encodeName(queryName, wire) == 0;
+            for (uint16_t qtype : qtypes)
+            {
+                PENDING query;
+                query.index = stats.names - 1;
+                query.origin = invalid ? name : queryName;
+                query.name = queryName;
+                query.qtype = qtype;
+                query.first = Clock::now();
+                if (args.budget > 0)
+                    query.deadline = query.first + std::chrono::milliseconds(args.budget);
+                if (invalid)
+                    finish(query, RCODE_INVALID, query.chain, query.chain, callback);
+                else
+                    resolve(std::move(query), nullptr, 0, nullptr, callback); // From the cache, or the first transmission
+            }
+        }
+
+        Clock::time_point now = Clock::now();
+        if (progress && now - reported >= std::chrono::duration<double>(options.reportInterval))
+        {
+            BULK_PROGRESS state;
+            state.seconds = std::chrono::duration<double>(now - start).count();
+            state.window = window();
+            state.inFlight = inFlight;
+            state.qps = (stats.sent - reportedSent) / std::chrono::duration<double>(now - reported).count();
+            state.srtt = congestion.smoothedRtt();
+            state.answered = stats.answered;
+            state.timeouts = stats.timeouts;
+            progress(state);
+            reported = now;
+            reportedSent = stats.sent;
+        }
+
+        // Sleeping until an answer arrives, the oldest query times out or the rate allows the next name
+        int wait = options.timeout;
+        if (!timeouts.empty())
+        {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                pending[timeouts.front().first].sent + std::chrono::milliseconds(options.timeout) - now);
+            wait = std::max(0, (int)left.count() + 1);
+        }
+        if (!inputDone && inFlight < window())
+            wait = std::min(wait, pacer.delay(now));
+        int hedgeWait = hedgeDelay(now);
+        if (hedgeWait >= 0)
+            wait = std::min(wait, hedgeWait);
+        if (!deadlines.empty())
+            wait = std::min(wait, std::max(0, (int)std::chrono::duration_cast<std::chrono::milliseconds>(deadlines.top().at - now).count() + 1));
+        if (options.cancel.cancellable())
+            wait = std::min(wait, DEADLINE_SLICE_MS);
+
+        if (inFlight == 0)
+        {
+            if (!inputDone)
+                std::this_thread::sleep_for(std::chrono::milliseconds(wait));
+            continue;
+        }
+        {
+            TraceSpan span("poll");
+            waitAny(transports, wait);
+        }
+
+        receive(callback);
+        overdue(Clock::now(), callback);
+        hedge(Clock::now());
+        expire(callback);
+    }
+
+    stats.duplicates = names.duplicates();
+    stats.decreases = congestion.decreases();
+    stats.window = window();
+    stats.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    return stats;
+}
+
+void summarizeResult(BULK_RESULT &result)
+{
+    for (const DNS_REC &answer : result.answers)
+    {
+        if (&answer == &result.answers.front() || (uint32_t)answer.ttl < result.ttl)
+            result.ttl = std::max(0, answer.ttl);
+    }
+
+    // Addresses of the final records (CNAME links have other type), IPv4 is mapped to IPv6
+    for (const DNS_REC &answer : result.answers)
+    {
+        BULK_ADDRESS address = {0};
+        if (answer.type == "A" && inet_pton(AF_INET, answer.value.c_str(), address.data() + 12) == 1)
+        {
+            address[10] = address[11] = 0xFF;
+            result.addresses.push_back(address);
+        }
+        else if (answer.type == "AAAA" && inet_pton(AF_INET6, answer.value.c_str(), address.data()) == 1)
+            result.addresses.push_back(address);
+    }
+}
+
+bool parseResult(const unsigned char *msg, size_t len, BULK_RESULT &result, bool *fast)
+{
+    const DNS_HEADER *header = reinterpret_cast<const DNS_HEADER *>(msg);
+    MESSAGE_INDEX index;
+    std::string questionName;
+
+    bool addresses = addressShape(msg, len) && ((result.qtype == T_A && parseAddressResult<T_A>(msg, len, result)) ||
+                                                (result.qtype == T_AAAA && parseAddressResult<T_AAAA>(msg, len, result)));
+    if (fast != nullptr)
+        *fast = addresses;
+    if (addresses)
+        return true;
+
+    validateMessage(msg, len, index);
+    if (index.questions != 1 || !header->qr || ntohs(header->qdcount) != 1 || index.qtype != result.qtype)
+        return false;
+    indexedName(msg, index.question, questionName);
+    if (!nameEquals(questionName, result.name) || index.sections[SECTION_ANSWER] != ntohs(header->ancount))
+        return false;
+
+    std::vector<DNS_REC> answers(index.sections[SECTION_ANSWER]);
+    for (size_t i = 0; i < answers.size(); i++)
+        indexedRecord(msg, index.records[i], answers[i]);
+
+    result.rcode = header->rcode;
+    result.authoritative = header->aa;
+    result.answers = std::move(answers);
+    summarizeResult(result);
+    return true;
+}
+
+ResultMerger::ResultMerger(const std::vector<uint16_t> &qtypes, MergedCallback callback) : qtypes(qtypes), callback(callback)
+{
+}
+
+void ResultMerger::add(const BULK_RESULT &result)
+{
+    size_t position = std::find(qtypes.begin(), qtypes.end(), result.qtype) - qtypes.begin();
+    if (position == qtypes.size())
+        return;
+
+    auto &entry = partial[result.index];
+    if (entry.second.empty())
+        entry.second.resize(qtypes.size());
+    entry.second[position] = result;
+
+    if (++entry.first == qtypes.size())
+    {
+        callback(entry.second);
+        partial.erase(result.index);
+    }
+}
+
+std::vector<uint16_t> queryTypes(const Args &args)
+{
+    if (!args.qtypes.empty())
+        return args.qtypes;
+    return {(uint16_t)(args.reverse ? T_PTR : (args.use_ipv6 ? T_AAAA : T_A))};
+}
@@ -0,0 +1,288 @@
+/**
+ * @author Rostislav Kral
+ * @brief Contains BulkResolver class, resolving list of names with many queries in flight over one UDP socket.
+ * @file bulk-resolver.h
+ * */
+
+#ifndef BULK_RESOLVER_H
+#define BULK_RESOLVER_H
+
+#include <array>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include "cache.h"
+#include "congestion.h"
+#include "local-table.h"
+#include "name-input.h"
+#include "trace.h"
+#include "transport.h"
+#include "upstream-ring.h"
+
+
+typedef std::array<unsigned char, 16> BULK_ADDRESS; // IPv6 or IPv4-mapped IPv6 address (::ffff:a.b.c.d)
+
+/**
+ * @brief Result of one name from the bulk run
+ * */
+struct BULK_RESULT {
+    uint64_t index = 0; // Position of the name in the input
+    std::string name;
+    uint16_t qtype = 0;
+    int rcode = RCODE_TIMEOUT; // RCODE of the response or RCODE_INVALID/RCODE_TIMEOUT
+    uint32_t ttl = 0; // Minimal TTL of the answers
+    uint32_t rtt = 0; // Microseconds from the first transmission to the answer
+    bool authoritative = false; // AA flag of the response, its TTLs are not counted down by a cache
+    std::vector<BULK_ADDRESS> addresses; // A and AAAA answers
+    std::vector<DNS_REC> answers;
+};
+
+/**
+ * @brief Options of the bulk run
+ * */
+struct BULK_OPTIONS {
+    size_t window = 64; // Maximal number of queries in flight
+    bool adaptive = true; // AIMD window up to the maximum, otherwise the window is fixed
+    double qps = 0; // Ceiling of the sending rate, 0 = unlimited
+    double reportInterval = 1; // Seconds between the progress reports
+    int timeout = 2000; // Milliseconds to wait for the answer before retransmission
+    int retries = 2; // Retransmissions of one query
+    double hedgePercent = 0; // Ceiling of the hedged queries in percent of the sent ones, 0 = no hedging
+    double hedgeQuantile = 0.95; // Query outstanding longer than this RTT quantile of its upstream is hedged
+    int shard = SHARD_NONE; // SHARD_NAME or SHARD_SUFFIX spreads the names over the upstreams by consistent hashing
+    double shardLoad = UPSTREAM_LOAD_FACTOR; // Upstream takes at most this multiple of the average load in flight
+    CancelToken cancel = CancelToken::none(); // Cancelled run stops reading, queries in flight end with RCODE_CANCELLED
+};
+
+/**
+ * @brief State of the running bulk run, reported once per interval
+ * */
+struct BULK_PROGRESS {
+    double seconds = 0; // From the start of the run
+    size_t window = 0;
+    size_t inFlight = 0;
+    double qps = 0; // Queries sent per second in the last interval
+    double srtt = 0; // Smoothed RTT in microseconds
+    uint64_t answered = 0;
+    uint64_t timeouts = 0;
+};
+
+struct BULK_STATS {
+    uint64_t names = 0;
+    uint64_t sent = 0;
+    uint64_t answered = 0;
+    uint64_t timeouts = 0;
+    uint64_t retransmits = 0;
+    uint64_t cached = 0; // Results found in the cache without any query
+    uint64_t followups = 0; // Queries for CNAME targets missing in the answer and the cache
+    uint64_t local = 0; // Answers from the local table
+    uint64_t decreases = 0; // Reductions of the window after loss or RTT growth
+    uint64_t duplicates = 0; // Repeated names of the input skipped by the source
+    uint64_t hedges = 0; // Duplicates of slow queries sent to the next upstream
+    uint64_t hedgesWon = 0; // Hedged queries answered by the next upstream first
+    uint64_t remapped = 0; // Sharded queries sent to other than their home upstream (down or full)
+    uint64_t downs = 0; // Upstreams marked down after timeouts in a row
+    uint64_t expired = 0; // Names ended by args.budget, with the CNAME chain followed so far
+    uint64_t cancelled = 0; // Queries in flight when options.cancel was cancelled
+    uint64_t fastPath = 0; // Answers decoded by the A/AAAA fast path without validateMessage()
+    size_t window = 0; // Window at the end of the run
+    double seconds = 0;
+};
+
+class BulkResolver {
+public:
+    typedef std::function<void(const BULK_RESULT &result)> ResultCallback;
+    typedef std::function<void(const BULK_PROGRESS &progress)> ProgressCallback;
+
+    /**
+     * @brief Constructor of the BulkResolver, args select the server and the type of the queries
+     * @param args
+     * @param options
+     * */
+    BulkResolver(Args args, BULK_OPTIONS options);
+
+    /**
+     * @brief Connecting the UDP socket to the DNS server and to every server of args.upstreams
+     * @return
+     * */
+    void connectToDNSServer();
+
+    /**
+     * @brief Uses the given transport instead of connecting to the server, e.g. loopback or replay in tests
+     * @param transport
+     * @return
+     * */
+    void useTransport(std::unique_ptr<Transport> transport);
+
+    /**
+     * @brief Adds the next upstream, slow queries are hedged to the upstream after the one they were sent to (with
+     * options.shard to the next live upstream on the ring of the name) and with options.shard the names are spread
+     * over all upstreams
+     * @param transport
+     * @return
+     * */
+    void addTransport(std::unique_ptr<Transport> transport);
+
+    /**
+     * @brief Names found in the table are answered before any query is sent, with args.upstreamFirst only the
+     * failed, NXDOMAIN and empty results of the server are looked up
+     * @param table
+     * @return
+     * */
+    void useLocalTable(std::shared_ptr<const LocalTable> table) { local = std::move(table); }
+
+    /**
+     * @brief Resolves every name from the input (one per line, empty lines and # comments are skipped), every type
+     * from args.qtypes is queried for every name at once
+     * @param input Stream with the names
+     * @param callback Receiver of the results, called in the order of the answers
+     * @param progress Optional receiver of the window and the rate, called every options.reportInterval
+     * @return BULK_STATS
+     * */
+    BULK_STATS run(std::istream &input, ResultCallback callback, ProgressCallback progress = nullptr);
+
+    /**
+     * @brief Resolves every name of the source, the names are taken only when the window has room for them. The
+     * resolver may run again, the transports, the RTTs of the upstreams and the cache stay until its destruction.
+     * @param names
+     * @param callback Receiver of the results, called in the order of the answers
+     * @param progress Optional receiver of the window and the rate, called every options.reportInterval
+     * @return BULK_STATS
+     * */
+    BULK_STATS run(NameSource &names, ResultCallback callback, ProgressCallback progress = nullptr);
+
+    /**
+     * @brief Cache shared by all runs of this resolver, CNAME links and RRsets expire by their TTL
+     * @return RecordCache&
+     * */
+    RecordCache &recordCache() { return cache; }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    // Query in flight, indexed by its ID
+    struct PENDING {
+        bool active = false;
+        uint64_t index = 0;
+        uint32_t sequence = 0; // Distinguishes reuses of the same ID in the timeout queue
+        int tries = 0; // 0 until the first transmission
+        Clock::time_point first;
+        Clock::time_point sent;
+        std::string origin; // Name from the input
+        std::string name; // Queried name, the target of the last CNAME
+        uint16_t qtype = 0;
+        std::vector<DNS_REC> chain; // CNAME links followed so far
+        bool local = false; // Local table was asked already
+        size_t upstream = 0; // Index of the transport
+        bool hedged = false; // Sent to the next upstream too, the same ID is used there
+        size_t hedgeUpstream = 0; // Index of the transport of the hedge
+        Clock::time_point hedgeSent;
+        Clock::time_point deadline = Clock::time_point::max(); // End of args.budget of the name
+    };
+
+    void transmit(PENDING query);
+
+    /**
+     * @brief Follows the chain of the query through the answer and the cache, then reports the result or sends
+     * the query for the next target, negative answer with SOA is cached
+     * */
+    void resolve(PENDING query, const RRSETS *message, int rcode, const SOA_RECORD *soa, ResultCallback &callback);
+
+    void finish(const PENDING &query, int rcode, const std::vector<DNS_REC> &chain, const std::vector<DNS_REC> &answers,
+                ResultCallback &callback);
+
+    bool answerLocally(PENDING &query, ResultCallback &callback);
+
+    void receive(ResultCallback &callback);
+
+    size_t receiveTraced(size_t upstream, unsigned char *buf, size_t size);
+
+    void expire(ResultCallback &callback);
+
+    void overdue(Clock::time_point now, ResultCallback &callback);
+
+    void cancelAll(ResultCallback &callback);
+
+    void abandon(PENDING &query);
+
+    void hedge(Clock::time_point now);
+
+    int hedgeDelay(Clock::time_point now);
+
+    bool hedging() const { return transports.size() > 1 && options.hedgePercent > 0; }
+
+    bool sharding() const { return transports.size() > 1 && options.shard != SHARD_NONE; }
+
+    uint16_t allocateId();
+
+    size_t window() const { return options.adaptive ? congestion.window() : options.window; }
+
+    std::vector<std::unique_ptr<Transport>> transports; // Upstreams, queries are sent to the first one unless sharded
+    std::vector<RttQuantile> latency; // Of every upstream
+    UpstreamRing ring; // Home upstreams of the names and their load, when sharded
+    std::shared_ptr<const LocalTable> local;
+    RecordCache cache;
+    Args args;
+    BULK_OPTIONS options;
+    BULK_STATS stats;
+    AimdWindow congestion;
+    TokenBucket pacer;
+
+    std::vector<PENDING> pending;
+    std::deque<std::pair<uint16_t, uint32_t>> timeouts; // (ID, sequence) in the order of transmission
+    DeadlineQueue hedgeQueue; // Queries by the time they become slow (sent + RTT quantile of their upstream)
+    DeadlineQueue deadlines; // Queries whose budget ends before their timeout
+    size_t inFlight = 0;
+    uint16_t nextId = 0;
+    uint32_t sequence = 0;
+};
+
+/**
+ * @brief Collects the results of all query types of one name, the name is complete when every type is answered
+ * or failed
+ * */
+class ResultMerger {
+public:
+    /**
+     * @brief Receiver of the complete name, the results are in the order of the types
+     * */
+    typedef std::function<void(const std::vector<BULK_RESULT> &results)> MergedCallback;
+
+    ResultMerger(const std::vector<uint16_t> &qtypes, MergedCallback callback);
+
+    void add(const BULK_RESULT &result);
+
+private:
+    std::vector<uint16_t> qtypes;
+    MergedCallback callback;
+    std::map<uint64_t, std::pair<size_t, std::vector<BULK_RESULT>>> partial; // Index -> (received, results)
+};
+
+/**
+ * @brief Sets the TTL (minimum of the answers) and the addresses (A and AAAA answers) of the result from its answers
+ * @param result
+ * @return
+ * */
+void summarizeResult(BULK_RESULT &result);
+
+/**
+ * @brief Checks that the response answers the question of the result (result.name and result.qtype) and fills the
+ * rcode and the answers in the order of the message, then summarizes them. Plain A/AAAA answers of the question
+ * name take the fast path of address-answer.h, the addresses are copied without any text conversion.
+ * @param msg
+ * @param len
+ * @param result
+ * @param fast Optional output, true when the fast path decoded the response
+ * @return false if the response is malformed or belongs to other query, the result is unchanged then
+ * */
+bool parseResult(const unsigned char *msg, size_t len, BULK_RESULT &result, bool *fast = nullptr);
+
+/**
+ * @brief Types queried for every name, args.qtypes or the single type selected by -6 and -x
+ * @param args
+ * @return std::vector<uint16_t>
+ * */
+std::vector<uint16_t> queryTypes(const Args &args);
+
+#endif // BULK_RESOLVER_H
@@ -0,0 +1,184 @@
+/**
+ * @author Rostislav Kral
+ * @brief Implementation of the record cache, negative caching and CNAME chain following.
+ * @file cache.cpp
+ * */
+
+#include "cache.h"
+#include "name-utils.h"
+#include <set>
+
+std::string RecordCache::key(const std::string &name, uint16_t type)
+{
+    std::string key = nameToLower(name);
+    if (!key.empty() && key.back() == '.')
+        key.pop_back();
+    return key + "/" + std::to_string(type);
+}
+
+RecordCache::ENTRY *RecordCache::insert(const std::string &key, int ttl, Clock::time_point now)
+{
+    if (ttl <= 0)
+        return nullptr; // Usable only for the answer it came in
+
+    if (entries.size() >= CACHE_MAX_ENTRIES)
+    {
+        purge(now);
+        if (entries.size() >= CACHE_MAX_ENTRIES)
+            return nullptr;
+    }
+
+    ENTRY &entry = entries[key];
+    entry.stored = now;
+    entry.expires = now + std::chrono::seconds(ttl);
+    return &entry;
+}
+
+RecordCache::ENTRY *RecordCache::find(const std::string &key, Clock::time_point now)
+{
+    auto found = entries.find(key);
+    if (found == entries.end())
+        return nullptr;
+    if (found->second.expires <= now)
+    {
+        entries.erase(found);
+        return nullptr;
+    }
+    return &found->second;
+}
+
+void RecordCache::store(const std::string &name, uint16_t type, const std::vector<DNS_REC> &records, Clock::time_point now)
+{
+    if (records.empty())
+        return;
+
+    int ttl = records.front().ttl;
+    for (const DNS_REC &record : records)
+        ttl = std::min(ttl, record.ttl);
+
+    ENTRY *entry = insert(key(name, type), ttl, now);
+    if (entry != nullptr)
+    {
+        entry->records = records;
+        entry->rcode = RCODE_NOERROR;
+    }
+}
+
+void RecordCache::store(const RRSETS &rrsets, Clock::time_point now)
+{
+    for (const auto &rrset : rrsets)
+        store(rrset.first.first, rrset.first.second, rrset.second, now);
+}
+
+void RecordCache::storeNegative(const std::string &name, uint16_t qtype, int rcode, const SOA_RECORD &soa,
+                                Clock::time_point now)
+{
+    // Type 0 is never queried, it holds NXDOMAIN of the whole name
+    int ttl = std::min<uint32_t>(std::min(soa.ttl, soa.minimum), INT32_MAX);
+    ENTRY *entry = insert(key(name, rcode == RCODE_NXDOMAIN ? 0 : qtype), ttl, now);
+    if (entry != nullptr)
+    {
+        entry->records.clear();
+        entry->rcode = rcode;
+    }
+}
+
+int RecordCache::negative(const std::string &name, uint16_t qtype, Clock::time_point now)
+{
+    ENTRY *entry = find(key(name, qtype), now);
+    if (entry != nullptr && entry->records.empty())
+        return entry->rcode;
+
+    // Nothing exists below nonexistent name, so NXDOMAIN of the closest cached ancestor is the answer
+    std::string suffix = nameToLower(name);
+    while (!suffix.empty())
+    {
+        if (find(key(suffix, 0), now) != nullptr)
+        {
+            hitCount++;
+            return RCODE_NXDOMAIN;
+        }
+        size_t dot = suffix.find('.');
+        suffix = dot == std::string::npos ? "" : suffix.substr(dot + 1);
+    }
+    return -1;
+}
+
+bool RecordCache::lookup(const std::string &name, uint16_t type, std::vector<DNS_REC> &records, Clock::time_point now)
+{
+    ENTRY *entry = find(key(name, type), now);
+    if (entry == nullptr || entry->records.empty())
+    {
+        missCount++;
+        return false;
+    }
+
+    hitCount++;
+    records = entry->records;
+    int elapsed = std::chrono::duration_cast<std::chrono::seconds>(now - entry->stored).count();
+    for (DNS_REC &record : records)
+        record.ttl -= elapsed;
+    return true;
+}
+
+void RecordCache::purge(Clock::time_point now)
+{
+    for (auto entry = entries.begin(); entry != entries.end();)
+    {
+        if (entry->second.expires <= now)
+            entry = entries.erase(entry);
+        else
+            ++entry;
+    }
+}
+
+CHAIN_STATE RecordCache::follow(const std::string &name, uint16_t qtype, Clock::time_point now, std::vector<DNS_REC> &chain,
+                                std::vector<DNS_REC> &answers, std::string &next, const RRSETS *message)
+{
+    // Owners of the links already followed, CNAME back to any of them is a loop
+    std::set<std::string> visited;
+    for (const DNS_REC &link : chain)
+        visited.insert(nameToLower(link.name));
+
+    next = name;
+    while (true)
+    {
+        std::string current = nameToLower(next);
+        if (!current.empty() && current.back() == '.')
+            current.pop_back();
+        visited.insert(current);
+
+        // Records of the message first, they are valid even with zero TTL
+        auto rrset = [&](uint16_t type, std::vector<DNS_REC> &records) {
+            if (message != nullptr)
+            {
+                auto found = message->find(std::make_pair(current, type));
+                if (found != message->end())
+                {
+                    records = found->second;
+                    return true;
+                }
+            }
+            return lookup(current, type, records, now);
+        };
+
+        if (rrset(qtype, answers))
+            return CHAIN_COMPLETE;
+
+        std::vector<DNS_REC> cname;
+        if (qtype == T_CNAME || !rrset(T_CNAME, cname))
+        {
+            int rcode = negative(current, qtype, now);
+            if (rcode == RCODE_NXDOMAIN)
+                return CHAIN_NXDOMAIN;
+            return rcode == RCODE_NOERROR ? CHAIN_NODATA : CHAIN_QUERY;
+        }
+
+        chain.push_back(cname.front());
+        next = cname.front().value;
+        if (visited.count(nameToLower(next)) > 0 || visited.count(nameToLower(next) + ".") > 0)
+            return CHAIN_LOOP;
+        if (chain.size() > CHAIN_MAX_DEPTH)
+            return CHAIN_TOO_DEEP;
+    }
+}
@@ -0,0 +1,126 @@
+/**
+ * @author Rostislav Kral
+ * @brief Contains cache of the resource records, every RRset (and so every CNAME link) expires by its own TTL,
+ * negative answers are cached as RFC 2308 describes.
+ * @file cache.h
+ * */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <chrono>
+#include <map>
+#include <unordered_map>
+#include "dns-resolver.h"
+
+#define CHAIN_MAX_DEPTH 8 // CNAME links followed for one name
+#define CACHE_MAX_ENTRIES 1000000 // New RRsets are not stored when the cache is full of unexpired ones
+
+/**
+ * @brief Records of one answer grouped by the owner (lowercase, without the trailing dot) and type
+ * */
+typedef std::map<std::pair<std::string, uint16_t>, std::vector<DNS_REC>> RRSETS;
+
+enum CHAIN_STATE {
+    CHAIN_COMPLETE, // Records of the type were found at the end of the chain
+    CHAIN_QUERY, // The name at the end of the chain must be queried
+    CHAIN_LOOP, // CNAME points back to the chain
+    CHAIN_TOO_DEEP, // More than CHAIN_MAX_DEPTH links
+    CHAIN_NXDOMAIN, // The name at the end of the chain or its ancestor doesn't exist (cached)
+    CHAIN_NODATA // The name at the end of the chain has no records of the type (cached)
+};
+
+class RecordCache {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    /**
+     * @brief Stores the RRset, it expires after the minimal TTL of its records
+     * @param name Owner
+     * @param type
+     * @param records
+     * @param now
+     * @return
+     * */
+    void store(const std::string &name, uint16_t type, const std::vector<DNS_REC> &records, Clock::time_point now);
+
+    /**
+     * @brief Stores every RRset of the answer
+     * @param rrsets
+     * @param now
+     * @return
+     * */
+    void store(const RRSETS &rrsets, Clock::time_point now);
+
+    /**
+     * @brief Stores negative answer for min(SOA TTL, SOA MINIMUM), without SOA nothing is cached
+     * @param name Name at the end of the CNAME chain
+     * @param qtype Type without data, NXDOMAIN is stored for all types
+     * @param rcode RCODE_NXDOMAIN or RCODE_NOERROR (NODATA)
+     * @param soa SOA record from the authority section with its TTL
+     * @param now
+     * @return
+     * */
+    void storeNegative(const std::string &name, uint16_t qtype, int rcode, const SOA_RECORD &soa, Clock::time_point now);
+
+    /**
+     * @brief Finds cached negative answer, NXDOMAIN of any ancestor covers the name too (RFC 8020)
+     * @param name
+     * @param qtype
+     * @param now
+     * @return int RCODE_NXDOMAIN, RCODE_NOERROR for NODATA or -1 when nothing is cached
+     * */
+    int negative(const std::string &name, uint16_t qtype, Clock::time_point now);
+
+    /**
+     * @brief Finds unexpired RRset, TTL of the returned records is the remaining time
+     * @param name
+     * @param type
+     * @param records Output
+     * @param now
+     * @return bool false if there is no such RRset
+     * */
+    bool lookup(const std::string &name, uint16_t type, std::vector<DNS_REC> &records, Clock::time_point now);
+
+    /**
+     * @brief Follows the CNAME chain from the name through the message and the cache
+     * @param name Start of the chain, or the last target when chain already contains earlier links
+     * @param qtype Wanted type
+     * @param now
+     * @param chain Input and output, CNAME links followed so far
+     * @param answers Output, records of the type at the end of the chain
+     * @param next Output, name at the end of the chain
+     * @param message Records of the just received answer, they are used even with zero TTL
+     * @return CHAIN_STATE
+     * */
+    CHAIN_STATE follow(const std::string &name, uint16_t qtype, Clock::time_point now, std::vector<DNS_REC> &chain,
+                       std::vector<DNS_REC> &answers, std::string &next, const RRSETS *message = nullptr);
+
+    size_t size() const { return entries.size(); }
+
+    uint64_t hits() const { return hitCount; }
+
+    uint64_t misses() const { return missCount; }
+
+private:
+    struct ENTRY {
+        std::vector<DNS_REC> records; // Empty for negative answer
+        int rcode = RCODE_NOERROR;
+        Clock::time_point stored;
+        Clock::time_point expires;
+    };
+
+    void purge(Clock::time_point now);
+
+    ENTRY *insert(const std::string &key, int ttl, Clock::time_point now);
+
+    ENTRY *find(const std::string &key, Clock::time_point now);
+
+    static std::string key(const std::string &name, uint16_t type);
+
+    std::unordered_map<std::string, ENTRY> entries;
+    uint64_t hitCount = 0;
+    uint64_t missCount = 0;
+};
+
+#endif // CACHE_H
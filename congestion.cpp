@@ -0,0 +1,104 @@
+/**
+ * @author Rostislav Kral
+ * @brief Implementation of the AIMD window and the token bucket.
+ * @file congestion.cpp
+ * */
+
+#include "congestion.h"
+#include <algorithm>
+#include <cmath>
+
+AimdWindow::AimdWindow(size_t maxWindow) : maxWindow(std::max<size_t>(1, maxWindow))
+{
+    cwnd = std::min<double>(AIMD_INITIAL_WINDOW, this->maxWindow);
+    ssthresh = this->maxWindow;
+}
+
+bool AimdWindow::decrease(double factor, Clock::time_point now)
+{
+    // Answers of the queries sent before the last decrease still reflect the old window
+    if (decreaseCount > 0 && now - lastDecrease < std::chrono::microseconds((int64_t)srtt))
+        return false;
+
+    cwnd = std::max(1.0, cwnd * factor);
+    ssthresh = cwnd;
+    lastDecrease = now;
+    decreaseCount++;
+    return true;
+}
+
+void AimdWindow::answered(uint32_t rtt, Clock::time_point now)
+{
+    if (rtt > 0)
+    {
+        srtt = srtt == 0 ? rtt : srtt + (rtt - srtt) / 8;
+        minRtt = minRtt == 0 ? rtt : std::min<double>(minRtt, rtt);
+
+        if (srtt > minRtt * AIMD_RTT_INFLATION && srtt - minRtt > AIMD_RTT_SLACK_US && decrease(AIMD_DELAY_FACTOR, now))
+            return;
+    }
+
+    if (cwnd < ssthresh)
+        cwnd += 1;
+    else
+        cwnd += 1 / cwnd;
+    cwnd = std::min(cwnd, maxWindow);
+}
+
+void AimdWindow::lost(Clock::time_point now)
+{
+    decrease(0.5, now);
+}
+
+TokenBucket::TokenBucket(double rate, Clock::time_point now) : rate(std::max(0.0, rate)), last(now)
+{
+    burst = std::max(1.0, this->rate * TOKEN_BUCKET_BURST);
+    tokens = burst;
+}
+
+void TokenBucket::refill(Clock::time_point now)
+{
+    double elapsed = std::chrono::duration<double>(now - last).count();
+    tokens = std::min(burst, tokens + elapsed * rate);
+    last = now;
+}
+
+bool TokenBucket::ready(Clock::time_point now)
+{
+    if (rate <= 0)
+        return true;
+    refill(now);
+    return tokens >= 1;
+}
+
+int TokenBucket::delay(Clock::time_point now)
+{
+    if (rate <= 0)
+        return 0;
+    refill(now);
+    return tokens >= 1 ? 0 : (int)std::ceil((1 - tokens) / rate * 1000);
+}
+
+RttQuantile::RttQuantile(double quantile) : quantile(std::min(1.0, std::max(0.0, quantile)))
+{
+    samples.reserve(RTT_QUANTILE_SAMPLES);
+}
+
+void RttQuantile::add(uint32_t rtt)
+{
+    if (samples.size() < RTT_QUANTILE_SAMPLES)
+        samples.push_back(rtt);
+    else
+        samples[next] = rtt;
+    next = (next + 1) % RTT_QUANTILE_SAMPLES;
+
+    if (++fresh < RTT_QUANTILE_UPDATE)
+        return;
+    fresh = 0;
+
+    // Selection on a copy, the ring keeps the order of arrival
+    std::vector<uint32_t> sorted(samples);
+    size_t position = std::min(sorted.size() - 1, (size_t)(quantile * sorted.size()));
+    std::nth_element(sorted.begin(), sorted.begin() + position, sorted.end());
+    current = sorted[position];
+}
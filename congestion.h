@@ -0,0 +1,145 @@
+/**
+ * @author Rostislav Kral
+ * @brief Contains AIMD window of the queries in flight, token bucket limiting the sending rate of the bulk run and
+ * the RTT quantile of an upstream.
+ * @file congestion.h
+ * */
+
+#ifndef CONGESTION_H
+#define CONGESTION_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#define AIMD_INITIAL_WINDOW 8 // Window at the start of the run, slow start doubles it every RTT
+#define AIMD_DELAY_FACTOR 0.85 // Decrease when the RTT grows, milder than the halving after loss
+#define AIMD_RTT_INFLATION 2.0 // Smoothed RTT above this multiple of the minimal RTT means queueing
+#define AIMD_RTT_SLACK_US 5000 // RTT must grow at least by this to count, jitter of fast servers is ignored
+#define TOKEN_BUCKET_BURST 0.01 // Seconds of the rate which can be sent at once
+#define RTT_QUANTILE_SAMPLES 512 // Latest RTTs the quantile is computed from
+#define RTT_QUANTILE_UPDATE 32 // New samples between two computations of the quantile
+
+/**
+ * @brief Window of the queries in flight controlled by additive increase and multiplicative decrease, loss
+ * (timeout) halves it and inflated RTT shrinks it, at most once per RTT
+ * */
+class AimdWindow {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    /**
+     * @brief Constructor of the AimdWindow
+     * @param maxWindow Upper bound, the window never grows above it
+     * */
+    explicit AimdWindow(size_t maxWindow);
+
+    /**
+     * @brief Answer arrived, the window grows by one per answer in slow start and by one per window later
+     * @param rtt Microseconds, 0 for answers of retransmitted queries (ambiguous RTT is not sampled)
+     * @param now
+     * @return
+     * */
+    void answered(uint32_t rtt, Clock::time_point now);
+
+    /**
+     * @brief Query timed out, the upstream drops queries
+     * @param now
+     * @return
+     * */
+    void lost(Clock::time_point now);
+
+    size_t window() const { return cwnd < 1 ? 1 : (size_t)cwnd; }
+
+    double smoothedRtt() const { return srtt; } // us
+
+    uint64_t decreases() const { return decreaseCount; }
+
+private:
+    bool decrease(double factor, Clock::time_point now);
+
+    double cwnd;
+    double ssthresh;
+    double maxWindow;
+    double srtt = 0;
+    double minRtt = 0;
+    Clock::time_point lastDecrease;
+    uint64_t decreaseCount = 0;
+};
+
+/**
+ * @brief Token bucket for the hard QPS ceiling, spending is always allowed so retransmissions and follow-ups go out
+ * at once, their debt delays the new queries
+ * */
+class TokenBucket {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    /**
+     * @brief Constructor of the TokenBucket
+     * @param rate Tokens per second, 0 disables the limit
+     * @param now
+     * */
+    TokenBucket(double rate, Clock::time_point now);
+
+    /**
+     * @brief Checks that a new query can go out
+     * @param now
+     * @return true if the bucket has at least one token
+     * */
+    bool ready(Clock::time_point now);
+
+    void spend() { tokens -= 1; }
+
+    /**
+     * @brief Time until the bucket has one token
+     * @param now
+     * @return int milliseconds, rounded up
+     * */
+    int delay(Clock::time_point now);
+
+    bool limited() const { return rate > 0; }
+
+private:
+    void refill(Clock::time_point now);
+
+    double rate;
+    double burst;
+    double tokens;
+    Clock::time_point last;
+};
+
+/**
+ * @brief Quantile (e.g. p95) of the latest RTTs of one upstream, recomputed every RTT_QUANTILE_UPDATE samples
+ * */
+class RttQuantile {
+public:
+    /**
+     * @brief Constructor of the RttQuantile
+     * @param quantile Between 0 and 1
+     * */
+    explicit RttQuantile(double quantile);
+
+    /**
+     * @brief Adds the RTT of one answer
+     * @param rtt Microseconds
+     * @return
+     * */
+    void add(uint32_t rtt);
+
+    /**
+     * @brief Quantile of the samples
+     * @return uint32_t microseconds, 0 until the first RTT_QUANTILE_UPDATE samples arrive
+     * */
+    uint32_t value() const { return current; }
+
+private:
+    double quantile;
+    std::vector<uint32_t> samples; // Ring of the latest RTTs
+    size_t next = 0;
+    size_t fresh = 0; // Samples since the last computation
+    uint32_t current = 0;
+};
+
+#endif // CONGESTION_H
@@ -0,0 +1,121 @@
+/**
+ * @author Rostislav Kral
+ * @brief Contains the budget of one resolution: absolute deadline and cancellation token, checked before every
+ * retry, CNAME target and wait of the resolvers, so the caller gets the partial result once the budget runs out.
+ * @file deadline.h
+ * */
+
+#ifndef DEADLINE_H
+#define DEADLINE_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <queue>
+#include <vector>
+
+#define DEADLINE_SLICE_MS 50 // Longest wait of a cancellable resolution, cancel() is noticed this late at most
+
+/**
+ * @brief Cancellation shared by all copies of the token, cancel() may be called from any thread or signal handler
+ * */
+class CancelToken {
+public:
+    CancelToken() : flag(std::make_shared<std::atomic<bool>>(false)) {}
+
+    /**
+     * @brief Token which is never cancelled, nothing is allocated
+     * @return CancelToken
+     * */
+    static CancelToken none() { return CancelToken(nullptr); }
+
+    void cancel() const
+    {
+        if (flag)
+            flag->store(true);
+    }
+
+    bool cancelled() const { return flag && flag->load(std::memory_order_relaxed); }
+
+    bool cancellable() const { return flag != nullptr; }
+
+private:
+    explicit CancelToken(std::nullptr_t) {}
+
+    std::shared_ptr<std::atomic<bool>> flag;
+};
+
+class Deadline {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    /**
+     * @brief No deadline and no cancellation, the resolution is bounded only by its tries
+     * */
+    Deadline() : deadline(Clock::time_point::max()), token(CancelToken::none()) {}
+
+    Deadline(Clock::time_point at, CancelToken token) : deadline(at), token(std::move(token)) {}
+
+    /**
+     * @brief Deadline from now
+     * @param milliseconds Budget, 0 or less = no deadline
+     * @param token
+     * @return Deadline
+     * */
+    static Deadline after(int milliseconds, CancelToken token = CancelToken::none())
+    {
+        return Deadline(milliseconds > 0 ? Clock::now() + std::chrono::milliseconds(milliseconds) : Clock::time_point::max(),
+                        std::move(token));
+    }
+
+    Clock::time_point at() const { return deadline; }
+
+    bool cancelled() const { return token.cancelled(); }
+
+    bool expired(Clock::time_point now) const { return now >= deadline || token.cancelled(); }
+
+    /**
+     * @brief Shortens the wait to the budget left, cancellable resolutions wait in slices to notice cancel()
+     * @param timeout Milliseconds, -1 = infinite
+     * @param now
+     * @return int Milliseconds, 0 when the budget is gone
+     * */
+    int limit(int timeout, Clock::time_point now) const
+    {
+        if (expired(now))
+            return 0;
+        if (deadline != Clock::time_point::max())
+        {
+            int left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count() + 1;
+            timeout = timeout < 0 ? left : std::min(timeout, left);
+        }
+        if (token.cancellable())
+            timeout = timeout < 0 ? DEADLINE_SLICE_MS : std::min(timeout, DEADLINE_SLICE_MS);
+        return timeout;
+    }
+
+    const CancelToken &cancellation() const { return token; }
+
+private:
+    Clock::time_point deadline;
+    CancelToken token;
+};
+
+/**
+ * @brief Deadline of the query in flight, (ID, sequence) like in the timeout queues of the resolvers, the entries
+ * of answered or retransmitted queries are skipped by the owner
+ * */
+struct DEADLINE_ENTRY {
+    Deadline::Clock::time_point at;
+    uint16_t id;
+    uint32_t sequence;
+
+    bool operator>(const DEADLINE_ENTRY &other) const { return at > other.at; }
+};
+
+// Earliest deadline on the top
+typedef std::priority_queue<DEADLINE_ENTRY, std::vector<DEADLINE_ENTRY>, std::greater<DEADLINE_ENTRY>> DeadlineQueue;
+
+#endif // DEADLINE_H
@@ -5,6 +5,12 @@
  * */
 
 #include "dns-resolver.h"
+#include "transport.h"
+#include "local-table.h"
+#include "trace.h"
+#include "message-index.h"
+#include "address-answer.h"
+#include <chrono>
 
 DnsResolver::DnsResolver(Args args)
 {
@@ -12,58 +18,49 @@ DnsResolver::DnsResolver(Args args)
     memset(buf, 0, sizeof(buf));
 }
 
-void DnsResolver::connectToDNSServer()
+DnsResolver::~DnsResolver()
 {
-    struct addrinfo hints, *result, *tmp;
+}
 
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_DGRAM;
-    // Trying to get addresses of the DNS server
-    if ((getaddrinfo(args.server, std::to_string(args.port).c_str(), &hints, &result)) != 0)
+void DnsResolver::connectToDNSServer()
+{
+    // Names of the local table never need the server
+    if (local && !args.upstreamFirst)
     {
-        perror("Cannot fetch given dns server!\n");
-        exit(1);
+        size_t length = buildRequest();
+        if (answerLocally(std::vector<unsigned char>(buf, buf + length)))
+            return;
     }
+    transport = openTransport(args, SOCK_DGRAM);
+}
 
-    tmp = result;
-
-    while (result != NULL)
-    {
-        if (result->ai_family == AF_INET || result->ai_family == AF_INET6)
-        {
-            if ((this->sock = socket(result->ai_family, SOCK_DGRAM, 0)) == -1)
-            {
-                perror("Socket creation failed\n");
-                exit(1);
-
-            }
-            if ((connect(sock, result->ai_addr, result->ai_addrlen)) == -1)
-            {
-                perror("DNS server unreachable\n");
-                exit(1);
-
-            }
+void DnsResolver::useTransport(std::unique_ptr<Transport> transport)
+{
+    this->transport = std::move(transport);
+}
 
-            break;
-        }
-        result = result->ai_next;
-    }
+void DnsResolver::useLocalTable(std::shared_ptr<const LocalTable> table)
+{
+    local = std::move(table);
+}
 
-    if (result == NULL)
+bool DnsResolver::answerLocally(const std::vector<unsigned char> &request)
+{
+    if (!local || (packetSize = local->answer(request.data(), request.size(), buf)) == 0)
     {
-        perror("DNS server not found\n");
-        exit(1);
+        memcpy(buf, request.data(), request.size());
+        return false;
     }
-
-    freeaddrinfo(tmp);
+    answered = true;
+    return true;
 }
 
-void DnsResolver::query()
+size_t DnsResolver::buildRequest()
 {
     // ---------------------------------       QUESTION SECTION QUERY             ----------------------------------
 
     unsigned char *qname;
+    TraceSpan span("encode");
 
     dns = (struct DNS_HEADER *)&buf;
 
@@ -81,9 +78,8 @@ void DnsResolver::query()
     dns->nscount = 0;
 
     qname = (unsigned char *)&buf[sizeof(struct DNS_HEADER)];
-    if (args.reverse)
-        args.domain = buildPTRQuery(args.domain);
-    ChangeToDnsNameFormat(qname, (unsigned char *)args.domain.c_str()); // Need to parse the domain to DNS format
+    std::string domain = args.reverse ? buildPTRQuery(args.domain) : args.domain;
+    ChangeToDnsNameFormat(qname, (unsigned char *)domain.c_str()); // Need to parse the domain to DNS format
     qinfo = (struct QUESTION *)&buf[sizeof(struct DNS_HEADER) + (strlen((const char *)qname) + 1)];
 
     if (args.reverse)
@@ -93,25 +89,100 @@ void DnsResolver::query()
 
     qinfo->qclass = htons(1); // IN
 
-    if (send(sock, (char *)buf,
-             sizeof(struct DNS_HEADER) + (strlen((const char *)qname) + 1) + sizeof(struct QUESTION), 0) < 0)
-    {
-        perror("Send failed");
-        exit(1);
-    }
+    return sizeof(struct DNS_HEADER) + (strlen((const char *)qname) + 1) + sizeof(struct QUESTION);
+}
 
-    if ((packetSize = recv(sock, buf, MAX_DNS_SIZE, 0)) < 0)
+void DnsResolver::query()
+{
+    query(Deadline::after(args.budget));
+}
+
+void DnsResolver::query(const Deadline &deadline)
+{
+    if (answered)
+        return; // From the local table in connectToDNSServer()
+
+    size_t length = buildRequest();
+    std::vector<unsigned char> request(buf, buf + length);
+
+    // Lost datagram is sent again, answers with other ID (late or spoofed) are skipped
+    for (int attempt = 0; attempt < args.tries && !deadline.expired(std::chrono::steady_clock::now()); attempt++)
     {
-        perror("Failed to receive");
-        exit(1);
+        if (attempt > 0)
+            Tracer::instant("retry", 0);
+        {
+            TraceSpan span("send");
+            transport->send(request.data(), request.size());
+        }
+
+        // The try ends with its timeout or the budget, cancellation is noticed between the slices of the wait
+        auto end = std::min(std::chrono::steady_clock::now() + std::chrono::milliseconds(args.timeout), deadline.at());
+        int left;
+        while (!deadline.cancelled() &&
+               (left = std::chrono::duration_cast<std::chrono::milliseconds>(end - std::chrono::steady_clock::now()).count()) >= 0)
+        {
+            if (!waitTraced(deadline.limit(left, std::chrono::steady_clock::now())))
+                continue;
+            while ((packetSize = receiveTraced()) > 0)
+            {
+                if (packetSize >= (int)sizeof(DNS_HEADER) && memcmp(buf, request.data(), 2) == 0 && dns->qr)
+                {
+                    // Local table fills what the server doesn't know
+                    if (args.upstreamFirst && (dns->rcode != RCODE_NOERROR || dns->ancount == 0))
+                    {
+                        std::vector<unsigned char> response(buf, buf + packetSize);
+                        if (!answerLocally(request))
+                        {
+                            memcpy(buf, response.data(), response.size());
+                            packetSize = response.size();
+                        }
+                    }
+                    return;
+                }
+            }
+        }
     }
 
-    // Close the socket
-    close(sock);
+    if (args.upstreamFirst && answerLocally(request))
+        return;
+    memcpy(buf, request.data(), request.size());
+    packetSize = 0;
+    if (deadline.cancelled())
+        throw TransportError("Query cancelled");
+    if (deadline.expired(std::chrono::steady_clock::now()))
+        throw TransportError("No answer from the server within the budget");
+    throw TransportError("No answer from the server");
 
     //  ----------------------------- END OF QUESTION QUERY SECTION ---------------------------------
 }
 
+bool DnsResolver::waitTraced(int timeout)
+{
+    TraceSpan span("wait");
+    return transport->wait(timeout);
+}
+
+int DnsResolver::receiveTraced()
+{
+    TraceSpan span("receive");
+    return transport->receive(buf, MAX_DNS_SIZE);
+}
+
+bool DnsResolver::useMessage(const unsigned char *msg, size_t len)
+{
+    MESSAGE_INDEX index;
+
+    // Malformed messages are refused here, getAnswer() would throw for them
+    if (len > MAX_DNS_SIZE || !validateMessage(msg, len, index) || index.questions == 0)
+        return false;
+
+    memcpy(buf, msg, len);
+    packetSize = len;
+    dns = reinterpret_cast<DNS_HEADER *>(buf);
+    answered = true;
+    return true;
+}
+
 void DnsResolver::printData()
 {
     // -------- HEX Data output -----------------
@@ -134,350 +205,153 @@ void DnsResolver::printData()
     // --------------- END OF HEX Data output -----------------
 }
 
-DNS_INFO DnsResolver::getAnswer()
+/**
+ * @brief Name in the format of the parseName() output, which keeps the terminating zero in the string
+ * */
+static std::string printedName(const unsigned char *msg, size_t pos)
 {
+    std::string name;
+    indexedName(msg, pos, name);
+    if (!name.empty())
+        name.push_back('\0');
+    return name;
+}
 
-    DNS_INFO dnsInfo;
-
-    // ---------------------------------------------- DNS HEADER PARSING ---------------------------------------------------------
-    DNS_HEADER *dnsHeader = reinterpret_cast<DNS_HEADER *>(buf);
-    //    uint16_t id = ntohs(dnsHeader->id);
-    uint16_t qdcount = ntohs(dnsHeader->qdcount);
-    uint16_t ancount = ntohs(dnsHeader->ancount);
-    uint16_t arcount = ntohs(dnsHeader->arcount);
-    uint16_t nscount = ntohs(dnsHeader->nscount);
-
-    dnsInfo.qdcount = qdcount;
-    dnsInfo.ancount = ancount;
-    dnsInfo.arcount = arcount;
-    dnsInfo.nscount = nscount;
-
-    std::string aa, rd, tc;
-    aa = (ntohs(dnsHeader->aa) ? "Yes" : "No");
-    rd = (ntohs(dnsHeader->rd) ? "Yes" : "No");
-    tc = (ntohs(dnsHeader->tc) ? "Yes" : "No");
-
-    dnsInfo.aa = aa;
-    dnsInfo.rd = rd;
-    dnsInfo.tc = tc;
-
-    int offset = 12; // RFC1035 DNS header packet structure
-    const unsigned char *questionPtr = buf + sizeof(DNS_HEADER);
-
-    // ---------------------------------------------- END OF DNS HEADER PARSING ---------------------------------------------------------
+/**
+ * @brief IPv6 address in the format of the output, every group in hex padded by zeros behind the digits
+ * */
+static std::string printedAddress6(const unsigned char *rdata)
+{
+    static const char digits[] = "0123456789abcdef";
+    char text[40];
+    char *p = text;
 
-    // ---------------------------------------------- DNS QUESTION PARSING --------------------------------------------------------------
-    // Parse QNAME
-    int questionLength = 0;
-    std::string questionName;
-    while (questionPtr[questionLength] != 0)
+    for (int i = 0; i < 16; i += 2)
     {
-        int labelLength = questionPtr[questionLength];
-        for (int i = 0; i < labelLength; i++)
-        {
-            questionName += questionPtr[questionLength + i + 1];
-        }
-        questionLength += labelLength + 1;
-        questionName += ".";
+        unsigned group = (rdata[i] << 8) | rdata[i + 1];
+        int shift = 12;
+        while (shift > 0 && (group >> shift) == 0)
+            shift -= 4;
+        char *start = p;
+        for (; shift >= 0; shift -= 4)
+            *p++ = digits[(group >> shift) & 0xF];
+        while (p - start < 4)
+            *p++ = '0';
+        *p++ = ':';
     }
+    return std::string(text, p - text - 1);
+}
 
-    dnsInfo.questionName = questionName;
-
-    std::string type;
-    if (ntohs(qinfo->qtype) == T_A)
-        type = "A";
-    else if (ntohs(qinfo->qtype) == T_AAAA)
-        type = "AAAA";
-    else if (ntohs(qinfo->qtype) == T_PTR)
-        type = "PTR";
-
-    questionPtr += questionLength + 5;
+DNS_INFO DnsResolver::getAnswer()
+{
+    TraceSpan span("parse");
 
-    dnsInfo.type = type;
+    DNS_INFO dnsInfo;
+    MESSAGE_INDEX index;
 
-    // ---------------------------------------------- END OF DNS QUESTION PARSING --------------------------------------------------------------
+    // The only bounds checks of the message, the decoding below reads the validated offsets
+    if (!validateMessage(buf, packetSize, index) || index.questions == 0)
+        throw TransportError("Malformed response from the server");
 
-    // ----------------------------------------------- DNS ANSWERS SECTION PARSING -------------------------------------------------------------
-    const unsigned char *answerPtr = questionPtr;
-    uint16_t rdlength;
-    for (int i = 0; i < ancount; i++)
-    {
-        uint16_t type;
-        uint32_t ttl;
-        DNS_REC record;
-        std::string parsedName;
-
-        // Parse TYPE
-        memcpy(&type, answerPtr + 2, sizeof(uint16_t));
-        type = ntohs(type);
-        // Parse TTL
-        memcpy(&ttl, answerPtr + 6, sizeof(uint32_t));
-        ttl = ntohl(ttl);
-        record.ttl = ttl;
-
-        // Parse RDLENGTH
-        memcpy(&rdlength, answerPtr + 10, sizeof(uint16_t));
-        rdlength = ntohs(rdlength);
-
-        // Parse NAME
-        if (type != T_CNAME)
-        {
-            parseName(answerPtr, buf, parsedName);
+    // ---------------------------------------------- DNS HEADER PARSING ---------------------------------------------------------
+    DNS_HEADER *dnsHeader = reinterpret_cast<DNS_HEADER *>(buf);
 
-            if (*answerPtr != 192)
-            {
-                answerPtr = answerPtr + (parsedName.length() - 1);
-            }
+    dnsInfo.qdcount = ntohs(dnsHeader->qdcount);
+    dnsInfo.ancount = ntohs(dnsHeader->ancount);
+    dnsInfo.arcount = ntohs(dnsHeader->arcount);
+    dnsInfo.nscount = ntohs(dnsHeader->nscount);
 
-            record.name = parsedName;
-        }
+    dnsInfo.aa = dnsHeader->aa ? "Yes" : "No";
+    dnsInfo.rd = dnsHeader->rd ? "Yes" : "No";
+    dnsInfo.tc = dnsHeader->tc ? "Yes" : "No";
+    dnsInfo.rcode = dnsHeader->rcode;
 
-        // Parse RDATA
-        if (type == T_A)
-        {
-            std::ostringstream stringStream;
-            stringStream << (int)*(answerPtr + offset) << "." << (int)*(answerPtr + offset + 1) << "."
-                         << (int)*(answerPtr + offset + 2) << "." << (int)*(answerPtr + offset + 3);
-            record.value = stringStream.str();
-            record.type = "A";
-        }
-        else if (type == T_AAAA)
+    // ---------------------------------------------- DNS QUESTION PARSING --------------------------------------------------------------
+    indexedName(buf, index.question, dnsInfo.questionName);
+    if (!dnsInfo.questionName.empty())
+        dnsInfo.questionName += ".";
+
+    if (index.qtype == T_A)
+        dnsInfo.type = "A";
+    else if (index.qtype == T_AAAA)
+        dnsInfo.type = "AAAA";
+    else if (index.qtype == T_PTR)
+        dnsInfo.type = "PTR";
+
+    // ----------------------------------------------- DNS RECORDS PARSING -------------------------------------------------------------
+    std::vector<DNS_REC> *sections[] = {&dnsInfo.answers, &dnsInfo.authorities, &dnsInfo.additionals};
+    size_t position = 0;
+    for (int section = SECTION_ANSWER; section <= SECTION_ADDITIONAL; section++)
+    {
+        sections[section]->reserve(index.sections[section]);
+        for (int i = 0; i < index.sections[section]; i++)
         {
+            const RECORD_INDEX &entry = index.records[position++];
+            const unsigned char *rdata = buf + entry.rdata;
+            DNS_REC record;
 
-            std::ostringstream stringStream;
-            std::ostringstream temp;
-            int len;
+            record.name = printedName(buf, entry.name);
+            record.ttl = entry.ttl;
+            record.type = "UNSUPPORTED";
 
-            for(int i = 0; i < 16; i+=2) 
+            if (section == SECTION_AUTHORITY)
             {
-           
-                temp << std::hex << ntohs(*reinterpret_cast<const uint16_t *>(answerPtr + offset + i));
-                
-                len = temp.str().length();
-               if(len != 4) {
-                    for(int i = 0; i < 4 - len; i++) temp << std::hex << "0";
+                // Delegation and the SOA of the negative answer, its MINIMUM limits the caching of NXDOMAIN and NODATA
+                if (entry.type == T_NS)
+                {
+                    record.value = printedName(buf, entry.rdata);
+                    record.type = "NS";
+                }
+                else if (entry.type == T_SOA)
+                {
+                    indexedRecord(buf, entry, record);
+                    record.name = printedName(buf, entry.name);
                 }
-
-                
-                stringStream << std::hex << temp.str();
-                if(i != 14) stringStream << ":";
-                temp.str("");
-
-                
             }
-            
-
-            record.value = stringStream.str();
-            record.type = "AAAA";
-        }   
-        else if (type == T_CNAME)
-        {
-            std::string parsedName, parsedCName;
-
-            parseName(answerPtr, buf, parsedCName);
-            if (*answerPtr != 192)
+            else if (entry.type == T_A)
             {
-                answerPtr = answerPtr + (parsedCName.length() - 1);
+                indexedAddress(rdata, record.value);
+                record.type = "A";
             }
-            parseName(answerPtr + offset, buf, parsedName);
-
-            record.value = parsedName;
-            record.name = parsedCName;
-
-            record.type = "CNAME";
-        }
-        else if (type == T_PTR)
-        {
-            int labelLength = 0;
-            std::ostringstream stringStream;
-
-            while (answerPtr[labelLength + offset] != 0)
+            else if (entry.type == T_AAAA)
             {
-                int currentLabelLength = answerPtr[labelLength + offset];
-                for (int j = 0; j < currentLabelLength; j++)
-                {
-                    stringStream << answerPtr[labelLength + offset + j + 1];
-                }
-                labelLength += currentLabelLength + 1;
-                if (answerPtr[labelLength + offset] != 0)
-                    stringStream << ".";
+                record.value = printedAddress6(rdata);
+                record.type = "AAAA";
             }
-
-            record.value = stringStream.str();
-            record.type = "PTR";
-        }
-        else
-            record.type = "UNSUPPORTED";
-        answerPtr += offset + rdlength;
-
-        dnsInfo.answers.push_back(record);
-    }
-    // ------------------------------------------------------------------- END OF DNS ANSWERS SECTION PARSING ---------------------------------------------------------------------
-
-    const unsigned char *authorityPtr = answerPtr;
-    for (int i = 0; i < nscount; i++)
-    {
-        // Parse NAME
-        uint16_t type;
-        uint32_t ttl;
-        DNS_REC record;
-        std::string parsedName, parsedCName;
-
-        parseName(authorityPtr, buf, parsedCName);
-
-        if (*authorityPtr != 192)
-        {
-            authorityPtr = authorityPtr + (parsedCName.length() - 1);
-        }
-
-        parseName(authorityPtr + offset, buf, parsedName);
-
-        // Parse RDLENGTH
-        memcpy(&rdlength, authorityPtr + 10, sizeof(uint16_t));
-        rdlength = ntohs(rdlength);
-        // Parse TYPE
-        memcpy(&type, authorityPtr + 2, sizeof(uint16_t));
-        type = ntohs(type);
-        // Parse TTL
-        memcpy(&ttl, authorityPtr + 6, sizeof(uint32_t));
-        ttl = ntohl(ttl);
-        if (type == T_NS)
-        {
-            record.ttl = ttl;
-            record.name = parsedCName;
-            record.value = parsedName;
-            record.ttl = ttl;
-            record.type = "NS";
-        }
-        else
-        {
-            record.type = "UNSUPPORTED";
-        }
-
-        dnsInfo.authorities.push_back(record);
-        authorityPtr += offset + rdlength;
-    }
-
-    /* ----------------------------------------------------------- ADDITIONAL SECTION ANSWERS PARSING ------------------------------------------------------------- */
-    const unsigned char *additionalPtr = authorityPtr;
-    for (int i = 0; i < arcount; i++)
-    {
-        uint16_t type;
-        // uint16_t _class; We do not need it for this project
-        uint32_t ttl;
-        DNS_REC record;
-        std::string parsedName;
-        // Parse TYPE
-
-        memcpy(&type, additionalPtr + 2, sizeof(uint16_t));
-        type = ntohs(type);
-        // Parse TTL
-        memcpy(&ttl, additionalPtr + 6, sizeof(uint32_t));
-        ttl = ntohl(ttl);
-        record.ttl = ttl;
-
-        // Parse RDLENGTH
-        memcpy(&rdlength, additionalPtr + 10, sizeof(uint16_t));
-        rdlength = ntohs(rdlength);
-        // Parse NAME
-        if (type != T_CNAME)
-        {
-            parseName(additionalPtr, this->buf, parsedName);
-            if (*answerPtr != 192)
+            else if (entry.type == T_CNAME)
             {
-                answerPtr = answerPtr + (parsedName.length() - 1);
+                record.value = printedName(buf, entry.rdata);
+                record.type = "CNAME";
             }
-
-            record.name = parsedName;
-        }
-
-        //  std::cout << "TYPE::::::::      " << type << std::endl;
-
-        // Parse RDATA
-        if (type == T_A)
-        {
-
-            std::ostringstream stringStream;
-            stringStream << (int)(*(additionalPtr + offset)) << "." << (int)(*(additionalPtr + offset + 1)) << "."
-                         << (int)(*(additionalPtr + offset + 2)) << "." << (int)(*(additionalPtr + offset + 3));
-            record.value = stringStream.str();
-            record.type = "A";
-        }
-        else if (type == T_AAAA)
-        {
-            std::ostringstream stringStream;
-            std::ostringstream temp;
-            int len;
-
-            for(int i = 0; i < 16; i+=2) 
+            else if (entry.type == T_PTR)
             {
-           
-                temp << std::hex << ntohs(*reinterpret_cast<const uint16_t *>(additionalPtr + offset + i));
-                
-                len = temp.str().length();
-               if(len != 4) {
-                    for(int i = 0; i < 4 - len; i++) temp << std::hex << "0";
-                }
-
-                
-                stringStream << std::hex << temp.str();
-                if(i != 14) stringStream << ":";
-                temp.str("");
-
-                
+                indexedName(buf, entry.rdata, record.value);
+                record.type = "PTR";
             }
-            record.value = stringStream.str();
-            record.type = "AAAA";
-        }
-        else if (type == T_CNAME)
-        {
 
-            std::string parsedName, parsedCName;
-            parseName(additionalPtr + offset, buf, parsedName);
-
-            parseName(additionalPtr, buf, parsedCName);
-            record.name = parsedCName;
-            record.value = parsedName;
-            record.type = "CNAME";
+            sections[section]->push_back(std::move(record));
         }
-        else if (type == T_PTR)
-        {
-            std::ostringstream stringStream;
-
-            int labelLength = 0;
-            while (additionalPtr[labelLength + offset] != 0)
-            {
-                int currentLabelLength = additionalPtr[labelLength + offset];
-                for (int j = 0; j < currentLabelLength; j++)
-                {
-                    stringStream << additionalPtr[labelLength + offset + j + 1];
-                }
-                labelLength += currentLabelLength + 1;
-                if (additionalPtr[labelLength + offset] != 0)
-                    stringStream << ".";
-            }
-            record.value = stringStream.str();
-            record.type = "PTR";
-        }
-        else
-        {
-            record.type = "UNSUPPORTED";
-        }
-
-        dnsInfo.additionals.push_back(record);
-        additionalPtr += offset + rdlength; // Next answer
     }
 
-    /* ----------------------------------------------------------- END OF ADDITIONAL SECTION ANSWERS PARSING ------------------------------------------------------------- */
-
     return dnsInfo;
 }
 
+bool DnsResolver::getAddresses(ADDRESS_ANSWER<T_A> &answer) const
+{
+    return decodeAddressAnswer(buf, packetSize, answer);
+}
+
+bool DnsResolver::getAddresses(ADDRESS_ANSWER<T_AAAA> &answer) const
+{
+    return decodeAddressAnswer(buf, packetSize, answer);
+}
+
 void DnsResolver::printAnswer(DNS_INFO info)
 {
+    TraceSpan span("format");
 
     std::cout << "DNS HEADER: Authoritative: " << info.aa << ", Recursive: " << info.rd << ", Truncated: " << info.tc
-              << std::endl;
+              << ", Rcode: " << rcodeToString(info.rcode) << std::endl;
 
     std::cout << "Question section(" << info.qdcount << ")" << std::endl
               << "  ";
@@ -516,3 +390,188 @@ void DnsResolver::printAnswer(DNS_INFO info)
             std::cout << "  UNSUPPORTED DNS RECORD TYPE" << std::endl;
     }
 }
+
+std::string typeToString(uint16_t type)
+{
+    switch (type)
+    {
+    case T_A:
+        return "A";
+    case T_NS:
+        return "NS";
+    case T_CNAME:
+        return "CNAME";
+    case T_SOA:
+        return "SOA";
+    case T_PTR:
+        return "PTR";
+    case T_MX:
+        return "MX";
+    case T_TXT:
+        return "TXT";
+    case T_AAAA:
+        return "AAAA";
+    default:
+        return "UNSUPPORTED";
+    }
+}
+
+std::string rcodeToString(int rcode)
+{
+    static const char *names[] = {"NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", "NOTIMP", "REFUSED"};
+
+    if (rcode >= 0 && rcode < 6)
+        return names[rcode];
+    if (rcode == RCODE_CANCELLED)
+        return "CANCELLED";
+    if (rcode == RCODE_INVALID)
+        return "INVALID";
+    if (rcode == RCODE_TIMEOUT)
+        return "TIMEOUT";
+    return "RCODE" + std::to_string(rcode);
+}
+
+bool parseSoa(const std::string &value, SOA_RECORD &soa)
+{
+    std::istringstream fields(value);
+
+    if (!(fields >> soa.mname >> soa.rname >> soa.serial >> soa.refresh >> soa.retry >> soa.expire >> soa.minimum))
+        return false;
+    if (soa.mname.size() > 1 && soa.mname.back() == '.')
+        soa.mname.pop_back();
+    if (soa.rname.size() > 1 && soa.rname.back() == '.')
+        soa.rname.pop_back();
+    return true;
+}
+
+int stringToType(const std::string &type)
+{
+    for (int known : {T_A, T_NS, T_CNAME, T_SOA, T_PTR, T_MX, T_TXT, T_AAAA})
+    {
+        if (strcasecmp(typeToString(known).c_str(), type.c_str()) == 0)
+            return known;
+    }
+    if (strcasecmp(type.c_str(), "AXFR") == 0)
+        return T_AXFR;
+    if (strcasecmp(type.c_str(), "IXFR") == 0)
+        return T_IXFR;
+    if (strncasecmp(type.c_str(), "TYPE", 4) == 0 && type.size() > 4)
+    {
+        int value = std::atoi(type.c_str() + 4);
+        return value > 0 && value < 65536 ? value : 0;
+    }
+    return 0;
+}
+
+bool decodeRecord(const unsigned char *msg, size_t len, size_t &pos, DNS_REC &record, uint16_t *rrType, size_t *rdata)
+{
+    size_t p = pos;
+
+    if (!readName(msg, len, p, record.name) || p + 10 > len)
+        return false;
+
+    uint16_t type = (msg[p] << 8) | msg[p + 1];
+    uint32_t ttl = ((uint32_t)msg[p + 4] << 24) | (msg[p + 5] << 16) | (msg[p + 6] << 8) | msg[p + 7];
+    uint16_t rdlength = (msg[p + 8] << 8) | msg[p + 9];
+    size_t rdataPos = p + 10;
+    size_t end = rdataPos + rdlength;
+
+    if (end > len)
+        return false;
+
+    record.ttl = ttl;
+    record.type = typeToString(type);
+    record.value.clear();
+
+    // Names inside of RDATA may be compressed, so they are read against the whole message, but must end inside RDATA
+    size_t namePos = rdataPos;
+    switch (type)
+    {
+    case T_A:
+    case T_AAAA:
+    {
+        char address[INET6_ADDRSTRLEN];
+        int family = type == T_A ? AF_INET : AF_INET6;
+        if (rdlength != (type == T_A ? 4 : 16) || inet_ntop(family, msg + rdataPos, address, sizeof(address)) == nullptr)
+            return false;
+        record.value = address;
+        break;
+    }
+    case T_NS:
+    case T_CNAME:
+    case T_PTR:
+        if (!readName(msg, end, namePos, record.value))
+            return false;
+        break;
+    case T_MX:
+    {
+        std::string exchange;
+        namePos += 2;
+        if (rdlength < 3 || !readName(msg, end, namePos, exchange))
+            return false;
+        record.value = std::to_string((msg[rdataPos] << 8) | msg[rdataPos + 1]) + " " + exchange;
+        break;
+    }
+    case T_SOA:
+    {
+        std::string mname, rname;
+        if (!readName(msg, end, namePos, mname) || !readName(msg, end, namePos, rname) || namePos + 20 > end)
+            return false;
+        std::ostringstream stringStream;
+        stringStream << mname << ". " << rname << ".";
+        for (int i = 0; i < 5; i++)
+        {
+            const unsigned char *field = msg + namePos + 4 * i;
+            stringStream << " " << (((uint32_t)field[0] << 24) | (field[1] << 16) | (field[2] << 8) | field[3]);
+        }
+        record.value = stringStream.str();
+        break;
+    }
+    case T_TXT:
+    {
+        size_t i = rdataPos;
+        while (i < end)
+        {
+            size_t stringLength = msg[i];
+            if (i + 1 + stringLength > end)
+                return false;
+            if (!record.value.empty())
+                record.value += " ";
+            record.value += "\"" + std::string(reinterpret_cast<const char *>(msg + i + 1), stringLength) + "\"";
+            i += stringLength + 1;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+
+    if (rrType != nullptr)
+        *rrType = type;
+    if (rdata != nullptr)
+        *rdata = rdataPos;
+
+    pos = end;
+    return true;
+}
+
+size_t buildQuery(unsigned char *buf, uint16_t id, const std::string &name, uint16_t qtype, bool recursion)
+{
+    struct DNS_HEADER *header = (struct DNS_HEADER *)buf;
+
+    memset(buf, 0, sizeof(struct DNS_HEADER));
+    header->id = htons(id);
+    header->rd = recursion ? 1 : 0;
+    header->qdcount = htons(1);
+
+    size_t nameLength = encodeName(name, buf + sizeof(struct DNS_HEADER));
+    if (nameLength == 0)
+        return 0;
+
+    struct QUESTION *question = (struct QUESTION *)&buf[sizeof(struct DNS_HEADER) + nameLength];
+    question->qtype = htons(qtype);
+    question->qclass = htons(1); // IN
+
+    return sizeof(struct DNS_HEADER) + nameLength + sizeof(struct QUESTION);
+}
+
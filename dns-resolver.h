@@ -4,6 +4,9 @@
  * @file dns-resolver.h
  * */
 
+#ifndef DNS_RESOLVER_H
+#define DNS_RESOLVER_H
+
 #include <iostream>
 #include <cstring>
 #include <getopt.h>
@@ -15,10 +18,13 @@
 #include <iomanip>
 #include <sstream>
 #include <algorithm>
+#include <memory>
 #include "helpers.h"
+#include "deadline.h"
 
 
 #define MAX_DNS_SIZE 512 // Maximal UDP size for DNS packet
+#define MAX_TCP_DNS_SIZE 65535 // Maximal size of DNS message over TCP (16 bit length prefix)
 
 #define T_A 1 //Ipv4 address
 #define T_NS 2 //Nameserver
@@ -26,7 +32,18 @@
 #define T_SOA 6 /* start of authority zone */
 #define T_PTR 12 /* domain name pointer */
 #define T_MX 15 //Mail server
+#define T_TXT 16 // Text strings
 #define T_AAAA 28 // IPv6 address
+#define T_IXFR 251 // Incremental zone transfer (RFC 1995)
+#define T_AXFR 252 // Full zone transfer
+
+#define RCODE_NOERROR 0
+#define RCODE_SERVFAIL 2
+#define RCODE_NXDOMAIN 3
+#define RCODE_REFUSED 5
+#define RCODE_CANCELLED 253 // Query was cancelled or the resolver stopped before the answer
+#define RCODE_INVALID 254 // Name from the input can't be queried
+#define RCODE_TIMEOUT 255 // No answer even after all retries
 
 #pragma pack(push, 1)
 
@@ -67,16 +84,112 @@ struct QUESTION {
     unsigned short qclass;
 };
 
+#pragma pack(pop)
+
 //Arguments from the command line
 struct Args {
     bool recursion = false;
     bool reverse = false;
     bool use_ipv6 = false;
     char *server = nullptr;
+    std::vector<std::string> upstreams; // More servers of the bulk run, after the server
     int port = 53;
     std::string domain;
+    int xfr = 0; // T_AXFR or T_IXFR when zone transfer was requested
+    uint32_t xfrSerial = 0; // Serial of the zone we already have (IXFR only)
+    std::vector<uint16_t> qtypes; // Types queried in parallel for every name, empty means the single type from -6/-x
+    std::string input; // File with names for the bulk run, "-" for stdin
+    bool unique = false; // Repeated names of the input are queried only once
+    bool watch = false; // Names of the input are queried again when their TTL expires, only changes are printed
+    std::string output; // Columnar result file of the bulk run
+    std::string capture; // Received messages are appended to this file
+    std::string replay; // Responses are taken from this capture file instead of the server
+    std::string log; // Queries and responses are logged to this binary file
+    int timeout = 5000; // Milliseconds to wait for the answer before the query is sent again
+    int tries = 3; // Number of sends of the query
+    int budget = 0; // Milliseconds for the whole resolution of one name (retries, CNAME targets), 0 = only the tries
+    bool upstreamFirst = false; // Local table answers only what the server fails to answer
 };
 
+/**
+ * @brief Writes DNS query with one question of class IN to the buffer.
+ * @param buf Output buffer, at least MAX_DNS_SIZE bytes
+ * @param id ID of the query
+ * @param name Queried domain name
+ * @param qtype Type of the query
+ * @param recursion Recursion Desired flag
+ * @return size_t length of the query, 0 if the name can't be encoded
+ * */
+size_t buildQuery(unsigned char *buf, uint16_t id, const std::string &name, uint16_t qtype, bool recursion);
+
+/**
+ * @brief Converts the numeric type of the record to the name used in the output.
+ * @param type Host byte order type of the record
+ * @return std::string "UNSUPPORTED" for types the resolver can't decode
+ * */
+std::string typeToString(uint16_t type);
+
+/**
+ * @brief Converts the RCODE (including RCODE_INVALID and RCODE_TIMEOUT) to its name
+ * @param rcode
+ * @return std::string
+ * */
+std::string rcodeToString(int rcode);
+
+/**
+ * @brief RCODE of the resolution ended by its deadline
+ * @param deadline
+ * @return int RCODE_CANCELLED or RCODE_TIMEOUT
+ * */
+inline int deadlineRcode(const Deadline &deadline) { return deadline.cancelled() ? RCODE_CANCELLED : RCODE_TIMEOUT; }
+
+/**
+ * @brief Inverse of typeToString(), case insensitive, numeric types can be written as TYPE<n>
+ * @param type Name of the type
+ * @return int type, 0 if unknown
+ * */
+int stringToType(const std::string &type);
+
+/**
+ * @brief Fields of the SOA record
+ * */
+struct SOA_RECORD {
+    uint32_t ttl = 0; // TTL of the record itself, set only when decoded from the message by indexedSoa()
+    std::string mname;
+    std::string rname;
+    uint32_t serial = 0;
+    uint32_t refresh = 0;
+    uint32_t retry = 0;
+    uint32_t expire = 0;
+    uint32_t minimum = 0; // TTL of the negative answers (RFC 2308)
+};
+
+/**
+ * @brief Parses the SOA value in the format made by decodeRecord()
+ * @param value "mname. rname. serial refresh retry expire minimum"
+ * @param soa Output
+ * @return false if the value doesn't have all fields
+ * */
+bool parseSoa(const std::string &value, SOA_RECORD &soa);
+
+/**
+ * @brief Bounds checked decoding of one resource record from arbitrary DNS message.
+ * @param msg Start of the DNS message
+ * @param len Length of the DNS message
+ * @param pos Offset of the record, moved to the next record on success
+ * @param record Output record
+ * @param rrType Optional output, numeric type of the record
+ * @param rdata Optional output, offset of the RDATA of the record
+ * @return false if the record doesn't fit into the message
+ * */
+bool decodeRecord(const unsigned char *msg, size_t len, size_t &pos, DNS_REC &record, uint16_t *rrType = nullptr,
+                  size_t *rdata = nullptr);
+
+
+class Transport;
+class LocalTable;
+template <uint16_t QTYPE>
+struct ADDRESS_ANSWER;
 
 class DnsResolver {
 public:
@@ -86,18 +199,51 @@ public:
      * */
     explicit DnsResolver(Args args);
 
+    ~DnsResolver();
+
     /**
-     * @brief This method will try to establish the connection to DNS server
+     * @brief This method will try to establish the connection to DNS server, TransportError is thrown on failure
      * @return
      * */
     void connectToDNSServer();
 
     /**
-     * @brief Creation of the DNS Question and sending it to DNS server
+     * @brief Uses the given transport instead of connecting to the server, e.g. loopback or replay in tests
+     * @param transport
+     * @return
+     * */
+    void useTransport(std::unique_ptr<Transport> transport);
+
+    /**
+     * @brief Names found in the table are answered by connectToDNSServer() without opening any socket, with
+     * args.upstreamFirst only failed, NXDOMAIN and empty answers of the server are replaced
+     * @param table
+     * @return
+     * */
+    void useLocalTable(std::shared_ptr<const LocalTable> table);
+
+    /**
+     * @brief Creation of the DNS Question and sending it to DNS server, the query is sent again after args.timeout
+     * up to args.tries times within args.budget, TransportError is thrown when no answer arrives
      * @return
      * */
     void query();
 
+    /**
+     * @brief query() ending at the deadline or its cancellation, whichever comes first
+     * @param deadline
+     * @return
+     * */
+    void query(const Deadline &deadline);
+
+    /**
+     * @brief Takes the message from elsewhere (e.g. the packet log) instead of query(), so it can be parsed and printed
+     * @param msg
+     * @param len
+     * @return false if the message is longer than MAX_DNS_SIZE, malformed or has no question
+     * */
+    bool useMessage(const unsigned char *msg, size_t len);
+
     /**
      * @brief Printing the whole received DNS packet in HEX format
      * @return
@@ -106,10 +252,21 @@ public:
 
     /**
      * @brief Parsing all answer sections and storing them in DNS_INFO structure which is going to be returned back to method caller for further usage.
+     * The message is validated by validateMessage() first, TransportError is thrown when it is malformed.
      * @return DNS_INFO
      * */
     DNS_INFO getAnswer();
 
+    /**
+     * @brief Fast path of getAnswer() for the answer of one question by the addresses (address-answer.h), nothing
+     * is allocated
+     * @param answer Output
+     * @return false if the response has other shape, getAnswer() has to be used
+     * */
+    bool getAddresses(ADDRESS_ANSWER<T_A> &answer) const;
+
+    bool getAddresses(ADDRESS_ANSWER<T_AAAA> &answer) const;
+
     /**
      * @brief Taking the DNS_INFO structure and printing it in human-readable format to console.
      * @return
@@ -117,13 +274,25 @@ public:
     void printAnswer(DNS_INFO info);
 
 private:
-    int sock;
+    size_t buildRequest();
+
+    bool answerLocally(const std::vector<unsigned char> &request);
+
+    // Transport calls inside the trace spans
+    bool waitTraced(int timeout);
+
+    int receiveTraced();
+
+    std::unique_ptr<Transport> transport;
+    std::shared_ptr<const LocalTable> local;
+    bool answered = false; // Answer is in the buffer without asking the server
     Args args;
     // Buffer initialization
     struct DNS_HEADER *dns = NULL;
     unsigned char buf[MAX_DNS_SIZE];
-    int packetSize;
+    int packetSize = 0;
     struct QUESTION *qinfo = NULL;
 
 };
 
+#endif // DNS_RESOLVER_H
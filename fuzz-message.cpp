@@ -0,0 +1,49 @@
+/**
+ * @author Rostislav Kral
+ * @brief libFuzzer target of the message validation (make fuzz, needs clang). Every message accepted by
+ * validateMessage() must decode by the unchecked decoders to the same records as by the checked decodeRecord(),
+ * the sanitizers catch any read outside of the message, also in the A/AAAA fast path. The seeds are in fuzz-corpus.
+ * @file fuzz-message.cpp
+ * */
+
+#include "dns-resolver.h"
+#include "message-index.h"
+#include "address-answer.h"
+#include <cstdlib>
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    MESSAGE_INDEX index;
+    ADDRESS_ANSWER<T_A> a;
+    ADDRESS_ANSWER<T_AAAA> aaaa;
+
+    // The fast path reads the message without validateMessage(), only the sanitizers check it
+    decodeAddressAnswer(data, size, a);
+    decodeAddressAnswer(data, size, aaaa);
+
+    if (!validateMessage(data, size, index))
+        return 0;
+
+    for (const RECORD_INDEX &entry : index.records)
+    {
+        DNS_REC indexed, checked;
+        size_t pos = entry.name;
+
+        indexedRecord(data, entry, indexed);
+        if (!decodeRecord(data, size, pos, checked) || pos != (size_t)entry.rdata + entry.rdlength)
+            abort();
+        if (indexed.name != checked.name || indexed.ttl != checked.ttl || indexed.type != checked.type ||
+            indexed.value != checked.value)
+            abort();
+
+        SOA_RECORD soa;
+        if (entry.type == T_SOA)
+            indexedSoa(data, entry, soa); // Only the sanitizers check it, the names may hold spaces parseSoa() can't read
+    }
+
+    // The whole printer path of the single query, it must not throw for a validated message
+    DnsResolver dnsResolver((Args()));
+    if (index.questions > 0 && dnsResolver.useMessage(data, size))
+        dnsResolver.getAnswer();
+    return 0;
+}
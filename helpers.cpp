@@ -28,6 +28,41 @@ void ChangeToDnsNameFormat(unsigned char *dns, unsigned char *host) {
 
 }
 
+size_t encodeName(const std::string &name, unsigned char *out) {
+    size_t length = name.size();
+    size_t written = 0;
+    size_t labelStart = 0;
+
+    if (length > 0 && name[length - 1] == '.') {
+        length--;
+    }
+
+    if (length == 0) {
+        out[0] = 0;
+        return 1;
+    }
+
+    if (length > 253) {
+        return 0;
+    }
+
+    for (size_t i = 0; i <= length; i++) {
+        if (i == length || name[i] == '.') {
+            size_t labelLength = i - labelStart;
+            if (labelLength == 0 || labelLength > 63) {
+                return 0;
+            }
+            out[written++] = labelLength;
+            memcpy(out + written, name.data() + labelStart, labelLength);
+            written += labelLength;
+            labelStart = i + 1;
+        }
+    }
+    out[written++] = 0;
+
+    return written;
+}
+
 std::vector<std::string> explode(std::string const &s, char delim) {
     std::vector<std::string> result;
     std::istringstream iss(s);
@@ -150,3 +185,48 @@ void parseName(const unsigned char *reader, const unsigned char *buffer, std::st
     }
     name[i - 1] = '\0'; // remove the last dot
 }
+
+bool readName(const unsigned char *msg, size_t len, size_t &pos, std::string &name) {
+    size_t p = pos;
+    int jumps = 0;
+    bool jumped = false;
+
+    name.clear();
+
+    while (true) {
+        if (p >= len) {
+            return false;
+        }
+
+        unsigned char labelLength = msg[p];
+
+        if (labelLength == 0) {
+            if (!jumped) {
+                pos = p + 1;
+            }
+            return true;
+        }
+
+        if ((labelLength & 0xC0) == 0xC0) { // pointer, 14 bit offset from the start of the message
+            if (p + 1 >= len || ++jumps > 126) { // there can't be more than 127 labels, so more jumps means loop
+                return false;
+            }
+            if (!jumped) {
+                pos = p + 2;
+            }
+            jumped = true;
+            p = ((labelLength & 0x3F) << 8) | msg[p + 1];
+            continue;
+        }
+
+        if ((labelLength & 0xC0) != 0 || p + 1 + labelLength > len) { // 01 and 10 prefixes are not used
+            return false;
+        }
+
+        if (!name.empty()) {
+            name.push_back('.');
+        }
+        name.append(reinterpret_cast<const char *>(msg + p + 1), labelLength);
+        p += labelLength + 1;
+    }
+}
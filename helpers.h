@@ -4,6 +4,9 @@
  * @file helpers.h
  * */
 
+#ifndef HELPERS_H
+#define HELPERS_H
+
 
 #include <vector>
 #include <cstring>
@@ -38,6 +41,7 @@ struct DNS_INFO {
     std::string aa;
     std::string rd;
     std::string tc;
+    int rcode = 0; // RCODE of the response, NXDOMAIN and NODATA differ only by this
 
     std::string questionName;
     std::string type;
@@ -50,8 +54,26 @@ struct DNS_INFO {
 
 void ChangeToDnsNameFormat(unsigned char *dns, unsigned char *host);
 
+/**
+ * @brief Checked variant of ChangeToDnsNameFormat() which doesn't modify the input, trailing dot is optional.
+ * @param name Domain name in presentation format, "" or "." is the root
+ * @param out Output buffer, at least 255 bytes
+ * @return size_t length of the encoded name, 0 for empty labels, labels over 63 bytes or names over 255 bytes
+ * */
+size_t encodeName(const std::string &name, unsigned char *out);
+
 void parseName(const unsigned char *reader, const unsigned char *buffer, std::string &name);
 
+/**
+ * @brief Bounds checked variant of parseName(), reading the name at pos in the message of len bytes. Compression pointers are followed, loops and out of packet reads are rejected.
+ * @param msg Start of the DNS message (compression pointers are relative to it)
+ * @param len Length of the DNS message
+ * @param pos Offset of the name, on success moved right behind the name in the record
+ * @param name Output, name without the trailing dot (empty string for the root)
+ * @return false if the name is malformed
+ * */
+bool readName(const unsigned char *msg, size_t len, size_t &pos, std::string &name);
+
 /**
  * @brief Functions for converting string to array of strings via delimiter.
  * @param s Reference of the input string that is going to be exploded.
@@ -67,3 +89,4 @@ std::vector<std::string> explode(std::string const &s, char delim);
  * */
 std::string buildPTRQuery(const std::string &ipAddress);
 
+#endif // HELPERS_H
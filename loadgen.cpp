@@ -0,0 +1,363 @@
+/**
+ * @author Rostislav Kral
+ * @brief Implementation of the open loop load generator.
+ *
+ * The sender thread sends every query at its scheduled time no matter how many answers are missing, so slow server
+ * can't slow down the load (no coordinated omission). Latency is measured from the scheduled time, not from the
+ * actual send, so the sender's own delays are included too.
+ * @file loadgen.cpp
+ * */
+
+#include "loadgen.h"
+#include "transport.h"
+#include <cmath>
+#include <poll.h>
+#include <thread>
+#include <time.h>
+
+#define LOADGEN_BATCH 64 // Messages per sendmmsg/recvmmsg call
+#define LOADGEN_SPIN_NS 100000 // Last part of the wait is spinning, sleeping is not accurate enough
+
+static int64_t monotonicNs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// ---------------------------------------------------------- HISTOGRAM ----------------------------------------------------------
+
+LatencyHistogram::LatencyHistogram() : buckets(HISTOGRAM_SUB_BUCKETS * (HISTOGRAM_POWERS - 5), 0)
+{
+}
+
+// First 64 us have their own buckets, every next power of two is split to 64 buckets
+size_t LatencyHistogram::bucket(uint64_t us)
+{
+    if (us < HISTOGRAM_SUB_BUCKETS)
+        return us;
+
+    int power = 63 - __builtin_clzll(us);
+    if (power >= HISTOGRAM_POWERS)
+        return HISTOGRAM_SUB_BUCKETS * (HISTOGRAM_POWERS - 5) - 1;
+
+    size_t sub = (us >> (power - 6)) - HISTOGRAM_SUB_BUCKETS;
+    return HISTOGRAM_SUB_BUCKETS + (power - 6) * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+uint64_t LatencyHistogram::bucketLimit(size_t index)
+{
+    if (index < HISTOGRAM_SUB_BUCKETS)
+        return index;
+
+    int power = (index - HISTOGRAM_SUB_BUCKETS) / HISTOGRAM_SUB_BUCKETS + 6;
+    uint64_t sub = (index - HISTOGRAM_SUB_BUCKETS) % HISTOGRAM_SUB_BUCKETS;
+    return ((HISTOGRAM_SUB_BUCKETS + sub + 1) << (power - 6)) - 1;
+}
+
+void LatencyHistogram::record(uint64_t us)
+{
+    buckets[bucket(us)]++;
+    samples++;
+}
+
+uint64_t LatencyHistogram::percentile(double fraction) const
+{
+    if (samples == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t)std::ceil(fraction * samples);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < buckets.size(); i++)
+    {
+        seen += buckets[i];
+        if (seen >= rank && seen > 0)
+            return bucketLimit(i);
+    }
+    return bucketLimit(buckets.size() - 1);
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other)
+{
+    for (size_t i = 0; i < buckets.size(); i++)
+        buckets[i] += other.buckets[i];
+    samples += other.samples;
+}
+
+// ---------------------------------------------------------- SCHEDULE ----------------------------------------------------------
+
+LoadSchedule::LoadSchedule(const std::vector<double> &rates, double stepSeconds) : rates(rates), stepSeconds(stepSeconds)
+{
+}
+
+bool LoadSchedule::next(uint64_t &time)
+{
+    while (step < rates.size())
+    {
+        // Time is computed from the count, so the rounding errors don't accumulate
+        double offset = rates[step] > 0 ? inStep / rates[step] : stepSeconds;
+        if (offset < stepSeconds)
+        {
+            inStep++;
+            time = (uint64_t)((step * stepSeconds + offset) * 1e9);
+            return true;
+        }
+        step++;
+        inStep = 0;
+    }
+    return false;
+}
+
+double LoadSchedule::rateAt(double seconds) const
+{
+    size_t index = (size_t)(seconds / stepSeconds);
+    return index < rates.size() ? rates[index] : 0;
+}
+
+// ---------------------------------------------------------- GENERATOR ----------------------------------------------------------
+
+LoadGenerator::LoadGenerator(Args args, LOADGEN_OPTIONS options) : args(args), options(options)
+{
+}
+
+LoadGenerator::~LoadGenerator()
+{
+    for (int sock : socks)
+        close(sock);
+}
+
+void LoadGenerator::connectToDNSServer()
+{
+    double maxRate = 1;
+    for (double rate : options.rates)
+        maxRate = std::max(maxRate, rate);
+
+    // Each socket has its own source port and so its own 65536 IDs
+    size_t count = std::max(1.0, std::ceil(2 * maxRate * options.timeout / 1000.0 / 65536));
+    for (size_t i = 0; i < count; i++)
+    {
+        int sock = connectSocket(args, SOCK_DGRAM);
+        int bufferSize = 8 * 1024 * 1024;
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+        setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize));
+        socks.push_back(sock);
+    }
+}
+
+void LoadGenerator::sender(const std::vector<std::vector<unsigned char>> &wire)
+{
+    LoadSchedule schedule(options.rates, options.stepSeconds);
+    uint64_t intervalNs = options.interval * 1e9;
+    std::vector<uint16_t> ids(socks.size(), (uint16_t)getpid());
+    size_t sockIndex = 0;
+    size_t queryIndex = 0;
+
+    struct mmsghdr messages[LOADGEN_BATCH];
+    struct iovec iov[LOADGEN_BATCH];
+    unsigned char bufs[LOADGEN_BATCH][MAX_DNS_SIZE];
+
+    uint64_t due;
+    bool more = schedule.next(due);
+
+    while (more)
+    {
+        int64_t now = monotonicNs() - startNs;
+
+        if ((int64_t)due > now + 2 * LOADGEN_SPIN_NS)
+        {
+            std::this_thread::sleep_for(std::chrono::nanoseconds(due - now - LOADGEN_SPIN_NS));
+            continue;
+        }
+        if ((int64_t)due > now)
+        {
+#ifdef __x86_64__
+            __builtin_ia32_pause();
+#endif
+            continue;
+        }
+
+        // Everything what is already due goes out in one system call
+        int count = 0;
+        int sock = sockIndex;
+        while (more && count < LOADGEN_BATCH && (int64_t)due <= now)
+        {
+            const std::vector<unsigned char> &query = wire[queryIndex];
+            uint16_t id = ids[sock]++;
+
+            memcpy(bufs[count], query.data(), query.size());
+            bufs[count][0] = id >> 8;
+            bufs[count][1] = id & 0xFF;
+            iov[count].iov_base = bufs[count];
+            iov[count].iov_len = query.size();
+            memset(&messages[count].msg_hdr, 0, sizeof(messages[count].msg_hdr));
+            messages[count].msg_hdr.msg_iov = &iov[count];
+            messages[count].msg_hdr.msg_iovlen = 1;
+
+            // Slot must be filled before the answer can arrive
+            slots[sock * 65536 + id].store(due + 1, std::memory_order_release);
+            sentPerInterval[due / intervalNs].fetch_add(1, std::memory_order_relaxed);
+
+            count++;
+            queryIndex = (queryIndex + 1) % wire.size();
+            more = schedule.next(due);
+        }
+
+        for (int done = 0; done < count;)
+        {
+            int sent = sendmmsg(socks[sock], messages + done, count - done, 0);
+            if (sent <= 0)
+                break; // Not sent queries are lost, that's what the server would see on overload too
+            done += sent;
+        }
+        sockIndex = (sockIndex + 1) % socks.size();
+    }
+}
+
+void LoadGenerator::receiver(ReportCallback &report, LOADGEN_INTERVAL &total)
+{
+    uint64_t intervalNs = options.interval * 1e9;
+    int64_t timeoutNs = options.timeout * 1000000LL;
+    size_t nextReport = 0;
+
+    struct mmsghdr messages[LOADGEN_BATCH];
+    struct iovec iov[LOADGEN_BATCH];
+    unsigned char bufs[LOADGEN_BATCH][MAX_DNS_SIZE];
+    std::vector<struct pollfd> pfds;
+
+    for (int sock : socks)
+        pfds.push_back({sock, POLLIN, 0});
+
+    while (nextReport < intervals.size())
+    {
+        poll(pfds.data(), pfds.size(), 10);
+
+        for (size_t s = 0; s < socks.size(); s++)
+        {
+            while (true)
+            {
+                for (int i = 0; i < LOADGEN_BATCH; i++)
+                {
+                    iov[i].iov_base = bufs[i];
+                    iov[i].iov_len = MAX_DNS_SIZE;
+                    memset(&messages[i].msg_hdr, 0, sizeof(messages[i].msg_hdr));
+                    messages[i].msg_hdr.msg_iov = &iov[i];
+                    messages[i].msg_hdr.msg_iovlen = 1;
+                }
+
+                int count = recvmmsg(socks[s], messages, LOADGEN_BATCH, MSG_DONTWAIT, nullptr);
+                if (count <= 0)
+                    break;
+
+                int64_t now = monotonicNs() - startNs;
+                for (int i = 0; i < count; i++)
+                {
+                    if (messages[i].msg_len < sizeof(DNS_HEADER))
+                        continue;
+
+                    uint16_t id = (bufs[i][0] << 8) | bufs[i][1];
+                    uint64_t scheduled = slots[s * 65536 + id].exchange(0, std::memory_order_acq_rel);
+                    if (scheduled == 0)
+                        continue; // Duplicate or unknown answer
+                    scheduled--;
+
+                    int64_t latency = now - (int64_t)scheduled;
+                    if (latency > timeoutNs)
+                        continue; // Too late, it is counted as lost
+
+                    LOADGEN_INTERVAL &interval = intervals[scheduled / intervalNs];
+                    interval.received++;
+                    interval.latency.record(std::max<int64_t>(latency, 0) / 1000);
+                }
+            }
+        }
+
+        // Interval is complete when the timeout of its last query is over
+        int64_t now = monotonicNs() - startNs;
+        while (nextReport < intervals.size() && now > (int64_t)((nextReport + 1) * intervalNs) + timeoutNs)
+        {
+            LOADGEN_INTERVAL &interval = intervals[nextReport];
+            double length = std::min(options.interval, LoadSchedule(options.rates, options.stepSeconds).duration() - interval.start);
+
+            interval.sent = sentPerInterval[nextReport].load();
+            interval.lost = interval.sent - std::min(interval.sent, interval.received);
+            interval.sentQps = interval.sent / length;
+            interval.receivedQps = interval.received / length;
+
+            total.sent += interval.sent;
+            total.received += interval.received;
+            total.lost += interval.lost;
+            total.latency.merge(interval.latency);
+
+            report(interval);
+            nextReport++;
+        }
+    }
+}
+
+LOADGEN_INTERVAL LoadGenerator::run(const std::vector<LOADGEN_QUERY> &queries, ReportCallback report)
+{
+    LoadSchedule schedule(options.rates, options.stepSeconds);
+    LOADGEN_INTERVAL total;
+    std::vector<std::vector<unsigned char>> wire;
+
+    // Queries are encoded only once, the sender just patches the ID
+    for (const LOADGEN_QUERY &query : queries)
+    {
+        unsigned char buf[MAX_DNS_SIZE];
+        size_t length = buildQuery(buf, 0, query.name, query.qtype, args.recursion);
+        if (length > 0)
+            wire.emplace_back(buf, buf + length);
+    }
+    if (wire.empty())
+        throw TransportError("No valid query to replay");
+
+    size_t count = std::max<size_t>(1, std::ceil(schedule.duration() / options.interval));
+    intervals.assign(count, LOADGEN_INTERVAL());
+    for (size_t i = 0; i < count; i++)
+    {
+        intervals[i].start = i * options.interval;
+        intervals[i].targetQps = schedule.rateAt(intervals[i].start);
+    }
+    sentPerInterval.reset(new std::atomic<uint64_t>[count]);
+    for (size_t i = 0; i < count; i++)
+        sentPerInterval[i] = 0;
+    slots.reset(new std::atomic<uint64_t>[socks.size() * 65536]);
+    for (size_t i = 0; i < socks.size() * 65536; i++)
+        slots[i] = 0;
+
+    startNs = monotonicNs();
+    std::thread senderThread(&LoadGenerator::sender, this, std::cref(wire));
+    receiver(report, total);
+    senderThread.join();
+
+    total.targetQps = 0;
+    for (double rate : options.rates)
+        total.targetQps += rate / options.rates.size();
+    total.sentQps = total.sent / schedule.duration();
+    total.receivedQps = total.received / schedule.duration();
+
+    return total;
+}
+
+std::vector<LOADGEN_QUERY> readQueryFile(std::istream &input, uint16_t defaultType)
+{
+    std::vector<LOADGEN_QUERY> queries;
+    std::string line;
+
+    while (std::getline(input, line))
+    {
+        std::istringstream fields(line);
+        LOADGEN_QUERY query;
+        std::string type;
+
+        if (!(fields >> query.name) || query.name[0] == '#')
+            continue;
+        query.qtype = defaultType;
+        if (fields >> type)
+            query.qtype = stringToType(type);
+        if (query.qtype != 0)
+            queries.push_back(query);
+    }
+
+    return queries;
+}
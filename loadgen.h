@@ -0,0 +1,148 @@
+/**
+ * @author Rostislav Kral
+ * @brief Contains open loop load generator, replaying queries at fixed or stepped rate and measuring latency percentiles.
+ * @file loadgen.h
+ * */
+
+#ifndef LOADGEN_H
+#define LOADGEN_H
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include "dns-resolver.h"
+
+#define HISTOGRAM_SUB_BUCKETS 64 // Buckets per power of two, relative error is below 1/64
+#define HISTOGRAM_POWERS 27 // Up to 2^27 us (more than 2 minutes)
+
+/**
+ * @brief Log-linear latency histogram in microseconds, constant size and O(1) recording
+ * */
+class LatencyHistogram {
+public:
+    LatencyHistogram();
+
+    void record(uint64_t us);
+
+    /**
+     * @brief Value below which the given fraction of the samples lies
+     * @param fraction 0.5 for median, 0.999 for p99.9
+     * @return uint64_t upper bound of the bucket in microseconds
+     * */
+    uint64_t percentile(double fraction) const;
+
+    uint64_t count() const { return samples; }
+
+    void merge(const LatencyHistogram &other);
+
+private:
+    static size_t bucket(uint64_t us);
+
+    static uint64_t bucketLimit(size_t index);
+
+    std::vector<uint32_t> buckets;
+    uint64_t samples = 0;
+};
+
+/**
+ * @brief Query replayed by the load generator
+ * */
+struct LOADGEN_QUERY {
+    std::string name;
+    uint16_t qtype;
+};
+
+struct LOADGEN_OPTIONS {
+    std::vector<double> rates; // Target QPS of the steps
+    double stepSeconds = 10; // Duration of one step
+    double interval = 1; // Reporting interval in seconds
+    int timeout = 1000; // Answers later than this (ms) are counted as lost
+};
+
+/**
+ * @brief Statistics of one reporting interval, every query belongs to the interval of its scheduled send time
+ * */
+struct LOADGEN_INTERVAL {
+    double start = 0; // Seconds from the start of the run
+    double targetQps = 0;
+    uint64_t sent = 0;
+    uint64_t received = 0;
+    uint64_t lost = 0;
+    double sentQps = 0;
+    double receivedQps = 0;
+    LatencyHistogram latency;
+};
+
+/**
+ * @brief Schedule of the open loop, the send time of every query depends only on the target rates
+ * */
+class LoadSchedule {
+public:
+    LoadSchedule(const std::vector<double> &rates, double stepSeconds);
+
+    /**
+     * @brief Moves to the next query
+     * @param time Output, scheduled time of the query in nanoseconds from the start
+     * @return false when the last step is over
+     * */
+    bool next(uint64_t &time);
+
+    double rateAt(double seconds) const;
+
+    double duration() const { return rates.size() * stepSeconds; }
+
+private:
+    std::vector<double> rates;
+    double stepSeconds;
+    size_t step = 0;
+    uint64_t inStep = 0; // Queries sent in the current step
+};
+
+class LoadGenerator {
+public:
+    typedef std::function<void(const LOADGEN_INTERVAL &interval)> ReportCallback;
+
+    LoadGenerator(Args args, LOADGEN_OPTIONS options);
+
+    ~LoadGenerator();
+
+    /**
+     * @brief Opens enough UDP sockets, so the 16 bit IDs are not reused within two timeouts
+     * @return
+     * */
+    void connectToDNSServer();
+
+    /**
+     * @brief Replays the queries in a loop until the last step ends, the report is called once per interval,
+     * TransportError is thrown when no query can be encoded
+     * @param queries
+     * @param report
+     * @return LOADGEN_INTERVAL totals of the whole run
+     * */
+    LOADGEN_INTERVAL run(const std::vector<LOADGEN_QUERY> &queries, ReportCallback report);
+
+private:
+    void sender(const std::vector<std::vector<unsigned char>> &wire);
+
+    void receiver(ReportCallback &report, LOADGEN_INTERVAL &total);
+
+    Args args;
+    LOADGEN_OPTIONS options;
+    std::vector<int> socks;
+
+    // Scheduled send time (ns from the start + 1, 0 = free) of every ID of every socket
+    std::unique_ptr<std::atomic<uint64_t>[]> slots;
+    std::unique_ptr<std::atomic<uint64_t>[]> sentPerInterval;
+    std::vector<LOADGEN_INTERVAL> intervals;
+    int64_t startNs = 0;
+};
+
+/**
+ * @brief Reads the query file, one "name [type]" per line, lines without type use the default type
+ * @param input
+ * @param defaultType
+ * @return std::vector<LOADGEN_QUERY>
+ * */
+std::vector<LOADGEN_QUERY> readQueryFile(std::istream &input, uint16_t defaultType);
+
+#endif // LOADGEN_H
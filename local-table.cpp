@@ -0,0 +1,389 @@
+/**
+ * @author Rostislav Kral
+ * @brief Implementation of the local answer table and its index.
+ * @file local-table.cpp
+ * */
+
+#include "local-table.h"
+#include "cache.h"
+#include "name-utils.h"
+#include <fcntl.h>
+#include <fstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Wire name of the presentation name, lowercase, empty if it can't be encoded
+static std::string wireName(const std::string &name)
+{
+    unsigned char wire[MAX_DNS_SIZE];
+    size_t length = encodeName(name, wire);
+    return nameToLower(std::string(reinterpret_cast<const char *>(wire), length));
+}
+
+static bool parseHosts(std::istream &input, std::vector<STUB_RECORD> &records, std::string &error)
+{
+    std::string line;
+    int lineNumber = 0;
+
+    while (std::getline(input, line))
+    {
+        lineNumber++;
+        line = line.substr(0, line.find('#'));
+
+        std::istringstream fields(line);
+        std::string address, name;
+        if (!(fields >> address))
+            continue;
+
+        STUB_RECORD record;
+        unsigned char binary[sizeof(struct in6_addr)];
+        if (inet_pton(AF_INET, address.c_str(), binary) == 1)
+        {
+            record.type = T_A;
+            record.rdata.assign(binary, binary + 4);
+        }
+        else if (inet_pton(AF_INET6, address.c_str(), binary) == 1)
+        {
+            record.type = T_AAAA;
+            record.rdata.assign(binary, binary + 16);
+        }
+        else
+        {
+            error = "line " + std::to_string(lineNumber) + ": invalid address " + address;
+            return false;
+        }
+        record.ttl = LOCAL_HOSTS_TTL;
+
+        bool canonical = true;
+        while (fields >> name)
+        {
+            record.name = wireName(name);
+            if (record.name.empty())
+            {
+                error = "line " + std::to_string(lineNumber) + ": invalid name " + name;
+                return false;
+            }
+            records.push_back(record);
+
+            // Reverse lookup of the address gives the first (canonical) name, like the system resolver does
+            if (canonical)
+            {
+                STUB_RECORD ptr;
+                ptr.name = wireName(buildPTRQuery(address));
+                ptr.type = T_PTR;
+                ptr.ttl = LOCAL_HOSTS_TTL;
+                ptr.rdata.assign(record.name.begin(), record.name.end());
+                records.push_back(ptr);
+                canonical = false;
+            }
+        }
+        if (canonical)
+        {
+            error = "line " + std::to_string(lineNumber) + ": missing name";
+            return false;
+        }
+    }
+    return true;
+}
+
+bool parseLocalFile(std::istream &input, std::vector<STUB_RECORD> &records, std::string &error)
+{
+    std::stringstream text;
+    text << input.rdbuf();
+
+    // Hosts file starts with an address, zone file with a name or a directive
+    std::string line, first;
+    while (first.empty() && std::getline(text, line))
+        std::istringstream(line.substr(0, line.find_first_of("#;"))) >> first;
+    text.clear();
+    text.seekg(0);
+
+    unsigned char binary[sizeof(struct in6_addr)];
+    if (inet_pton(AF_INET, first.c_str(), binary) == 1 || inet_pton(AF_INET6, first.c_str(), binary) == 1)
+        return parseHosts(text, records, error);
+
+    StubZone zone;
+    if (!zone.load(text, error))
+        return false;
+    records.insert(records.end(), zone.zoneRecords().begin(), zone.zoneRecords().end());
+    return true;
+}
+
+std::vector<unsigned char> buildLocalIndex(std::vector<STUB_RECORD> records)
+{
+    std::stable_sort(records.begin(), records.end(), [](const STUB_RECORD &a, const STUB_RECORD &b) {
+        return a.name != b.name ? a.name < b.name : a.type < b.type;
+    });
+
+    std::vector<LOCAL_ENTRY> entries;
+    std::vector<unsigned char> heap;
+    for (const STUB_RECORD &record : records)
+    {
+        // Records of one name are consecutive, the name is stored once
+        LOCAL_ENTRY entry = {0};
+        if (!entries.empty() && records[entries.size() - 1].name == record.name)
+            entry.name = entries.back().name;
+        else
+        {
+            entry.name = heap.size();
+            heap.insert(heap.end(), record.name.begin(), record.name.end());
+        }
+        entry.nameLength = record.name.size();
+        entry.rdata = heap.size();
+        entry.rdataLength = record.rdata.size();
+        entry.type = record.type;
+        entry.ttl = record.ttl;
+        heap.insert(heap.end(), record.rdata.begin(), record.rdata.end());
+        entries.push_back(entry);
+    }
+
+    LOCAL_INDEX_HEADER header;
+    memcpy(header.magic, LOCAL_INDEX_MAGIC, 8);
+    header.count = entries.size();
+    header.heapSize = heap.size();
+
+    // Sized once and filled by memcpy, inserting from the pointer range of the header trips -Warray-bounds of GCC 12
+    size_t entriesSize = entries.size() * sizeof(LOCAL_ENTRY);
+    std::vector<unsigned char> image(sizeof(header) + entriesSize + heap.size());
+    memcpy(image.data(), &header, sizeof(header));
+    if (entriesSize > 0)
+        memcpy(image.data() + sizeof(header), entries.data(), entriesSize);
+    if (!heap.empty())
+        memcpy(image.data() + sizeof(header) + entriesSize, heap.data(), heap.size());
+    return image;
+}
+
+LocalTable::~LocalTable()
+{
+    for (const std::unique_ptr<TABLE> &table : tables)
+    {
+        if (table->size > 0)
+            munmap(const_cast<unsigned char *>(table->base), table->size);
+    }
+}
+
+bool LocalTable::attach(TABLE &table, const unsigned char *base, size_t size)
+{
+    if (size < sizeof(LOCAL_INDEX_HEADER))
+        return false;
+    const LOCAL_INDEX_HEADER *header = reinterpret_cast<const LOCAL_INDEX_HEADER *>(base);
+    if (memcmp(header->magic, LOCAL_INDEX_MAGIC, 8) != 0 ||
+        header->count > (size - sizeof(LOCAL_INDEX_HEADER)) / sizeof(LOCAL_ENTRY) ||
+        header->heapSize != size - sizeof(LOCAL_INDEX_HEADER) - header->count * sizeof(LOCAL_ENTRY))
+        return false;
+
+    table.base = base;
+    table.count = header->count;
+    table.entries = reinterpret_cast<const LOCAL_ENTRY *>(base + sizeof(LOCAL_INDEX_HEADER));
+    table.heap = base + sizeof(LOCAL_INDEX_HEADER) + header->count * sizeof(LOCAL_ENTRY);
+
+    // Offsets are checked once here, so the lookups don't need to
+    for (uint64_t i = 0; i < table.count; i++)
+    {
+        const LOCAL_ENTRY &entry = table.entries[i];
+        if ((uint64_t)entry.name + entry.nameLength > header->heapSize ||
+            (uint64_t)entry.rdata + entry.rdataLength > header->heapSize)
+            return false;
+    }
+    return true;
+}
+
+bool LocalTable::add(const std::string &path, std::string &error)
+{
+    std::string indexPath = path + LOCAL_INDEX_SUFFIX;
+    struct stat source, index;
+    std::unique_ptr<TABLE> table(new TABLE());
+
+    if (stat(path.c_str(), &source) == -1)
+    {
+        error = "Cannot open " + path;
+        return false;
+    }
+
+    // Index newer than the source is mapped without parsing
+    bool fresh = stat(indexPath.c_str(), &index) == 0 &&
+                 (index.st_mtim.tv_sec > source.st_mtim.tv_sec ||
+                  (index.st_mtim.tv_sec == source.st_mtim.tv_sec && index.st_mtim.tv_nsec > source.st_mtim.tv_nsec));
+    if (!fresh)
+    {
+        std::ifstream input(path);
+        std::vector<STUB_RECORD> records;
+        if (!input || !parseLocalFile(input, records, error))
+        {
+            error = path + ": " + (error.empty() ? "cannot be read" : error);
+            return false;
+        }
+        table->memory = buildLocalIndex(std::move(records));
+
+        // Renamed at once, a concurrent run never maps half written index
+        std::string temporary = indexPath + "." + std::to_string(getpid());
+        std::ofstream output(temporary, std::ios::binary);
+        output.write(reinterpret_cast<const char *>(table->memory.data()), table->memory.size());
+        output.close();
+        if (!output || rename(temporary.c_str(), indexPath.c_str()) == -1)
+        {
+            unlink(temporary.c_str());
+            attach(*table, table->memory.data(), table->memory.size()); // Read only directory, e.g. /etc/hosts
+            tables.push_back(std::move(table));
+            return true;
+        }
+    }
+
+    int fd = open(indexPath.c_str(), O_RDONLY);
+    if (fd == -1 || fstat(fd, &index) == -1)
+    {
+        if (fd != -1)
+            close(fd);
+        error = "Cannot open " + indexPath;
+        return false;
+    }
+    void *mapping = index.st_size > 0 ? mmap(nullptr, index.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        error = "Cannot map " + indexPath;
+        return false;
+    }
+    table->size = index.st_size;
+
+    if (!attach(*table, static_cast<const unsigned char *>(mapping), index.st_size))
+    {
+        munmap(mapping, index.st_size);
+        error = "Invalid index " + indexPath + ", remove it to compile it again";
+        return false;
+    }
+    table->memory.clear();
+    tables.push_back(std::move(table));
+    return true;
+}
+
+size_t LocalTable::records() const
+{
+    size_t count = 0;
+    for (const std::unique_ptr<TABLE> &table : tables)
+        count += table->count;
+    return count;
+}
+
+bool LocalTable::find(const std::string &name, uint16_t type, const TABLE *&table, const LOCAL_ENTRY *&first,
+                      const LOCAL_ENTRY *&last) const
+{
+    for (const std::unique_ptr<TABLE> &candidate : tables)
+    {
+        const unsigned char *heap = candidate->heap;
+        auto less = [heap](const LOCAL_ENTRY &entry, const std::pair<const std::string *, uint16_t> &key) {
+            int order = memcmp(heap + entry.name, key.first->data(), std::min<size_t>(entry.nameLength, key.first->size()));
+            if (order != 0)
+                return order < 0;
+            if (entry.nameLength != key.first->size())
+                return entry.nameLength < key.first->size();
+            return entry.type < key.second;
+        };
+
+        const LOCAL_ENTRY *end = candidate->entries + candidate->count;
+        const LOCAL_ENTRY *found = std::lower_bound(candidate->entries, end, std::make_pair(&name, type), less);
+        const LOCAL_ENTRY *stop = found;
+        while (stop != end && stop->type == type && stop->nameLength == name.size() &&
+               memcmp(heap + stop->name, name.data(), name.size()) == 0)
+            stop++;
+
+        if (stop != found)
+        {
+            table = candidate.get();
+            first = found;
+            last = stop;
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t LocalTable::answer(const unsigned char *query, size_t len, unsigned char *out) const
+{
+    const DNS_HEADER *header = reinterpret_cast<const DNS_HEADER *>(query);
+    if (tables.empty() || len < sizeof(DNS_HEADER) || header->qr || header->opcode != 0 || ntohs(header->qdcount) != 1)
+        return 0;
+
+    // Queries are never compressed, the name is a plain sequence of labels
+    size_t pos = sizeof(DNS_HEADER);
+    while (pos < len && query[pos] != 0 && query[pos] < 64)
+        pos += query[pos] + 1;
+    if (pos >= len || query[pos] != 0 || pos + 1 + sizeof(QUESTION) > len)
+        return 0;
+    std::string name = nameToLower(std::string(reinterpret_cast<const char *>(query) + sizeof(DNS_HEADER),
+                                               pos + 1 - sizeof(DNS_HEADER)));
+    uint16_t qtype = (query[pos + 1] << 8) | query[pos + 2];
+    if (((query[pos + 3] << 8) | query[pos + 4]) != 1)
+        return 0;
+
+    size_t length = pos + 1 + sizeof(QUESTION);
+    memcpy(out, query, length);
+    DNS_HEADER *response = reinterpret_cast<DNS_HEADER *>(out);
+    uint16_t ancount = 0;
+    std::vector<std::pair<std::string, size_t>> names = {{name, sizeof(DNS_HEADER)}};
+
+    auto append = [&](const TABLE *table, const LOCAL_ENTRY &entry) {
+        if (length + entry.nameLength + 10 + entry.rdataLength > MAX_DNS_SIZE)
+        {
+            response->tc = 1;
+            return false;
+        }
+        // Owners are compressed to the question or the CNAME target, parsers of the single answer expect it
+        std::string owner(reinterpret_cast<const char *>(table->heap + entry.name), entry.nameLength);
+        auto known = std::find_if(names.begin(), names.end(),
+                                  [&](const std::pair<std::string, size_t> &candidate) { return candidate.first == owner; });
+        if (known != names.end())
+        {
+            out[length++] = 0xC0 | (known->second >> 8);
+            out[length++] = known->second & 0xFF;
+        }
+        else
+        {
+            names.emplace_back(owner, length);
+            memcpy(out + length, owner.data(), owner.size());
+            length += owner.size();
+        }
+        unsigned char fixed[10] = {(unsigned char)(entry.type >> 8), (unsigned char)entry.type, 0, 1,
+                                   (unsigned char)(entry.ttl >> 24), (unsigned char)(entry.ttl >> 16),
+                                   (unsigned char)(entry.ttl >> 8), (unsigned char)entry.ttl,
+                                   (unsigned char)(entry.rdataLength >> 8), (unsigned char)entry.rdataLength};
+        memcpy(out + length, fixed, sizeof(fixed));
+        length += sizeof(fixed);
+        if (entry.type == T_CNAME)
+            names.emplace_back(nameToLower(std::string(reinterpret_cast<const char *>(table->heap + entry.rdata),
+                                                       entry.rdataLength)), length);
+        memcpy(out + length, table->heap + entry.rdata, entry.rdataLength);
+        length += entry.rdataLength;
+        ancount++;
+        return true;
+    };
+
+    response->tc = 0;
+    for (int depth = 0; depth <= CHAIN_MAX_DEPTH; depth++)
+    {
+        const TABLE *table;
+        const LOCAL_ENTRY *first, *last;
+        if (find(name, qtype, table, first, last))
+        {
+            while (first != last && append(table, *first))
+                first++;
+            break;
+        }
+
+        // The target outside of the table is left to the resolver, like the referral of an authoritative server
+        if (qtype == T_CNAME || !find(name, T_CNAME, table, first, last) || !append(table, *first))
+            break;
+        name = nameToLower(std::string(reinterpret_cast<const char *>(table->heap + first->rdata), first->rdataLength));
+    }
+    if (ancount == 0)
+        return 0;
+
+    response->qr = 1;
+    response->aa = 1;
+    response->ra = 0;
+    response->rcode = 0;
+    response->ancount = htons(ancount);
+    response->nscount = 0;
+    response->arcount = 0;
+    return length;
+}
@@ -0,0 +1,111 @@
+/**
+ * @author Rostislav Kral
+ * @brief Contains table of the local answers compiled from hosts and zone files to memory mapped sorted index.
+ *
+ * Index layout (host byte order), written next to the source as <source>.idx and reused while it is newer:
+ *   LOCAL_INDEX_HEADER
+ *   LOCAL_ENTRY * count, sorted by the lowercase wire name and the type
+ *   heap with the names and RDATA (uncompressed wire format)
+ * @file local-table.h
+ * */
+
+#ifndef LOCAL_TABLE_H
+#define LOCAL_TABLE_H
+
+#include <string>
+#include <vector>
+#include "stub-server.h"
+
+#define LOCAL_INDEX_MAGIC "DNSLOC01"
+#define LOCAL_INDEX_SUFFIX ".idx"
+#define LOCAL_HOSTS_TTL 3600 // TTL of the answers from hosts files
+
+struct LOCAL_INDEX_HEADER {
+    char magic[8];
+    uint64_t count;
+    uint64_t heapSize;
+};
+
+/**
+ * @brief One record of the index, offsets point to the heap
+ * */
+struct LOCAL_ENTRY {
+    uint32_t name;
+    uint32_t rdata;
+    uint32_t ttl;
+    uint16_t nameLength;
+    uint16_t rdataLength;
+    uint16_t type;
+    uint16_t reserved;
+};
+
+/**
+ * @brief Parses hosts file ("address name [alias...]", '#' starts comment) or zone file (see StubZone), the format is
+ * chosen by the first token of the file
+ * @param input
+ * @param records Output, records in any order
+ * @param error Output, line and reason of the failure
+ * @return false for syntax error
+ * */
+bool parseLocalFile(std::istream &input, std::vector<STUB_RECORD> &records, std::string &error);
+
+/**
+ * @brief Sorts the records and serializes them to the index image
+ * @param records
+ * @return std::vector<unsigned char>
+ * */
+std::vector<unsigned char> buildLocalIndex(std::vector<STUB_RECORD> records);
+
+class LocalTable {
+public:
+    LocalTable() = default;
+
+    LocalTable(const LocalTable &) = delete;
+
+    LocalTable &operator=(const LocalTable &) = delete;
+
+    ~LocalTable();
+
+    /**
+     * @brief Adds the hosts or zone file, its index is compiled only when it is missing or older than the file,
+     * earlier files take precedence
+     * @param path
+     * @param error Output, reason of the failure
+     * @return false if the file can't be read or parsed
+     * */
+    bool add(const std::string &path, std::string &error);
+
+    /**
+     * @brief Writes the answer to the query when the table has data for the name and the type, CNAME is followed
+     * through the table up to CHAIN_MAX_DEPTH links, O(log n) per link
+     * @param query Query in wire format
+     * @param len Length of the query
+     * @param out Output buffer, at least MAX_DNS_SIZE bytes
+     * @return size_t length of the answer, 0 when the upstream has to be asked
+     * */
+    size_t answer(const unsigned char *query, size_t len, unsigned char *out) const;
+
+    size_t records() const;
+
+    bool empty() const { return tables.empty(); }
+
+private:
+    struct TABLE {
+        const unsigned char *base = nullptr;
+        size_t size = 0; // Mapped length, 0 when the image lives in the memory
+        std::vector<unsigned char> memory; // Image which couldn't be written next to the source
+        const LOCAL_ENTRY *entries = nullptr;
+        uint64_t count = 0;
+        const unsigned char *heap = nullptr;
+    };
+
+    static bool attach(TABLE &table, const unsigned char *base, size_t size);
+
+    // Records of the name and the type from the first table which has any
+    bool find(const std::string &name, uint16_t type, const TABLE *&table, const LOCAL_ENTRY *&first,
+              const LOCAL_ENTRY *&last) const;
+
+    std::vector<std::unique_ptr<TABLE>> tables;
+};
+
+#endif // LOCAL_TABLE_H
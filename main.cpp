@@ -4,27 +4,329 @@
  * */
 
 #include "dns-resolver.h"
+#include "zone-transfer.h"
+#include "bulk-resolver.h"
+#include "result-file.h"
+#include "loadgen.h"
+#include "transport.h"
+#include "local-table.h"
+#include "packet-log.h"
+#include "name-watcher.h"
+#include "trace.h"
+#include <csignal>
+#include <fstream>
+#include <memory>
 
 void printHelp()
 {
-                std::cout << "Usage: " << "./dns [-r] [-x] [-6] -s server [-p port] address" << std::endl
+                std::cout << "Usage: " << "./dns [-r] [-x] [-6] [-t AXFR|IXFR=serial|type,...] [-B budget] [-T trace] -s server [-p port] address" << std::endl
+                      << "       ./dns [-r] [-x] [-6] [-t type,...] [-w window] [-q qps] [-o results] [-S servers [-e percent] [-k name|suffix]] [-B budget] [-T trace] -s server [-p port] [-u] -f names" << std::endl
+                      << "       ./dns [-r] [-x] [-6] [-t type,...] -s server [-p port] -W -f names" << std::endl
+                      << "       ./dns [-r] [-6] -L qps[,qps...] [-d seconds] -s server [-p port] -f queries" << std::endl
+                      << "       ./dns -R results [type=T] [rcode=R] [rtt=us] [suffix=name] [print]" << std::endl
+                      << "       ./dns -D log" << std::endl
                       << "Options:" << std::endl
                       << "  -r      Recursion desired" << std::endl
                       << "  -x      Reverse query, adress must be IP address!" << std::endl
                       << "  -6      IPv6(AAAA type) DNS query, address must be IPv6" << std::endl
                       << "  -s      Server IP or domain name" << std::endl
                       << "  -p      Port number, default 53" << std::endl
+                      << "  -t      Zone transfer of the address over TCP, AXFR or IXFR=serial of the version we have," << std::endl
+                      << "          or list of types (A,AAAA,MX) queried in parallel and printed as one record per name" << std::endl
+                      << "  -f      Bulk run, file with one name per line (- for stdin)" << std::endl
+                      << "  -u      Bulk run, every name is queried once, repeated names of the file are skipped" << std::endl
+                      << "  -w      Bulk run, maximal number of queries in flight, default 64, the window adapts to loss and RTT" << std::endl
+                      << "  -q      Bulk run, ceiling of the sending rate in queries per second" << std::endl
+                      << "  -o      Bulk run, write the results to columnar binary file instead of stdout" << std::endl
+                      << "  -S      Bulk run, more upstream servers (comma separated) for the hedged queries" << std::endl
+                      << "  -e      Bulk run, query slower than p95 of its upstream is sent to the next one too, at most percent of the queries" << std::endl
+                      << "  -k      Bulk run, each name is sent to one upstream (-s and -S) by consistent hash of the name or of its domain (suffix)," << std::endl
+                      << "          so the caches of the upstreams add up, names of a down upstream move to the next one" << std::endl
+                      << "  -W      Watch the names of the file, each is queried again when its TTL expires and only the changes are printed" << std::endl
+                      << "  -R      Filter and aggregate the columnar result file" << std::endl
+                      << "  -L      Load generator, replays the query file (name [type] per line) at the target QPS steps" << std::endl
+                      << "  -d      Load generator, duration of one QPS step in seconds, default 10" << std::endl
+                      << "  -C      Append the received messages to the capture file" << std::endl
+                      << "  -P      Answer the queries from the capture file instead of the server (-s is not needed)" << std::endl
+                      << "  -H      Hosts or zone files (comma separated) answered locally, compiled to <file>.idx for next runs" << std::endl
+                      << "  -l      Log every query and response to the binary file, written by a background thread" << std::endl
+                      << "  -B      Budget of one name in milliseconds (retries and CNAME targets), the name ends with TIMEOUT and" << std::endl
+                      << "          the chain followed so far when it runs out, Ctrl+C ends the bulk run with the results so far" << std::endl
+                      << "  -T      Trace every query (encode, send, wait, parse, cache, format) to Chrome trace-event JSON file" << std::endl
+                      << "  -D      Decode the binary log, the messages are parsed and printed like the answers" << std::endl
+                      << "  -U      Server takes precedence, the -H files answer only its failures, NXDOMAIN and empty answers" << std::endl
                       << "  -h      Show help" << std::endl << std::endl;
 }
 
+void printBulkResult(const BULK_RESULT &result)
+{
+    std::cout << result.name << "., " << typeToString(result.qtype) << ", " << rcodeToString(result.rcode) << ", "
+              << result.ttl;
+    for (const DNS_REC &answer : result.answers)
+        std::cout << ", " << answer.value;
+    std::cout << " (" << result.rtt / 1000.0 << " ms)\n";
+}
+
+void printMergedResult(const std::vector<BULK_RESULT> &results)
+{
+    uint32_t rtt = 0;
+
+    std::cout << results.front().name << ".";
+    for (const BULK_RESULT &result : results)
+    {
+        std::cout << (&result == &results.front() ? ", " : "; ") << typeToString(result.qtype) << ", "
+                  << rcodeToString(result.rcode) << ", " << result.ttl;
+        for (const DNS_REC &answer : result.answers)
+            std::cout << ", " << answer.value;
+        rtt = std::max(rtt, result.rtt);
+    }
+    std::cout << " (" << rtt / 1000.0 << " ms)\n";
+}
+
+int readResultFile(const char *path, int argc, char *argv[])
+{
+    RESULT_FILTER filter;
+    bool print = false;
+
+    for (int i = 0; i < argc; i++)
+    {
+        if (strcmp(argv[i], "print") == 0)
+            print = true;
+        else if (!parseResultFilter(argv[i], filter))
+        {
+            printHelp();
+            std::cerr << "Unknown filter " << argv[i] << std::endl;
+            return 1;
+        }
+    }
+
+    ResultFileReader reader;
+    std::string error;
+    if (!reader.open(path, error))
+    {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+    RESULT_SUMMARY summary = aggregateResults(reader, filter, [print](const ResultBatch &batch, size_t row) {
+        if (!print)
+            return;
+
+        size_t len, count;
+        const char *name = batch.name(row, len);
+        const BULK_ADDRESS *addresses = batch.rowAddresses(row, count);
+        std::cout.write(name, len) << "., " << typeToString(batch.qtype(row)) << ", " << rcodeToString(batch.rcode(row))
+                                   << ", " << batch.ttl(row);
+        for (size_t i = 0; i < count; i++)
+        {
+            char text[INET6_ADDRSTRLEN];
+            bool mapped = IN6_IS_ADDR_V4MAPPED(reinterpret_cast<const struct in6_addr *>(addresses[i].data()));
+            inet_ntop(mapped ? AF_INET : AF_INET6, addresses[i].data() + (mapped ? 12 : 0), text, sizeof(text));
+            std::cout << ", " << text;
+        }
+        std::cout << " (" << batch.rtt(row) / 1000.0 << " ms)\n";
+    });
+
+    std::cout << "Rows: " << summary.rows << " of " << reader.rows() << " in " << reader.batches() << " batches" << std::endl;
+    for (const auto &rcode : summary.rcodes)
+        std::cout << "  " << rcodeToString(rcode.first) << ": " << rcode.second << std::endl;
+    for (const auto &qtype : summary.qtypes)
+        std::cout << "  " << typeToString(qtype.first) << ": " << qtype.second << std::endl;
+    if (summary.rows > 0)
+    {
+        std::cout << "Addresses: " << summary.addresses << std::endl
+                  << "Average RTT: " << summary.rttSum / 1000.0 / summary.rows << " ms, max RTT: "
+                  << summary.rttMax / 1000.0 << " ms" << std::endl
+                  << "Average TTL: " << summary.ttlSum / summary.rows << std::endl;
+    }
+
+    return 0;
+}
+
+int decodePacketLog(const char *path)
+{
+    uint64_t frames = 0;
+    std::string error;
+
+    bool valid = readPacketLog(path, [&frames](const PACKET_LOG_ENTRY &entry, const unsigned char *msg, size_t len) {
+        char address[INET6_ADDRSTRLEN] = "-";
+        if (entry.family == AF_INET || entry.family == AF_INET6)
+            inet_ntop(entry.family, entry.address, address, sizeof(address));
+        std::cout << ";; " << (entry.kind == LOG_QUERY ? "Query to " : "Response from ") << address << "#" << entry.port
+                  << (entry.protocol == IPPROTO_TCP ? " TCP, " : " UDP, ") << len << " B at " << entry.time / 1000000000
+                  << "." << std::setw(9) << std::setfill('0') << entry.time % 1000000000 << std::setfill(' ') << std::endl;
+        frames++;
+
+        // The same parser and printer as the live answer
+        DnsResolver dnsResolver((Args()));
+        if (!dnsResolver.useMessage(msg, len))
+        {
+            std::cout << "  Message can't be printed" << std::endl << std::endl;
+            return;
+        }
+        dnsResolver.printData();
+        dnsResolver.printAnswer(dnsResolver.getAnswer());
+        std::cout << std::endl;
+    }, error);
+
+    std::cout.flush();
+    std::cerr << "Log: " << frames << " messages" << std::endl;
+    if (!valid)
+    {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+void printInterval(const char *label, const LOADGEN_INTERVAL &interval)
+{
+    std::cout << std::setw(8) << label << std::setw(10) << (uint64_t)interval.targetQps << std::setw(12)
+              << (uint64_t)interval.sentQps << std::setw(12) << (uint64_t)interval.receivedQps << std::setw(10)
+              << interval.lost << std::fixed << std::setprecision(3);
+    for (double fraction : {0.5, 0.9, 0.99, 0.999})
+        std::cout << std::setw(10) << interval.latency.percentile(fraction) / 1000.0;
+    std::cout << std::defaultfloat << std::endl;
+}
+
+int runLoadGenerator(const Args &args, const LOADGEN_OPTIONS &options)
+{
+    std::ifstream file(args.input);
+    if (!file)
+    {
+        std::cerr << "Cannot open " << args.input << std::endl;
+        return 1;
+    }
+    std::vector<LOADGEN_QUERY> queries = readQueryFile(file, args.use_ipv6 ? T_AAAA : T_A);
+
+    LoadGenerator loadGenerator(args, options);
+    loadGenerator.connectToDNSServer();
+
+    std::cout << std::setw(8) << "time" << std::setw(10) << "target" << std::setw(12) << "sent/s" << std::setw(12)
+              << "answers/s" << std::setw(10) << "lost" << std::setw(10) << "p50 ms" << std::setw(10) << "p90 ms"
+              << std::setw(10) << "p99 ms" << std::setw(10) << "p99.9 ms" << std::endl;
+
+    LOADGEN_INTERVAL total = loadGenerator.run(queries, [](const LOADGEN_INTERVAL &interval) {
+        printInterval(std::to_string((int)interval.start).c_str(), interval);
+    });
+    printInterval("total", total);
+
+    return 0;
+}
+
+int runBulk(const Args &args, const BULK_OPTIONS &options, NameSource &names, std::shared_ptr<const LocalTable> local)
+{
+    std::unique_ptr<ResultFileWriter> writer;
+    std::string error;
+    if (!args.output.empty())
+    {
+        writer.reset(new ResultFileWriter());
+        if (!writer->open(args.output, error))
+        {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+    }
+
+    // More types are printed together when all of them are answered, the file gets row per type
+    ResultMerger merger(queryTypes(args), printMergedResult);
+
+    // Live window and rate go to stderr, so they don't mix with the results
+    BulkResolver::ProgressCallback progress = [](const BULK_PROGRESS &state) {
+        std::cerr << "Progress: " << std::fixed << std::setprecision(1) << state.seconds << " s, window " << state.window
+                  << ", in flight " << state.inFlight << ", " << (uint64_t)state.qps << " q/s, RTT "
+                  << state.srtt / 1000.0 << " ms, " << state.answered << " answered, " << state.timeouts << " timeouts"
+                  << std::defaultfloat << std::endl;
+    };
+
+    BulkResolver bulkResolver(args, options);
+    if (local)
+        bulkResolver.useLocalTable(local);
+    bulkResolver.connectToDNSServer();
+    BULK_STATS stats = bulkResolver.run(names, [&](const BULK_RESULT &result) {
+        TraceSpan span("format", traceId(result.index, result.qtype));
+        if (writer)
+            writer->append(result);
+        else if (args.qtypes.size() > 1)
+            merger.add(result);
+        else
+            printBulkResult(result);
+    }, args.input.empty() ? nullptr : progress);
+    std::cout.flush();
+    if (writer && !writer->close(error))
+    {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+
+    if (args.input.empty())
+        return 0; // Types of the single address, the statistics would be only noise
+
+    std::cerr << "Bulk: " << stats.names << " names, " << stats.answered << " answered, " << stats.timeouts
+              << " timeouts, " << stats.retransmits << " retransmits, " << stats.cached << " from cache, "
+              << stats.followups << " CNAME follow-ups, " << stats.local << " local, " << stats.fastPath
+              << " fast path, " << stats.duplicates << " duplicates, " << stats.hedges << " hedged ("
+              << stats.hedgesWon << " won), " << stats.remapped << " remapped, " << stats.downs << " upstream downs, "
+              << stats.expired << " over budget, " << stats.cancelled << " cancelled, window " << stats.window
+              << " after " << stats.decreases << " decreases in " << stats.seconds << " s ("
+              << (uint64_t)(stats.seconds > 0 ? stats.names / stats.seconds : 0) << " names/s)" << std::endl;
+    return 0;
+}
+
+static CancelToken interrupted; // Ctrl+C ends the bulk run, the results so far and the statistics are printed
+
+static void onInterrupt(int)
+{
+    interrupted.cancel();
+    signal(SIGINT, SIG_DFL); // Second Ctrl+C kills the program
+}
+
+int runWatch(const Args &args, NameSource &names)
+{
+    NameWatcher watcher(args, WATCH_OPTIONS());
+    std::string error, name;
+    if (!watcher.open(error))
+    {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+
+    std::vector<uint16_t> qtypes = queryTypes(args);
+    unsigned char check[sizeof(struct in6_addr)];
+    while (names.next(name))
+    {
+        if (args.reverse && inet_pton(AF_INET, name.c_str(), check) != 1 && inet_pton(AF_INET6, name.c_str(), check) != 1)
+        {
+            std::cerr << "Not an IP address, skipped: " << name << std::endl;
+            continue;
+        }
+        for (uint16_t qtype : qtypes)
+            watcher.add(args.reverse ? buildPTRQuery(name) : name, qtype);
+    }
+
+    // Runs until killed, every change is flushed at once for the monitoring reading the output
+    watcher.run([](const WATCH_CHANGE &change) {
+        char stamp[32];
+        time_t now = time(nullptr);
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&now));
+        std::cout << stamp << " " << formatChange(change) << std::endl;
+    });
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     int c;
 
     Args args;
+    BULK_OPTIONS bulkOptions;
+    LOADGEN_OPTIONS loadOptions;
+    const char *resultFile = nullptr;
+    const char *packetLog = nullptr;
+    std::unique_ptr<TraceFile> trace; // Written when main returns
+    std::shared_ptr<LocalTable> localTable;
 
     // Processing arguments obtained from the terminal
-    while ((c = getopt(argc, argv, "hrx6s:p:")) != -1)
+    while ((c = getopt(argc, argv, "hrx6s:p:t:f:uo:w:q:R:L:d:C:P:H:Ul:D:WS:e:k:T:B:")) != -1)
     {
         switch (c)
         {
@@ -46,8 +348,115 @@ int main(int argc, char *argv[])
         case 'p':
             args.port = std::atoi(optarg);
             break;
+        case 't':
+            if (strcasecmp(optarg, "AXFR") == 0)
+                args.xfr = T_AXFR;
+            else if (strncasecmp(optarg, "IXFR=", 5) == 0)
+            {
+                args.xfr = T_IXFR;
+                args.xfrSerial = std::strtoul(optarg + 5, nullptr, 10);
+            }
+            else
+            {
+                // List of the types queried in parallel
+                for (const std::string &name : explode(optarg, ','))
+                {
+                    int type = stringToType(name);
+                    if (type == 0 || type == T_AXFR || type == T_IXFR)
+                    {
+                        printHelp();
+                        std::cerr << "Unknown query type " << name << std::endl;
+                        return 1;
+                    }
+                    // Same type twice would share the merger slot, only the first one is queried
+                    if (std::find(args.qtypes.begin(), args.qtypes.end(), type) == args.qtypes.end())
+                        args.qtypes.push_back(type);
+                }
+            }
+            break;
+        case 'f':
+            args.input = optarg;
+            break;
+        case 'o':
+            args.output = optarg;
+            break;
+        case 'w':
+            bulkOptions.window = std::max(1, std::atoi(optarg));
+            break;
+        case 'q':
+            bulkOptions.qps = std::max(0.0, std::atof(optarg));
+            break;
+        case 'S':
+            for (const std::string &server : explode(optarg, ','))
+                args.upstreams.push_back(server);
+            break;
+        case 'e':
+            bulkOptions.hedgePercent = std::max(0.0, std::atof(optarg));
+            break;
+        case 'k':
+            if (strcasecmp(optarg, "name") == 0)
+                bulkOptions.shard = SHARD_NAME;
+            else if (strcasecmp(optarg, "suffix") == 0)
+                bulkOptions.shard = SHARD_SUFFIX;
+            else
+            {
+                printHelp();
+                std::cerr << "Parameter -k must be name or suffix." << std::endl;
+                return 1;
+            }
+            break;
+        case 'R':
+            resultFile = optarg;
+            break;
+        case 'L':
+            for (const std::string &rate : explode(optarg, ','))
+                loadOptions.rates.push_back(std::atof(rate.c_str()));
+            break;
+        case 'd':
+            loadOptions.stepSeconds = std::atof(optarg);
+            break;
+        case 'C':
+            args.capture = optarg;
+            break;
+        case 'P':
+            args.replay = optarg;
+            break;
+        case 'H':
+            if (!localTable)
+                localTable = std::make_shared<LocalTable>();
+            for (const std::string &path : explode(optarg, ','))
+            {
+                std::string error;
+                if (!localTable->add(path, error))
+                {
+                    std::cerr << error << std::endl;
+                    return 1;
+                }
+            }
+            break;
+        case 'U':
+            args.upstreamFirst = true;
+            break;
+        case 'u':
+            args.unique = true;
+            break;
+        case 'l':
+            args.log = optarg;
+            break;
+        case 'W':
+            args.watch = true;
+            break;
+        case 'D':
+            packetLog = optarg;
+            break;
+        case 'B':
+            args.budget = std::max(0, std::atoi(optarg));
+            break;
+        case 'T':
+            trace.reset(new TraceFile(optarg));
+            break;
         case '?':
-            if (optopt == 's' || optopt == 'p')
+            if (strchr("sptfowqRLdCPHlDSekTB", optopt) != nullptr)
             {
                 printHelp();
                 std::cerr << "Parameter -" << static_cast<char>(optopt) << " requires argument." << std::endl;
@@ -72,30 +481,105 @@ int main(int argc, char *argv[])
         std::cerr << "Invalid combination, can't use -x and -6 together" << std::endl;
         return 1;
     }
-    // Checking the address
-    if (optind >= argc)
+    // Network failures end the program here, the classes only report them
+    try
     {
-        printHelp();
-        std::cerr << "Missing the address argument" << std::endl;
-        return 1;
-    }
+        if (resultFile != nullptr)
+            return readResultFile(resultFile, argc - optind, argv + optind);
+        if (packetLog != nullptr)
+            return decodePacketLog(packetLog);
 
-    if (argc < 4 || argc > 8)
-    {
-        printHelp();
-        std::cerr << "Invalid number of arguments" << std::endl;
-        exit(1);
-    }
+        if (!loadOptions.rates.empty())
+        {
+            if (args.input.empty() || loadOptions.stepSeconds <= 0)
+            {
+                printHelp();
+                std::cerr << "Load generator needs the query file (-f) and positive step duration" << std::endl;
+                return 1;
+            }
+            return runLoadGenerator(args, loadOptions);
+        }
 
-    args.domain = argv[optind];
+        if (args.watch && args.input.empty())
+        {
+            printHelp();
+            std::cerr << "Watch needs the file with the names (-f)" << std::endl;
+            return 1;
+        }
+        if (!args.input.empty())
+        {
+            // Regular files are mapped and split to lines ahead of the resolver
+            std::string error;
+            std::unique_ptr<NameSource> names = openNameSource(args.input, args.unique || args.watch, error);
+            if (!names)
+            {
+                std::cerr << error << std::endl;
+                return 1;
+            }
+            if (args.watch)
+                return runWatch(args, *names);
+            bulkOptions.cancel = interrupted;
+            signal(SIGINT, onInterrupt);
+            return runBulk(args, bulkOptions, *names, localTable);
+        }
 
-    DnsResolver dnsResolver(args);
+        if (!args.output.empty())
+        {
+            printHelp();
+            std::cerr << "Result file can be written only by the bulk run" << std::endl;
+            return 1;
+        }
 
-    dnsResolver.connectToDNSServer();
-    dnsResolver.query();
-    dnsResolver.printData();
-    DNS_INFO info = dnsResolver.getAnswer();
-    dnsResolver.printAnswer(info);
+        // Checking the address
+        if (optind >= argc)
+        {
+            printHelp();
+            std::cerr << "Missing the address argument" << std::endl;
+            return 1;
+        }
+
+        args.domain = argv[optind];
+
+        if (args.xfr != 0)
+        {
+            ZoneTransfer zoneTransfer(args);
+
+            zoneTransfer.connectToDNSServer();
+            XFR_STATS stats = zoneTransfer.transfer([&args](const DNS_REC &record, bool removed) {
+                const char *mark = args.xfr == T_IXFR ? (removed ? "- " : "+ ") : "  ";
+                std::cout << mark << record.name << "., " << record.type << ", IN, " << record.ttl << ", " << record.value << "\n";
+            });
+            std::cout.flush();
+
+            std::cerr << "Transfer: " << stats.records << " records, " << stats.messages << " messages, " << stats.bytes
+                      << " bytes in " << stats.seconds << " s (" << (uint64_t)stats.recordsPerSecond() << " records/s, "
+                      << (uint64_t)stats.bytesPerSecond() << " B/s)" << std::endl;
+            return 0;
+        }
+
+        // Several types of one address are the bulk run of the single name
+        if (!args.qtypes.empty())
+        {
+            std::istringstream input(args.domain);
+            StreamNameSource names(input);
+            return runBulk(args, bulkOptions, names, localTable);
+        }
+
+        DnsResolver dnsResolver(args);
+        if (localTable)
+            dnsResolver.useLocalTable(localTable);
+
+        dnsResolver.connectToDNSServer();
+        dnsResolver.query();
+        dnsResolver.printData();
+        DNS_INFO info = dnsResolver.getAnswer();
+        dnsResolver.printAnswer(info);
+    }
+    catch (const TransportError &error)
+    {
+        std::cerr << error.what() << std::endl;
+        return 1;
+    }
 
     return 0;
 }
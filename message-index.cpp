@@ -0,0 +1,278 @@
+/**
+ * @author Rostislav Kral
+ * @brief Implementation of the one-pass message validation and of the unchecked decoders.
+ * @file message-index.cpp
+ * */
+
+#include "message-index.h"
+#include "dns-resolver.h"
+
+static inline uint16_t read16(const unsigned char *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static inline uint32_t read32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/**
+ * @brief Checks one name, its labels before the first pointer must end before end
+ * @param pos Offset of the name, moved behind it on success
+ * @param end Limit of the name in place, the end of the message or of RDATA
+ * @return false if the name is malformed
+ * */
+static bool checkName(const unsigned char *msg, size_t &pos, size_t end)
+{
+    size_t p = pos, limit = end, wire = 1; // Root byte
+    int jumps = 0;
+    bool jumped = false;
+
+    while (true)
+    {
+        if (p >= limit)
+            return false;
+        unsigned char labelLength = msg[p];
+
+        if (labelLength == 0)
+        {
+            if (!jumped)
+                pos = p + 1;
+            return true;
+        }
+        if ((labelLength & 0xC0) == 0xC0)
+        {
+            if (p + 1 >= limit || ++jumps > 126) // Same bound as readName()
+                return false;
+            size_t target = ((labelLength & 0x3F) << 8) | msg[p + 1];
+            // Strictly backwards, so the chain can't loop, and the target is never inside the header
+            if (target >= p || target < sizeof(DNS_HEADER))
+                return false;
+            if (!jumped)
+                pos = p + 2;
+            jumped = true;
+            limit = p; // The rest of the name is before the pointer
+            p = target;
+            continue;
+        }
+        if ((labelLength & 0xC0) != 0 || p + 1 + labelLength > limit)
+            return false;
+        wire += labelLength + 1;
+        if (wire > MAX_WIRE_NAME)
+            return false;
+        p += labelLength + 1;
+    }
+}
+
+/**
+ * @brief Checks the RDATA of the known types, the others are opaque
+ * @return false if the RDATA doesn't match its type
+ * */
+static bool checkRdata(const unsigned char *msg, uint16_t type, size_t rdata, size_t end)
+{
+    size_t pos = rdata;
+
+    switch (type)
+    {
+    case T_A:
+        return end - rdata == 4;
+    case T_AAAA:
+        return end - rdata == 16;
+    case T_NS:
+    case T_CNAME:
+    case T_PTR:
+        return checkName(msg, pos, end);
+    case T_MX:
+        pos += 2;
+        return end - rdata >= 3 && checkName(msg, pos, end);
+    case T_SOA:
+        return checkName(msg, pos, end) && checkName(msg, pos, end) && pos + 20 <= end;
+    case T_TXT:
+        while (pos < end)
+            pos += msg[pos] + 1;
+        return pos == end;
+    default:
+        return true;
+    }
+}
+
+bool validateMessage(const unsigned char *msg, size_t len, MESSAGE_INDEX &index)
+{
+    // The vector keeps its capacity, so the index reused for many messages doesn't allocate
+    index.questions = index.question = index.qtype = 0;
+    std::fill(index.sections, index.sections + 3, 0);
+    index.records.clear();
+    if (len < sizeof(DNS_HEADER) || len > MAX_TCP_DNS_SIZE)
+        return false;
+
+    const DNS_HEADER *header = reinterpret_cast<const DNS_HEADER *>(msg);
+    uint16_t qdcount = ntohs(header->qdcount);
+    uint16_t counts[3] = {(uint16_t)ntohs(header->ancount), (uint16_t)ntohs(header->nscount), (uint16_t)ntohs(header->arcount)};
+    size_t pos = sizeof(DNS_HEADER);
+
+    for (int i = 0; i < qdcount; i++)
+    {
+        size_t name = pos;
+        if (!checkName(msg, pos, len) || pos + sizeof(QUESTION) > len)
+            return false;
+        if (i == 0)
+        {
+            index.question = name;
+            index.qtype = read16(msg + pos);
+        }
+        pos += sizeof(QUESTION);
+        index.questions++;
+    }
+
+    // Every record has at least 11 bytes, so the counts can't ask for more records than fit
+    index.records.reserve(std::min<size_t>(counts[0] + counts[1] + counts[2], (len - pos) / 11));
+    for (int section = SECTION_ANSWER; section <= SECTION_ADDITIONAL; section++)
+    {
+        for (int i = 0; i < counts[section]; i++)
+        {
+            RECORD_INDEX record;
+            record.name = pos;
+            if (!checkName(msg, pos, len) || pos + 10 > len)
+                return false;
+
+            record.type = read16(msg + pos);
+            record.ttl = read32(msg + pos + 4);
+            record.rdlength = read16(msg + pos + 8);
+            record.rdata = pos + 10;
+            pos = record.rdata + record.rdlength;
+            if (pos > len || !checkRdata(msg, record.type, record.rdata, pos))
+                return false;
+
+            index.records.push_back(record);
+            index.sections[section]++;
+        }
+    }
+    return true;
+}
+
+void indexedName(const unsigned char *msg, size_t pos, std::string &name)
+{
+    name.clear();
+    while (msg[pos] != 0)
+    {
+        if ((msg[pos] & 0xC0) == 0xC0)
+        {
+            pos = ((msg[pos] & 0x3F) << 8) | msg[pos + 1];
+            continue;
+        }
+        if (!name.empty())
+            name.push_back('.');
+        name.append(reinterpret_cast<const char *>(msg + pos + 1), msg[pos]);
+        pos += msg[pos] + 1;
+    }
+}
+
+/**
+ * @brief Offset behind the name in place, the name is already validated
+ * */
+static size_t skipName(const unsigned char *msg, size_t pos)
+{
+    while (msg[pos] != 0)
+    {
+        if ((msg[pos] & 0xC0) == 0xC0)
+            return pos + 2;
+        pos += msg[pos] + 1;
+    }
+    return pos + 1;
+}
+
+void indexedSoa(const unsigned char *msg, const RECORD_INDEX &record, SOA_RECORD &soa)
+{
+    size_t pos = record.rdata;
+
+    soa.ttl = record.ttl;
+    indexedName(msg, pos, soa.mname);
+    pos = skipName(msg, pos);
+    indexedName(msg, pos, soa.rname);
+    pos = skipName(msg, pos);
+    soa.serial = read32(msg + pos);
+    soa.refresh = read32(msg + pos + 4);
+    soa.retry = read32(msg + pos + 8);
+    soa.expire = read32(msg + pos + 12);
+    soa.minimum = read32(msg + pos + 16);
+}
+
+void indexedAddress(const unsigned char *rdata, std::string &out)
+{
+    char text[16]; // "255.255.255.255"
+    char *p = text;
+    for (int i = 0; i < 4; i++)
+    {
+        unsigned value = rdata[i];
+        if (value >= 100)
+            *p++ = '0' + value / 100;
+        if (value >= 10)
+            *p++ = '0' + value / 10 % 10;
+        *p++ = '0' + value % 10;
+        *p++ = '.';
+    }
+    out.assign(text, p - text - 1);
+}
+
+void indexedRecord(const unsigned char *msg, const RECORD_INDEX &record, DNS_REC &out)
+{
+    const unsigned char *rdata = msg + record.rdata;
+
+    indexedName(msg, record.name, out.name);
+    out.ttl = record.ttl;
+    out.type = typeToString(record.type);
+    out.value.clear();
+
+    switch (record.type)
+    {
+    case T_A:
+        indexedAddress(rdata, out.value);
+        break;
+    case T_AAAA:
+    {
+        char address[INET6_ADDRSTRLEN];
+        inet_ntop(AF_INET6, rdata, address, sizeof(address));
+        out.value = address;
+        break;
+    }
+    case T_NS:
+    case T_CNAME:
+    case T_PTR:
+        indexedName(msg, record.rdata, out.value);
+        break;
+    case T_MX:
+    {
+        std::string exchange;
+        indexedName(msg, record.rdata + 2, exchange);
+        out.value = std::to_string(read16(rdata)) + " " + exchange;
+        break;
+    }
+    case T_SOA:
+    {
+        std::string mname, rname;
+        size_t pos = record.rdata;
+        indexedName(msg, pos, mname);
+        pos = skipName(msg, pos);
+        indexedName(msg, pos, rname);
+        pos = skipName(msg, pos);
+        out.value = mname + ". " + rname + ".";
+        for (int i = 0; i < 5; i++)
+            out.value += " " + std::to_string(read32(msg + pos + 4 * i));
+        break;
+    }
+    case T_TXT:
+    {
+        size_t end = record.rdata + record.rdlength;
+        for (size_t i = record.rdata; i < end; i += msg[i] + 1)
+        {
+            if (!out.value.empty())
+                out.value += " ";
+            out.value += "\"" + std::string(reinterpret_cast<const char *>(msg + i + 1), msg[i]) + "\"";
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
@@ -0,0 +1,110 @@
+/**
+ * @author Rostislav Kral
+ * @brief Contains the one-pass validation of the DNS message. validateMessage() walks the message once, checks the
+ * section counts, every name with its compression pointers and every RDATA against the length of the message and
+ * remembers the offsets of the records, the decoders below then read only those offsets without any bounds checks.
+ * @file message-index.h
+ * */
+
+#ifndef MESSAGE_INDEX_H
+#define MESSAGE_INDEX_H
+
+#include "helpers.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#define MAX_WIRE_NAME 255 // Longest name in the wire format including the length bytes and the root (RFC 1035)
+
+#define SECTION_ANSWER 0
+#define SECTION_AUTHORITY 1
+#define SECTION_ADDITIONAL 2
+
+struct SOA_RECORD;
+
+/**
+ * @brief Offsets of one validated resource record, the fixed fields are already in host byte order
+ * */
+struct RECORD_INDEX {
+    uint16_t name; // Offset of the owner name
+    uint16_t type;
+    uint32_t ttl;
+    uint16_t rdata; // Offset of RDATA
+    uint16_t rdlength;
+};
+
+/**
+ * @brief Result of validateMessage(), the records are in the order of the message
+ * */
+struct MESSAGE_INDEX {
+    uint16_t questions = 0; // Valid questions, all of them when the message is valid
+    uint16_t question = 0; // Offset of the name of the first question
+    uint16_t qtype = 0; // Type of the first question
+    uint16_t sections[3] = {0, 0, 0}; // Valid records of the answer, authority and additional section
+    std::vector<RECORD_INDEX> records;
+
+    /**
+     * @brief Position of the first record of the section in records
+     * @param section SECTION_ANSWER, SECTION_AUTHORITY or SECTION_ADDITIONAL
+     * @return size_t
+     * */
+    size_t first(int section) const
+    {
+        size_t position = 0;
+        for (int i = 0; i < section; i++)
+            position += sections[i];
+        return position;
+    }
+};
+
+/**
+ * @brief Validates the whole message in one pass. Names may jump only backwards behind the header, so every pointer
+ * chain ends, and must not be longer than MAX_WIRE_NAME. Names in RDATA (NS, CNAME, PTR, MX, SOA) must end inside
+ * RDATA, A and AAAA must have 4 and 16 bytes, TXT strings must fill RDATA exactly. Bytes after the last record are
+ * ignored.
+ * @param msg Start of the DNS message
+ * @param len Length of the DNS message, at most 65535
+ * @param index Output, on failure it keeps the questions and records checked before the malformed one, so the answer
+ * section can still be used when only a later section is broken
+ * @return false if some count, name or RDATA doesn't fit into the message
+ * */
+bool validateMessage(const unsigned char *msg, size_t len, MESSAGE_INDEX &index);
+
+/**
+ * @brief Unchecked decoding of the name validated by validateMessage()
+ * @param msg Start of the DNS message
+ * @param pos Offset of the name from the index
+ * @param name Output, labels joined by dots without the trailing dot, "" is the root
+ * @return
+ * */
+void indexedName(const unsigned char *msg, size_t pos, std::string &name);
+
+/**
+ * @brief Unchecked decoding of the record validated by validateMessage(), the result is the same as decodeRecord()
+ * @param msg Start of the DNS message
+ * @param record Record from the index
+ * @param out Output record
+ * @return
+ * */
+void indexedRecord(const unsigned char *msg, const RECORD_INDEX &record, DNS_REC &out);
+
+/**
+ * @brief Unchecked decoding of the SOA record validated by validateMessage() straight into its fields, the names
+ * are without the trailing dot like from parseSoa()
+ * @param msg Start of the DNS message
+ * @param record Record of type SOA from the index
+ * @param soa Output, including the TTL of the record
+ * @return
+ * */
+void indexedSoa(const unsigned char *msg, const RECORD_INDEX &record, SOA_RECORD &soa);
+
+/**
+ * @brief Unchecked dotted quad of the A record
+ * @param rdata 4 bytes of the address
+ * @param out Output
+ * @return
+ * */
+void indexedAddress(const unsigned char *rdata, std::string &out);
+
+#endif // MESSAGE_INDEX_H
@@ -0,0 +1,366 @@
+/**
+ * @author Rostislav Kral
+ * @brief Implementation of the name sources of the bulk run.
+ * @file name-input.cpp
+ * */
+
+#include "name-input.h"
+#include "name-utils.h"
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#define NAME_INPUT_X86
+#endif
+
+#define NAME_SET_INITIAL 1024 // Slots of the empty set, power of two
+
+NameSet::NameSet() : slots(NAME_SET_INITIAL, SLOT{0, {nullptr, 0}})
+{
+}
+
+bool NameSet::insert(const NAME_VIEW &name)
+{
+    // Load stays under one half, so the probe sequences are short
+    if (2 * (count + 1) > slots.size())
+        grow();
+
+    uint64_t hash = nameHash(name.data, name.length) | 1;
+    size_t mask = slots.size() - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask)
+    {
+        SLOT &slot = slots[i];
+        if (slot.hash == 0)
+        {
+            slot.hash = hash;
+            slot.name = name;
+            count++;
+            return true;
+        }
+        if (slot.hash == hash && nameEquals(slot.name.data, slot.name.length, name.data, name.length))
+            return false;
+    }
+}
+
+void NameSet::grow()
+{
+    std::vector<SLOT> old(slots.size() * 2, SLOT{0, {nullptr, 0}});
+    old.swap(slots);
+
+    size_t mask = slots.size() - 1;
+    for (const SLOT &slot : old)
+    {
+        if (slot.hash == 0)
+            continue;
+        size_t i = slot.hash & mask;
+        while (slots[i].hash != 0)
+            i = (i + 1) & mask;
+        slots[i] = slot;
+    }
+}
+
+// ---------------------------------------------------------- NEWLINES ----------------------------------------------------------
+
+void findNewlinesScalar(const char *data, size_t len, std::vector<uint32_t> &offsets)
+{
+    const char *end = data + len;
+    const char *newline = data;
+
+    while ((newline = static_cast<const char *>(memchr(newline, '\n', end - newline))) != nullptr)
+    {
+        offsets.push_back(newline - data);
+        newline++;
+    }
+}
+
+#ifdef NAME_INPUT_X86
+
+// One comparison gives the mask of all newlines in the block, so short lines don't pay a call each like memchr()
+static void findNewlinesSse2(const char *data, size_t len, std::vector<uint32_t> &offsets)
+{
+    const __m128i newline = _mm_set1_epi8('\n');
+
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i)), newline));
+        while (mask != 0)
+        {
+            offsets.push_back(i + __builtin_ctz(mask));
+            mask &= mask - 1;
+        }
+    }
+    for (; i < len; i++)
+    {
+        if (data[i] == '\n')
+            offsets.push_back(i);
+    }
+}
+
+__attribute__((target("avx2"))) static void findNewlinesAvx2(const char *data, size_t len, std::vector<uint32_t> &offsets)
+{
+    const __m256i newline = _mm256_set1_epi8('\n');
+
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64)
+    {
+        // Two blocks per iteration, the 64 bit mask is walked bit by bit
+        uint64_t low = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i)), newline));
+        uint64_t high = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i + 32)), newline));
+        uint64_t mask = low | (high << 32);
+        while (mask != 0)
+        {
+            offsets.push_back(i + __builtin_ctzll(mask));
+            mask &= mask - 1;
+        }
+    }
+    size_t before = offsets.size();
+    findNewlinesSse2(data + i, len - i, offsets);
+    for (size_t j = before; j < offsets.size(); j++)
+        offsets[j] += i;
+}
+
+#endif // NAME_INPUT_X86
+
+typedef void (*FindNewlines)(const char *, size_t, std::vector<uint32_t> &);
+
+static FindNewlines selectFindNewlines()
+{
+#ifdef NAME_INPUT_X86
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? findNewlinesAvx2 : findNewlinesSse2;
+#else
+    return findNewlinesScalar;
+#endif
+}
+
+void findNewlines(const char *data, size_t len, std::vector<uint32_t> &offsets)
+{
+    static const FindNewlines implementation = selectFindNewlines();
+    implementation(data, len, offsets);
+}
+
+bool normalizeLine(const char *line, size_t length, NAME_VIEW &name)
+{
+    size_t start = 0;
+    while (start < length && (line[start] == ' ' || line[start] == '\t' || line[start] == '\r'))
+        start++;
+    while (length > start && (line[length - 1] == ' ' || line[length - 1] == '\t' || line[length - 1] == '\r'))
+        length--;
+    if (start == length || line[start] == '#')
+        return false;
+
+    // "example.com." and "example.com" are the same name
+    if (length - start > 1 && line[length - 1] == '.')
+        length--;
+    name.data = line + start;
+    name.length = length - start;
+    return true;
+}
+
+// ---------------------------------------------------------- STREAM ----------------------------------------------------------
+
+StreamNameSource::StreamNameSource(std::istream &input, bool unique) : input(input), unique(unique)
+{
+}
+
+StreamNameSource::StreamNameSource(std::unique_ptr<std::istream> input, bool unique)
+    : owned(std::move(input)), input(*owned), unique(unique)
+{
+}
+
+bool StreamNameSource::next(std::string &name)
+{
+    NAME_VIEW view;
+
+    while (std::getline(input, line))
+    {
+        if (!normalizeLine(line.data(), line.size(), view))
+            continue;
+        name.assign(view.data, view.length);
+        if (unique && !seen.insert(nameToLower(name)).second)
+        {
+            duplicateCount++;
+            continue;
+        }
+        return true;
+    }
+    return false;
+}
+
+// ---------------------------------------------------------- MAPPED ----------------------------------------------------------
+
+MappedNameSource::MappedNameSource(const std::string &path, bool unique, unsigned threads) : unique(unique)
+{
+    int fd;
+    struct stat info;
+
+    if ((fd = open(path.c_str(), O_RDONLY)) == -1 || fstat(fd, &info) == -1)
+    {
+        failure = "Cannot open " + path + ": " + strerror(errno);
+        if (fd != -1)
+            close(fd);
+        return;
+    }
+    size = info.st_size;
+
+    // Empty file has nothing to map
+    void *mapping = size > 0 ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        failure = "Cannot map " + path + ": " + strerror(errno);
+        size = 0;
+        return;
+    }
+    base = static_cast<const char *>(mapping);
+    if (size > 0)
+        madvise(mapping, size, MADV_SEQUENTIAL);
+
+    if (threads == 0)
+        threads = std::min<unsigned>(std::max(1u, std::thread::hardware_concurrency()), NAME_INPUT_THREADS);
+    this->threads = threads;
+    prefetch();
+}
+
+MappedNameSource::~MappedNameSource()
+{
+    // The thread of the next window reads the mapping
+    if (ahead.valid())
+        ahead.wait();
+    if (base != nullptr)
+        munmap(const_cast<char *>(base), size);
+}
+
+bool MappedNameSource::opened(std::string &error) const
+{
+    error = failure;
+    return failure.empty();
+}
+
+std::vector<NAME_VIEW> MappedNameSource::split(size_t begin, size_t end) const
+{
+    std::vector<uint32_t> offsets;
+    std::vector<NAME_VIEW> names;
+    NAME_VIEW name;
+
+    findNewlines(base + begin, end - begin, offsets);
+    size_t start = begin;
+    for (uint32_t offset : offsets)
+    {
+        if (normalizeLine(base + start, begin + offset - start, name))
+            names.push_back(name);
+        start = begin + offset + 1;
+    }
+    // Only the end of the file has a line without the newline
+    if (start < end && normalizeLine(base + start, end - start, name))
+        names.push_back(name);
+    return names;
+}
+
+void MappedNameSource::prefetch()
+{
+    if (position >= size)
+        return;
+
+    // The window ends behind a newline, so no line is split between two windows
+    size_t begin = position;
+    size_t end = std::min(size, begin + (size_t)threads * NAME_INPUT_CHUNK);
+    if (end < size)
+    {
+        const void *newline = memchr(base + end, '\n', size - end);
+        end = newline == nullptr ? size : static_cast<const char *>(newline) - base + 1;
+    }
+    position = end;
+
+    ahead = std::async(std::launch::async, [this, begin, end]() {
+        // Parts of the window end behind a newline too, every thread splits one of them
+        std::vector<size_t> bounds(1, begin);
+        for (unsigned i = 1; i < threads; i++)
+        {
+            size_t bound = std::max(bounds.back(), begin + (end - begin) * i / threads);
+            const void *newline = bound < end ? memchr(base + bound, '\n', end - bound) : nullptr;
+            bounds.push_back(newline == nullptr ? end : static_cast<const char *>(newline) - base + 1);
+        }
+        bounds.push_back(end);
+
+        std::vector<std::vector<NAME_VIEW>> parts(threads);
+        std::vector<std::thread> workers;
+        for (unsigned i = 1; i < threads; i++)
+            workers.emplace_back([&, i]() { parts[i] = split(bounds[i], bounds[i + 1]); });
+        parts[0] = split(bounds[0], bounds[1]);
+        for (std::thread &worker : workers)
+            worker.join();
+
+        std::vector<NAME_VIEW> names = std::move(parts[0]);
+        for (unsigned i = 1; i < threads; i++)
+            names.insert(names.end(), parts[i].begin(), parts[i].end());
+        return names;
+    });
+}
+
+bool MappedNameSource::next(std::string &name)
+{
+    while (true)
+    {
+        if (batchPosition == batch.size())
+        {
+            if (!ahead.valid())
+                return false;
+            batch = ahead.get();
+            batchPosition = 0;
+
+            // Without the set nothing points back, the pages of the consumed windows can be dropped
+            if (!unique && !batch.empty())
+            {
+                size_t consumed = (batch.front().data - base) & ~(size_t)(sysconf(_SC_PAGESIZE) - 1);
+                if (consumed > released)
+                    madvise(const_cast<char *>(base) + released, consumed - released, MADV_DONTNEED);
+                released = std::max(released, consumed);
+            }
+            prefetch();
+            continue;
+        }
+
+        const NAME_VIEW &view = batch[batchPosition++];
+        if (unique && !seen.insert(view))
+        {
+            duplicateCount++;
+            continue;
+        }
+        name.assign(view.data, view.length);
+        return true;
+    }
+}
+
+std::unique_ptr<NameSource> openNameSource(const std::string &path, bool unique, std::string &error)
+{
+    struct stat info;
+
+    if (path == "-")
+        return std::unique_ptr<NameSource>(new StreamNameSource(std::cin, unique));
+
+    if (stat(path.c_str(), &info) == 0 && S_ISREG(info.st_mode))
+    {
+        std::unique_ptr<MappedNameSource> mapped(new MappedNameSource(path, unique));
+        if (!mapped->opened(error))
+            return nullptr;
+        return std::move(mapped);
+    }
+
+    // Pipes and devices can't be mapped
+    std::unique_ptr<std::istream> file(new std::ifstream(path));
+    if (!*file)
+    {
+        error = "Cannot open " + path;
+        return nullptr;
+    }
+    return std::unique_ptr<NameSource>(new StreamNameSource(std::move(file), unique));
+}
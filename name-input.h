@@ -0,0 +1,182 @@
+/**
+ * @author Rostislav Kral
+ * @brief Contains readers of the names of the bulk run. Files are memory mapped and split to lines by several threads
+ * (SSE2/AVX2 newline scan) one window ahead of the resolver, streams are read line by line. Both can skip repeated
+ * names, compared case insensitively through views into the mapped file, so nothing is copied for the check.
+ * @file name-input.h
+ * */
+
+#ifndef NAME_INPUT_H
+#define NAME_INPUT_H
+
+#include <future>
+#include <istream>
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#define NAME_INPUT_CHUNK (1 << 20) // Bytes of the mapped file split by one thread at once
+#define NAME_INPUT_THREADS 8 // Maximal number of the splitting threads
+
+/**
+ * @brief Name inside the input, the memory belongs to the source
+ * */
+struct NAME_VIEW {
+    const char *data;
+    size_t length;
+};
+
+/**
+ * @brief Set of the views, case insensitive like nameEquals(). Open addressing with the hash stored in the slot, so
+ * the names in the input are touched only when the hashes match.
+ * */
+class NameSet {
+public:
+    NameSet();
+
+    /**
+     * @brief Adds the name, the view must stay valid as long as the set
+     * @param name
+     * @return false if the name is in the set already
+     * */
+    bool insert(const NAME_VIEW &name);
+
+    size_t size() const { return count; }
+
+private:
+    struct SLOT {
+        uint64_t hash; // 0 = empty slot
+        NAME_VIEW name;
+    };
+
+    void grow();
+
+    std::vector<SLOT> slots;
+    size_t count = 0;
+};
+
+/**
+ * @brief Finds every '\n', SSE2 or AVX2 variant is selected at runtime
+ * @param data
+ * @param len
+ * @param offsets Output, offsets of the newlines from data are appended
+ * @return
+ * */
+void findNewlines(const char *data, size_t len, std::vector<uint32_t> &offsets);
+
+// memchr() per line, reference for the tests and benchmarks
+void findNewlinesScalar(const char *data, size_t len, std::vector<uint32_t> &offsets);
+
+/**
+ * @brief Trims the line and drops the trailing dot of the name
+ * @param line
+ * @param length
+ * @param name Output
+ * @return false for empty lines and # comments
+ * */
+bool normalizeLine(const char *line, size_t length, NAME_VIEW &name);
+
+/**
+ * @brief Names of the bulk run in the order of the input
+ * */
+class NameSource {
+public:
+    virtual ~NameSource() {}
+
+    /**
+     * @brief Takes the next name, trimmed and without the trailing dot
+     * @param name Output, its buffer is reused
+     * @return false at the end of the input
+     * */
+    virtual bool next(std::string &name) = 0;
+
+    /**
+     * @brief Repeated names skipped so far, only when the source was created with unique
+     * @return uint64_t
+     * */
+    uint64_t duplicates() const { return duplicateCount; }
+
+protected:
+    uint64_t duplicateCount = 0;
+};
+
+class StreamNameSource : public NameSource {
+public:
+    /**
+     * @brief Reads the lines of the stream, which must live until the end of the source
+     * @param input
+     * @param unique Repeated names are skipped (the set keeps a copy of every name)
+     * */
+    explicit StreamNameSource(std::istream &input, bool unique = false);
+
+    /**
+     * @brief The source owns the stream
+     * */
+    StreamNameSource(std::unique_ptr<std::istream> input, bool unique);
+
+    bool next(std::string &name) override;
+
+private:
+    std::unique_ptr<std::istream> owned;
+    std::istream &input;
+    bool unique;
+    std::string line;
+    std::unordered_set<std::string> seen; // Lowercased names
+};
+
+/**
+ * @brief Names of the mapped file. The window of threads * NAME_INPUT_CHUNK bytes is split to lines in parallel
+ * while the previous window is consumed, so the resolver doesn't wait for the input and only two windows of views
+ * are held besides the set of the unique names.
+ * */
+class MappedNameSource : public NameSource {
+public:
+    /**
+     * @brief Maps the file, opened() tells the result
+     * @param path
+     * @param unique Repeated names are skipped
+     * @param threads Splitting threads, 0 = number of CPUs up to NAME_INPUT_THREADS
+     * */
+    MappedNameSource(const std::string &path, bool unique, unsigned threads = 0);
+
+    ~MappedNameSource();
+
+    /**
+     * @brief Checks the mapping
+     * @param error Output, reason of the failure
+     * @return false if the file can't be read
+     * */
+    bool opened(std::string &error) const;
+
+    bool next(std::string &name) override;
+
+private:
+    std::vector<NAME_VIEW> split(size_t begin, size_t end) const;
+
+    void prefetch();
+
+    std::string failure;
+    const char *base = nullptr;
+    size_t size = 0;
+    size_t position = 0; // Start of the window not split yet
+    unsigned threads;
+    bool unique;
+
+    std::future<std::vector<NAME_VIEW>> ahead; // Next window
+    std::vector<NAME_VIEW> batch; // Current window
+    size_t batchPosition = 0;
+    size_t released = 0; // Bytes already given back to the kernel
+    NameSet seen;
+};
+
+/**
+ * @brief Opens the names of the bulk run, regular files are mapped, "-" is stdin, anything else is read as a stream
+ * @param path
+ * @param unique Repeated names are skipped
+ * @param error Output, reason of the failure
+ * @return std::unique_ptr<NameSource> nullptr on failure
+ * */
+std::unique_ptr<NameSource> openNameSource(const std::string &path, bool unique, std::string &error);
+
+#endif // NAME_INPUT_H
@@ -0,0 +1,404 @@
+/**
+ * @author Rostislav Kral
+ * @brief Implementation of the name utilities, scalar, SSE2 (16 bytes) and AVX2 (32 bytes) variants.
+ * @file name-utils.cpp
+ * */
+
+#include "name-utils.h"
+#include <cstring>
+
+#ifdef __x86_64__ // SSE2 is part of the x86-64 baseline, AVX2 is checked at runtime
+#include <immintrin.h>
+#define NAME_UTILS_X86
+#endif
+
+#define HASH_K1 0x9E3779B97F4A7C15ULL
+#define HASH_K2 0xC2B2AE3D27D4EB4FULL
+
+static inline char lowerChar(char c)
+{
+    return (c >= 'A' && c <= 'Z') ? c | 0x20 : c;
+}
+
+static inline bool labelChar(char c)
+{
+    c = lowerChar(c);
+    return (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '-' || c == '_';
+}
+
+// Hash is defined over 8 byte little endian words of the lowercased name, the last word is padded by zeros
+static inline uint64_t hashMix(uint64_t hash, uint64_t word)
+{
+    hash ^= word * HASH_K2;
+    hash = (hash << 29) | (hash >> 35);
+    return hash * HASH_K1;
+}
+
+static inline uint64_t hashStart(size_t len)
+{
+    return 0x243F6A8885A308D3ULL ^ (len * HASH_K1);
+}
+
+static inline uint64_t hashFinish(uint64_t hash)
+{
+    hash ^= hash >> 32;
+    hash *= HASH_K2;
+    return hash ^ (hash >> 29);
+}
+
+static uint64_t hashTail(uint64_t hash, const char *name, size_t len)
+{
+    while (len > 0)
+    {
+        char word[8] = {0};
+        size_t n = len < 8 ? len : 8;
+        for (size_t i = 0; i < n; i++)
+            word[i] = lowerChar(name[i]);
+
+        uint64_t value;
+        memcpy(&value, word, 8);
+        hash = hashMix(hash, value);
+        name += n;
+        len -= n;
+    }
+    return hash;
+}
+
+// Splits the name to labels and checks their lengths, characters are checked by the caller
+static bool labelsValid(const char *name, size_t len)
+{
+    if (len > 0 && name[len - 1] == '.')
+        len--;
+    if (len == 0 || len > 253)
+        return false;
+
+    const char *end = name + len;
+    while (name < end)
+    {
+        const char *dot = static_cast<const char *>(memchr(name, '.', end - name));
+        size_t labelLength = (dot == nullptr ? end : dot) - name;
+        if (labelLength == 0 || labelLength > 63)
+            return false;
+        name += labelLength + 1;
+    }
+    return true;
+}
+
+// ---------------------------------------------------------- SCALAR ----------------------------------------------------------
+
+void nameToLowerScalar(const char *in, char *out, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+        out[i] = lowerChar(in[i]);
+}
+
+bool nameEqualsScalar(const char *a, size_t aLength, const char *b, size_t bLength)
+{
+    if (aLength != bLength)
+        return false;
+    for (size_t i = 0; i < aLength; i++)
+    {
+        if (lowerChar(a[i]) != lowerChar(b[i]))
+            return false;
+    }
+    return true;
+}
+
+uint64_t nameHashScalar(const char *name, size_t len)
+{
+    return hashFinish(hashTail(hashStart(len), name, len));
+}
+
+static bool charsValidScalar(const char *name, size_t len, bool allowDot)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        if (!labelChar(name[i]) && !(allowDot && name[i] == '.'))
+            return false;
+    }
+    return true;
+}
+
+bool validateNameScalar(const char *name, size_t len)
+{
+    return charsValidScalar(name, len, true) && labelsValid(name, len);
+}
+
+#ifdef NAME_UTILS_X86
+
+// Loads the last n < 16 bytes, bytes behind the end are zero. The copy stays inside of the buffer, so the sanitizers
+// and the tools checking the reads see no access past the end of the name.
+static inline __m128i loadTail16(const char *p, size_t n)
+{
+    char tmp[16] = {0};
+    memcpy(tmp, p, n);
+    return _mm_loadu_si128((const __m128i *)tmp);
+}
+
+// Mask with the first n bytes set
+static inline __m128i prefixMask16(size_t n)
+{
+    static const char ones[32] = {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1};
+    return _mm_loadu_si128((const __m128i *)(ones + 16 - n));
+}
+
+// ---------------------------------------------------------- SSE2 ----------------------------------------------------------
+
+// Range is moved to the bottom of the signed range, so one signed comparison is enough for the range check
+static inline __m128i inRange16(__m128i x, char low, char count)
+{
+    __m128i shifted = _mm_add_epi8(x, _mm_set1_epi8((char)(0x80 - low)));
+    return _mm_cmplt_epi8(shifted, _mm_set1_epi8((char)(0x80 + count)));
+}
+
+static inline __m128i lower16(__m128i x)
+{
+    return _mm_or_si128(x, _mm_and_si128(inRange16(x, 'A', 26), _mm_set1_epi8(0x20)));
+}
+
+static inline __m128i valid16(__m128i x, __m128i dot)
+{
+    x = lower16(x);
+    __m128i valid = _mm_or_si128(inRange16(x, 'a', 26), inRange16(x, '0', 10));
+    valid = _mm_or_si128(valid, _mm_cmpeq_epi8(x, _mm_set1_epi8('-')));
+    valid = _mm_or_si128(valid, _mm_cmpeq_epi8(x, _mm_set1_epi8('_')));
+    return _mm_or_si128(valid, _mm_cmpeq_epi8(x, dot));
+}
+
+static void nameToLowerSse2(const char *in, char *out, size_t len)
+{
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16)
+        _mm_storeu_si128((__m128i *)(out + i), lower16(_mm_loadu_si128((const __m128i *)(in + i))));
+
+    if (i < len)
+    {
+        char tmp[16];
+        _mm_storeu_si128((__m128i *)tmp, lower16(loadTail16(in + i, len - i)));
+        memcpy(out + i, tmp, len - i);
+    }
+}
+
+static bool nameEqualsSse2(const char *a, size_t aLength, const char *b, size_t bLength)
+{
+    if (aLength != bLength)
+        return false;
+
+    size_t i = 0;
+    for (; i + 16 <= aLength; i += 16)
+    {
+        __m128i x = lower16(_mm_loadu_si128((const __m128i *)(a + i)));
+        __m128i y = lower16(_mm_loadu_si128((const __m128i *)(b + i)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xFFFF)
+            return false;
+    }
+
+    if (i == aLength)
+        return true;
+
+    unsigned rest = (1u << (aLength - i)) - 1;
+    __m128i x = lower16(loadTail16(a + i, aLength - i));
+    __m128i y = lower16(loadTail16(b + i, aLength - i));
+    return ((unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) & rest) == rest;
+}
+
+static uint64_t nameHashSse2(const char *name, size_t len)
+{
+    uint64_t hash = hashStart(len);
+    uint64_t words[2];
+
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        _mm_storeu_si128((__m128i *)words, lower16(_mm_loadu_si128((const __m128i *)(name + i))));
+        hash = hashMix(hashMix(hash, words[0]), words[1]);
+    }
+
+    if (i < len)
+    {
+        // Bytes behind the end are zeroed, same as the padding of the scalar variant
+        __m128i tail = _mm_and_si128(lower16(loadTail16(name + i, len - i)), prefixMask16(len - i));
+        _mm_storeu_si128((__m128i *)words, tail);
+        hash = hashMix(hash, words[0]);
+        if (len - i > 8)
+            hash = hashMix(hash, words[1]);
+    }
+    return hashFinish(hash);
+}
+
+static bool charsValidSse2(const char *name, size_t len, bool allowDot)
+{
+    const __m128i dot = _mm_set1_epi8(allowDot ? '.' : '-');
+
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        if (_mm_movemask_epi8(valid16(_mm_loadu_si128((const __m128i *)(name + i)), dot)) != 0xFFFF)
+            return false;
+    }
+
+    if (i == len)
+        return true;
+
+    unsigned rest = (1u << (len - i)) - 1;
+    return ((unsigned)_mm_movemask_epi8(valid16(loadTail16(name + i, len - i), dot)) & rest) == rest;
+}
+
+// ---------------------------------------------------------- AVX2 ----------------------------------------------------------
+
+#define AVX2_INLINE __attribute__((target("avx2"), always_inline)) static inline
+
+AVX2_INLINE __m256i inRange32(__m256i x, char low, char count)
+{
+    __m256i shifted = _mm256_add_epi8(x, _mm256_set1_epi8((char)(0x80 - low)));
+    return _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(0x80 + count)), shifted);
+}
+
+AVX2_INLINE __m256i lower32(__m256i x)
+{
+    return _mm256_or_si256(x, _mm256_and_si256(inRange32(x, 'A', 26), _mm256_set1_epi8(0x20)));
+}
+
+// Only whole 32 byte blocks are processed here, the rest (less than 32 bytes) is handed over to the SSE2 variant
+__attribute__((target("avx2"))) static void nameToLowerAvx2(const char *in, char *out, size_t len)
+{
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32)
+        _mm256_storeu_si256((__m256i *)(out + i), lower32(_mm256_loadu_si256((const __m256i *)(in + i))));
+    nameToLowerSse2(in + i, out + i, len - i);
+}
+
+__attribute__((target("avx2"))) static bool nameEqualsAvx2(const char *a, size_t aLength, const char *b, size_t bLength)
+{
+    if (aLength != bLength)
+        return false;
+
+    size_t i = 0;
+    for (; i + 32 <= aLength; i += 32)
+    {
+        __m256i x = lower32(_mm256_loadu_si256((const __m256i *)(a + i)));
+        __m256i y = lower32(_mm256_loadu_si256((const __m256i *)(b + i)));
+        if ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)) != 0xFFFFFFFFu)
+            return false;
+    }
+    return nameEqualsSse2(a + i, aLength - i, b + i, bLength - i);
+}
+
+__attribute__((target("avx2"))) static uint64_t nameHashAvx2(const char *name, size_t len)
+{
+    uint64_t hash = hashStart(len);
+    uint64_t words[4];
+
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32)
+    {
+        _mm256_storeu_si256((__m256i *)words, lower32(_mm256_loadu_si256((const __m256i *)(name + i))));
+        hash = hashMix(hashMix(hashMix(hashMix(hash, words[0]), words[1]), words[2]), words[3]);
+    }
+    for (; i + 16 <= len; i += 16)
+    {
+        _mm_storeu_si128((__m128i *)words, lower16(_mm_loadu_si128((const __m128i *)(name + i))));
+        hash = hashMix(hashMix(hash, words[0]), words[1]);
+    }
+    if (i < len)
+    {
+        __m128i tail = _mm_and_si128(lower16(loadTail16(name + i, len - i)), prefixMask16(len - i));
+        _mm_storeu_si128((__m128i *)words, tail);
+        hash = hashMix(hash, words[0]);
+        if (len - i > 8)
+            hash = hashMix(hash, words[1]);
+    }
+    return hashFinish(hash);
+}
+
+__attribute__((target("avx2"))) static bool charsValidAvx2(const char *name, size_t len, bool allowDot)
+{
+    const __m256i dot = _mm256_set1_epi8(allowDot ? '.' : '-');
+
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i x = lower32(_mm256_loadu_si256((const __m256i *)(name + i)));
+        __m256i valid = _mm256_or_si256(inRange32(x, 'a', 26), inRange32(x, '0', 10));
+        valid = _mm256_or_si256(valid, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('-')));
+        valid = _mm256_or_si256(valid, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('_')));
+        valid = _mm256_or_si256(valid, _mm256_cmpeq_epi8(x, dot));
+        if ((uint32_t)_mm256_movemask_epi8(valid) != 0xFFFFFFFFu)
+            return false;
+    }
+    return charsValidSse2(name + i, len - i, allowDot);
+}
+
+#endif // NAME_UTILS_X86
+
+// ---------------------------------------------------------- DISPATCH ----------------------------------------------------------
+
+struct NameOps {
+    void (*toLower)(const char *, char *, size_t);
+    bool (*equals)(const char *, size_t, const char *, size_t);
+    uint64_t (*hash)(const char *, size_t);
+    bool (*charsValid)(const char *, size_t, bool);
+    const char *implementation;
+};
+
+static NameOps selectNameOps()
+{
+#ifdef NAME_UTILS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return {nameToLowerAvx2, nameEqualsAvx2, nameHashAvx2, charsValidAvx2, "avx2"};
+    return {nameToLowerSse2, nameEqualsSse2, nameHashSse2, charsValidSse2, "sse2"};
+#else
+    return {nameToLowerScalar, nameEqualsScalar, nameHashScalar, charsValidScalar, "scalar"};
+#endif
+}
+
+// Local static, so the functions are usable from other static initializers too
+static const NameOps &nameOps()
+{
+    static const NameOps ops = selectNameOps();
+    return ops;
+}
+
+void nameToLower(const char *in, char *out, size_t len)
+{
+    nameOps().toLower(in, out, len);
+}
+
+bool nameEquals(const char *a, size_t aLength, const char *b, size_t bLength)
+{
+    return nameOps().equals(a, aLength, b, bLength);
+}
+
+uint64_t nameHash(const char *name, size_t len)
+{
+    return nameOps().hash(name, len);
+}
+
+bool validateName(const char *name, size_t len)
+{
+    return nameOps().charsValid(name, len, true) && labelsValid(name, len);
+}
+
+size_t validateWireName(const unsigned char *name, size_t len)
+{
+    size_t pos = 0;
+
+    while (pos < len)
+    {
+        size_t labelLength = name[pos];
+        if (labelLength == 0)
+            return pos + 1 <= 255 ? pos + 1 : 0;
+        // Compression pointers and labels over 63 bytes are not allowed here
+        if (labelLength > 63 || pos + 1 + labelLength > len ||
+            !nameOps().charsValid(reinterpret_cast<const char *>(name + pos + 1), labelLength, false))
+            return 0;
+        pos += labelLength + 1;
+    }
+    return 0;
+}
+
+const char *nameUtilsImplementation()
+{
+    return nameOps().implementation;
+}
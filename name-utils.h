@@ -0,0 +1,80 @@
+/**
+ * @author Rostislav Kral
+ * @brief Contains case insensitive operations over domain names (lowercasing, validation, comparison, hashing).
+ * The SSE2/AVX2 variant is selected at runtime, scalar variants are exported for the tests and benchmarks.
+ * All functions work on presentation names ("www.example.com") as well as on uncompressed wire names
+ * ("\3www\7example\3com"), the label length bytes are never changed by lowercasing.
+ * @file name-utils.h
+ * */
+
+#ifndef NAME_UTILS_H
+#define NAME_UTILS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * @brief Copies the name and converts ASCII letters to lowercase, in and out may be the same buffer.
+ * @param in Input name
+ * @param out Output buffer of len bytes
+ * @param len Length of the name
+ * @return
+ * */
+void nameToLower(const char *in, char *out, size_t len);
+
+/**
+ * @brief Case insensitive equality of two names
+ * @return bool
+ * */
+bool nameEquals(const char *a, size_t aLength, const char *b, size_t bLength);
+
+/**
+ * @brief Case insensitive 64 bit hash, the result is the same for every implementation and CPU
+ * @return uint64_t
+ * */
+uint64_t nameHash(const char *name, size_t len);
+
+/**
+ * @brief Checks the presentation name, only letters, digits, '-' and '_' in labels of 1-63 bytes, max 253 bytes
+ * and the trailing dot is optional
+ * @return bool
+ * */
+bool validateName(const char *name, size_t len);
+
+/**
+ * @brief Checks uncompressed wire name, labels must have the same characters as in validateName()
+ * @param name Wire name including the terminating zero byte
+ * @param len Length of the buffer, the name may be shorter
+ * @return size_t length of the name including the zero byte, 0 if it is invalid
+ * */
+size_t validateWireName(const unsigned char *name, size_t len);
+
+inline bool nameEquals(const std::string &a, const std::string &b) { return nameEquals(a.data(), a.size(), b.data(), b.size()); }
+
+inline uint64_t nameHash(const std::string &name) { return nameHash(name.data(), name.size()); }
+
+inline bool validateName(const std::string &name) { return validateName(name.data(), name.size()); }
+
+inline std::string nameToLower(std::string name)
+{
+    nameToLower(&name[0], &name[0], name.size());
+    return name;
+}
+
+/**
+ * @brief Name of the implementation selected for this CPU, "avx2", "sse2" or "scalar"
+ * @return const char*
+ * */
+const char *nameUtilsImplementation();
+
+// Byte at a time reference implementations
+void nameToLowerScalar(const char *in, char *out, size_t len);
+
+bool nameEqualsScalar(const char *a, size_t aLength, const char *b, size_t bLength);
+
+uint64_t nameHashScalar(const char *name, size_t len);
+
+bool validateNameScalar(const char *name, size_t len);
+
+#endif // NAME_UTILS_H
@@ -0,0 +1,173 @@
+/**
+ * @author Rostislav Kral
+ * @brief Implementation of the NameWatcher class.
+ * @file name-watcher.cpp
+ * */
+
+#include "name-watcher.h"
+#include "name-utils.h"
+
+NameWatcher::NameWatcher(Args args, WATCH_OPTIONS options) : options(options), stopped(false), resolver(args)
+{
+}
+
+bool NameWatcher::open(std::string &error)
+{
+    return resolver.open(error);
+}
+
+void NameWatcher::add(const std::string &name, uint16_t qtype)
+{
+    WATCHED watched;
+    watched.name = name;
+    watched.qtype = qtype;
+    names.push_back(watched);
+    due.push(DUE(Clock::now(), names.size() - 1));
+    stats.names++;
+}
+
+void NameWatcher::schedule(size_t index, double seconds)
+{
+    seconds = std::min(std::max(seconds, options.minInterval), options.maxInterval);
+    due.push(DUE(Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds)), index));
+}
+
+void NameWatcher::report(WATCH_CHANGE &change, const WATCHED &watched, ChangeCallback &callback)
+{
+    change.name = watched.name;
+    change.qtype = watched.qtype;
+    stats.changes++;
+    callback(change);
+}
+
+// Same record regardless of the TTL, owner names are case insensitive
+static const DNS_REC *findRecord(const std::vector<DNS_REC> &records, const DNS_REC &record)
+{
+    for (const DNS_REC &candidate : records)
+    {
+        if (candidate.type == record.type && candidate.value == record.value && nameEquals(candidate.name, record.name))
+            return &candidate;
+    }
+    return nullptr;
+}
+
+void NameWatcher::handle(size_t index, const BULK_RESULT &result, ChangeCallback &callback)
+{
+    inFlight--;
+    if (result.rcode == RCODE_CANCELLED)
+        return;
+    stats.queries++;
+
+    WATCHED &watched = names[index];
+    WATCH_CHANGE change;
+    change.rcode = result.rcode;
+
+    // The first NOERROR is told by its added records
+    if (watched.rcode != result.rcode && !(watched.rcode == WATCH_FIRST_ANSWER && result.rcode == RCODE_NOERROR))
+    {
+        change.kind = WATCH_RCODE;
+        change.oldRcode = watched.rcode;
+        report(change, watched, callback);
+    }
+    watched.rcode = result.rcode;
+
+    // Failure says nothing about the records, the previous ones stay for the next comparison
+    if (result.rcode != RCODE_NOERROR && result.rcode != RCODE_NXDOMAIN)
+    {
+        stats.errors++;
+        schedule(index, options.errorInterval);
+        return;
+    }
+
+    change.kind = WATCH_REMOVED;
+    for (const DNS_REC &old : watched.answers)
+    {
+        if (findRecord(result.answers, old) == nullptr)
+        {
+            change.record = old;
+            report(change, watched, callback);
+        }
+    }
+    for (const DNS_REC &record : result.answers)
+    {
+        const DNS_REC *old = findRecord(watched.answers, record);
+        change.record = record;
+        if (old == nullptr)
+        {
+            change.kind = WATCH_ADDED;
+            report(change, watched, callback);
+        }
+        // Cache of the recursive server counts the TTL down, only the TTLs of the zone itself can be compared
+        else if (old->ttl != record.ttl && watched.authoritative && result.authoritative)
+        {
+            change.kind = WATCH_TTL;
+            change.oldTtl = old->ttl;
+            report(change, watched, callback);
+        }
+    }
+
+    watched.answers = result.answers;
+    watched.authoritative = result.authoritative;
+    schedule(index, result.answers.empty() ? options.negativeInterval : result.ttl);
+}
+
+WATCH_STATS NameWatcher::run(ChangeCallback callback)
+{
+    Clock::time_point end = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(options.duration));
+
+    stopped = false;
+    while (!stopped.load() && (options.duration <= 0 || Clock::now() < end))
+    {
+        Clock::time_point now = Clock::now();
+        while (!due.empty() && due.top().first <= now && inFlight < options.window)
+        {
+            size_t index = due.top().second;
+            due.pop();
+            inFlight++;
+            resolver.resolve(names[index].name, names[index].qtype,
+                             [this, index, &callback](const BULK_RESULT &result) { handle(index, result, callback); });
+        }
+
+        // Sleeping until the next name is due, the answers and the retransmissions end poll() earlier
+        int wait = -1;
+        if (!due.empty() && inFlight < options.window)
+            wait = std::max(0, (int)std::chrono::duration_cast<std::chrono::milliseconds>(due.top().first - now).count() + 1);
+        if (options.duration > 0)
+        {
+            int left = std::max(0, (int)std::chrono::duration_cast<std::chrono::milliseconds>(end - now).count() + 1);
+            wait = wait < 0 ? left : std::min(wait, left);
+        }
+        resolver.poll(wait);
+    }
+
+    // Answers in flight are still compared, the callback isn't called after return
+    while (inFlight > 0)
+        resolver.poll(-1);
+    return stats;
+}
+
+void NameWatcher::stop()
+{
+    stopped = true;
+    resolver.wake();
+}
+
+std::string formatChange(const WATCH_CHANGE &change)
+{
+    std::ostringstream line;
+
+    if (change.kind == WATCH_RCODE)
+    {
+        line << "! " << change.name << "., " << typeToString(change.qtype) << ", "
+             << (change.oldRcode == WATCH_FIRST_ANSWER ? "NONE" : rcodeToString(change.oldRcode)) << " -> "
+             << rcodeToString(change.rcode);
+        return line.str();
+    }
+
+    line << (change.kind == WATCH_ADDED ? "+ " : change.kind == WATCH_REMOVED ? "- " : "~ ") << change.record.name
+         << "., " << change.record.type << ", IN, ";
+    if (change.kind == WATCH_TTL)
+        line << change.oldTtl << " -> ";
+    line << change.record.ttl << ", " << change.record.value;
+    return line.str();
+}
@@ -0,0 +1,130 @@
+/**
+ * @author Rostislav Kral
+ * @brief Contains NameWatcher class, names are queried again when the TTL of their answer expires and only the
+ * differences against the previous answer are reported.
+ * @file name-watcher.h
+ * */
+
+#ifndef NAME_WATCHER_H
+#define NAME_WATCHER_H
+
+#include <queue>
+#include "async-resolver.h"
+
+#define WATCH_ADDED 1 // Record is in the answer for the first time
+#define WATCH_REMOVED 2 // Record of the previous answer is missing
+#define WATCH_TTL 3 // Same record with other TTL, both answers authoritative
+#define WATCH_RCODE 4 // Other RCODE, failures keep the previous records
+
+#define WATCH_FIRST_ANSWER -1 // Previous RCODE of the name without any answer yet
+
+/**
+ * @brief Options of the watch, the intervals are in seconds
+ * */
+struct WATCH_OPTIONS {
+    double minInterval = 1; // Floor of the re-query period, answers with TTL 0 are not queried in a loop
+    double maxInterval = 86400; // Ceiling of the re-query period
+    double negativeInterval = 300; // Re-query of NXDOMAIN and empty answers, they have no TTL in the answer section
+    double errorInterval = 30; // Re-query after timeout, SERVFAIL and other failures
+    double duration = 0; // Seconds until run() returns, 0 = until stop()
+    size_t window = 64; // Maximal number of queries in flight
+};
+
+/**
+ * @brief One difference of the new answer of the name
+ * */
+struct WATCH_CHANGE {
+    int kind = 0; // WATCH_ADDED, WATCH_REMOVED, WATCH_TTL or WATCH_RCODE
+    std::string name; // Watched name
+    uint16_t qtype = 0;
+    DNS_REC record; // Added or removed record, the new TTL for WATCH_TTL
+    uint32_t oldTtl = 0; // WATCH_TTL only
+    int oldRcode = WATCH_FIRST_ANSWER; // WATCH_RCODE only
+    int rcode = RCODE_NOERROR; // RCODE of the new answer
+};
+
+struct WATCH_STATS {
+    uint64_t names = 0;
+    uint64_t queries = 0; // Answered and failed, not the retransmissions
+    uint64_t changes = 0;
+    uint64_t errors = 0;
+};
+
+class NameWatcher {
+public:
+    typedef std::function<void(const WATCH_CHANGE &change)> ChangeCallback;
+
+    /**
+     * @brief Constructor of the NameWatcher, args select the server, the timeout and the number of tries
+     * @param args
+     * @param options
+     * */
+    NameWatcher(Args args, WATCH_OPTIONS options);
+
+    /**
+     * @brief Connects the resolver
+     * @param error Output, reason of the failure
+     * @return false if the server can't be used
+     * */
+    bool open(std::string &error);
+
+    /**
+     * @brief Adds the name to the watch, its first query is due at once
+     * @param name
+     * @param qtype
+     * @return
+     * */
+    void add(const std::string &name, uint16_t qtype);
+
+    /**
+     * @brief Queries every name when it is due until options.duration passes or stop() is called, may be called
+     * again and the previous answers are kept
+     * @param callback Receiver of the changes, called on the thread of run()
+     * @return WATCH_STATS totals since the construction
+     * */
+    WATCH_STATS run(ChangeCallback callback);
+
+    /**
+     * @brief Makes run() return after the queries in flight, may be called from any thread or the callback
+     * @return
+     * */
+    void stop();
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct WATCHED {
+        std::string name;
+        uint16_t qtype = 0;
+        int rcode = WATCH_FIRST_ANSWER;
+        bool authoritative = false;
+        std::vector<DNS_REC> answers;
+    };
+
+    // Due time and index of the name, the earliest is on the top of the heap
+    typedef std::pair<Clock::time_point, size_t> DUE;
+
+    void handle(size_t index, const BULK_RESULT &result, ChangeCallback &callback);
+
+    void report(WATCH_CHANGE &change, const WATCHED &watched, ChangeCallback &callback);
+
+    void schedule(size_t index, double seconds);
+
+    WATCH_OPTIONS options;
+    WATCH_STATS stats;
+    std::vector<WATCHED> names;
+    std::priority_queue<DUE, std::vector<DUE>, std::greater<DUE>> due;
+    size_t inFlight = 0;
+    std::atomic<bool> stopped;
+    AsyncResolver resolver; // Last, so its cancelled queries don't find the members destroyed
+};
+
+/**
+ * @brief Formats the change as one line: "+ name., TYPE, IN, ttl, value", "- ...", "~ name., TYPE, IN, old -> new,
+ * value" or "! name., TYPE, OLD -> NEW"
+ * @param change
+ * @return std::string
+ * */
+std::string formatChange(const WATCH_CHANGE &change);
+
+#endif // NAME_WATCHER_H
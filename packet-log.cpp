@@ -0,0 +1,251 @@
+/**
+ * @author Rostislav Kral
+ * @brief Implementation of the binary packet log, its lock-free ring and the decoder.
+ * @file packet-log.cpp
+ * */
+
+#include "packet-log.h"
+#include <cerrno>
+#include <chrono>
+#include <netinet/in.h>
+
+SpscRing::SpscRing(size_t capacity) : head(0), tail(0)
+{
+    size_t size = 64;
+    while (size < capacity)
+        size <<= 1;
+    buffer.resize(size);
+    mask = size - 1;
+}
+
+void SpscRing::copyIn(uint64_t position, const void *data, size_t length)
+{
+    size_t offset = position & mask;
+    size_t first = std::min(length, buffer.size() - offset);
+    memcpy(&buffer[offset], data, first);
+    memcpy(&buffer[0], static_cast<const unsigned char *>(data) + first, length - first);
+}
+
+void SpscRing::copyOut(uint64_t position, void *data, size_t length) const
+{
+    size_t offset = position & mask;
+    size_t first = std::min(length, buffer.size() - offset);
+    memcpy(data, &buffer[offset], first);
+    memcpy(static_cast<unsigned char *>(data) + first, &buffer[0], length - first);
+}
+
+bool SpscRing::push(const void *first, size_t firstLength, const void *second, size_t secondLength)
+{
+    uint32_t length = firstLength + secondLength;
+    uint64_t position = head.load(std::memory_order_relaxed);
+
+    // Acquire pairs with the release of pop(), the consumer is done with the bytes we overwrite
+    if (buffer.size() - (position - tail.load(std::memory_order_acquire)) < sizeof(length) + length)
+        return false;
+
+    copyIn(position, &length, sizeof(length));
+    copyIn(position + sizeof(length), first, firstLength);
+    copyIn(position + sizeof(length) + firstLength, second, secondLength);
+    head.store(position + sizeof(length) + length, std::memory_order_release);
+    return true;
+}
+
+bool SpscRing::pop(std::vector<unsigned char> &frame)
+{
+    uint64_t position = tail.load(std::memory_order_relaxed);
+    if (position == head.load(std::memory_order_acquire))
+        return false;
+
+    uint32_t length;
+    copyOut(position, &length, sizeof(length));
+    frame.resize(length);
+    copyOut(position + sizeof(length), frame.data(), length);
+    tail.store(position + sizeof(length) + length, std::memory_order_release);
+    return true;
+}
+
+PacketLogger::PacketLogger(const std::string &path)
+    : ring(PACKET_LOG_RING), running(true), loggedCount(0), droppedCount(0)
+{
+    if ((file = fopen(path.c_str(), "ab")) == nullptr)
+        throw TransportError(std::string("Cannot create the log file: ") + strerror(errno));
+    fseek(file, 0, SEEK_END);
+    if (ftell(file) == 0)
+        fwrite(PACKET_LOG_MAGIC, 1, 8, file);
+
+    thread = std::thread(&PacketLogger::writer, this);
+}
+
+PacketLogger::~PacketLogger()
+{
+    close();
+}
+
+void PacketLogger::log(const PACKET_LOG_ENTRY &entry, const unsigned char *msg, size_t len)
+{
+    // Only memcpy here, the conversion to the file format is left to the writer thread
+    if (ring.push(&entry, sizeof(entry), msg, len))
+        loggedCount.fetch_add(1, std::memory_order_relaxed);
+    else
+        droppedCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Appends the number in network byte order
+static void appendNumber(std::vector<unsigned char> &out, uint64_t value, int bytes)
+{
+    for (int i = bytes - 1; i >= 0; i--)
+        out.push_back((value >> (8 * i)) & 0xFF);
+}
+
+void PacketLogger::writer()
+{
+    std::vector<unsigned char> frame, out;
+
+    while (true)
+    {
+        bool stopping = !running.load(std::memory_order_acquire);
+
+        out.clear();
+        while (out.size() < 65536 && ring.pop(frame))
+        {
+            PACKET_LOG_ENTRY entry;
+            memcpy(&entry, frame.data(), sizeof(entry));
+            size_t messageLength = frame.size() - sizeof(entry);
+
+            appendNumber(out, PACKET_LOG_FRAME_HEADER + messageLength, 4);
+            appendNumber(out, entry.time, 8);
+            out.push_back(entry.kind);
+            out.push_back(entry.protocol);
+            out.push_back(entry.family);
+            out.push_back(0);
+            appendNumber(out, entry.port, 2);
+            out.insert(out.end(), entry.address, entry.address + 16);
+            out.insert(out.end(), frame.begin() + sizeof(entry), frame.end());
+        }
+
+        if (!out.empty())
+            fwrite(out.data(), 1, out.size(), file);
+        else if (stopping)
+            break; // Ring was drained after the stop
+        else
+            std::this_thread::sleep_for(std::chrono::microseconds(PACKET_LOG_POLL_US));
+    }
+}
+
+void PacketLogger::close()
+{
+    if (file == nullptr)
+        return;
+
+    running.store(false, std::memory_order_release);
+    thread.join();
+
+    if (fclose(file) != 0)
+        perror("Cannot write the log file");
+    file = nullptr;
+    if (droppedCount > 0)
+        std::cerr << "Log: " << droppedCount << " messages dropped, the writer was behind" << std::endl;
+}
+
+LoggingTransport::LoggingTransport(std::unique_ptr<Transport> inner, std::shared_ptr<PacketLogger> logger, const Args &args,
+                                   int type)
+    : inner(std::move(inner)), logger(std::move(logger))
+{
+    upstream.protocol = type == SOCK_STREAM ? IPPROTO_TCP : IPPROTO_UDP;
+    upstream.port = args.port;
+
+    struct addrinfo hints, *result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = type;
+    if (args.server != nullptr && getaddrinfo(args.server, nullptr, &hints, &result) == 0)
+    {
+        upstream.family = result->ai_family;
+        if (result->ai_family == AF_INET)
+            memcpy(upstream.address, &reinterpret_cast<struct sockaddr_in *>(result->ai_addr)->sin_addr, 4);
+        else if (result->ai_family == AF_INET6)
+            memcpy(upstream.address, &reinterpret_cast<struct sockaddr_in6 *>(result->ai_addr)->sin6_addr, 16);
+        freeaddrinfo(result);
+    }
+}
+
+void LoggingTransport::log(uint8_t kind, const unsigned char *msg, size_t len)
+{
+    upstream.kind = kind;
+    upstream.time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::system_clock::now().time_since_epoch()).count();
+    logger->log(upstream, msg, len);
+}
+
+void LoggingTransport::send(const unsigned char *msg, size_t len)
+{
+    log(LOG_QUERY, msg, len);
+    inner->send(msg, len);
+}
+
+bool LoggingTransport::wait(int timeout)
+{
+    return inner->wait(timeout);
+}
+
+size_t LoggingTransport::receive(unsigned char *buf, size_t size)
+{
+    size_t length = inner->receive(buf, size);
+    if (length > 0)
+        log(LOG_RESPONSE, buf, length);
+    return length;
+}
+
+static uint64_t readNumber(const unsigned char *data, int bytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++)
+        value = (value << 8) | data[i];
+    return value;
+}
+
+bool readPacketLog(const std::string &path,
+                   const std::function<void(const PACKET_LOG_ENTRY &entry, const unsigned char *msg, size_t len)> &callback,
+                   std::string &error)
+{
+    FILE *file = fopen(path.c_str(), "rb");
+    char magic[8];
+    if (file == nullptr || fread(magic, 1, 8, file) != 8 || memcmp(magic, PACKET_LOG_MAGIC, 8) != 0)
+    {
+        error = file == nullptr ? "Cannot open " + path : path + " is not a packet log";
+        if (file != nullptr)
+            fclose(file);
+        return false;
+    }
+
+    std::vector<unsigned char> frame;
+    unsigned char prefix[4];
+    size_t read;
+    bool valid = true;
+    while ((read = fread(prefix, 1, 4, file)) == 4)
+    {
+        uint32_t length = readNumber(prefix, 4);
+        frame.resize(length);
+        if (length < PACKET_LOG_FRAME_HEADER || fread(frame.data(), 1, length, file) != length)
+        {
+            valid = false;
+            break;
+        }
+
+        PACKET_LOG_ENTRY entry;
+        entry.time = readNumber(&frame[0], 8);
+        entry.kind = frame[8];
+        entry.protocol = frame[9];
+        entry.family = frame[10];
+        entry.port = readNumber(&frame[12], 2);
+        memcpy(entry.address, &frame[14], 16);
+        callback(entry, frame.data() + PACKET_LOG_FRAME_HEADER, length - PACKET_LOG_FRAME_HEADER);
+    }
+    fclose(file);
+
+    if (!valid || read != 0)
+    {
+        error = path + ": truncated frame";
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,153 @@
+/**
+ * @author Rostislav Kral
+ * @brief Contains binary log of the queries and the responses, the resolver only copies the packets to lock-free ring
+ * and the background thread writes them to the file.
+ *
+ * File layout (network byte order, framing like dnstap Frame Streams):
+ *   "DNSLOG01"
+ *   frame: length of the rest (u32), time in ns since the epoch (u64), kind (u8), protocol (u8), family (u8),
+ *          reserved (u8), port (u16), address (16 B, IPv4 in the first 4 bytes), DNS message
+ *   frame ...
+ * @file packet-log.h
+ * */
+
+#ifndef PACKET_LOG_H
+#define PACKET_LOG_H
+
+#include <atomic>
+#include <cstdio>
+#include <functional>
+#include <thread>
+#include "transport.h"
+
+#define PACKET_LOG_MAGIC "DNSLOG01"
+#define PACKET_LOG_RING (4 << 20) // Bytes of the ring between the resolver and the writer thread, power of two
+#define PACKET_LOG_POLL_US 1000 // Sleep of the writer thread when the ring is empty
+#define PACKET_LOG_FRAME_HEADER 30 // Bytes of the frame behind the length
+
+#define LOG_QUERY 1
+#define LOG_RESPONSE 2
+
+/**
+ * @brief Metadata of one logged message
+ * */
+struct PACKET_LOG_ENTRY {
+    uint64_t time = 0; // ns since the epoch
+    uint8_t kind = 0; // LOG_QUERY or LOG_RESPONSE
+    uint8_t protocol = 0; // IPPROTO_UDP or IPPROTO_TCP
+    uint8_t family = 0; // AF_INET or AF_INET6 of the upstream
+    uint16_t port = 0;
+    unsigned char address[16] = {0};
+};
+
+/**
+ * @brief Single producer, single consumer ring of variable length frames, neither side ever blocks or locks
+ * */
+class SpscRing {
+public:
+    /**
+     * @brief Constructor of the SpscRing
+     * @param capacity Bytes, rounded up to power of two
+     * */
+    explicit SpscRing(size_t capacity);
+
+    /**
+     * @brief Copies the frame made of two parts to the ring, producer thread only
+     * @return false when the ring is full, the frame is dropped then
+     * */
+    bool push(const void *first, size_t firstLength, const void *second, size_t secondLength);
+
+    /**
+     * @brief Takes the oldest frame, consumer thread only
+     * @param frame Output, replaced by the frame
+     * @return false when the ring is empty
+     * */
+    bool pop(std::vector<unsigned char> &frame);
+
+private:
+    void copyIn(uint64_t position, const void *data, size_t length);
+
+    void copyOut(uint64_t position, void *data, size_t length) const;
+
+    std::vector<unsigned char> buffer;
+    uint64_t mask;
+    alignas(64) std::atomic<uint64_t> head; // Written by the producer
+    alignas(64) std::atomic<uint64_t> tail; // Written by the consumer
+};
+
+class PacketLogger {
+public:
+    /**
+     * @brief Opens the log file (appended, the magic is written to the new file) and starts the writer thread,
+     * TransportError is thrown when the file can't be opened
+     * @param path
+     * */
+    explicit PacketLogger(const std::string &path);
+
+    ~PacketLogger();
+
+    /**
+     * @brief Hot path, copies the message to the ring, the message is dropped when the writer is behind
+     * @param entry
+     * @param msg
+     * @param len
+     * @return
+     * */
+    void log(const PACKET_LOG_ENTRY &entry, const unsigned char *msg, size_t len);
+
+    /**
+     * @brief Writes everything from the ring and closes the file, called by destructor too
+     * @return
+     * */
+    void close();
+
+    uint64_t logged() const { return loggedCount; }
+
+    uint64_t dropped() const { return droppedCount; }
+
+private:
+    void writer();
+
+    FILE *file = nullptr;
+    SpscRing ring;
+    std::thread thread;
+    std::atomic<bool> running;
+    std::atomic<uint64_t> loggedCount;
+    std::atomic<uint64_t> droppedCount;
+};
+
+/**
+ * @brief Logs every sent query and received response of the inner transport, the upstream is taken from args
+ * */
+class LoggingTransport : public Transport {
+public:
+    LoggingTransport(std::unique_ptr<Transport> inner, std::shared_ptr<PacketLogger> logger, const Args &args, int type);
+
+    void send(const unsigned char *msg, size_t len) override;
+
+    bool wait(int timeout) override;
+
+    size_t receive(unsigned char *buf, size_t size) override;
+
+    int descriptor() const override { return inner->descriptor(); }
+
+private:
+    void log(uint8_t kind, const unsigned char *msg, size_t len);
+
+    std::unique_ptr<Transport> inner;
+    std::shared_ptr<PacketLogger> logger;
+    PACKET_LOG_ENTRY upstream;
+};
+
+/**
+ * @brief Decodes the log file
+ * @param path
+ * @param callback Called for every frame in the order of the file
+ * @param error Output, reason of the failure
+ * @return false if the file can't be read or a frame is broken (frames before it are decoded)
+ * */
+bool readPacketLog(const std::string &path,
+                   const std::function<void(const PACKET_LOG_ENTRY &entry, const unsigned char *msg, size_t len)> &callback,
+                   std::string &error);
+
+#endif // PACKET_LOG_H
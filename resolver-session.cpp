@@ -0,0 +1,181 @@
+/**
+ * @author Rostislav Kral
+ * @brief Implementation of the ResolverSession class.
+ * @file resolver-session.cpp
+ * */
+
+#include "resolver-session.h"
+#include "transport.h"
+#include <cerrno>
+#include <chrono>
+#include <poll.h>
+
+ResolverSession::ResolverSession(Args args) : args(args)
+{
+    struct addrinfo hints, *result;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (args.server == nullptr || getaddrinfo(args.server, std::to_string(args.port).c_str(), &hints, &result) != 0)
+        throw TransportError("Cannot fetch given dns server!");
+
+    for (struct addrinfo *tmp = result; tmp != nullptr; tmp = tmp->ai_next)
+    {
+        if (tmp->ai_family != AF_INET && tmp->ai_family != AF_INET6)
+            continue;
+        ADDRESS address;
+        memcpy(&address.address, tmp->ai_addr, tmp->ai_addrlen);
+        address.length = tmp->ai_addrlen;
+        addresses.push_back(address);
+    }
+    freeaddrinfo(result);
+
+    if (addresses.empty())
+        throw TransportError("DNS server not found");
+    if (!connect() && !reconnect())
+        throw TransportError(std::string("DNS server unreachable: ") + strerror(errno));
+    reconnectCount = 0;
+    nextId = (uint16_t)getpid();
+}
+
+ResolverSession::~ResolverSession()
+{
+    if (sock != -1)
+        close(sock);
+}
+
+bool ResolverSession::connect()
+{
+    const ADDRESS &address = addresses[current];
+
+    if ((sock = socket(address.address.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0)) == -1)
+        return false;
+    if (::connect(sock, reinterpret_cast<const struct sockaddr *>(&address.address), address.length) == -1)
+    {
+        int error = errno;
+        close(sock);
+        sock = -1;
+        errno = error;
+        return false;
+    }
+    return true;
+}
+
+bool ResolverSession::reconnect()
+{
+    if (sock != -1)
+        close(sock);
+    sock = -1;
+
+    // Next address of the server first, the same one last
+    for (size_t i = 0; i < addresses.size(); i++)
+    {
+        current = (current + 1) % addresses.size();
+        if (connect())
+        {
+            reconnectCount++;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ResolverSession::exchange(const unsigned char *query, size_t length, const Deadline &deadline, BULK_RESULT &result,
+                               bool &broken)
+{
+    // ICMP unreachable of the previous datagram (ECONNREFUSED) only means this one may be lost too
+    if (send(sock, query, length, 0) < 0 && errno != EAGAIN && errno != ECONNREFUSED)
+    {
+        broken = true;
+        return false;
+    }
+
+    auto end = std::min(std::chrono::steady_clock::now() + std::chrono::milliseconds(args.timeout), deadline.at());
+    struct pollfd descriptor = {sock, POLLIN, 0};
+    int left;
+    while (!deadline.cancelled() &&
+           (left = std::chrono::duration_cast<std::chrono::milliseconds>(end - std::chrono::steady_clock::now()).count()) >= 0)
+    {
+        // Slices of the cancellable wait end without any event
+        int ready = poll(&descriptor, 1, deadline.limit(left, std::chrono::steady_clock::now()));
+        if (ready == 0 || (ready < 0 && errno == EINTR))
+            continue;
+        if (ready < 0)
+        {
+            broken = true;
+            return false;
+        }
+
+        ssize_t received;
+        while ((received = recv(sock, response, sizeof(response), MSG_DONTWAIT)) != 0)
+        {
+            if (received < 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    break;
+                if (errno == ECONNREFUSED || errno == EINTR)
+                    continue;
+                broken = true;
+                return false;
+            }
+            // Late answers of the previous queries have other ID
+            bool fast;
+            if (received >= (ssize_t)sizeof(DNS_HEADER) && memcmp(response, query, 2) == 0 &&
+                parseResult(response, received, result, &fast))
+            {
+                fastCount += fast;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+BULK_RESULT ResolverSession::resolve(const std::string &name, uint16_t qtype)
+{
+    return resolve(name, qtype, Deadline::after(args.budget));
+}
+
+BULK_RESULT ResolverSession::resolve(const std::string &name, uint16_t qtype, const Deadline &deadline)
+{
+    BULK_RESULT result;
+    result.name = name.size() > 1 && name.back() == '.' ? name.substr(0, name.size() - 1) : name;
+    result.qtype = qtype;
+    queryCount++;
+
+    size_t length = result.name.empty() ? 0 : buildQuery(request, nextId++, result.name, qtype, args.recursion);
+    if (length == 0)
+    {
+        result.rcode = RCODE_INVALID;
+        return result;
+    }
+
+    auto first = std::chrono::steady_clock::now();
+    for (int attempt = 0; attempt < args.tries; attempt++)
+    {
+        bool broken = false;
+        if (deadline.expired(std::chrono::steady_clock::now()))
+            break;
+        if (sock == -1 && !reconnect())
+            continue;
+        if (exchange(request, length, deadline, result, broken))
+        {
+            result.rtt = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - first).count();
+            return result;
+        }
+        if (broken)
+            reconnect(); // The query goes on over the new socket
+    }
+
+    // The server may be fine, only the budget of the caller is gone
+    if (deadline.expired(std::chrono::steady_clock::now()))
+    {
+        result.rcode = deadlineRcode(deadline);
+        return result;
+    }
+
+    // Silent server, the next query starts from new socket (and the next address) instead of the stale one
+    reconnect();
+    return result;
+}
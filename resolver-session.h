@@ -0,0 +1,83 @@
+/**
+ * @author Rostislav Kral
+ * @brief Contains ResolverSession class, synchronous queries over one socket kept open for the whole session.
+ * @file resolver-session.h
+ * */
+
+#ifndef RESOLVER_SESSION_H
+#define RESOLVER_SESSION_H
+
+#include <sys/socket.h>
+#include "bulk-resolver.h"
+
+/**
+ * @brief Blocking resolver for many queries in a row. The server name is resolved once and the socket, the query and
+ * the receive buffers are reused by every resolve(), DnsResolver pays getaddrinfo() and socket() for each query.
+ *
+ * Broken socket (send, poll or receive error other than lost datagram) makes the session connect new socket to the
+ * next address of the server, the query continues on it. Query left without any answer by all the tries makes the
+ * next query start on new socket to the next address.
+ * */
+class ResolverSession {
+public:
+    /**
+     * @brief Resolves args.server and connects the socket, TransportError is thrown when the server can't be used
+     * @param args Server, port, recursion, timeout and tries
+     * */
+    explicit ResolverSession(Args args);
+
+    ~ResolverSession();
+
+    ResolverSession(const ResolverSession &) = delete;
+
+    ResolverSession &operator=(const ResolverSession &) = delete;
+
+    /**
+     * @brief Sends the query up to args.tries times and waits args.timeout for each answer, within args.budget,
+     * never throws
+     * @param name
+     * @param qtype
+     * @return BULK_RESULT with the RCODE of the server, RCODE_INVALID or RCODE_TIMEOUT
+     * */
+    BULK_RESULT resolve(const std::string &name, uint16_t qtype);
+
+    /**
+     * @brief resolve() ending at the deadline or its cancellation, whichever comes first
+     * @param name
+     * @param qtype
+     * @param deadline
+     * @return BULK_RESULT with RCODE_CANCELLED too
+     * */
+    BULK_RESULT resolve(const std::string &name, uint16_t qtype, const Deadline &deadline);
+
+    uint64_t queries() const { return queryCount; }
+
+    uint64_t reconnects() const { return reconnectCount; }
+
+    uint64_t fastAnswers() const { return fastCount; } // Answers decoded by the A/AAAA fast path of parseResult()
+
+private:
+    struct ADDRESS {
+        struct sockaddr_storage address;
+        socklen_t length;
+    };
+
+    bool connect();
+
+    bool reconnect();
+
+    bool exchange(const unsigned char *query, size_t length, const Deadline &deadline, BULK_RESULT &result, bool &broken);
+
+    Args args;
+    std::vector<ADDRESS> addresses; // All addresses of args.server, used in turn by reconnect()
+    size_t current = 0;
+    int sock = -1;
+    uint16_t nextId;
+    unsigned char request[MAX_DNS_SIZE];
+    unsigned char response[MAX_DNS_SIZE];
+    uint64_t queryCount = 0;
+    uint64_t reconnectCount = 0;
+    uint64_t fastCount = 0;
+};
+
+#endif // RESOLVER_SESSION_H
@@ -0,0 +1,331 @@
+/**
+ * @author Rostislav Kral
+ * @brief Implementation of the columnar result file.
+ * @file result-file.cpp
+ * */
+
+#include "result-file.h"
+#include "name-utils.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+bool ResultFileWriter::open(const std::string &path, std::string &error)
+{
+    if ((file = fopen(path.c_str(), "wb")) == nullptr)
+    {
+        error = "Cannot create the result file " + path + ": " + strerror(errno);
+        return false;
+    }
+
+    writeError = 0;
+    position = 0;
+    footers.clear();
+    write(RESULT_FILE_MAGIC, 8);
+    nameOffsets.assign(1, 0);
+    addressIndex.assign(1, 0);
+    return true;
+}
+
+ResultFileWriter::~ResultFileWriter()
+{
+    std::string error;
+    close(error);
+}
+
+void ResultFileWriter::write(const void *data, size_t size)
+{
+    // The first error is kept, the later writes would only report its consequences
+    if (size > 0 && fwrite(data, 1, size, file) != size && writeError == 0)
+        writeError = errno ? errno : EIO;
+    position += size;
+}
+
+void ResultFileWriter::append(const BULK_RESULT &result)
+{
+    heap.insert(heap.end(), result.name.begin(), result.name.end());
+    nameOffsets.push_back(heap.size());
+    qtypes.push_back(result.qtype);
+    rcodes.push_back(result.rcode);
+    ttls.push_back(result.ttl);
+    rtts.push_back(result.rtt);
+    addresses.insert(addresses.end(), result.addresses.begin(), result.addresses.end());
+    addressIndex.push_back(addresses.size());
+
+    if (qtypes.size() == RESULT_BATCH_ROWS)
+        flushBatch();
+}
+
+template <typename T>
+void ResultFileWriter::writeColumn(const std::vector<T> &column, uint64_t &offset)
+{
+    static const char padding[8] = {0};
+
+    offset = position;
+    write(column.data(), sizeof(T) * column.size());
+    write(padding, (8 - position % 8) % 8);
+}
+
+void ResultFileWriter::flushBatch()
+{
+    RESULT_BATCH_FOOTER footer;
+
+    footer.magic = RESULT_BATCH_MAGIC;
+    footer.rows = qtypes.size();
+    footer.addressCount = addresses.size();
+    footer.heapSize = heap.size();
+
+    writeColumn(nameOffsets, footer.nameOffsets);
+    writeColumn(qtypes, footer.qtypes);
+    writeColumn(rcodes, footer.rcodes);
+    writeColumn(ttls, footer.ttls);
+    writeColumn(rtts, footer.rtts);
+    writeColumn(addressIndex, footer.addressIndex);
+    writeColumn(addresses, footer.addresses);
+    writeColumn(heap, footer.heap);
+
+    footers.push_back(position);
+    write(&footer, sizeof(footer));
+
+    nameOffsets.assign(1, 0);
+    qtypes.clear();
+    rcodes.clear();
+    ttls.clear();
+    rtts.clear();
+    addressIndex.assign(1, 0);
+    addresses.clear();
+    heap.clear();
+}
+
+bool ResultFileWriter::close(std::string &error)
+{
+    if (file == nullptr)
+        return true;
+
+    if (!qtypes.empty())
+        flushBatch();
+
+    RESULT_FILE_TRAILER trailer;
+    trailer.batches = footers.size();
+    trailer.index = position;
+    memcpy(trailer.magic, RESULT_FILE_MAGIC, 8);
+
+    write(footers.data(), sizeof(uint64_t) * footers.size());
+    write(&trailer, sizeof(trailer));
+
+    if (fclose(file) != 0 && writeError == 0)
+        writeError = errno;
+    file = nullptr;
+    if (writeError != 0)
+    {
+        error = std::string("Cannot write the result file: ") + strerror(writeError);
+        return false;
+    }
+    return true;
+}
+
+ResultBatch::ResultBatch(const unsigned char *base, const RESULT_BATCH_FOOTER *footer) : footer(footer)
+{
+    nameOffsets = reinterpret_cast<const uint32_t *>(base + footer->nameOffsets);
+    qtypes = reinterpret_cast<const uint16_t *>(base + footer->qtypes);
+    rcodes = base + footer->rcodes;
+    ttls = reinterpret_cast<const uint32_t *>(base + footer->ttls);
+    rtts = reinterpret_cast<const uint32_t *>(base + footer->rtts);
+    addressIndex = reinterpret_cast<const uint32_t *>(base + footer->addressIndex);
+    addresses = reinterpret_cast<const BULK_ADDRESS *>(base + footer->addresses);
+    heap = reinterpret_cast<const char *>(base + footer->heap);
+}
+
+// Checks that the column of count items of the given size lies inside the batch, aligned for any item up to 8 bytes
+static bool columnFits(uint64_t offset, uint64_t count, uint64_t itemSize, uint64_t end)
+{
+    return offset % 8 == 0 && offset <= end && count <= (end - offset) / itemSize;
+}
+
+bool ResultFileReader::open(const std::string &path, std::string &error)
+{
+    int fd;
+    struct stat info;
+
+    unmap();
+    if ((fd = ::open(path.c_str(), O_RDONLY)) == -1 || fstat(fd, &info) == -1)
+    {
+        error = "Cannot open the result file " + path + ": " + strerror(errno);
+        if (fd != -1)
+            ::close(fd);
+        return false;
+    }
+
+    // Every part is written 8 byte aligned, so the mapped trailer, footers and columns are aligned too
+    if ((size_t)info.st_size < 8 + sizeof(RESULT_FILE_TRAILER) || info.st_size % 8 != 0)
+    {
+        ::close(fd);
+        error = "Invalid result file " + path + ": too short or not aligned";
+        return false;
+    }
+
+    void *mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        error = "Cannot map the result file " + path + ": " + strerror(errno);
+        return false;
+    }
+    base = static_cast<const unsigned char *>(mapping);
+    size = info.st_size;
+    madvise(mapping, size, MADV_SEQUENTIAL);
+
+    const RESULT_FILE_TRAILER *trailer = reinterpret_cast<const RESULT_FILE_TRAILER *>(base + size - sizeof(RESULT_FILE_TRAILER));
+    if (memcmp(base, RESULT_FILE_MAGIC, 8) != 0 || memcmp(trailer->magic, RESULT_FILE_MAGIC, 8) != 0 ||
+        !columnFits(trailer->index, trailer->batches, sizeof(uint64_t), size - sizeof(RESULT_FILE_TRAILER)))
+    {
+        unmap();
+        error = "Invalid result file " + path + ": bad magic or batch index (truncated?)";
+        return false;
+    }
+
+    const uint64_t *index = reinterpret_cast<const uint64_t *>(base + trailer->index);
+    for (uint64_t i = 0; i < trailer->batches; i++)
+    {
+        uint64_t end = index[i];
+        bool valid = columnFits(end, 1, sizeof(RESULT_BATCH_FOOTER), trailer->index);
+
+        const RESULT_BATCH_FOOTER *footer = reinterpret_cast<const RESULT_BATCH_FOOTER *>(base + end);
+        valid = valid && footer->magic == RESULT_BATCH_MAGIC && columnFits(footer->nameOffsets, footer->rows + 1, 4, end) &&
+                columnFits(footer->qtypes, footer->rows, 2, end) && columnFits(footer->rcodes, footer->rows, 1, end) &&
+                columnFits(footer->ttls, footer->rows, 4, end) && columnFits(footer->rtts, footer->rows, 4, end) &&
+                columnFits(footer->addressIndex, footer->rows + 1, 4, end) &&
+                columnFits(footer->addresses, footer->addressCount, 16, end) &&
+                columnFits(footer->heap, footer->heapSize, 1, end);
+        if (valid)
+        {
+            // Index columns are checked once here, so the accessors don't need to
+            const uint32_t *names = reinterpret_cast<const uint32_t *>(base + footer->nameOffsets);
+            const uint32_t *addressIndex = reinterpret_cast<const uint32_t *>(base + footer->addressIndex);
+            valid = names[footer->rows] <= footer->heapSize && addressIndex[footer->rows] <= footer->addressCount;
+            for (uint32_t row = 0; valid && row < footer->rows; row++)
+                valid = names[row] <= names[row + 1] && addressIndex[row] <= addressIndex[row + 1];
+        }
+        if (!valid)
+        {
+            unmap();
+            error = "Invalid batch " + std::to_string(i) + " in the result file " + path;
+            return false;
+        }
+        footers.push_back(footer);
+    }
+    return true;
+}
+
+void ResultFileReader::unmap()
+{
+    if (base != nullptr)
+        munmap(const_cast<unsigned char *>(base), size);
+    base = nullptr;
+    size = 0;
+    footers.clear();
+}
+
+ResultFileReader::~ResultFileReader()
+{
+    unmap();
+}
+
+uint64_t ResultFileReader::rows() const
+{
+    uint64_t rows = 0;
+    for (const RESULT_BATCH_FOOTER *footer : footers)
+        rows += footer->rows;
+    return rows;
+}
+
+RESULT_SUMMARY aggregateResults(const ResultFileReader &reader, const RESULT_FILTER &filter,
+                                const std::function<void(const ResultBatch &batch, size_t row)> &row)
+{
+    RESULT_SUMMARY summary;
+
+    for (size_t b = 0; b < reader.batches(); b++)
+    {
+        ResultBatch batch = reader.batch(b);
+        const uint16_t *qtypes = batch.qtypeColumn();
+        const uint8_t *rcodes = batch.rcodeColumn();
+        const uint32_t *ttls = batch.ttlColumn();
+        const uint32_t *rtts = batch.rttColumn();
+
+        for (size_t i = 0; i < batch.rows(); i++)
+        {
+            // Cheap fixed size columns first, the name only when the rest matches
+            if ((filter.qtype >= 0 && qtypes[i] != filter.qtype) || (filter.rcode >= 0 && rcodes[i] != filter.rcode) ||
+                (filter.minRtt >= 0 && rtts[i] < filter.minRtt))
+                continue;
+
+            if (!filter.suffix.empty())
+            {
+                size_t len;
+                const char *name = batch.name(i, len);
+                size_t suffixLength = filter.suffix.size();
+                if (len < suffixLength || !nameEquals(name + len - suffixLength, suffixLength, filter.suffix.data(), suffixLength) ||
+                    (len > suffixLength && name[len - suffixLength - 1] != '.'))
+                    continue;
+            }
+
+            size_t addressCount;
+            batch.rowAddresses(i, addressCount);
+
+            summary.rows++;
+            summary.addresses += addressCount;
+            summary.rttSum += rtts[i];
+            summary.rttMax = std::max(summary.rttMax, rtts[i]);
+            summary.ttlSum += ttls[i];
+            summary.rcodes[rcodes[i]]++;
+            summary.qtypes[qtypes[i]]++;
+
+            if (row)
+                row(batch, i);
+        }
+    }
+
+    return summary;
+}
+
+bool parseResultFilter(const std::string &expression, RESULT_FILTER &filter)
+{
+    size_t equals = expression.find('=');
+    if (equals == std::string::npos)
+        return false;
+
+    std::string key = expression.substr(0, equals);
+    std::string value = expression.substr(equals + 1);
+
+    if (key == "type")
+    {
+        filter.qtype = stringToType(value);
+        if (filter.qtype == 0)
+            filter.qtype = std::atoi(value.c_str());
+    }
+    else if (key == "rcode")
+    {
+        filter.rcode = -1;
+        for (int rcode : {0, 1, 2, 3, 4, 5, RCODE_CANCELLED, RCODE_INVALID, RCODE_TIMEOUT})
+        {
+            if (strcasecmp(rcodeToString(rcode).c_str(), value.c_str()) == 0)
+                filter.rcode = rcode;
+        }
+        if (filter.rcode < 0)
+            filter.rcode = std::atoi(value.c_str());
+    }
+    else if (key == "rtt")
+        filter.minRtt = std::atoll(value.c_str());
+    else if (key == "suffix")
+    {
+        filter.suffix = value;
+        if (!filter.suffix.empty() && filter.suffix.back() == '.')
+            filter.suffix.pop_back();
+    }
+    else
+        return false;
+
+    return true;
+}
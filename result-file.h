@@ -0,0 +1,233 @@
+/**
+ * @author Rostislav Kral
+ * @brief Contains writer and memory mapped reader of the columnar binary file with results of the bulk run.
+ *
+ * File layout (host byte order, every column starts at 8 byte boundary):
+ *   "DNSCOL01"
+ *   batch 0: names heap offsets (u32, rows + 1), qtypes (u16), rcodes (u8), TTLs (u32), RTTs in us (u32),
+ *            address index (u32, rows + 1), addresses (16 B each, IPv4 is mapped to ::ffff:0:0/96), names heap,
+ *            RESULT_BATCH_FOOTER
+ *   batch 1 ...
+ *   offsets of all batch footers (u64), RESULT_FILE_TRAILER
+ * @file result-file.h
+ * */
+
+#ifndef RESULT_FILE_H
+#define RESULT_FILE_H
+
+#include <cstdio>
+#include <map>
+#include "bulk-resolver.h"
+
+#define RESULT_FILE_MAGIC "DNSCOL01"
+#define RESULT_BATCH_MAGIC 0x48435442 // "BTCH"
+#define RESULT_BATCH_ROWS 65536 // Rows buffered by the writer before the batch is written
+
+/**
+ * @brief Footer written behind every batch, offsets are absolute in the file
+ * */
+struct RESULT_BATCH_FOOTER {
+    uint32_t magic;
+    uint32_t rows;
+    uint32_t addressCount;
+    uint32_t heapSize;
+    uint64_t nameOffsets;
+    uint64_t qtypes;
+    uint64_t rcodes;
+    uint64_t ttls;
+    uint64_t rtts;
+    uint64_t addressIndex;
+    uint64_t addresses;
+    uint64_t heap;
+};
+
+/**
+ * @brief End of the file, it points to the index of the batch footers
+ * */
+struct RESULT_FILE_TRAILER {
+    uint64_t batches;
+    uint64_t index;
+    char magic[8];
+};
+
+class ResultFileWriter {
+public:
+    ResultFileWriter() = default;
+
+    ResultFileWriter(const ResultFileWriter &) = delete;
+
+    ResultFileWriter &operator=(const ResultFileWriter &) = delete;
+
+    ~ResultFileWriter();
+
+    /**
+     * @brief Creates the file, the results are buffered and written by batches
+     * @param path
+     * @param error Output, reason of the failure
+     * @return false if the file can't be created
+     * */
+    bool open(const std::string &path, std::string &error);
+
+    /**
+     * @brief Adds one row
+     * @param result
+     * @return
+     * */
+    void append(const BULK_RESULT &result);
+
+    /**
+     * @brief Writes the last batch and the index, called by destructor too (the error is lost there)
+     * @param error Output, reason of the failure
+     * @return false if any write since open() failed, the file is then incomplete
+     * */
+    bool close(std::string &error);
+
+private:
+    void flushBatch();
+
+    void write(const void *data, size_t size);
+
+    template <typename T>
+    void writeColumn(const std::vector<T> &column, uint64_t &offset);
+
+    FILE *file = nullptr;
+    int writeError = 0; // errno of the first failed write
+    uint64_t position = 0;
+    std::vector<uint64_t> footers;
+
+    std::vector<uint32_t> nameOffsets;
+    std::vector<uint16_t> qtypes;
+    std::vector<uint8_t> rcodes;
+    std::vector<uint32_t> ttls;
+    std::vector<uint32_t> rtts;
+    std::vector<uint32_t> addressIndex;
+    std::vector<BULK_ADDRESS> addresses;
+    std::vector<char> heap;
+};
+
+/**
+ * @brief View of one batch, pointers go directly to the mapped file
+ * */
+class ResultBatch {
+public:
+    ResultBatch(const unsigned char *base, const RESULT_BATCH_FOOTER *footer);
+
+    size_t rows() const { return footer->rows; }
+
+    const char *name(size_t row, size_t &len) const
+    {
+        len = nameOffsets[row + 1] - nameOffsets[row];
+        return heap + nameOffsets[row];
+    }
+
+    uint16_t qtype(size_t row) const { return qtypes[row]; }
+
+    uint8_t rcode(size_t row) const { return rcodes[row]; }
+
+    uint32_t ttl(size_t row) const { return ttls[row]; }
+
+    uint32_t rtt(size_t row) const { return rtts[row]; }
+
+    /**
+     * @brief Addresses of the row, count is set to their number
+     * @return const BULK_ADDRESS*
+     * */
+    const BULK_ADDRESS *rowAddresses(size_t row, size_t &count) const
+    {
+        count = addressIndex[row + 1] - addressIndex[row];
+        return addresses + addressIndex[row];
+    }
+
+    // Whole columns for scans
+    const uint16_t *qtypeColumn() const { return qtypes; }
+
+    const uint8_t *rcodeColumn() const { return rcodes; }
+
+    const uint32_t *ttlColumn() const { return ttls; }
+
+    const uint32_t *rttColumn() const { return rtts; }
+
+private:
+    const RESULT_BATCH_FOOTER *footer;
+    const uint32_t *nameOffsets;
+    const uint16_t *qtypes;
+    const uint8_t *rcodes;
+    const uint32_t *ttls;
+    const uint32_t *rtts;
+    const uint32_t *addressIndex;
+    const BULK_ADDRESS *addresses;
+    const char *heap;
+};
+
+class ResultFileReader {
+public:
+    ResultFileReader() = default;
+
+    ResultFileReader(const ResultFileReader &) = delete;
+
+    ResultFileReader &operator=(const ResultFileReader &) = delete;
+
+    ~ResultFileReader();
+
+    /**
+     * @brief Maps the file to the memory and checks its structure
+     * @param path
+     * @param error Output, reason of the failure
+     * @return false if the file can't be mapped or it is truncated or corrupted
+     * */
+    bool open(const std::string &path, std::string &error);
+
+    size_t batches() const { return footers.size(); }
+
+    ResultBatch batch(size_t index) const { return ResultBatch(base, footers[index]); }
+
+    uint64_t rows() const;
+
+private:
+    void unmap();
+
+    const unsigned char *base = nullptr;
+    size_t size = 0;
+    std::vector<const RESULT_BATCH_FOOTER *> footers;
+};
+
+/**
+ * @brief Condition for the rows, negative values mean no condition
+ * */
+struct RESULT_FILTER {
+    int qtype = -1;
+    int rcode = -1;
+    int64_t minRtt = -1; // us
+    std::string suffix; // Name must end with this suffix (case insensitive)
+};
+
+/**
+ * @brief Aggregated values of the matching rows
+ * */
+struct RESULT_SUMMARY {
+    uint64_t rows = 0;
+    uint64_t addresses = 0;
+    uint64_t rttSum = 0;
+    uint32_t rttMax = 0;
+    uint64_t ttlSum = 0;
+    std::map<int, uint64_t> rcodes;
+    std::map<int, uint64_t> qtypes;
+};
+
+/**
+ * @brief Scans the columns of all batches, the rows are never converted to DNS_REC
+ * @param reader
+ * @param filter
+ * @param row Optional callback for every matching row (batch and index of the row)
+ * @return RESULT_SUMMARY
+ * */
+RESULT_SUMMARY aggregateResults(const ResultFileReader &reader, const RESULT_FILTER &filter,
+                                const std::function<void(const ResultBatch &batch, size_t row)> &row = nullptr);
+
+/**
+ * @brief Parses filter expression type=AAAA, rcode=3 (or NXDOMAIN), rtt=us or suffix=example.com
+ * @return false for unknown expression
+ * */
+bool parseResultFilter(const std::string &expression, RESULT_FILTER &filter);
+
+#endif // RESULT_FILE_H
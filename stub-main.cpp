@@ -0,0 +1,81 @@
+/**
+ * @author Rostislav Kral
+ * @brief Standalone stub authoritative server answering the zone file over UDP on the loopback, target of benchmarks.
+ * @file stub-main.cpp
+ * */
+
+#include <csignal>
+#include <fstream>
+#include "stub-server.h"
+
+static volatile sig_atomic_t stopped = 0;
+
+static void onSignal(int)
+{
+    stopped = 1;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, port = 5353, threads = 1;
+
+    while ((opt = getopt(argc, argv, "hp:j:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'p':
+                port = std::atoi(optarg);
+                break;
+            case 'j':
+                threads = std::atoi(optarg);
+                break;
+            default:
+                std::cerr << "Usage: dns-stub [-p port] [-j threads] zone-file" << std::endl;
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (optind != argc - 1)
+    {
+        std::cerr << "Usage: dns-stub [-p port] [-j threads] zone-file" << std::endl;
+        return 1;
+    }
+
+    std::ifstream file(argv[optind]);
+    if (!file)
+    {
+        perror("Cannot open the zone file");
+        return 1;
+    }
+
+    StubZone zone;
+    std::string error;
+    if (!zone.load(file, error))
+    {
+        std::cerr << argv[optind] << ": " << error << std::endl;
+        return 1;
+    }
+
+    StubUdpServer server(zone);
+    try
+    {
+        port = server.start(port, threads);
+    }
+    catch (const TransportError &e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    std::cerr << "Serving " << zone.records() << " records on 127.0.0.1:" << port << " with " << threads << " threads"
+              << std::endl;
+
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+    while (!stopped)
+        pause();
+
+    server.stop();
+    std::cerr << "Answered " << server.answered() << " queries" << std::endl;
+
+    return 0;
+}
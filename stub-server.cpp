@@ -0,0 +1,928 @@
+/**
+ * @author Rostislav Kral
+ * @brief Implementation of the local stub authoritative servers.
+ * @file stub-server.cpp
+ * */
+
+#include "stub-server.h"
+#include "name-utils.h"
+#include <cerrno>
+#include <poll.h>
+#include <set>
+
+static std::string systemError(const std::string &message)
+{
+    return message + ": " + strerror(errno);
+}
+
+#define STUB_FLUSH_SIZE 16000 // Messages of the transfer are sent when they reach this size
+#define STUB_ZONE_PTR 0xC00C // Compression pointer to the question name, i.e. the zone apex
+#define STUB_NXDOMAIN 0xFFFF // Reserved type, the NXDOMAIN answer for names below the apex is stored under the apex
+#define STUB_DEFAULT_TTL 3600 // TTL of the records before the first $TTL
+
+/**
+ * @brief Builds messages of the transfer, every message repeats the question so the records can point to it
+ * */
+class TransferWriter {
+public:
+    TransferWriter(uint16_t id, const std::string &origin, int qtype, const StubAuthServer::StreamSink &sink)
+        : sink(sink), buf(MAX_TCP_DNS_SIZE + 2)
+    {
+        DNS_HEADER *header = reinterpret_cast<DNS_HEADER *>(buf.data() + 2);
+        memset(header, 0, sizeof(DNS_HEADER));
+        header->id = htons(id);
+        header->qr = 1;
+        header->aa = 1;
+        header->qdcount = htons(1);
+
+        size_t nameLength = encodeName(origin, buf.data() + 2 + sizeof(DNS_HEADER));
+        QUESTION *question = reinterpret_cast<QUESTION *>(buf.data() + 2 + sizeof(DNS_HEADER) + nameLength);
+        question->qtype = htons(qtype);
+        question->qclass = htons(1);
+        headerLength = 2 + sizeof(DNS_HEADER) + nameLength + sizeof(QUESTION);
+        length = headerLength;
+    }
+
+    void soa(uint32_t serial)
+    {
+        unsigned char rdata[64];
+        size_t n = 0;
+        n += label("ns1", rdata + n);
+        n += pointer(STUB_ZONE_PTR, rdata + n);
+        n += label("hostmaster", rdata + n);
+        n += pointer(STUB_ZONE_PTR, rdata + n);
+        const uint32_t fields[] = {serial, 3600, 600, 86400, 300};
+        for (uint32_t field : fields)
+        {
+            uint32_t value = htonl(field);
+            memcpy(rdata + n, &value, 4);
+            n += 4;
+        }
+        record(nullptr, T_SOA, 3600, rdata, n);
+    }
+
+    void ns()
+    {
+        unsigned char rdata[8];
+        size_t n = label("ns1", rdata);
+        n += pointer(STUB_ZONE_PTR, rdata + n);
+        record(nullptr, T_NS, 3600, rdata, n);
+    }
+
+    void host(uint32_t index, uint32_t address)
+    {
+        address = htonl(address);
+        record(("h" + std::to_string(index)).c_str(), T_A, 300, reinterpret_cast<unsigned char *>(&address), 4);
+    }
+
+    void finish()
+    {
+        if (records > 0)
+            flush();
+    }
+
+private:
+    static size_t label(const char *text, unsigned char *out)
+    {
+        size_t n = strlen(text);
+        out[0] = n;
+        memcpy(out + 1, text, n);
+        return n + 1;
+    }
+
+    static size_t pointer(uint16_t target, unsigned char *out)
+    {
+        out[0] = target >> 8;
+        out[1] = target & 0xFF;
+        return 2;
+    }
+
+    // Owner is the first label below the apex, or the apex itself for nullptr
+    void record(const char *owner, uint16_t type, uint32_t ttl, const unsigned char *rdata, size_t rdlength)
+    {
+        if (length > STUB_FLUSH_SIZE)
+            flush();
+
+        unsigned char *p = buf.data() + length;
+        if (owner != nullptr)
+            p += label(owner, p);
+        p += pointer(STUB_ZONE_PTR, p);
+        const uint16_t fixed[] = {htons(type), htons(1), htons(ttl >> 16), htons(ttl & 0xFFFF), htons(rdlength)};
+        memcpy(p, fixed, sizeof(fixed));
+        p += sizeof(fixed);
+        memcpy(p, rdata, rdlength);
+        p += rdlength;
+
+        length = p - buf.data();
+        records++;
+    }
+
+    void flush()
+    {
+        DNS_HEADER *header = reinterpret_cast<DNS_HEADER *>(buf.data() + 2);
+        header->ancount = htons(records);
+        buf[0] = (length - 2) >> 8;
+        buf[1] = (length - 2) & 0xFF;
+        sink(buf.data(), length);
+        length = headerLength;
+        records = 0;
+    }
+
+    const StubAuthServer::StreamSink &sink;
+    std::vector<unsigned char> buf;
+    size_t headerLength;
+    size_t length;
+    uint16_t records = 0;
+};
+
+// Hosts are numbered from 10.0.0.1 up
+static uint32_t hostAddress(uint32_t index)
+{
+    return (10u << 24) + index + 1;
+}
+
+StubAuthServer::StubAuthServer(const std::string &origin, uint32_t hosts, uint32_t serial)
+    : origin(origin), hosts(hosts), serial(serial), running(false)
+{
+}
+
+StubAuthServer::~StubAuthServer()
+{
+    stop();
+}
+
+int StubAuthServer::start()
+{
+    struct sockaddr_in address;
+    socklen_t addressLength = sizeof(address);
+    int enable = 1;
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0;
+
+    if ((listener = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+        throw TransportError(systemError("Socket creation failed"));
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    if (bind(listener, (struct sockaddr *)&address, sizeof(address)) == -1 || listen(listener, 16) == -1 ||
+        getsockname(listener, (struct sockaddr *)&address, &addressLength) == -1)
+    {
+        std::string error = systemError("Stub server can't listen");
+        close(listener);
+        listener = -1;
+        throw TransportError(error);
+    }
+
+    running = true;
+    thread = std::thread(&StubAuthServer::serve, this);
+
+    return ntohs(address.sin_port);
+}
+
+void StubAuthServer::stop()
+{
+    if (!running)
+        return;
+
+    running = false;
+    thread.join();
+    close(listener);
+    listener = -1;
+}
+
+void StubAuthServer::serve()
+{
+    struct pollfd pfd = {listener, POLLIN, 0};
+
+    while (running)
+    {
+        // Waking up regularly to notice stop()
+        if (poll(&pfd, 1, 50) <= 0)
+            continue;
+
+        int client = accept(listener, NULL, NULL);
+        if (client == -1)
+            continue;
+
+        handleClient(client);
+        close(client);
+    }
+}
+
+// Reads exactly len bytes, false if the client went away
+static bool readFull(int fd, unsigned char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t received = recv(fd, buf, len, 0);
+        if (received <= 0)
+            return false;
+        buf += received;
+        len -= received;
+    }
+    return true;
+}
+
+void StubAuthServer::handleClient(int client)
+{
+    unsigned char prefix[2];
+    std::vector<unsigned char> query(MAX_TCP_DNS_SIZE);
+
+    while (running && readFull(client, prefix, 2))
+    {
+        size_t length = (prefix[0] << 8) | prefix[1];
+        if (length < sizeof(DNS_HEADER) || !readFull(client, query.data(), length))
+            return;
+
+        const DNS_HEADER *header = reinterpret_cast<const DNS_HEADER *>(query.data());
+        size_t pos = sizeof(DNS_HEADER);
+        std::string name;
+        if (!readName(query.data(), length, pos, name) || pos + sizeof(QUESTION) > length)
+            return;
+        uint16_t qtype = (query[pos] << 8) | query[pos + 1];
+        pos += sizeof(QUESTION);
+
+        // IXFR carries the client's SOA in the authority section
+        uint32_t clientSerial = 0;
+        DNS_REC soa;
+        size_t rdata;
+        if (qtype == T_IXFR && ntohs(header->nscount) == 1 && decodeRecord(query.data(), length, pos, soa, nullptr, &rdata) &&
+            readName(query.data(), length, rdata, name) && readName(query.data(), length, rdata, name) && rdata + 4 <= length)
+            clientSerial = ((uint32_t)query[rdata] << 24) | (query[rdata + 1] << 16) | (query[rdata + 2] << 8) | query[rdata + 3];
+
+        bool failed = false;
+        writeTransfer(ntohs(header->id), qtype, clientSerial, [&](const unsigned char *data, size_t len) {
+            if (!failed && send(client, data, len, MSG_NOSIGNAL) != (ssize_t)len)
+                failed = true;
+        });
+        if (failed)
+            return;
+    }
+}
+
+void StubAuthServer::writeTransfer(uint16_t id, int qtype, uint32_t clientSerial, const StreamSink &sink) const
+{
+    TransferWriter writer(id, origin, qtype, sink);
+
+    writer.soa(serial);
+
+    if (qtype == T_IXFR && clientSerial == serial)
+    {
+        // Client is up to date, the single SOA is the whole answer
+        writer.finish();
+        return;
+    }
+
+    if (qtype == T_IXFR && clientSerial == serial - 1 && hosts > 0)
+    {
+        // Difference between the versions, h0 got new address
+        writer.soa(clientSerial);
+        writer.host(0, hostAddress(0) - 1);
+        writer.soa(serial);
+        writer.host(0, hostAddress(0));
+    }
+    else
+    {
+        writer.ns();
+        for (uint32_t i = 0; i < hosts; i++)
+            writer.host(i, hostAddress(i));
+    }
+
+    writer.soa(serial);
+    writer.finish();
+}
+
+// ---------------------------------------------------------- ZONE FILE ----------------------------------------------------------
+
+// Splits the line on white space, quoted strings stay one token including the quotes, ';' starts comment
+static std::vector<std::string> tokenize(const std::string &line)
+{
+    std::vector<std::string> tokens;
+    size_t i = 0;
+
+    while (i < line.size())
+    {
+        if (isspace((unsigned char)line[i]))
+        {
+            i++;
+            continue;
+        }
+        if (line[i] == ';')
+            break;
+
+        size_t start = i;
+        if (line[i] == '"')
+        {
+            i = line.find('"', i + 1);
+            i = i == std::string::npos ? line.size() : i + 1;
+        }
+        else
+        {
+            while (i < line.size() && !isspace((unsigned char)line[i]) && line[i] != ';')
+                i++;
+        }
+        tokens.push_back(line.substr(start, i - start));
+    }
+    return tokens;
+}
+
+static bool isNumber(const std::string &token)
+{
+    return !token.empty() && token.size() <= 10 && std::all_of(token.begin(), token.end(), ::isdigit);
+}
+
+// Completes the relative name by the origin and encodes it, empty result for invalid name
+static std::string zoneName(const std::string &token, const std::string &origin)
+{
+    std::string name = token == "@" ? origin : token;
+    if (token != "@" && (name.empty() || name.back() != '.'))
+        name += origin.empty() || origin == "." ? "." : "." + origin;
+
+    unsigned char wire[MAX_DNS_SIZE];
+    size_t length = encodeName(name, wire);
+    return std::string(reinterpret_cast<char *>(wire), length);
+}
+
+static void appendNumber(std::vector<unsigned char> &rdata, uint32_t value, int bytes)
+{
+    for (int i = bytes - 1; i >= 0; i--)
+        rdata.push_back((value >> (8 * i)) & 0xFF);
+}
+
+/**
+ * @brief Converts the RDATA tokens of the record to the wire format
+ * @return false if the tokens don't match the type
+ * */
+static bool encodeRdata(uint16_t type, const std::vector<std::string> &fields, const std::string &origin,
+                        std::vector<unsigned char> &rdata)
+{
+    unsigned char address[sizeof(struct in6_addr)];
+    std::string name;
+
+    switch (type)
+    {
+        case T_A:
+        case T_AAAA:
+            if (fields.size() != 1 || inet_pton(type == T_A ? AF_INET : AF_INET6, fields[0].c_str(), address) != 1)
+                return false;
+            rdata.assign(address, address + (type == T_A ? 4 : 16));
+            return true;
+        case T_NS:
+        case T_CNAME:
+        case T_PTR:
+            if (fields.size() != 1 || (name = zoneName(fields[0], origin)).empty())
+                return false;
+            rdata.assign(name.begin(), name.end());
+            return true;
+        case T_MX:
+            if (fields.size() != 2 || !isNumber(fields[0]) || std::stoul(fields[0]) > 0xFFFF ||
+                (name = zoneName(fields[1], origin)).empty())
+                return false;
+            appendNumber(rdata, std::stoul(fields[0]), 2);
+            rdata.insert(rdata.end(), name.begin(), name.end());
+            return true;
+        case T_TXT:
+            for (std::string text : fields)
+            {
+                if (text.size() >= 2 && text.front() == '"' && text.back() == '"')
+                    text = text.substr(1, text.size() - 2);
+                if (text.size() > 255)
+                    return false;
+                rdata.push_back(text.size());
+                rdata.insert(rdata.end(), text.begin(), text.end());
+            }
+            return !fields.empty();
+        case T_SOA:
+            if (fields.size() != 7)
+                return false;
+            for (int i = 0; i < 2; i++)
+            {
+                if ((name = zoneName(fields[i], origin)).empty())
+                    return false;
+                rdata.insert(rdata.end(), name.begin(), name.end());
+            }
+            for (int i = 2; i < 7; i++)
+            {
+                if (!isNumber(fields[i]) || std::stoull(fields[i]) > 0xFFFFFFFF)
+                    return false;
+                appendNumber(rdata, std::stoul(fields[i]), 4);
+            }
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool StubZone::load(std::istream &input, std::string &error)
+{
+    std::vector<STUB_RECORD> loaded;
+    std::string line, origin, owner;
+    uint32_t defaultTtl = STUB_DEFAULT_TTL;
+    int number = 0;
+
+    while (std::getline(input, line))
+    {
+        number++;
+        std::vector<std::string> tokens = tokenize(line);
+        if (tokens.empty())
+            continue;
+
+        error = "line " + std::to_string(number) + ": ";
+
+        if (tokens[0] == "$ORIGIN" || tokens[0] == "$TTL")
+        {
+            if (tokens.size() != 2)
+            {
+                error += tokens[0] + " needs one value";
+                return false;
+            }
+            if (tokens[0] == "$TTL" && isNumber(tokens[1]))
+                defaultTtl = std::stoul(tokens[1]);
+            else if (tokens[0] == "$ORIGIN" && tokens[1].back() == '.' && !zoneName(tokens[1], "").empty())
+                origin = tokens[1];
+            else
+            {
+                error += "invalid " + tokens[0];
+                return false;
+            }
+            continue;
+        }
+
+        // Line starting with white space continues with the previous owner
+        size_t field = 0;
+        if (!isspace((unsigned char)line[0]))
+        {
+            owner = zoneName(tokens[field++], origin);
+            if (owner.empty())
+            {
+                error += "invalid owner name";
+                return false;
+            }
+        }
+        else if (owner.empty())
+        {
+            error += "missing owner name";
+            return false;
+        }
+
+        STUB_RECORD record;
+        record.name = nameToLower(owner);
+        record.ttl = defaultTtl;
+        for (int optional = 0; optional < 2 && field < tokens.size(); optional++)
+        {
+            if (isNumber(tokens[field]))
+                record.ttl = std::stoull(tokens[field++]);
+            else if (strcasecmp(tokens[field].c_str(), "IN") == 0)
+                field++;
+        }
+
+        int type = field < tokens.size() ? stringToType(tokens[field++]) : 0;
+        if (type == 0)
+        {
+            error += "unknown type";
+            return false;
+        }
+        record.type = type;
+
+        if (!encodeRdata(record.type, std::vector<std::string>(tokens.begin() + field, tokens.end()), origin, record.rdata))
+        {
+            error += "invalid " + typeToString(record.type) + " data";
+            return false;
+        }
+        loaded.push_back(record);
+    }
+
+    error.clear();
+    zone.insert(zone.end(), loaded.begin(), loaded.end());
+    compile();
+    return true;
+}
+
+// ---------------------------------------------------------- COMPILED ANSWERS ----------------------------------------------------------
+
+/**
+ * @brief Writes the sections behind the question, names already present in the message are compressed
+ * */
+class AnswerWriter {
+public:
+    /**
+     * @param question Lowercase wire name of the question, empty when it isn't known in advance (no compression then)
+     * */
+    explicit AnswerWriter(const std::string &question) : compress(!question.empty())
+    {
+        if (compress)
+            offsets[question] = sizeof(DNS_HEADER);
+        start = sizeof(DNS_HEADER) + question.size() + sizeof(QUESTION);
+    }
+
+    void record(const STUB_RECORD &record)
+    {
+        auto known = offsets.find(record.name);
+        if (compress && known != offsets.end())
+        {
+            tail.push_back(0xC0 | (known->second >> 8));
+            tail.push_back(known->second & 0xFF);
+        }
+        else
+        {
+            remember(record.name, tail.size());
+            tail.insert(tail.end(), record.name.begin(), record.name.end());
+        }
+
+        appendNumber(tail, record.type, 2);
+        appendNumber(tail, 1, 2);
+        appendNumber(tail, record.ttl, 4);
+        appendNumber(tail, record.rdata.size(), 2);
+
+        // Target of CNAME can be pointed to by the next records
+        if (record.type == T_CNAME)
+            remember(nameToLower(std::string(record.rdata.begin(), record.rdata.end())), tail.size());
+        tail.insert(tail.end(), record.rdata.begin(), record.rdata.end());
+    }
+
+    std::vector<unsigned char> tail;
+
+private:
+    void remember(const std::string &name, size_t offset)
+    {
+        if (compress && start + offset < 0x4000)
+            offsets.emplace(name, start + offset);
+    }
+
+    bool compress;
+    size_t start;
+    std::map<std::string, size_t> offsets;
+};
+
+static void compiledHeader(unsigned char *out, int rcode, uint16_t ancount, uint16_t nscount)
+{
+    DNS_HEADER header;
+    memset(&header, 0, sizeof(header));
+    header.qr = 1;
+    header.aa = 1;
+    header.rcode = rcode;
+    header.qdcount = htons(1);
+    header.ancount = htons(ancount);
+    header.nscount = htons(nscount);
+    memcpy(out, &header, sizeof(header));
+}
+
+const STUB_RECORD *StubZone::findSoa(const std::string &name) const
+{
+    for (size_t label = 0; label < name.size() && name[label] != 0; label += name[label] + 1)
+    {
+        auto records = byName.find(name.substr(label));
+        if (records == byName.end())
+            continue;
+        for (const STUB_RECORD *record : records->second)
+        {
+            if (record->type == T_SOA)
+                return record;
+        }
+    }
+    return nullptr;
+}
+
+void StubZone::compileName(const std::string &name, const std::vector<const STUB_RECORD *> &records)
+{
+    std::vector<const STUB_RECORD *> chain;
+    const std::vector<const STUB_RECORD *> *target = &records;
+    std::set<std::string> visited = {name};
+
+    // Following CNAME inside the zone, the answers then contain the whole chain
+    while (chain.size() < STUB_MAX_CHAIN)
+    {
+        auto cname = std::find_if(target->begin(), target->end(), [](const STUB_RECORD *r) { return r->type == T_CNAME; });
+        if (cname == target->end())
+            break;
+        chain.push_back(*cname);
+
+        std::string next = nameToLower(std::string((*cname)->rdata.begin(), (*cname)->rdata.end()));
+        auto found = byName.find(next);
+        if (found == byName.end() || !visited.insert(next).second)
+        {
+            target = nullptr;
+            break;
+        }
+        target = &found->second;
+    }
+
+    std::set<uint16_t> types;
+    for (const STUB_RECORD *record : records)
+        types.insert(record->type);
+    if (target != nullptr && !chain.empty())
+    {
+        for (const STUB_RECORD *record : *target)
+            types.insert(record->type);
+    }
+
+    for (uint16_t qtype : types)
+    {
+        AnswerWriter writer(name);
+        uint16_t ancount = 0;
+
+        bool direct = chain.empty() || qtype == T_CNAME;
+        if (!direct)
+        {
+            for (const STUB_RECORD *record : chain)
+                writer.record(*record);
+            ancount = chain.size();
+        }
+        for (const STUB_RECORD *record : direct ? records : (target ? *target : records))
+        {
+            if (record->type == qtype && (direct || target))
+            {
+                writer.record(*record);
+                ancount++;
+            }
+        }
+
+        COMPILED answer;
+        answer.name = name;
+        answer.qtype = qtype;
+        compiledHeader(answer.header, 0, ancount, 0);
+        answer.tail = writer.tail;
+        answers.push_back(answer);
+    }
+
+    // Other types get the chain alone, or no data with SOA for negative caching
+    const STUB_RECORD *soa = findSoa(name);
+    AnswerWriter writer(name);
+    COMPILED other;
+    other.name = name;
+    other.qtype = 0;
+    if (!chain.empty())
+    {
+        for (const STUB_RECORD *record : chain)
+            writer.record(*record);
+        compiledHeader(other.header, 0, chain.size(), 0);
+    }
+    else
+    {
+        if (soa != nullptr)
+            writer.record(*soa);
+        compiledHeader(other.header, 0, 0, soa != nullptr);
+    }
+    other.tail = writer.tail;
+    answers.push_back(other);
+
+    // Apex answers nonexistent names below it, their question is not known so nothing is compressed
+    for (const STUB_RECORD *record : records)
+    {
+        if (record->type != T_SOA)
+            continue;
+        AnswerWriter negative("");
+        negative.record(*record);
+        COMPILED nxdomain;
+        nxdomain.name = name;
+        nxdomain.qtype = STUB_NXDOMAIN;
+        compiledHeader(nxdomain.header, 3, 0, 1);
+        nxdomain.tail = negative.tail;
+        answers.push_back(nxdomain);
+        break;
+    }
+}
+
+uint64_t StubZone::slotHash(const unsigned char *name, size_t len, uint16_t qtype)
+{
+    return nameHash(reinterpret_cast<const char *>(name), len) ^ (qtype * 0x9E3779B97F4A7C15ULL);
+}
+
+void StubZone::compile()
+{
+    byName.clear();
+    for (const STUB_RECORD &record : zone)
+        byName[record.name].push_back(&record);
+
+    // Names between the owners and the apex exist without records, they get no data instead of NXDOMAIN (RFC 8020)
+    std::set<std::string> empty;
+    for (const auto &name : byName)
+    {
+        for (size_t label = name.first[0] + 1; label < name.first.size() && name.first[label] != 0; label += name.first[label] + 1)
+        {
+            std::string ancestor = name.first.substr(label);
+            if (byName.count(ancestor) == 0 && findSoa(ancestor) != nullptr)
+                empty.insert(ancestor);
+        }
+    }
+
+    answers.clear();
+    for (const auto &name : byName)
+        compileName(name.first, name.second);
+    for (const std::string &name : empty)
+        compileName(name, {});
+
+    size_t size = 1;
+    while (size < 2 * answers.size())
+        size <<= 1;
+    table.assign(size, SLOT{0, 0});
+
+    for (size_t i = 0; i < answers.size(); i++)
+    {
+        const COMPILED &answer = answers[i];
+        uint64_t hash = slotHash(reinterpret_cast<const unsigned char *>(answer.name.data()), answer.name.size(), answer.qtype);
+        size_t index = hash & (size - 1);
+        while (table[index].answer != 0)
+            index = (index + 1) & (size - 1);
+        table[index] = SLOT{hash, (uint32_t)i + 1};
+    }
+}
+
+const StubZone::COMPILED *StubZone::find(const unsigned char *name, size_t len, uint16_t qtype) const
+{
+    if (table.empty())
+        return nullptr;
+
+    uint64_t hash = slotHash(name, len, qtype);
+    size_t mask = table.size() - 1;
+    for (size_t index = hash & mask; table[index].answer != 0; index = (index + 1) & mask)
+    {
+        if (table[index].hash != hash)
+            continue;
+        const COMPILED &answer = answers[table[index].answer - 1];
+        if (answer.qtype == qtype && nameEquals(answer.name.data(), answer.name.size(), reinterpret_cast<const char *>(name), len))
+            return &answer;
+    }
+    return nullptr;
+}
+
+size_t StubZone::answer(const unsigned char *query, size_t len, unsigned char *out) const
+{
+    const DNS_HEADER *header = reinterpret_cast<const DNS_HEADER *>(query);
+    if (len < sizeof(DNS_HEADER) || header->qr)
+        return 0;
+
+    // Queries are never compressed, the name is a plain sequence of labels
+    size_t pos = sizeof(DNS_HEADER);
+    while (pos < len && query[pos] != 0 && query[pos] < 64)
+        pos += query[pos] + 1;
+    if (pos >= len || query[pos] != 0 || pos + 1 + sizeof(QUESTION) > len || pos + 1 - sizeof(DNS_HEADER) > 255)
+        return 0;
+    const unsigned char *name = query + sizeof(DNS_HEADER);
+    size_t nameLength = pos + 1 - sizeof(DNS_HEADER);
+    size_t questionLength = nameLength + sizeof(QUESTION);
+    uint16_t qtype = (query[pos + 1] << 8) | query[pos + 2];
+    uint16_t qclass = (query[pos + 3] << 8) | query[pos + 4];
+
+    const COMPILED *compiled = nullptr;
+    if (header->opcode == 0 && ntohs(header->qdcount) == 1 && qclass == 1)
+    {
+        compiled = find(name, nameLength, qtype);
+        if (compiled == nullptr)
+            compiled = find(name, nameLength, 0);
+        for (size_t label = 0; compiled == nullptr && name[label] != 0; label += name[label] + 1)
+            compiled = find(name + label + name[label] + 1, nameLength - label - name[label] - 1, STUB_NXDOMAIN);
+    }
+
+    DNS_HEADER *response = reinterpret_cast<DNS_HEADER *>(out);
+    if (compiled != nullptr)
+        memcpy(out, compiled->header, sizeof(DNS_HEADER));
+    else
+    {
+        // Not our zone or not a standard query
+        compiledHeader(out, header->opcode != 0 ? 4 : 5, 0, 0);
+        response->aa = 0;
+    }
+    response->id = header->id;
+    response->rd = header->rd;
+    memcpy(out + sizeof(DNS_HEADER), query + sizeof(DNS_HEADER), questionLength);
+
+    size_t length = sizeof(DNS_HEADER) + questionLength;
+    if (compiled != nullptr && length + compiled->tail.size() > MAX_DNS_SIZE)
+    {
+        response->tc = 1;
+        response->ancount = response->nscount = 0;
+    }
+    else if (compiled != nullptr)
+    {
+        memcpy(out + length, compiled->tail.data(), compiled->tail.size());
+        length += compiled->tail.size();
+    }
+    return length;
+}
+
+// ---------------------------------------------------------- UDP SERVER ----------------------------------------------------------
+
+StubUdpServer::StubUdpServer(const StubZone &zone) : zone(zone), running(false), answeredCount(0)
+{
+}
+
+StubUdpServer::~StubUdpServer()
+{
+    stop();
+}
+
+int StubUdpServer::start(int port, int threads)
+{
+    struct sockaddr_in address;
+    socklen_t addressLength = sizeof(address);
+    int enable = 1;
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+
+    // The kernel spreads the clients over the sockets sharing the port
+    for (int i = 0; i < std::max(1, threads); i++)
+    {
+        int sock = socket(AF_INET, SOCK_DGRAM, 0);
+        int bufferSize = 4 * 1024 * 1024;
+        if (sock != -1)
+        {
+            socks.push_back(sock);
+            setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+            setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize));
+            setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable));
+        }
+        if (sock == -1 || bind(sock, (struct sockaddr *)&address, sizeof(address)) == -1 ||
+            getsockname(sock, (struct sockaddr *)&address, &addressLength) == -1)
+        {
+            // Sockets of the threads bound so far are closed, the server stays stopped
+            std::string error = systemError(sock == -1 ? "Socket creation failed" : "Stub server can't bind");
+            for (int bound : socks)
+                close(bound);
+            socks.clear();
+            throw TransportError(error);
+        }
+    }
+
+    running = true;
+    for (int sock : socks)
+        this->threads.emplace_back(&StubUdpServer::serve, this, sock);
+
+    return ntohs(address.sin_port);
+}
+
+void StubUdpServer::stop()
+{
+    if (!running)
+        return;
+
+    running = false;
+    for (std::thread &thread : threads)
+        thread.join();
+    threads.clear();
+    for (int sock : socks)
+        close(sock);
+    socks.clear();
+}
+
+void StubUdpServer::serve(int sock)
+{
+    std::vector<unsigned char> in(STUB_BATCH * MAX_DNS_SIZE), out(STUB_BATCH * MAX_DNS_SIZE);
+    struct sockaddr_storage addresses[STUB_BATCH];
+    struct iovec inVectors[STUB_BATCH], outVectors[STUB_BATCH];
+    struct mmsghdr received[STUB_BATCH], replies[STUB_BATCH];
+    struct pollfd pfd = {sock, POLLIN, 0};
+
+    for (int i = 0; i < STUB_BATCH; i++)
+        inVectors[i] = {in.data() + i * MAX_DNS_SIZE, MAX_DNS_SIZE};
+
+    while (running)
+    {
+        // Waking up regularly to notice stop()
+        if (poll(&pfd, 1, 50) <= 0)
+            continue;
+
+        for (int i = 0; i < STUB_BATCH; i++)
+        {
+            memset(&received[i], 0, sizeof(received[i]));
+            received[i].msg_hdr.msg_name = &addresses[i];
+            received[i].msg_hdr.msg_namelen = sizeof(addresses[i]);
+            received[i].msg_hdr.msg_iov = &inVectors[i];
+            received[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        int count = recvmmsg(sock, received, STUB_BATCH, MSG_DONTWAIT, nullptr);
+        int answers = 0;
+        for (int i = 0; i < count; i++)
+        {
+            if (received[i].msg_hdr.msg_flags & MSG_TRUNC)
+                continue;
+
+            unsigned char *answer = out.data() + answers * MAX_DNS_SIZE;
+            size_t length = zone.answer(in.data() + i * MAX_DNS_SIZE, received[i].msg_len, answer);
+            if (length == 0)
+                continue;
+
+            outVectors[answers] = {answer, length};
+            memset(&replies[answers], 0, sizeof(replies[answers]));
+            replies[answers].msg_hdr.msg_name = &addresses[i];
+            replies[answers].msg_hdr.msg_namelen = received[i].msg_hdr.msg_namelen;
+            replies[answers].msg_hdr.msg_iov = &outVectors[answers];
+            replies[answers].msg_hdr.msg_iovlen = 1;
+            answers++;
+        }
+
+        for (int sent = 0; sent < answers;)
+        {
+            int result = sendmmsg(sock, replies + sent, answers - sent, 0);
+            if (result <= 0)
+                break; // Client is gone or the buffer is full, UDP answer may be lost
+            sent += result;
+        }
+        answeredCount += answers;
+    }
+}
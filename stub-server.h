@@ -0,0 +1,187 @@
+/**
+ * @author Rostislav Kral
+ * @brief Contains local stub authoritative servers for tests and benchmarks, zone transfers of generated zone over TCP
+ * and UDP answers from zone file compiled to wire format.
+ * @file stub-server.h
+ * */
+
+#ifndef STUB_SERVER_H
+#define STUB_SERVER_H
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <thread>
+#include "dns-resolver.h"
+#include "transport.h"
+
+#define STUB_MAX_CHAIN 8 // CNAME links followed when the answers are compiled
+#define STUB_BATCH 64 // Datagrams received and sent by one system call
+
+class StubAuthServer {
+public:
+    /**
+     * @brief Receiver of the serialized TCP stream (length prefixed messages)
+     * */
+    typedef std::function<void(const unsigned char *data, size_t len)> StreamSink;
+
+    /**
+     * @brief Constructor of the server, the zone contains SOA, NS and hosts A records h0 ... h<hosts-1>
+     * @param origin Name of the zone
+     * @param hosts Number of the generated A records
+     * @param serial Serial of the zone, serial - 1 is answered by IXFR difference
+     * */
+    StubAuthServer(const std::string &origin, uint32_t hosts, uint32_t serial);
+
+    ~StubAuthServer();
+
+    /**
+     * @brief Binds to the ephemeral port on 127.0.0.1 and starts serving in the background thread, TransportError is
+     * thrown when the socket can't listen
+     * @return int port of the server
+     * */
+    int start();
+
+    /**
+     * @brief Stops the background thread, called by destructor too
+     * @return
+     * */
+    void stop();
+
+    /**
+     * @brief Serializes the answer to the AXFR/IXFR query without any socket, usable for feeding parsers directly
+     * @param id ID of the query
+     * @param qtype T_AXFR or T_IXFR
+     * @param clientSerial Serial sent in the IXFR query
+     * @param sink Receiver of the length prefixed messages
+     * @return
+     * */
+    void writeTransfer(uint16_t id, int qtype, uint32_t clientSerial, const StreamSink &sink) const;
+
+private:
+    void serve();
+
+    void handleClient(int client);
+
+    std::string origin;
+    uint32_t hosts;
+    uint32_t serial;
+
+    int listener = -1;
+    std::thread thread;
+    std::atomic<bool> running;
+};
+
+/**
+ * @brief Record of the zone file, RDATA names are not compressed
+ * */
+struct STUB_RECORD {
+    std::string name; // Lowercase wire name
+    uint16_t type;
+    uint32_t ttl;
+    std::vector<unsigned char> rdata;
+};
+
+/**
+ * @brief Zone loaded from the text file, every answer is compiled to the wire format in advance
+ *
+ * File format is subset of the master file (RFC 1035), one record per line:
+ *   $ORIGIN example.com.
+ *   $TTL 300
+ *   @    IN SOA ns1 hostmaster 1 3600 600 86400 300
+ *   www  60 A 10.0.0.1
+ * Relative names are completed by $ORIGIN, owner may be omitted by starting the line with space, ';' starts comment.
+ * Supported types are A, AAAA, NS, CNAME, PTR, MX, TXT and SOA.
+ * */
+class StubZone {
+public:
+    /**
+     * @brief Parses the zone text and compiles the answers, may be called repeatedly to add more records
+     * @param input
+     * @param error Output, line and reason of the failure
+     * @return false for syntax error, the zone is unchanged then
+     * */
+    bool load(std::istream &input, std::string &error);
+
+    /**
+     * @brief Writes the answer to the query, only the ID, RD flag and the question are taken from the query
+     * @param query Received datagram
+     * @param len Length of the datagram
+     * @param out Output buffer, at least MAX_DNS_SIZE bytes
+     * @return size_t length of the answer, 0 when the datagram is not a query and should be dropped
+     * */
+    size_t answer(const unsigned char *query, size_t len, unsigned char *out) const;
+
+    size_t records() const { return zone.size(); }
+
+    const std::vector<STUB_RECORD> &zoneRecords() const { return zone; }
+
+private:
+    /**
+     * @brief Answer without the question, the question of the query is copied between header and tail
+     * */
+    struct COMPILED {
+        std::string name; // Lowercase wire name
+        uint16_t qtype; // 0 for the answer to other types of the name
+        unsigned char header[sizeof(DNS_HEADER)];
+        std::vector<unsigned char> tail;
+    };
+
+    struct SLOT {
+        uint64_t hash;
+        uint32_t answer; // Index to answers + 1, 0 = empty slot
+    };
+
+    void compile();
+
+    void compileName(const std::string &name, const std::vector<const STUB_RECORD *> &records);
+
+    const STUB_RECORD *findSoa(const std::string &name) const;
+
+    const COMPILED *find(const unsigned char *name, size_t len, uint16_t qtype) const;
+
+    static uint64_t slotHash(const unsigned char *name, size_t len, uint16_t qtype);
+
+    std::vector<STUB_RECORD> zone;
+    std::map<std::string, std::vector<const STUB_RECORD *>> byName;
+    std::vector<COMPILED> answers;
+    std::vector<SLOT> table; // Open addressing, the size is power of two
+};
+
+class StubUdpServer {
+public:
+    /**
+     * @brief Constructor of the server, the zone must live until the server is stopped
+     * @param zone
+     * */
+    explicit StubUdpServer(const StubZone &zone);
+
+    ~StubUdpServer();
+
+    /**
+     * @brief Binds the sockets on 127.0.0.1 and starts the threads, every thread has own SO_REUSEPORT socket
+     * @param port Port of the server, 0 for ephemeral one
+     * @param threads Number of the serving threads
+     * @return int port of the server, TransportError is thrown when a socket can't be bound
+     * */
+    int start(int port = 0, int threads = 1);
+
+    /**
+     * @brief Stops the threads, called by destructor too
+     * @return
+     * */
+    void stop();
+
+    uint64_t answered() const { return answeredCount; }
+
+private:
+    void serve(int sock);
+
+    const StubZone &zone;
+    std::vector<int> socks;
+    std::vector<std::thread> threads;
+    std::atomic<bool> running;
+    std::atomic<uint64_t> answeredCount;
+};
+
+#endif // STUB_SERVER_H
@@ -7,6 +7,30 @@
 #include "googletest/googletest/include/gtest/gtest.h"
 #include "googletest/googlemock/include/gmock/gmock.h"
 #include "dns-resolver.h"
+#include "zone-transfer.h"
+#include "stub-server.h"
+#include "name-utils.h"
+#include "result-file.h"
+#include "loadgen.h"
+#include "transport.h"
+#include "bulk-resolver.h"
+#include "cache.h"
+#include "congestion.h"
+#include "local-table.h"
+#include "packet-log.h"
+#include "async-resolver.h"
+#include "resolver-session.h"
+#include "name-input.h"
+#include "name-watcher.h"
+#include "upstream-ring.h"
+#include "trace.h"
+#include "message-index.h"
+#include "address-answer.h"
+#include <fstream>
+#include <random>
+#include <set>
+#include <sys/stat.h>
+#include <unistd.h>
 
 
 TEST(Ipv4ATestSuite, CnameGithubTest)
@@ -219,6 +243,2399 @@ ASSERT_EQ(result.additionals.front().value, "2001:67c0:e000:0000:0000:0000:0000:
 
 }
 
+TEST(ZoneTransferSuite, AxfrFromStubServer)
+{
+StubAuthServer server("example.test", 100000, 7);
+
+Args args;
+args.server = (char *) "127.0.0.1";
+args.port = server.start();
+args.domain = "example.test";
+args.xfr = T_AXFR;
+
+size_t records = 0;
+DNS_REC last;
+ZoneTransfer zoneTransfer(args);
+zoneTransfer.connectToDNSServer();
+XFR_STATS stats = zoneTransfer.transfer([&](const DNS_REC &record, bool removed) {
+    ASSERT_FALSE(removed);
+    if (records == 0) {
+        ASSERT_EQ(record.type, "SOA");
+        ASSERT_EQ(record.value, "ns1.example.test. hostmaster.example.test. 7 3600 600 86400 300");
+    }
+    records++;
+    last = record;
+});
+
+ASSERT_EQ(records, 100002); // SOA, NS and the hosts, closing SOA is not reported
+ASSERT_EQ(stats.records, 100003);
+ASSERT_GT(stats.messages, 1);
+ASSERT_EQ(last.name, "h99999.example.test");
+ASSERT_EQ(last.type, "A");
+ASSERT_EQ(last.value, "10.1.134.160");
+}
+
+TEST(ZoneTransferSuite, IxfrDifference)
+{
+StubAuthServer server("example.test", 10, 7);
+
+Args args;
+args.server = (char *) "127.0.0.1";
+args.port = server.start();
+args.domain = "example.test";
+args.xfr = T_IXFR;
+args.xfrSerial = 6;
+
+std::vector<std::string> changes;
+ZoneTransfer zoneTransfer(args);
+zoneTransfer.connectToDNSServer();
+zoneTransfer.transfer([&](const DNS_REC &record, bool removed) {
+    changes.push_back((removed ? "-" : "+") + record.type + " " + record.value);
+});
+
+std::vector<std::string> expected = {
+    "+SOA ns1.example.test. hostmaster.example.test. 7 3600 600 86400 300",
+    "-SOA ns1.example.test. hostmaster.example.test. 6 3600 600 86400 300",
+    "-A 10.0.0.0",
+    "+SOA ns1.example.test. hostmaster.example.test. 7 3600 600 86400 300",
+    "+A 10.0.0.1"};
+ASSERT_EQ(changes, expected);
+}
+
+TEST(ZoneTransferSuite, IxfrUpToDate)
+{
+StubAuthServer server("example.test", 10, 7);
+
+Args args;
+args.server = (char *) "127.0.0.1";
+args.port = server.start();
+args.domain = "example.test";
+args.xfr = T_IXFR;
+args.xfrSerial = 7;
+
+size_t records = 0;
+ZoneTransfer zoneTransfer(args);
+zoneTransfer.connectToDNSServer();
+XFR_STATS stats = zoneTransfer.transfer([&](const DNS_REC &, bool) { records++; });
+
+ASSERT_EQ(records, 1);
+ASSERT_EQ(stats.messages, 1);
+}
+
+TEST(ZoneTransferSuite, ParserAcceptsArbitrarySplits)
+{
+StubAuthServer server("example.test", 2000, 1);
+std::string stream;
+server.writeTransfer(42, T_AXFR, 0, [&](const unsigned char *data, size_t len) {
+    stream.append(reinterpret_cast<const char *>(data), len);
+});
+
+for (size_t split : {1, 2, 3, 7, 1000, 65536}) {
+    size_t records = 0;
+    XfrStreamParser parser(42, T_AXFR, [&](const DNS_REC &, bool) { records++; });
+    for (size_t i = 0; i < stream.size(); i += split) {
+        size_t len = std::min(split, stream.size() - i);
+        ASSERT_TRUE(parser.feed(reinterpret_cast<const unsigned char *>(stream.data()) + i, len));
+    }
+    ASSERT_TRUE(parser.finished());
+    ASSERT_EQ(records, 2002);
+}
+}
+
+TEST(ZoneTransferSuite, ParserRejectsForeignId)
+{
+StubAuthServer server("example.test", 1, 1);
+std::string stream;
+server.writeTransfer(42, T_AXFR, 0, [&](const unsigned char *data, size_t len) {
+    stream.append(reinterpret_cast<const char *>(data), len);
+});
+
+XfrStreamParser parser(43, T_AXFR, [](const DNS_REC &, bool) {});
+ASSERT_FALSE(parser.feed(reinterpret_cast<const unsigned char *>(stream.data()), stream.size()));
+ASSERT_FALSE(parser.finished());
+}
+
+// Length prefixed message with the single record, as sent by servers with one-answer transfer format
+static std::string xfrMessage(uint16_t id, uint16_t type, uint32_t value)
+{
+    unsigned char buf[MAX_DNS_SIZE] = {0};
+    DNS_HEADER *header = reinterpret_cast<DNS_HEADER *>(buf + 2);
+    header->id = htons(id);
+    header->qr = 1;
+    header->ancount = htons(1);
+
+    size_t pos = 2 + sizeof(DNS_HEADER);
+    pos += encodeName("example.test", buf + pos);
+    unsigned char fixed[] = {0, (unsigned char)type, 0, 1, 0, 0, 0, 60, 0, 0};
+    memcpy(buf + pos, fixed, sizeof(fixed));
+    size_t rdlength = pos + 8;
+    pos += sizeof(fixed);
+
+    size_t rdata = pos;
+    if (type == T_SOA)
+    {
+        pos += encodeName("ns1.example.test", buf + pos);
+        pos += encodeName("hostmaster.example.test", buf + pos);
+        for (int i = 0; i < 5; i++, pos += 4)
+        {
+            uint32_t field = htonl(i == 0 ? value : 60);
+            memcpy(buf + pos, &field, 4);
+        }
+    }
+    else
+    {
+        uint32_t address = htonl(value);
+        memcpy(buf + pos, &address, 4);
+        pos += 4;
+    }
+    buf[rdlength] = (pos - rdata) >> 8;
+    buf[rdlength + 1] = (pos - rdata) & 0xFF;
+    buf[0] = (pos - 2) >> 8;
+    buf[1] = (pos - 2) & 0xFF;
+    return std::string(reinterpret_cast<const char *>(buf), pos);
+}
+
+TEST(ZoneTransferSuite, IxfrOneRecordPerMessage)
+{
+// Difference 6 -> 7: SOA 7, SOA 6, deleted A, SOA 7, added A, SOA 7
+std::vector<std::string> messages = {xfrMessage(42, T_SOA, 7), xfrMessage(42, T_SOA, 6), xfrMessage(42, T_A, 1),
+                                     xfrMessage(42, T_SOA, 7), xfrMessage(42, T_A, 2), xfrMessage(42, T_SOA, 7)};
+std::vector<std::string> changes;
+XfrStreamParser parser(42, T_IXFR, [&](const DNS_REC &record, bool removed) {
+    changes.push_back((removed ? "-" : "+") + record.type);
+}, 6);
+for (size_t i = 0; i < messages.size(); i++)
+{
+    ASSERT_FALSE(parser.finished()) << i;
+    ASSERT_TRUE(parser.feed(reinterpret_cast<const unsigned char *>(messages[i].data()), messages[i].size()));
+}
+ASSERT_TRUE(parser.finished());
+std::vector<std::string> expected = {"+SOA", "-SOA", "-A", "+SOA", "+A"};
+ASSERT_EQ(changes, expected);
+
+// The single SOA is up to date only when it isn't newer, or when the server closes the stream after it
+XfrStreamParser current(42, T_IXFR, [](const DNS_REC &, bool) {}, 7);
+ASSERT_TRUE(current.feed(reinterpret_cast<const unsigned char *>(messages[0].data()), messages[0].size()));
+ASSERT_TRUE(current.finished());
+
+XfrStreamParser closed(42, T_IXFR, [](const DNS_REC &, bool) {}, 6);
+ASSERT_TRUE(closed.feed(reinterpret_cast<const unsigned char *>(messages[0].data()), messages[0].size()));
+ASSERT_FALSE(closed.finished());
+ASSERT_TRUE(closed.endOfStream());
+
+XfrStreamParser axfr(42, T_AXFR, [](const DNS_REC &, bool) {});
+ASSERT_TRUE(axfr.feed(reinterpret_cast<const unsigned char *>(messages[0].data()), messages[0].size()));
+ASSERT_FALSE(axfr.endOfStream());
+}
+
+TEST(ZoneTransferSuite, StalledPrimaryTimesOut)
+{
+// Listening socket which never answers, the connection is completed by the kernel
+int listener = socket(AF_INET, SOCK_STREAM, 0);
+sockaddr_in address = {};
+address.sin_family = AF_INET;
+address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+socklen_t length = sizeof(address);
+ASSERT_EQ(bind(listener, reinterpret_cast<sockaddr *>(&address), length), 0);
+ASSERT_EQ(listen(listener, 1), 0);
+getsockname(listener, reinterpret_cast<sockaddr *>(&address), &length);
+
+Args args;
+args.server = (char *) "127.0.0.1";
+args.port = ntohs(address.sin_port);
+args.domain = "example.test";
+args.xfr = T_AXFR;
+args.timeout = 100;
+
+auto start = std::chrono::steady_clock::now();
+ZoneTransfer zoneTransfer(args);
+zoneTransfer.connectToDNSServer();
+ASSERT_THROW(zoneTransfer.transfer([](const DNS_REC &, bool) {}), TransportError);
+ASSERT_LT(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(1000));
+
+// The budget ends the transfer before the idle timeout
+args.timeout = 5000;
+args.budget = 100;
+start = std::chrono::steady_clock::now();
+ZoneTransfer bounded(args);
+bounded.connectToDNSServer();
+ASSERT_THROW(bounded.transfer([](const DNS_REC &, bool) {}), TransportError);
+ASSERT_LT(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(1000));
+close(listener);
+}
+
+TEST(NameUtilsSuite, MatchesScalarForAllLengths)
+{
+std::string upper, lower;
+for (size_t len = 1; len < 300; len++) {
+    char c = "AbCdEfGhIjKlMnOpQrStUvWxYz0123456789-_"[len % 38];
+    upper.push_back(toupper(c));
+    lower.push_back(tolower(c));
+
+    std::string converted(len, ' ');
+    nameToLower(upper.data(), &converted[0], len);
+    ASSERT_EQ(converted, lower);
+    ASSERT_TRUE(nameEquals(upper, lower));
+    ASSERT_EQ(nameHash(upper), nameHashScalar(lower.data(), len));
+    ASSERT_EQ(nameHash(upper), nameHash(lower));
+}
+
+// Difference in the last byte of the tail and of the full block
+ASSERT_FALSE(nameEquals(std::string("www.example.com"), std::string("www.example.coM.")));
+ASSERT_FALSE(nameEquals(std::string("www.example.com"), std::string("www.example.con")));
+ASSERT_FALSE(nameEquals(std::string("abcdefghijklmnopqrstuvwxyzabcdef"), std::string("abcdefghijklmnopqrstuvwxyzabcdeg")));
+ASSERT_NE(nameHash(std::string("example.com")), nameHash(std::string("example.org")));
+}
+
+TEST(NameUtilsSuite, ExactSizedBuffers)
+{
+// Every tail is read only inside of its allocation, the sanitizer build reports any read past it
+for (size_t len = 1; len < 70; len++)
+{
+    std::unique_ptr<char[]> a(new char[len]), b(new char[len]), out(new char[len]);
+    for (size_t i = 0; i < len; i++)
+    {
+        a[i] = "WwW.ExAmPlE.CoM"[i % 15];
+        b[i] = tolower(a[i]);
+    }
+    ASSERT_TRUE(nameEquals(a.get(), len, b.get(), len));
+    ASSERT_EQ(nameHash(a.get(), len), nameHashScalar(b.get(), len));
+    nameToLower(a.get(), out.get(), len);
+    ASSERT_EQ(memcmp(out.get(), b.get(), len), 0);
+    ASSERT_EQ(validateName(a.get(), len), validateNameScalar(a.get(), len));
+}
+}
+
+TEST(NameUtilsSuite, ValidatePresentationName)
+{
+const char *valid[] = {"example.com", "www.Example.COM.", "_dmarc.example.com", "a-b.c", "x"};
+const char *invalid[] = {"", ".", "a..b", "exa mple.com", "ex@mple.com", "caf\xc3\xa9.com", ".example.com"};
+
+for (const char *name : valid)
+    ASSERT_TRUE(validateName(name, strlen(name))) << name;
+for (const char *name : invalid) {
+    ASSERT_FALSE(validateName(name, strlen(name))) << name;
+    ASSERT_EQ(validateName(name, strlen(name)), validateNameScalar(name, strlen(name))) << name;
+}
+
+ASSERT_TRUE(validateName(std::string(63, 'a') + ".com"));
+ASSERT_FALSE(validateName(std::string(64, 'a') + ".com"));
+}
+
+TEST(NameUtilsSuite, ValidateWireName)
+{
+unsigned char wire[256];
+size_t len = encodeName("www.Example.com", wire);
+
+ASSERT_EQ(validateWireName(wire, len), len);
+ASSERT_EQ(validateWireName(wire, len - 1), 0); // missing terminating zero
+wire[5] = '.';
+ASSERT_EQ(validateWireName(wire, len), 0);
+
+const unsigned char pointer[] = {3, 'w', 'w', 'w', 0xC0, 0x0C};
+ASSERT_EQ(validateWireName(pointer, sizeof(pointer)), 0);
+}
+
+TEST(ResultFileSuite, RoundTripAcrossBatches)
+{
+const char *path = "/tmp/dns-result-file-test.col";
+const size_t rows = RESULT_BATCH_ROWS + 1000;
+
+std::string error;
+{
+    ResultFileWriter writer;
+    ASSERT_TRUE(writer.open(path, error));
+    for (size_t i = 0; i < rows; i++) {
+        BULK_RESULT result;
+        result.name = "host" + std::to_string(i) + (i % 2 ? ".example.com" : ".example.org");
+        result.qtype = i % 3 ? T_A : T_AAAA;
+        result.rcode = i % 10 == 0 ? 3 : 0;
+        result.ttl = i;
+        result.rtt = 1000 + i;
+        BULK_ADDRESS address = {0};
+        address[15] = i & 0xFF;
+        for (size_t j = 0; j < i % 3; j++)
+            result.addresses.push_back(address);
+        writer.append(result);
+    }
+    ASSERT_TRUE(writer.close(error));
+}
+
+ResultFileReader reader;
+ASSERT_TRUE(reader.open(path, error));
+ASSERT_EQ(reader.batches(), 2);
+ASSERT_EQ(reader.rows(), rows);
+
+ResultBatch second = reader.batch(1);
+size_t len, count;
+const char *name = second.name(4, len);
+ASSERT_EQ(std::string(name, len), "host" + std::to_string(RESULT_BATCH_ROWS + 4) + ".example.org");
+ASSERT_EQ(second.ttl(4), RESULT_BATCH_ROWS + 4);
+const BULK_ADDRESS *addresses = second.rowAddresses(4, count);
+ASSERT_EQ(count, 2);
+ASSERT_EQ(addresses[1][15], (RESULT_BATCH_ROWS + 4) & 0xFF);
+
+RESULT_FILTER filter;
+ASSERT_TRUE(parseResultFilter("rcode=NXDOMAIN", filter));
+ASSERT_TRUE(parseResultFilter("suffix=EXAMPLE.org.", filter));
+RESULT_SUMMARY summary = aggregateResults(reader, filter);
+ASSERT_EQ(summary.rows, (rows + 9) / 10); // every tenth row is even, so it is in example.org
+ASSERT_EQ(summary.rcodes[3], summary.rows);
+
+ASSERT_TRUE(parseResultFilter("type=AAAA", filter));
+ASSERT_FALSE(parseResultFilter("colour=blue", filter));
+summary = aggregateResults(reader, filter);
+ASSERT_EQ(summary.rows, (rows + 29) / 30);
+
+unlink(path);
+}
+
+TEST(ResultFileSuite, EmptyFile)
+{
+const char *path = "/tmp/dns-result-file-empty.col";
+std::string error;
+{
+    ResultFileWriter writer;
+    ASSERT_TRUE(writer.open(path, error));
+}
+ResultFileReader reader;
+ASSERT_TRUE(reader.open(path, error));
+ASSERT_EQ(reader.batches(), 0);
+ASSERT_EQ(aggregateResults(reader, RESULT_FILTER()).rows, 0);
+unlink(path);
+}
+
+TEST(ResultFileSuite, TruncatedFile)
+{
+const char *path = "/tmp/dns-result-file-truncated.col";
+std::string error;
+{
+    ResultFileWriter writer;
+    ASSERT_TRUE(writer.open(path, error));
+    BULK_RESULT result;
+    result.name = "www.example.com";
+    result.qtype = T_A;
+    for (int i = 0; i < 100; i++)
+        writer.append(result);
+}
+
+struct stat info;
+ASSERT_EQ(stat(path, &info), 0);
+ResultFileReader reader;
+// Every cut loses the trailer or its batch, none of them may be mapped as valid
+for (off_t size : {info.st_size - 1, info.st_size - 4, info.st_size / 2, (off_t)40, (off_t)8, (off_t)0}) {
+    ASSERT_EQ(truncate(path, size), 0);
+    error.clear();
+    ASSERT_FALSE(reader.open(path, error)) << size;
+    ASSERT_FALSE(error.empty());
+    ASSERT_EQ(reader.batches(), 0);
+}
+
+unlink(path);
+ASSERT_FALSE(reader.open(path, error));
+ResultFileWriter writer;
+ASSERT_FALSE(writer.open("/nonexistent-directory/results.col", error));
+}
+
+TEST(LoadGenSuite, HistogramPercentiles)
+{
+LatencyHistogram histogram;
+for (uint64_t us = 1; us <= 10000; us++)
+    histogram.record(us);
+
+ASSERT_EQ(histogram.count(), 10000);
+// Relative error of the bucket is below 1/64
+ASSERT_NEAR(histogram.percentile(0.5), 5000, 5000 / 64 + 1);
+ASSERT_NEAR(histogram.percentile(0.99), 9900, 9900 / 64 + 1);
+ASSERT_GE(histogram.percentile(1), 10000);
+ASSERT_EQ(histogram.percentile(0.001), 10);
+
+LatencyHistogram other;
+other.record(1000000);
+histogram.merge(other);
+ASSERT_EQ(histogram.count(), 10001);
+ASSERT_NEAR(histogram.percentile(1), 1000000, 1000000 / 64 + 1);
+}
+
+TEST(LoadGenSuite, ScheduleSteps)
+{
+LoadSchedule schedule({1000, 2000}, 1);
+uint64_t time, last = 0;
+size_t count = 0, firstStep = 0;
+
+while (schedule.next(time))
+{
+    ASSERT_GE(time, last);
+    last = time;
+    if (time < 1000000000)
+        firstStep++;
+    count++;
+}
+ASSERT_EQ(count, 3000);
+ASSERT_EQ(firstStep, 1000);
+ASSERT_LT(last, 2000000000);
+ASSERT_EQ(schedule.rateAt(1.5), 2000);
+ASSERT_EQ(schedule.duration(), 2);
+}
+
+TEST(LoadGenSuite, ReadQueryFile)
+{
+std::istringstream input("example.com\n# comment\n\n  www.example.com  AAAA\nexample.org MX\n");
+std::vector<LOADGEN_QUERY> queries = readQueryFile(input, T_A);
+
+ASSERT_EQ(queries.size(), 3);
+ASSERT_EQ(queries[0].name, "example.com");
+ASSERT_EQ(queries[0].qtype, T_A);
+ASSERT_EQ(queries[1].name, "www.example.com");
+ASSERT_EQ(queries[1].qtype, T_AAAA);
+ASSERT_EQ(queries[2].qtype, T_MX);
+}
+
+// Zone of the stub server with the same answers as the live servers above
+static const char *stubZoneText =
+    "$ORIGIN github.com.\n"
+    "@     SOA  ns1 hostmaster 1 3600 600 86400 300\n"
+    "@  60 A    140.82.121.4\n"
+    "www   CNAME github.com.\n"
+    "$ORIGIN vut.cz.\n"
+    "fit   AAAA 2001:67c:1220:8090::93e5:91a0\n"
+    "26.9.229.147.in-addr.arpa. PTR www.fit\n";
+
+static DNS_INFO askStub(Args arguments)
+{
+    StubZone zone;
+    std::string error;
+    std::istringstream input(stubZoneText);
+    EXPECT_TRUE(zone.load(input, error)) << error;
+
+    StubUdpServer server(zone);
+    arguments.server = (char *)"127.0.0.1";
+    arguments.port = server.start();
+
+    DnsResolver dnsResolver(arguments);
+    dnsResolver.connectToDNSServer();
+    dnsResolver.query();
+    return dnsResolver.getAnswer();
+}
+
+TEST(LoadGenSuite, ReplayAgainstStub)
+{
+StubZone zone;
+std::string error;
+std::istringstream input(stubZoneText);
+ASSERT_TRUE(zone.load(input, error)) << error;
+StubUdpServer server(zone);
+
+Args arguments;
+arguments.server = (char *)"127.0.0.1";
+arguments.port = server.start();
+
+LOADGEN_OPTIONS options;
+options.rates = {400, 800};
+options.stepSeconds = 0.5;
+options.interval = 0.5;
+options.timeout = 200;
+
+LoadGenerator loadGenerator(arguments, options);
+loadGenerator.connectToDNSServer();
+ASSERT_THROW(loadGenerator.run({{"bad..name", T_A}}, [](const LOADGEN_INTERVAL &) {}), TransportError);
+
+std::vector<LOADGEN_INTERVAL> intervals;
+LOADGEN_INTERVAL total = loadGenerator.run({{"github.com", T_A}, {"www.github.com", T_A}}, [&](const LOADGEN_INTERVAL &interval) {
+    intervals.push_back(interval);
+});
+
+// The schedule decides the counts, the loopback server answers all of them
+ASSERT_EQ(intervals.size(), 2);
+ASSERT_EQ(intervals[0].sent, 200);
+ASSERT_EQ(intervals[1].sent, 400);
+ASSERT_EQ(total.sent, 600);
+ASSERT_EQ(total.received, total.sent);
+ASSERT_EQ(total.lost, 0);
+ASSERT_EQ(server.answered(), total.sent);
+for (const LOADGEN_INTERVAL &interval : intervals)
+    ASSERT_NEAR(interval.sentQps, interval.targetQps, interval.targetQps / 10);
+ASSERT_EQ(total.latency.count(), total.received);
+}
+
+TEST(StubServerSuite, CnameGithub)
+{
+Args arguments;
+arguments.domain = "www.github.com";
+DNS_INFO result = askStub(arguments);
+
+ASSERT_EQ(result.ancount, 2);
+ASSERT_EQ(result.aa, "Yes");
+ASSERT_EQ(result.answers[0].type, "CNAME");
+ASSERT_EQ(result.answers[0].name.substr(0,  result.answers[0].name.size()-1), "www.github.com");
+ASSERT_EQ(result.answers[0].value.substr(0,  result.answers[0].value.size()-1), "github.com");
+ASSERT_EQ(result.answers[1].type, "A");
+ASSERT_EQ(result.answers[1].value, "140.82.121.4");
+ASSERT_EQ(result.answers[1].ttl, 60);
+ASSERT_EQ(result.answers[1].name.substr(0,  result.answers[1].name.size()-1), "github.com");
+}
+
+TEST(StubServerSuite, IPv6AndReverse)
+{
+Args arguments;
+arguments.domain = "fit.vut.cz";
+arguments.use_ipv6 = true;
+DNS_INFO result = askStub(arguments);
+
+ASSERT_EQ(result.ancount, 1);
+ASSERT_EQ(result.answers.front().value, "2001:67c0:1220:8090:0000:0000:93e5:91a0");
+ASSERT_EQ(result.answers.front().type, "AAAA");
+
+Args reverse;
+reverse.reverse = true;
+reverse.domain = "147.229.9.26";
+result = askStub(reverse);
+
+ASSERT_EQ(result.ancount, 1);
+ASSERT_EQ(result.questionName, "26.9.229.147.in-addr.arpa.");
+ASSERT_EQ(result.answers.front().value, "www.fit.vut.cz");
+}
+
+TEST(StubServerSuite, NegativeAnswers)
+{
+StubZone zone;
+std::string error;
+std::istringstream input(stubZoneText);
+ASSERT_TRUE(zone.load(input, error));
+
+unsigned char query[MAX_DNS_SIZE], out[MAX_DNS_SIZE];
+const DNS_HEADER *header = reinterpret_cast<const DNS_HEADER *>(out);
+struct {
+    const char *name;
+    uint16_t qtype;
+    int rcode;
+    int ancount;
+    int nscount;
+} cases[] = {
+    {"GitHub.COM", T_A, 0, 1, 0},
+    {"github.com", T_MX, 0, 0, 1},        // No data, SOA for negative caching
+    {"nope.github.com", T_A, 3, 0, 1},    // NXDOMAIN below the apex
+    {"www.github.com", T_MX, 0, 1, 0},    // Only the CNAME
+    {"example.org", T_A, 5, 0, 0},        // Refused, not our zone
+};
+
+for (const auto &c : cases)
+{
+    size_t length = buildQuery(query, 0x1234, c.name, c.qtype, true);
+    size_t answer = zone.answer(query, length, out);
+
+    ASSERT_GE(answer, length) << c.name;
+    ASSERT_EQ(ntohs(header->id), 0x1234);
+    ASSERT_EQ(header->rd, 1);
+    ASSERT_EQ(header->rcode, c.rcode) << c.name;
+    ASSERT_EQ(ntohs(header->ancount), c.ancount) << c.name;
+    ASSERT_EQ(ntohs(header->nscount), c.nscount) << c.name;
+    // Question is copied from the query including the case of the letters
+    ASSERT_EQ(memcmp(out + sizeof(DNS_HEADER), query + sizeof(DNS_HEADER), length - sizeof(DNS_HEADER)), 0);
+
+    size_t pos = length;
+    DNS_REC record;
+    for (int i = 0; i < c.ancount + c.nscount; i++)
+        ASSERT_TRUE(decodeRecord(out, answer, pos, record));
+    ASSERT_EQ(pos, answer);
+}
+
+// Answers are never sent to answers
+size_t length = buildQuery(query, 1, "github.com", T_A, false);
+reinterpret_cast<DNS_HEADER *>(query)->qr = 1;
+ASSERT_EQ(zone.answer(query, length, out), 0);
+}
+
+TEST(StubServerSuite, EmptyNonTerminal)
+{
+StubZone zone;
+std::string error;
+std::istringstream input("$ORIGIN example.com.\n@ SOA ns1 hostmaster 1 3600 600 86400 300\na.b A 10.0.0.1\n");
+ASSERT_TRUE(zone.load(input, error)) << error;
+
+// b.example.com has no records but a name below it, so it exists
+unsigned char query[MAX_DNS_SIZE], out[MAX_DNS_SIZE];
+const DNS_HEADER *header = reinterpret_cast<const DNS_HEADER *>(out);
+zone.answer(query, buildQuery(query, 1, "b.example.com", T_A, true), out);
+ASSERT_EQ(header->rcode, RCODE_NOERROR);
+ASSERT_EQ(ntohs(header->ancount), 0);
+ASSERT_EQ(ntohs(header->nscount), 1);
+zone.answer(query, buildQuery(query, 2, "c.b.example.com", T_A, true), out);
+ASSERT_EQ(header->rcode, RCODE_NXDOMAIN);
+
+// The no data answer must not cut the names below it out of the bulk run
+Args arguments;
+BULK_OPTIONS options;
+options.timeout = 10;
+options.window = 1;
+options.adaptive = false;
+BulkResolver resolver(arguments, options);
+resolver.useTransport(std::unique_ptr<Transport>(new LoopbackTransport([&](const unsigned char *request, size_t len, unsigned char *response) {
+    return zone.answer(request, len, response);
+})));
+std::istringstream names("b.example.com\na.b.example.com\n");
+std::map<std::string, BULK_RESULT> results;
+resolver.run(names, [&](const BULK_RESULT &result) { results[result.name] = result; });
+ASSERT_EQ(results["b.example.com"].rcode, RCODE_NOERROR);
+ASSERT_EQ(results["a.b.example.com"].rcode, RCODE_NOERROR);
+ASSERT_EQ(results["a.b.example.com"].addresses.size(), 1);
+}
+
+TEST(StubServerSuite, PortInUse)
+{
+StubZone zone;
+std::string error;
+std::istringstream input(stubZoneText);
+ASSERT_TRUE(zone.load(input, error));
+
+// Port held by a socket without SO_REUSEPORT, the failure goes to the caller
+int holder = socket(AF_INET, SOCK_DGRAM, 0);
+struct sockaddr_in address;
+socklen_t addressLength = sizeof(address);
+memset(&address, 0, sizeof(address));
+address.sin_family = AF_INET;
+address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+ASSERT_EQ(bind(holder, (struct sockaddr *)&address, sizeof(address)), 0);
+ASSERT_EQ(getsockname(holder, (struct sockaddr *)&address, &addressLength), 0);
+
+StubUdpServer server(zone);
+ASSERT_THROW(server.start(ntohs(address.sin_port), 2), TransportError);
+close(holder);
+ASSERT_EQ(server.start(ntohs(address.sin_port), 2), ntohs(address.sin_port));
+}
+
+TEST(StubServerSuite, ZoneSyntaxErrors)
+{
+StubZone zone;
+std::string error;
+std::istringstream badAddress("a.example. A 10.0.0\n");
+ASSERT_FALSE(zone.load(badAddress, error));
+ASSERT_EQ(error, "line 1: invalid A data");
+
+std::istringstream badType("$ORIGIN example.\n\na 300 IN BOGUS x\n");
+ASSERT_FALSE(zone.load(badType, error));
+ASSERT_EQ(error, "line 3: unknown type");
+ASSERT_EQ(zone.records(), 0);
+}
+
+TEST(TransportSuite, LoopbackRetriesLostQuery)
+{
+StubZone zone;
+std::string error;
+std::istringstream input(stubZoneText);
+ASSERT_TRUE(zone.load(input, error));
+
+// First datagram is lost, the second one is answered
+int queries = 0;
+LoopbackTransport *loopback = new LoopbackTransport([&](const unsigned char *query, size_t len, unsigned char *out) {
+    return ++queries == 1 ? 0 : zone.answer(query, len, out);
+});
+
+Args arguments;
+arguments.domain = "www.github.com";
+arguments.timeout = 10;
+DnsResolver dnsResolver(arguments);
+dnsResolver.useTransport(std::unique_ptr<Transport>(loopback));
+dnsResolver.query();
+DNS_INFO result = dnsResolver.getAnswer();
+
+ASSERT_EQ(queries, 2);
+ASSERT_EQ(result.ancount, 2);
+ASSERT_EQ(result.answers[1].value, "140.82.121.4");
+
+// Nothing is answered, the error goes to the caller
+DnsResolver silent(arguments);
+silent.useTransport(std::unique_ptr<Transport>(
+    new LoopbackTransport([](const unsigned char *, size_t, unsigned char *) { return (size_t)0; })));
+ASSERT_THROW(silent.query(), TransportError);
+}
+
+TEST(TransportSuite, BulkOverLoopback)
+{
+StubZone zone;
+std::string error;
+std::istringstream input(stubZoneText);
+ASSERT_TRUE(zone.load(input, error));
+
+// Names with "lost" in them are answered only on the second try
+std::map<std::string, int> tries;
+LoopbackTransport *loopback = new LoopbackTransport([&](const unsigned char *query, size_t len, unsigned char *out) {
+    size_t pos = sizeof(DNS_HEADER);
+    std::string name;
+    readName(query, len, pos, name);
+    return name.find("lost") != std::string::npos && ++tries[name] == 1 ? 0 : zone.answer(query, len, out);
+});
+
+Args arguments;
+BULK_OPTIONS options;
+options.timeout = 10;
+options.window = 4;
+BulkResolver resolver(arguments, options);
+resolver.useTransport(std::unique_ptr<Transport>(loopback));
+
+std::istringstream names("github.com\nwww.github.com\nlost.github.com\nfit.vut.cz\nexample.org\nbad..name\n");
+std::map<std::string, int> rcodes;
+BULK_STATS stats = resolver.run(names, [&](const BULK_RESULT &result) { rcodes[result.name] = result.rcode; });
+
+ASSERT_EQ(stats.names, 6);
+ASSERT_EQ(stats.answered, 5);
+ASSERT_EQ(stats.retransmits, 1);
+ASSERT_EQ(stats.timeouts, 0);
+ASSERT_EQ(rcodes["github.com"], 0);
+ASSERT_EQ(rcodes["lost.github.com"], 3);
+ASSERT_EQ(rcodes["fit.vut.cz"], 0);
+ASSERT_EQ(rcodes["example.org"], 5);
+ASSERT_EQ(rcodes["bad..name"], RCODE_INVALID);
+}
+
+TEST(TransportSuite, BulkRunsTwice)
+{
+StubZone zone;
+std::string error;
+std::istringstream input(stubZoneText);
+ASSERT_TRUE(zone.load(input, error));
+int queries = 0;
+LoopbackTransport *loopback = new LoopbackTransport([&](const unsigned char *query, size_t len, unsigned char *out) {
+    queries++;
+    return zone.answer(query, len, out);
+});
+
+Args arguments;
+BULK_OPTIONS options;
+options.timeout = 10;
+BulkResolver resolver(arguments, options);
+resolver.useTransport(std::unique_ptr<Transport>(loopback));
+
+// The second run keeps the transport and the cache of the first one
+std::istringstream first("github.com\n");
+BULK_STATS stats = resolver.run(first, [](const BULK_RESULT &) {});
+ASSERT_EQ(stats.answered, 1);
+ASSERT_EQ(queries, 1);
+
+std::istringstream second("github.com\nfit.vut.cz\n");
+std::map<std::string, int> rcodes;
+stats = resolver.run(second, [&](const BULK_RESULT &result) { rcodes[result.name] = result.rcode; });
+ASSERT_EQ(stats.names, 2);
+ASSERT_EQ(stats.cached, 1);
+ASSERT_EQ(queries, 2);
+ASSERT_EQ(rcodes["github.com"], RCODE_NOERROR);
+ASSERT_EQ(rcodes["fit.vut.cz"], RCODE_NOERROR);
+}
+
+TEST(TransportSuite, RecordAndReplay)
+{
+const char *path = "/tmp/dns-transport-capture.bin";
+unlink(path);
+
+StubZone zone;
+std::string error;
+std::istringstream input(stubZoneText);
+ASSERT_TRUE(zone.load(input, error));
+
+unsigned char query[MAX_DNS_SIZE], answer[MAX_DNS_SIZE];
+{
+    RecordingTransport recording(std::unique_ptr<Transport>(new LoopbackTransport(
+        [&](const unsigned char *q, size_t len, unsigned char *out) { return zone.answer(q, len, out); })), path);
+    for (const char *name : {"github.com", "nope.github.com"})
+    {
+        recording.send(query, buildQuery(query, 1, name, T_A, true));
+        ASSERT_TRUE(recording.wait(0));
+        ASSERT_GT(recording.receive(answer, sizeof(answer)), 0);
+    }
+}
+
+ReplayTransport replay(path);
+ASSERT_EQ(replay.responses(), 2);
+
+// Matched by the question regardless of the case, ID is taken from the query
+size_t length = buildQuery(query, 0xBEEF, "NOPE.github.com", T_A, true);
+replay.send(query, length);
+ASSERT_TRUE(replay.wait(0));
+size_t received = replay.receive(answer, sizeof(answer));
+const DNS_HEADER *header = reinterpret_cast<const DNS_HEADER *>(answer);
+ASSERT_GT(received, length);
+ASSERT_EQ(ntohs(header->id), 0xBEEF);
+ASSERT_EQ(header->rcode, 3);
+
+// Never recorded question is lost
+replay.send(query, buildQuery(query, 2, "github.com", T_AAAA, true));
+ASSERT_FALSE(replay.wait(0));
+ASSERT_EQ(replay.sent(), 2);
+
+unlink(path);
+}
+
+TEST(MultiTypeSuite, ParallelTypesMerged)
+{
+StubZone zone;
+std::string error;
+std::istringstream input(stubZoneText);
+ASSERT_TRUE(zone.load(input, error));
+
+LoopbackTransport *loopback = new LoopbackTransport(
+    [&](const unsigned char *query, size_t len, unsigned char *out) { return zone.answer(query, len, out); });
+
+Args arguments;
+arguments.qtypes = {T_AAAA, T_A, T_MX};
+BULK_OPTIONS options;
+options.window = 1; // Types of one name still go out together
+BulkResolver resolver(arguments, options);
+resolver.useTransport(std::unique_ptr<Transport>(loopback));
+
+std::vector<std::vector<BULK_RESULT>> merged;
+ResultMerger merger(queryTypes(arguments), [&](const std::vector<BULK_RESULT> &results) { merged.push_back(results); });
+std::istringstream names("fit.vut.cz\ngithub.com\nfit.vut.cz\nbad..name\n");
+BULK_STATS stats = resolver.run(names, [&](const BULK_RESULT &result) { merger.add(result); });
+
+ASSERT_EQ(stats.names, 4);
+ASSERT_EQ(stats.sent, 8); // AAAA of the repeated name is cached
+ASSERT_EQ(stats.cached, 1);
+ASSERT_EQ(merged.size(), 4);
+for (const std::vector<BULK_RESULT> &results : merged)
+{
+    ASSERT_EQ(results.size(), 3);
+    ASSERT_EQ(results[0].qtype, T_AAAA);
+    ASSERT_EQ(results[1].qtype, T_A);
+    ASSERT_EQ(results[2].qtype, T_MX);
+}
+// The same name twice is merged separately
+ASSERT_EQ(merged[0][0].name, "fit.vut.cz");
+ASSERT_EQ(merged[0][0].addresses.size(), 1);
+ASSERT_EQ(merged[0][1].addresses.size(), 0);
+ASSERT_EQ(merged[1][1].answers[0].value, "140.82.121.4");
+ASSERT_EQ(merged[2][0].index, 2);
+ASSERT_EQ(merged[3][2].rcode, RCODE_INVALID);
+
+ASSERT_EQ(queryTypes(Args()), std::vector<uint16_t>{T_A});
+}
+
+// Two servers behind one loopback, the first one knows only the CNAME to the second one
+static LoopbackTransport *twoZones(StubZone &first, StubZone &second, std::vector<std::string> &queried)
+{
+    return new LoopbackTransport([&](const unsigned char *query, size_t len, unsigned char *out) {
+        size_t pos = sizeof(DNS_HEADER);
+        std::string name;
+        readName(query, len, pos, name);
+        queried.push_back(name);
+        size_t length = first.answer(query, len, out);
+        return reinterpret_cast<DNS_HEADER *>(out)->rcode == 5 ? second.answer(query, len, out) : length;
+    });
+}
+
+TEST(CacheSuite, FollowsChainAcrossZones)
+{
+StubZone shop, cdn;
+std::string error;
+std::istringstream shopText("$ORIGIN shop.example.\n@ SOA ns hostmaster 1 3600 600 86400 300\n"
+                            "www 300 CNAME edge.cdn.net.\nimg 300 CNAME edge.cdn.net.\nloop CNAME loop2\nloop2 CNAME loop\n");
+std::istringstream cdnText("$ORIGIN cdn.net.\n@ SOA ns hostmaster 1 3600 600 86400 300\nedge 30 A 192.0.2.7\n");
+ASSERT_TRUE(shop.load(shopText, error));
+ASSERT_TRUE(cdn.load(cdnText, error));
+
+std::vector<std::string> queried;
+Args arguments;
+BulkResolver resolver(arguments, BULK_OPTIONS());
+resolver.useTransport(std::unique_ptr<Transport>(twoZones(shop, cdn, queried)));
+
+std::vector<BULK_RESULT> results;
+std::istringstream names("www.shop.example\n");
+BULK_STATS stats = resolver.run(names, [&](const BULK_RESULT &result) { results.push_back(result); });
+
+// Answer of the first server ends with the CNAME, its target is asked next
+ASSERT_EQ(queried, (std::vector<std::string>{"www.shop.example", "edge.cdn.net"}));
+ASSERT_EQ(stats.followups, 1);
+ASSERT_EQ(results[0].rcode, 0);
+ASSERT_EQ(results[0].answers.size(), 2);
+ASSERT_EQ(results[0].answers[0].type, "CNAME");
+ASSERT_EQ(results[0].answers[1].value, "192.0.2.7");
+ASSERT_EQ(results[0].addresses.size(), 1);
+ASSERT_EQ(results[0].ttl, 30);
+
+// Shared target is cached, one round trip for the new link, none for the repeated name
+BulkResolver second(arguments, BULK_OPTIONS());
+std::swap(second.recordCache(), resolver.recordCache());
+queried.clear();
+results.clear();
+second.useTransport(std::unique_ptr<Transport>(twoZones(shop, cdn, queried)));
+std::istringstream more("img.shop.example\nWWW.shop.example.\nloop.shop.example\n");
+stats = second.run(more, [&](const BULK_RESULT &result) { results.push_back(result); });
+
+ASSERT_EQ(queried, (std::vector<std::string>{"img.shop.example", "loop.shop.example"}));
+ASSERT_EQ(stats.cached, 1);
+ASSERT_EQ(stats.followups, 0);
+ASSERT_EQ(results.size(), 3);
+for (const BULK_RESULT &result : results)
+{
+    if (result.name == "loop.shop.example")
+        ASSERT_EQ(result.rcode, 2); // CNAME loop is SERVFAIL
+    else
+        ASSERT_EQ(result.answers.back().value, "192.0.2.7") << result.name;
+}
+}
+
+TEST(CacheSuite, TtlAndLoops)
+{
+RecordCache cache;
+RecordCache::Clock::time_point now = RecordCache::Clock::now();
+DNS_REC a = {60, "b.example", "A", "192.0.2.1"};
+DNS_REC cname = {10, "A.example", "CNAME", "b.example"};
+DNS_REC zero = {0, "c.example", "A", "192.0.2.2"};
+
+cache.store("a.example", T_CNAME, {cname}, now);
+cache.store("b.example", T_A, {a}, now);
+cache.store("c.example", T_A, {zero}, now);
+ASSERT_EQ(cache.size(), 2); // Zero TTL is never cached
+
+std::vector<DNS_REC> chain, answers;
+std::string next;
+ASSERT_EQ(cache.follow("a.EXAMPLE", T_A, now + std::chrono::seconds(5), chain, answers, next), CHAIN_COMPLETE);
+ASSERT_EQ(chain.size(), 1);
+ASSERT_EQ(answers[0].ttl, 55); // Remaining time
+
+// Link expires on its own, the target stays
+chain.clear();
+ASSERT_EQ(cache.follow("a.example", T_A, now + std::chrono::seconds(11), chain, answers, next), CHAIN_QUERY);
+ASSERT_EQ(next, "a.example");
+ASSERT_TRUE(cache.lookup("b.example", T_A, answers, now + std::chrono::seconds(11)));
+
+// Records of the message are used even with zero TTL, loop is detected
+RRSETS message;
+message[std::make_pair(std::string("x.example"), (uint16_t)T_CNAME)] = {{0, "x.example", "CNAME", "y.example"}};
+message[std::make_pair(std::string("y.example"), (uint16_t)T_CNAME)] = {{0, "y.example", "CNAME", "X.example"}};
+chain.clear();
+ASSERT_EQ(cache.follow("x.example", T_A, now, chain, answers, next, &message), CHAIN_LOOP);
+ASSERT_EQ(chain.size(), 2);
+}
+
+TEST(CacheSuite, NegativeAnswers)
+{
+Args arguments;
+arguments.domain = "nope.github.com";
+DNS_INFO result = askStub(arguments);
+
+ASSERT_EQ(result.rcode, RCODE_NXDOMAIN);
+ASSERT_EQ(result.authorities.size(), 1);
+ASSERT_EQ(result.authorities[0].type, "SOA");
+SOA_RECORD soa;
+ASSERT_TRUE(parseSoa(result.authorities[0].value, soa));
+ASSERT_EQ(soa.serial, 1);
+ASSERT_EQ(soa.minimum, 300);
+
+// Cached for min(SOA TTL, MINIMUM)
+RecordCache cache;
+RecordCache::Clock::time_point now = RecordCache::Clock::now();
+soa.ttl = 3600;
+cache.storeNegative("gone.example", T_A, RCODE_NXDOMAIN, soa, now);
+soa.ttl = 60;
+cache.storeNegative("empty.example", T_MX, RCODE_NOERROR, soa, now);
+ASSERT_EQ(cache.negative("gone.example", T_AAAA, now + std::chrono::seconds(299)), RCODE_NXDOMAIN);
+ASSERT_EQ(cache.negative("deep.below.GONE.example", T_A, now), RCODE_NXDOMAIN); // NXDOMAIN cut
+ASSERT_EQ(cache.negative("gone.example", T_A, now + std::chrono::seconds(300)), -1);
+ASSERT_EQ(cache.negative("empty.example", T_MX, now + std::chrono::seconds(59)), RCODE_NOERROR);
+ASSERT_EQ(cache.negative("empty.example", T_A, now), -1);
+ASSERT_EQ(cache.negative("empty.example", T_MX, now + std::chrono::seconds(60)), -1);
+
+// Names below the nonexistent one and repeated NODATA are answered without query
+StubZone zone;
+std::string error;
+std::istringstream input(stubZoneText);
+ASSERT_TRUE(zone.load(input, error));
+LoopbackTransport *loopback = new LoopbackTransport(
+    [&](const unsigned char *query, size_t len, unsigned char *out) { return zone.answer(query, len, out); });
+
+arguments.qtypes = {T_MX};
+BULK_OPTIONS options;
+options.window = 1;
+BulkResolver resolver(arguments, options);
+resolver.useTransport(std::unique_ptr<Transport>(loopback));
+
+std::vector<BULK_RESULT> results;
+std::istringstream names("nope.github.com\nwww.nope.github.com\ngithub.com\nGITHUB.com\n");
+BULK_STATS stats = resolver.run(names, [&](const BULK_RESULT &result) { results.push_back(result); });
+
+ASSERT_EQ(stats.sent, 2);
+ASSERT_EQ(stats.cached, 2);
+ASSERT_EQ(results.size(), 4);
+ASSERT_EQ(results[1].rcode, RCODE_NXDOMAIN);
+ASSERT_EQ(results[3].rcode, RCODE_NOERROR);
+ASSERT_TRUE(results[3].answers.empty());
+}
+
+TEST(CongestionSuite, AimdWindow)
+{
+AimdWindow::Clock::time_point now = AimdWindow::Clock::now();
+AimdWindow control(64);
+ASSERT_EQ(control.window(), AIMD_INITIAL_WINDOW);
+
+// Slow start, one more query per answer up to the maximum
+for (int i = 0; i < 100; i++)
+    control.answered(1000, now);
+ASSERT_EQ(control.window(), 64);
+
+// Loss halves the window once per RTT, the other timeouts of the same burst don't count
+control.lost(now);
+control.lost(now);
+ASSERT_EQ(control.window(), 32);
+ASSERT_EQ(control.decreases(), 1);
+
+// Congestion avoidance, one more query per window of answers
+for (int i = 0; i < 34; i++)
+    control.answered(1000, now + std::chrono::milliseconds(1));
+ASSERT_EQ(control.window(), 33);
+
+// Queueing in the upstream, the RTT grows far above the minimum
+for (int i = 0; i < 40; i++)
+    control.answered(50000, now + std::chrono::milliseconds(10 * i));
+ASSERT_LT(control.window(), 33);
+ASSERT_GT(control.decreases(), 1);
+ASSERT_GE(control.window(), 1);
+
+// Token bucket lets the burst out at once and then keeps the rate
+TokenBucket bucket(100, now);
+ASSERT_TRUE(bucket.limited());
+ASSERT_TRUE(bucket.ready(now));
+bucket.spend();
+ASSERT_FALSE(bucket.ready(now));
+ASSERT_EQ(bucket.delay(now), 10);
+ASSERT_TRUE(bucket.ready(now + std::chrono::milliseconds(10)));
+ASSERT_TRUE(TokenBucket(0, now).ready(now));
+}
+
+TEST(CongestionSuite, PacedBulkRun)
+{
+StubZone zone;
+std::string error;
+std::istringstream input(stubZoneText);
+ASSERT_TRUE(zone.load(input, error));
+LoopbackTransport *loopback = new LoopbackTransport(
+    [&](const unsigned char *query, size_t len, unsigned char *out) { return zone.answer(query, len, out); });
+
+Args arguments;
+BULK_OPTIONS options;
+options.qps = 200;
+options.reportInterval = 0.02;
+BulkResolver resolver(arguments, options);
+resolver.useTransport(std::unique_ptr<Transport>(loopback));
+
+std::string names;
+for (int i = 0; i < 30; i++)
+    names += "n" + std::to_string(i) + ".github.com\n";
+std::istringstream stream(names);
+std::vector<BULK_PROGRESS> reports;
+BULK_STATS stats = resolver.run(stream, [](const BULK_RESULT &) {},
+                                [&](const BULK_PROGRESS &progress) { reports.push_back(progress); });
+
+ASSERT_EQ(stats.sent, 30);
+ASSERT_EQ(stats.decreases, 0);
+ASSERT_GE(stats.seconds, 0.14); // 29 queries behind the first one at 200 QPS
+ASSERT_GE(reports.size(), 3);
+ASSERT_LE(reports.back().qps, 300);
+ASSERT_GT(reports.back().answered, reports.front().answered);
+}
+
+TEST(CongestionSuite, HedgedBulkRun)
+{
+StubZone zone;
+std::string error;
+std::istringstream input(stubZoneText);
+ASSERT_TRUE(zone.load(input, error));
+
+RttQuantile quantile(0.95);
+for (uint32_t rtt = 1; rtt < RTT_QUANTILE_UPDATE; rtt++)
+    quantile.add(rtt * 10);
+ASSERT_EQ(quantile.value(), 0);
+quantile.add(5000);
+ASSERT_EQ(quantile.value(), 310);
+
+// Primary loses every tenth query once it has RTTs, the backup answers everything
+for (double percent : {15.0, 2.0})
+{
+int primaryQueries = 0;
+LoopbackTransport *primary = new LoopbackTransport([&](const unsigned char *query, size_t len, unsigned char *out) {
+    return ++primaryQueries > 100 && primaryQueries % 10 == 0 ? 0 : zone.answer(query, len, out);
+});
+LoopbackTransport *backup = new LoopbackTransport(
+    [&](const unsigned char *query, size_t len, unsigned char *out) { return zone.answer(query, len, out); });
+
+Args arguments;
+BULK_OPTIONS options;
+options.hedgePercent = percent;
+options.timeout = 100;
+BulkResolver resolver(arguments, options);
+resolver.useTransport(std::unique_ptr<Transport>(primary));
+resolver.addTransport(std::unique_ptr<Transport>(backup));
+
+std::string names;
+for (int i = 0; i < 600; i++)
+    names += "n" + std::to_string(i) + ".github.com\n";
+std::istringstream stream(names);
+size_t answered = 0;
+BULK_STATS stats = resolver.run(stream, [&](const BULK_RESULT &result) { answered += result.rcode == RCODE_NXDOMAIN; });
+
+ASSERT_EQ(answered + stats.timeouts, 600);
+ASSERT_LE(stats.hedges, stats.sent * percent / 100);
+ASSERT_EQ(stats.hedgesWon, stats.hedges);
+ASSERT_EQ(backup->sent(), stats.hedges);
+if (percent > 10)
+{
+    ASSERT_GE(stats.hedges, 45); // Every lost query, nothing waits for the timeout
+    ASSERT_EQ(stats.retransmits, 0);
+    ASSERT_EQ(stats.timeouts, 0);
+}
+else
+    ASSERT_GT(stats.retransmits, 0); // Over the budget the lost queries time out, retransmissions are lost too
+}
+}
+
+TEST(UpstreamRingSuite, SuffixAndRemapping)
+{
+std::string names[] = {"www.github.com", "github.com", "com", "www.bbc.co.uk", "bbc.co.uk", "a.b.example.cz"};
+std::string suffixes[] = {"github.com", "github.com", "com", "bbc.co.uk", "bbc.co.uk", "example.cz"};
+for (int i = 0; i < 6; i++)
+    ASSERT_EQ(names[i].substr(registrableSuffix(names[i].data(), names[i].size())), suffixes[i]);
+ASSERT_EQ(shardHash("WWW.GitHub.com", SHARD_SUFFIX), shardHash("api.github.com", SHARD_SUFFIX));
+ASSERT_NE(shardHash("www.github.com", SHARD_NAME), shardHash("api.github.com", SHARD_NAME));
+
+// Every name has its home, the shares are about even
+UpstreamRing ring(4);
+UpstreamRing::Clock::time_point now = UpstreamRing::Clock::now();
+std::vector<size_t> home(4000), share(4);
+bool remapped;
+for (size_t i = 0; i < home.size(); i++)
+{
+    home[i] = ring.acquire(shardHash("n" + std::to_string(i) + ".example.com", SHARD_NAME), now, remapped);
+    ring.release(home[i]);
+    ASSERT_FALSE(remapped);
+    share[home[i]]++;
+}
+for (size_t count : share)
+{
+    ASSERT_GT(count, 600);
+    ASSERT_LT(count, 1400);
+}
+
+// Only the names of the down upstream move, back home after the down time
+for (int i = 0; i < UPSTREAM_DOWN_LOSSES - 1; i++)
+    ASSERT_FALSE(ring.lost(2, now));
+ASSERT_TRUE(ring.lost(2, now));
+for (size_t i = 0; i < home.size(); i++)
+{
+    size_t upstream = ring.acquire(shardHash("n" + std::to_string(i) + ".example.com", SHARD_NAME), now, remapped);
+    ring.release(upstream);
+    ASSERT_NE(upstream, 2);
+    ASSERT_EQ(remapped, home[i] == 2);
+    if (home[i] != 2) {
+        ASSERT_EQ(upstream, home[i]);
+    }
+}
+now += std::chrono::milliseconds(UPSTREAM_DOWN_MS);
+size_t back = ring.acquire(shardHash("n0.example.com", SHARD_NAME), now, remapped);
+ASSERT_EQ(back, home[0]);
+ASSERT_FALSE(ring.down(2));
+
+// Hedge goes to the next live upstream clockwise, never to the query's own one
+for (int i = 0; i < 100; i++)
+{
+    uint64_t hash = shardHash("n" + std::to_string(i) + ".example.com", SHARD_NAME);
+    size_t upstream = ring.acquire(hash, now, remapped);
+    size_t hedge = ring.next(hash, upstream);
+    ASSERT_NE(hedge, upstream);
+    ASSERT_FALSE(ring.down(hedge));
+    ring.release(upstream);
+}
+for (size_t upstream : {1, 3})
+{
+    for (int i = 0; i < UPSTREAM_DOWN_LOSSES; i++)
+        ring.lost(upstream, now);
+}
+ring.hold(2);
+ASSERT_EQ(ring.load(2), 1);
+ring.release(2);
+for (int i = 0; i < 100; i++)
+{
+    uint64_t hash = shardHash("n" + std::to_string(i) + ".example.com", SHARD_NAME);
+    ASSERT_EQ(ring.next(hash, 0), 2);
+    ASSERT_EQ(ring.next(hash, 2), 0);
+}
+for (int i = 0; i < UPSTREAM_DOWN_LOSSES; i++)
+    ring.lost(0, now);
+ASSERT_EQ(ring.next(42, 2), 2); // Nothing else is up
+
+// Load in flight stays under the bound even when all names hash to one point
+UpstreamRing bounded(4, 1.25);
+for (int i = 0; i < 400; i++)
+    bounded.acquire(42, now, remapped);
+for (size_t upstream = 0; upstream < 4; upstream++)
+    ASSERT_LE(bounded.load(upstream), 125);
+}
+
+TEST(UpstreamRingSuite, ShardedBulkRun)
+{
+StubZone zone;
+std::string error;
+std::istringstream input(stubZoneText);
+ASSERT_TRUE(zone.load(input, error));
+
+// Third upstream never answers, its names move to the others once it is marked down
+std::vector<std::set<std::string>> asked(3);
+std::vector<LoopbackTransport *> upstreams;
+for (size_t i = 0; i < 3; i++)
+{
+    upstreams.push_back(new LoopbackTransport([&, i](const unsigned char *query, size_t len, unsigned char *out) {
+        size_t pos = sizeof(DNS_HEADER);
+        std::string name;
+        readName(query, len, pos, name);
+        asked[i].insert(name);
+        return i == 2 ? 0 : zone.answer(query, len, out);
+    }));
+}
+
+Args arguments;
+BULK_OPTIONS options;
+options.shard = SHARD_NAME;
+options.timeout = 50;
+BulkResolver resolver(arguments, options);
+for (size_t i = 0; i < 3; i++)
+{
+    if (i == 0)
+        resolver.useTransport(std::unique_ptr<Transport>(upstreams[i]));
+    else
+        resolver.addTransport(std::unique_ptr<Transport>(upstreams[i]));
+}
+
+std::string names;
+for (int i = 0; i < 300; i++)
+    names += "n" + std::to_string(i) + ".github.com\n";
+std::istringstream stream(names);
+size_t answered = 0;
+BULK_STATS stats = resolver.run(stream, [&](const BULK_RESULT &result) { answered += result.rcode == RCODE_NXDOMAIN; });
+
+ASSERT_EQ(stats.downs, 1);
+ASSERT_GT(stats.remapped, 0);
+ASSERT_EQ(stats.timeouts, 0);
+ASSERT_EQ(answered, 300);
+ASSERT_LE(asked[2].size(), UPSTREAM_DOWN_LOSSES + options.window);
+
+// Names of the live upstreams are split between them only when moved by the load bound or the down upstream
+ASSERT_GT(asked[0].size(), 50);
+ASSERT_GT(asked[1].size(), 50);
+size_t both = 0;
+for (const std::string &name : asked[0])
+    both += asked[1].count(name);
+ASSERT_LE(both, stats.remapped);
+}
+
+TEST(UpstreamRingSuite, HedgesFollowTheRing)
+{
+StubZone zone;
+std::string error;
+std::istringstream input(stubZoneText);
+ASSERT_TRUE(zone.load(input, error));
+
+// Second upstream is dead, the first one loses every tenth query once it has RTTs, the third answers everything
+std::vector<size_t> asked(3);
+std::vector<LoopbackTransport *> upstreams;
+for (size_t i = 0; i < 3; i++)
+{
+    upstreams.push_back(new LoopbackTransport([&, i](const unsigned char *query, size_t len, unsigned char *out) {
+        asked[i]++;
+        if (i == 1 || (i == 0 && asked[0] > 100 && asked[0] % 10 == 0))
+            return (size_t)0;
+        return zone.answer(query, len, out);
+    }));
+}
+
+Args arguments;
+BULK_OPTIONS options;
+options.shard = SHARD_NAME;
+options.hedgePercent = 20;
+options.timeout = 100;
+BulkResolver resolver(arguments, options);
+for (size_t i = 0; i < 3; i++)
+{
+    if (i == 0)
+        resolver.useTransport(std::unique_ptr<Transport>(upstreams[i]));
+    else
+        resolver.addTransport(std::unique_ptr<Transport>(upstreams[i]));
+}
+
+std::string names;
+for (int i = 0; i < 600; i++)
+    names += "n" + std::to_string(i) + ".github.com\n";
+std::istringstream stream(names);
+size_t answered = 0;
+BULK_STATS stats = resolver.run(stream, [&](const BULK_RESULT &result) { answered += result.rcode == RCODE_NXDOMAIN; });
+
+ASSERT_EQ(answered, 600);
+ASSERT_EQ(stats.downs, 1);
+ASSERT_LE(stats.hedges, stats.sent * options.hedgePercent / 100);
+// Only the hedges sent before the dead upstream was marked down are lost, the rest go to the third one
+ASSERT_GT(stats.hedgesWon, stats.hedges / 4);
+}
+
+TEST(TraceSuite, BulkRunTimeline)
+{
+StubZone zone;
+std::string error;
+std::istringstream input(stubZoneText);
+ASSERT_TRUE(zone.load(input, error));
+
+// Off by default, the spans record nothing
+{
+    TraceSpan span("encode", 1);
+}
+ASSERT_EQ(Tracer::events(), 0);
+
+// Every second query is lost once, so the query span holds two tries
+int queries = 0;
+Args arguments;
+BULK_OPTIONS options;
+options.timeout = 30;
+BulkResolver resolver(arguments, options);
+resolver.useTransport(std::unique_ptr<Transport>(new LoopbackTransport(
+    [&](const unsigned char *query, size_t len, unsigned char *out) { return ++queries % 2 == 0 ? 0 : zone.answer(query, len, out); })));
+
+Tracer::enable();
+std::istringstream names("a.github.com\nb.github.com\nc.github.com\nd.github.com\n");
+BULK_STATS stats = resolver.run(names, [](const BULK_RESULT &result) { TraceSpan span("format", traceId(result.index, result.qtype)); });
+ASSERT_EQ(stats.timeouts, 0);
+ASSERT_GT(stats.retransmits, 0);
+
+std::string path = "/tmp/dns-test-trace.json";
+ASSERT_TRUE(Tracer::write(path, error));
+Tracer::reset();
+ASSERT_EQ(Tracer::events(), 0);
+
+std::ifstream file(path);
+std::string json((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+std::remove(path.c_str());
+auto count = [&json](const std::string &needle) {
+    size_t found = 0;
+    for (size_t pos = json.find(needle); pos != std::string::npos; pos = json.find(needle, pos + 1))
+        found++;
+    return found;
+};
+ASSERT_EQ(json.find("{\"displayTimeUnit\":\"ns\",\"traceEvents\":["), 0);
+ASSERT_EQ(json.substr(json.size() - 4), "\n]}\n");
+ASSERT_EQ(count("{\"name\":\"query\",\"cat\":\"query\",\"ph\":\"b\""), 4);
+ASSERT_EQ(count("{\"name\":\"query\",\"cat\":\"query\",\"ph\":\"e\""), 4);
+ASSERT_EQ(count("{\"name\":\"wait\",\"cat\":\"query\",\"ph\":\"b\""), stats.sent);
+ASSERT_EQ(count("{\"name\":\"encode\""), stats.sent);
+ASSERT_EQ(count("{\"name\":\"retry\""), stats.retransmits);
+ASSERT_EQ(count("{\"name\":\"parse\""), stats.answered);
+ASSERT_EQ(count("{\"name\":\"format\""), 4);
+ASSERT_GT(count("{\"name\":\"poll\""), 0);
+ASSERT_GE(count("\"args\":{\"query\":" + std::to_string(traceId(3, T_A)) + "}}"), 5); // encode, send, cache, parse, format
+}
+
+TEST(DeadlineSuite, BudgetAndCancellation)
+{
+Deadline::Clock::time_point now = Deadline::Clock::now();
+Deadline unlimited;
+ASSERT_FALSE(unlimited.expired(now));
+ASSERT_EQ(unlimited.limit(-1, now), -1);
+ASSERT_EQ(Deadline::after(0).limit(700, now), 700);
+
+Deadline budget(now + std::chrono::milliseconds(100), CancelToken::none());
+ASSERT_EQ(budget.limit(-1, now), 101);
+ASSERT_EQ(budget.limit(30, now), 30);
+ASSERT_TRUE(budget.expired(now + std::chrono::milliseconds(100)));
+ASSERT_EQ(budget.limit(30, now + std::chrono::milliseconds(100)), 0);
+
+// Copies share the cancellation, the waits are sliced to notice it
+CancelToken token;
+Deadline cancellable(Deadline::Clock::time_point::max(), token);
+ASSERT_EQ(cancellable.limit(-1, now), DEADLINE_SLICE_MS);
+Deadline copy = cancellable;
+token.cancel();
+ASSERT_TRUE(copy.expired(now));
+ASSERT_EQ(deadlineRcode(copy), RCODE_CANCELLED);
+ASSERT_EQ(deadlineRcode(budget), RCODE_TIMEOUT);
+}
+
+TEST(DeadlineSuite, BulkPartialChainAndCancel)
+{
+// CNAME target is never answered, the name ends at its budget with the link followed so far
+StubZone shop;
+std::string error;
+std::istringstream shopText("$ORIGIN shop.example.\n@ SOA ns hostmaster 1 3600 600 86400 300\nwww 300 CNAME edge.cdn.net.\n");
+ASSERT_TRUE(shop.load(shopText, error));
+
+Args arguments;
+arguments.budget = 120;
+BULK_OPTIONS options;
+options.timeout = 50;
+BulkResolver resolver(arguments, options);
+resolver.useTransport(std::unique_ptr<Transport>(new LoopbackTransport([&](const unsigned char *query, size_t len, unsigned char *out) {
+    size_t length = shop.answer(query, len, out);
+    return reinterpret_cast<DNS_HEADER *>(out)->rcode == RCODE_REFUSED ? 0 : length;
+})));
+
+std::vector<BULK_RESULT> results;
+std::istringstream names("www.shop.example\n");
+auto start = std::chrono::steady_clock::now();
+BULK_STATS stats = resolver.run(names, [&](const BULK_RESULT &result) { results.push_back(result); });
+auto elapsed = std::chrono::steady_clock::now() - start;
+
+ASSERT_EQ(stats.expired, 1);
+ASSERT_EQ(stats.timeouts, 0);
+ASSERT_EQ(results.size(), 1);
+ASSERT_EQ(results[0].rcode, RCODE_TIMEOUT);
+ASSERT_EQ(results[0].answers.size(), 1);
+ASSERT_EQ(results[0].answers[0].value, "edge.cdn.net");
+ASSERT_GE(elapsed, std::chrono::milliseconds(120));
+ASSERT_LT(elapsed, std::chrono::milliseconds(150)); // Third try would time out at 150 ms
+
+// Cancelled run returns at once, the queries in flight end with RCODE_CANCELLED
+Args silent;
+BULK_OPTIONS cancelOptions;
+cancelOptions.timeout = 2000;
+cancelOptions.cancel = CancelToken();
+BulkResolver cancelled(silent, cancelOptions);
+cancelled.useTransport(std::unique_ptr<Transport>(
+    new LoopbackTransport([](const unsigned char *, size_t, unsigned char *) { return (size_t)0; })));
+std::thread canceller([&cancelOptions]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    cancelOptions.cancel.cancel();
+});
+std::istringstream many("a.example\nb.example\nc.example\n");
+size_t cancelledResults = 0;
+start = std::chrono::steady_clock::now();
+stats = cancelled.run(many, [&](const BULK_RESULT &result) { cancelledResults += result.rcode == RCODE_CANCELLED; });
+elapsed = std::chrono::steady_clock::now() - start;
+canceller.join();
+
+ASSERT_EQ(stats.cancelled, 3);
+ASSERT_EQ(cancelledResults, 3);
+ASSERT_LT(elapsed, std::chrono::milliseconds(30 + 2 * DEADLINE_SLICE_MS));
+}
+
+TEST(DeadlineSuite, SessionAndAsyncBudgets)
+{
+// Bound socket which never reads, the queries get no answer and no ICMP error
+int silent = socket(AF_INET, SOCK_DGRAM, 0);
+struct sockaddr_in address;
+socklen_t length = sizeof(address);
+memset(&address, 0, sizeof(address));
+address.sin_family = AF_INET;
+address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+ASSERT_EQ(bind(silent, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)), 0);
+getsockname(silent, reinterpret_cast<struct sockaddr *>(&address), &length);
+
+Args arguments;
+arguments.server = (char *)"127.0.0.1";
+arguments.port = ntohs(address.sin_port);
+arguments.timeout = 1000;
+arguments.tries = 3;
+arguments.budget = 80;
+
+ResolverSession session(arguments);
+auto start = std::chrono::steady_clock::now();
+ASSERT_EQ(session.resolve("github.com", T_A).rcode, RCODE_TIMEOUT);
+ASSERT_LT(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(200));
+ASSERT_EQ(session.reconnects(), 0); // The budget ended, the server wasn't proven silent
+
+CancelToken token;
+std::thread canceller([&token]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    token.cancel();
+});
+start = std::chrono::steady_clock::now();
+ASSERT_EQ(session.resolve("github.com", T_A, Deadline(Deadline::Clock::time_point::max(), token)).rcode, RCODE_CANCELLED);
+ASSERT_LT(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(30 + 2 * DEADLINE_SLICE_MS));
+canceller.join();
+
+// The deadline timer ends the try of args.timeout, the token ends the query in flight
+std::string error;
+AsyncResolver resolver(arguments);
+ASSERT_TRUE(resolver.open(error));
+resolver.start();
+CancelToken asyncToken;
+start = std::chrono::steady_clock::now();
+std::future<BULK_RESULT> budgeted = resolver.resolve("github.com", T_A);
+std::future<BULK_RESULT> cancelled = resolver.resolve("fit.vut.cz", T_AAAA, Deadline(Deadline::Clock::time_point::max(), asyncToken));
+std::this_thread::sleep_for(std::chrono::milliseconds(20));
+asyncToken.cancel();
+ASSERT_EQ(cancelled.get().rcode, RCODE_CANCELLED);
+ASSERT_LT(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(20 + 2 * DEADLINE_SLICE_MS));
+ASSERT_EQ(budgeted.get().rcode, RCODE_TIMEOUT);
+ASSERT_LT(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(200));
+resolver.stop();
+close(silent);
+}
+
+/**
+ * @brief Every message accepted by validateMessage() decodes by the unchecked decoders to the records of the checked
+ * decodeRecord() and prints without an exception, the same check as the libFuzzer target in fuzz-message.cpp
+ * @return true if the message was valid
+ * */
+static bool checkIndexedMessage(const unsigned char *msg, size_t len)
+{
+    MESSAGE_INDEX index;
+    if (!validateMessage(msg, len, index))
+        return false;
+
+    for (const RECORD_INDEX &entry : index.records)
+    {
+        DNS_REC indexed, checked;
+        size_t pos = entry.name;
+        indexedRecord(msg, entry, indexed);
+        EXPECT_TRUE(decodeRecord(msg, len, pos, checked));
+        EXPECT_EQ(pos, (size_t)entry.rdata + entry.rdlength);
+        EXPECT_EQ(indexed.name, checked.name);
+        EXPECT_EQ(indexed.ttl, checked.ttl);
+        EXPECT_EQ(indexed.value, checked.value);
+    }
+
+    DnsResolver dnsResolver((Args()));
+    if (index.questions > 0 && dnsResolver.useMessage(msg, len)) {
+        EXPECT_NO_THROW(dnsResolver.getAnswer());
+    }
+    return true;
+}
+
+TEST(MessageIndexSuite, OffsetsAndMalformedNames)
+{
+StubZone zone;
+std::string error;
+std::istringstream input(stubZoneText);
+ASSERT_TRUE(zone.load(input, error));
+
+unsigned char query[MAX_DNS_SIZE], out[MAX_DNS_SIZE];
+size_t len = zone.answer(query, buildQuery(query, 1, "www.github.com", T_A, true), out);
+MESSAGE_INDEX index;
+ASSERT_TRUE(validateMessage(out, len, index));
+ASSERT_EQ(index.questions, 1);
+ASSERT_EQ(index.qtype, T_A);
+ASSERT_EQ(index.sections[SECTION_ANSWER], 2);
+ASSERT_EQ(index.records[1].type, T_A);
+ASSERT_EQ(index.records[1].ttl, 60);
+ASSERT_EQ(index.records[1].rdlength, 4);
+
+std::string name;
+indexedName(out, index.question, name);
+ASSERT_EQ(name, "www.github.com");
+indexedName(out, index.records[0].rdata, name);
+ASSERT_EQ(name, "github.com");
+
+// SOA of the negative answer is decoded from the wire to the same fields as from its text
+len = zone.answer(query, buildQuery(query, 2, "nope.github.com", T_A, true), out);
+ASSERT_TRUE(validateMessage(out, len, index));
+ASSERT_EQ(index.sections[SECTION_AUTHORITY], 1);
+const RECORD_INDEX &authority = index.records[index.first(SECTION_AUTHORITY)];
+DNS_REC record;
+SOA_RECORD wire, text;
+indexedRecord(out, authority, record);
+indexedSoa(out, authority, wire);
+ASSERT_TRUE(parseSoa(record.value, text));
+ASSERT_EQ(wire.ttl, (uint32_t)record.ttl);
+ASSERT_EQ(wire.mname, text.mname);
+ASSERT_EQ(wire.rname, "hostmaster.github.com");
+ASSERT_EQ(wire.serial, text.serial);
+ASSERT_EQ(wire.refresh, 3600);
+ASSERT_EQ(wire.expire, 86400);
+ASSERT_EQ(wire.minimum, 300);
+
+// The address record is the last one, its owner name is a pointer
+len = zone.answer(query, buildQuery(query, 1, "www.github.com", T_A, true), out);
+ASSERT_TRUE(validateMessage(out, len, index));
+size_t answer = len - 16;
+ASSERT_EQ(out[answer] & 0xC0, 0xC0);
+std::vector<unsigned char> broken(out, out + len);
+broken[answer + 1] = answer; // Pointer to itself
+ASSERT_FALSE(validateMessage(broken.data(), len, index));
+ASSERT_EQ(index.sections[SECTION_ANSWER], 1); // CNAME before it is still valid
+broken[answer + 1] = len - 4; // Forward
+ASSERT_FALSE(validateMessage(broken.data(), len, index));
+broken[answer + 1] = 2; // Into the header
+ASSERT_FALSE(validateMessage(broken.data(), len, index));
+
+broken.assign(out, out + len);
+broken[7] = 3; // ANCOUNT beyond the message
+ASSERT_FALSE(validateMessage(broken.data(), len, index));
+ASSERT_FALSE(validateMessage(out, len - 1, index));
+broken[7] = 2;
+broken[len - 5] = 5; // RDLENGTH of A
+ASSERT_FALSE(validateMessage(broken.data(), len, index));
+
+// The printer refuses the malformed message, the single query reports it
+DnsResolver resolver((Args()));
+ASSERT_FALSE(resolver.useMessage(out, len - 1));
+Args arguments;
+arguments.domain = "www.github.com";
+DnsResolver truncated(arguments);
+truncated.useTransport(std::unique_ptr<Transport>(new LoopbackTransport([&](const unsigned char *query, size_t length, unsigned char *response) {
+    return zone.answer(query, length, response) - 1;
+})));
+truncated.query();
+ASSERT_THROW(truncated.getAnswer(), TransportError);
+}
+
+TEST(MessageIndexSuite, FuzzCorpusAndMutations)
+{
+StubZone zone;
+std::string error;
+std::ifstream input("stub.zone");
+ASSERT_TRUE(zone.load(input, error)) << error;
+
+// Answers of every decoded type, with compression in the owners and in RDATA
+std::vector<std::vector<unsigned char>> corpus;
+struct {
+    const char *name;
+    uint16_t qtype;
+} seeds[] = {{"github.com", T_A}, {"www.github.com", T_A}, {"fit.vut.cz", T_AAAA}, {"26.9.229.147.in-addr.arpa", T_PTR},
+             {"missing.github.com", T_A}, {"github.com", T_SOA}, {"github.com", T_NS}, {"www.fit.vut.cz", T_MX},
+             {"www.fit.vut.cz", T_TXT}};
+for (auto &seed : seeds)
+{
+    unsigned char query[MAX_DNS_SIZE], out[MAX_DNS_SIZE];
+    size_t len = zone.answer(query, buildQuery(query, 1, seed.name, seed.qtype, true), out);
+    ASSERT_TRUE(checkIndexedMessage(out, len)) << seed.name;
+    corpus.emplace_back(out, out + len);
+}
+
+// Seeds of the fuzzer, the malformed ones among them must not pass
+const char *files[] = {"a", "cname", "aaaa", "ptr", "nxdomain", "nodata", "soa", "ns", "mx", "txt",
+                       "pointer-loop", "forward-pointer", "count-overflow", "truncated"};
+for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++)
+{
+    std::ifstream file(std::string("fuzz-corpus/") + files[i] + ".bin", std::ios::binary);
+    ASSERT_TRUE(file.good()) << files[i];
+    std::vector<unsigned char> message((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    ASSERT_EQ(checkIndexedMessage(message.data(), message.size()), i < 10) << files[i];
+    corpus.push_back(message);
+}
+
+// Flipped bytes, changed counts and cut tails, the sanitizer build of the fuzzer goes much further
+std::mt19937 random(46);
+size_t valid = 0, invalid = 0;
+for (int i = 0; i < 20000; i++)
+{
+    std::vector<unsigned char> message = corpus[random() % corpus.size()];
+    int mutations = 1 + random() % 3;
+    for (int j = 0; j < mutations; j++)
+    {
+        switch (random() % 4)
+        {
+        case 0:
+            message[random() % message.size()] = random();
+            break;
+        case 1:
+            message[random() % message.size()] ^= 1 << (random() % 8);
+            break;
+        case 2:
+            if (message.size() >= sizeof(DNS_HEADER))
+                message[5 + 2 * (random() % 4)] = random() % 4;
+            break;
+        default:
+            message.resize(random() % message.size() + 1);
+        }
+    }
+    if (checkIndexedMessage(message.data(), message.size()))
+        valid++;
+    else
+        invalid++;
+}
+ASSERT_GT(valid, 1000);
+ASSERT_GT(invalid, 1000);
+}
+
+TEST(AddressAnswerSuite, FastPathAndFallback)
+{
+StubZone zone;
+std::string error;
+std::ifstream input("stub.zone");
+ASSERT_TRUE(zone.load(input, error)) << error;
+unsigned char query[MAX_DNS_SIZE], out[MAX_DNS_SIZE];
+char text[INET6_ADDRSTRLEN];
+
+// CNAME chain in front of the address, the TTL is the minimum of both
+size_t len = zone.answer(query, buildQuery(query, 7, "www.github.com", T_A, true), out);
+ADDRESS_ANSWER<T_A> a;
+ASSERT_TRUE(decodeAddressAnswer(out, len, a));
+ASSERT_EQ(a.id, 7);
+ASSERT_TRUE(a.authoritative);
+ASSERT_EQ(a.cnames, 1);
+ASSERT_EQ(a.count, 1);
+ASSERT_EQ(a.ttls[0], 60);
+ASSERT_EQ(a.ttl, 60);
+ASSERT_STREQ(inet_ntop(ADDRESS_TYPE<T_A>::family, a.addresses[0], text, sizeof(text)), "140.82.121.4");
+
+// Not the type of the question, truncated or cut message
+ADDRESS_ANSWER<T_AAAA> aaaa;
+ASSERT_FALSE(decodeAddressAnswer(out, len, aaaa));
+ASSERT_FALSE(decodeAddressAnswer(out, len - 1, a));
+out[2] |= 0x02; // TC
+ASSERT_FALSE(decodeAddressAnswer(out, len, a));
+
+len = zone.answer(query, buildQuery(query, 8, "fit.vut.cz", T_AAAA, true), out);
+ASSERT_TRUE(decodeAddressAnswer(out, len, aaaa));
+ASSERT_EQ(aaaa.cnames, 0);
+ASSERT_STREQ(inet_ntop(ADDRESS_TYPE<T_AAAA>::family, aaaa.addresses[0], text, sizeof(text)), "2001:67c:1220:8090::93e5:91a0");
+
+// Other shapes go the generic path
+struct {
+    const char *name;
+    uint16_t qtype;
+} generic[] = {{"missing.github.com", T_A}, {"github.com", T_AAAA}, {"www.fit.vut.cz", T_MX}, {"26.9.229.147.in-addr.arpa", T_PTR}};
+for (auto &shape : generic)
+{
+    len = zone.answer(query, buildQuery(query, 9, shape.name, shape.qtype, true), out);
+    ASSERT_FALSE(decodeAddressAnswer(out, len, a)) << shape.name;
+    ASSERT_FALSE(decodeAddressAnswer(out, len, aaaa)) << shape.name;
+}
+
+// The resolver offers both, the fast one agrees with getAnswer()
+Args arguments;
+arguments.domain = "www.github.com";
+DnsResolver dnsResolver(arguments);
+dnsResolver.useTransport(std::unique_ptr<Transport>(new LoopbackTransport([&](const unsigned char *request, size_t length, unsigned char *response) {
+    return zone.answer(request, length, response);
+})));
+dnsResolver.query();
+ASSERT_TRUE(dnsResolver.getAddresses(a));
+ASSERT_FALSE(dnsResolver.getAddresses(aaaa));
+DNS_INFO info = dnsResolver.getAnswer();
+ASSERT_EQ(info.answers.size(), a.cnames + a.count);
+ASSERT_EQ(info.answers.back().value, inet_ntop(AF_INET, a.addresses[0], text, sizeof(text)));
+
+// Mutations accepted by both paths decode to the same addresses
+std::mt19937 random(47);
+len = zone.answer(query, buildQuery(query, 7, "www.github.com", T_A, true), out);
+int both = 0;
+for (int i = 0; i < 5000; i++)
+{
+    std::vector<unsigned char> message(out, out + len);
+    message[random() % len] ^= 1 << (random() % 8);
+    MESSAGE_INDEX index;
+    if (!decodeAddressAnswer(message.data(), len, a) || !validateMessage(message.data(), len, index))
+        continue;
+    both++;
+    std::vector<const RECORD_INDEX *> addresses;
+    for (int j = 0; j < index.sections[SECTION_ANSWER]; j++)
+    {
+        if (index.records[j].type == T_A)
+            addresses.push_back(&index.records[j]);
+    }
+    ASSERT_EQ(addresses.size(), a.count);
+    for (size_t j = 0; j < addresses.size(); j++)
+    {
+        ASSERT_EQ(addresses[j]->ttl, a.ttls[j]);
+        ASSERT_EQ(memcmp(message.data() + addresses[j]->rdata, a.addresses[j], 4), 0);
+    }
+}
+ASSERT_GT(both, 100);
+}
+
+TEST(AddressAnswerSuite, BulkAndSessionPaths)
+{
+StubZone zone;
+std::string error;
+std::istringstream input(stubZoneText);
+ASSERT_TRUE(zone.load(input, error));
+BULK_ADDRESS github = {}, fit = {};
+github[10] = github[11] = 0xFF;
+inet_pton(AF_INET, "140.82.121.4", github.data() + 12);
+inet_pton(AF_INET6, "2001:67c:1220:8090::93e5:91a0", fit.data());
+
+// Only github.com A and fit.vut.cz AAAA are plain addresses of the question name
+Args arguments;
+arguments.qtypes = {T_A, T_AAAA};
+BULK_OPTIONS options;
+options.timeout = 10;
+BulkResolver resolver(arguments, options);
+resolver.useTransport(std::unique_ptr<Transport>(new LoopbackTransport([&](const unsigned char *query, size_t len, unsigned char *out) {
+    return zone.answer(query, len, out);
+})));
+std::istringstream names("github.com\nfit.vut.cz\nmissing.github.com\n");
+std::map<std::pair<std::string, uint16_t>, BULK_RESULT> results;
+BULK_STATS stats = resolver.run(names, [&](const BULK_RESULT &result) { results[std::make_pair(result.name, result.qtype)] = result; });
+ASSERT_EQ(stats.answered, 6);
+ASSERT_EQ(stats.fastPath, 2);
+BULK_RESULT &address = results[std::make_pair(std::string("github.com"), (uint16_t)T_A)];
+ASSERT_EQ(address.ttl, 60);
+ASSERT_EQ(address.addresses, std::vector<BULK_ADDRESS>{github});
+ASSERT_EQ(address.answers.size(), 1);
+ASSERT_EQ(address.answers[0].name, "github.com");
+ASSERT_EQ(address.answers[0].type, "A");
+ASSERT_EQ(address.answers[0].value, "140.82.121.4");
+ASSERT_EQ(results[std::make_pair(std::string("fit.vut.cz"), (uint16_t)T_AAAA)].addresses, std::vector<BULK_ADDRESS>{fit});
+ASSERT_EQ(results[std::make_pair(std::string("missing.github.com"), (uint16_t)T_A)].rcode, RCODE_NXDOMAIN);
+
+// The session takes the same fast path, the CNAME chain and the other types go the generic one
+StubUdpServer server(zone);
+arguments.server = (char *)"127.0.0.1";
+arguments.port = server.start();
+arguments.timeout = 100;
+ResolverSession session(arguments);
+BULK_RESULT fast = session.resolve("GitHub.com", T_A);
+ASSERT_EQ(session.fastAnswers(), 1);
+ASSERT_EQ(fast.rcode, RCODE_NOERROR);
+ASSERT_TRUE(fast.authoritative);
+ASSERT_EQ(fast.ttl, 60);
+ASSERT_EQ(fast.addresses, std::vector<BULK_ADDRESS>{github});
+ASSERT_EQ(session.resolve("fit.vut.cz", T_AAAA).addresses, std::vector<BULK_ADDRESS>{fit});
+ASSERT_EQ(session.fastAnswers(), 2);
+
+BULK_RESULT chain = session.resolve("www.github.com", T_A);
+ASSERT_EQ(chain.answers.size(), 2);
+ASSERT_EQ(chain.ttl, 60);
+ASSERT_EQ(chain.addresses, std::vector<BULK_ADDRESS>{github});
+ASSERT_EQ(session.resolve("github.com", T_AAAA).rcode, RCODE_NOERROR);
+ASSERT_EQ(session.resolve("26.9.229.147.in-addr.arpa", T_PTR).answers.size(), 1);
+ASSERT_EQ(session.resolve("missing.github.com", T_A).rcode, RCODE_NXDOMAIN);
+ASSERT_EQ(session.fastAnswers(), 2);
+}
+
+TEST(LocalTableSuite, HostsAndZoneIndex)
+{
+const char *hostsPath = "/tmp/dns-local-test.hosts";
+const char *zonePath = "/tmp/dns-local-test.zone";
+unlink((std::string(hostsPath) + LOCAL_INDEX_SUFFIX).c_str());
+unlink((std::string(zonePath) + LOCAL_INDEX_SUFFIX).c_str());
+std::ofstream(hostsPath) << "# infrastructure\n10.0.0.1 db.internal db   # primary\n2001:db8::1 db.internal\n";
+std::ofstream(zonePath) << "$ORIGIN internal.\nweb CNAME db\ndb A 10.9.9.9\nmail MX 10 db\n";
+
+std::string error;
+{
+LocalTable table;
+ASSERT_TRUE(table.add(hostsPath, error)) << error;
+ASSERT_TRUE(table.add(zonePath, error)) << error;
+ASSERT_EQ(table.records(), 5 + 3); // Addresses, aliases and PTR of the first names
+}
+ASSERT_EQ(access((std::string(hostsPath) + LOCAL_INDEX_SUFFIX).c_str(), R_OK), 0);
+
+// Second run maps the index, the hosts file comes first so its address wins
+std::shared_ptr<LocalTable> table = std::make_shared<LocalTable>();
+ASSERT_TRUE(table->add(hostsPath, error));
+ASSERT_TRUE(table->add(zonePath, error));
+
+Args arguments;
+arguments.domain = "WEB.internal";
+DnsResolver dnsResolver(arguments);
+dnsResolver.useLocalTable(table);
+dnsResolver.connectToDNSServer(); // No server, no socket
+dnsResolver.query();
+DNS_INFO result = dnsResolver.getAnswer();
+ASSERT_EQ(result.ancount, 2);
+ASSERT_EQ(result.aa, "Yes");
+ASSERT_EQ(result.answers[0].type, "CNAME");
+ASSERT_EQ(result.answers[1].value, "10.0.0.1");
+
+unsigned char query[MAX_DNS_SIZE], out[MAX_DNS_SIZE];
+size_t length = buildQuery(query, 1, "1.0.0.10.in-addr.arpa", T_PTR, true);
+ASSERT_GT(table->answer(query, length, out), length);
+length = buildQuery(query, 1, "db.internal", T_TXT, true);
+ASSERT_EQ(table->answer(query, length, out), 0); // Upstream is asked for the other types
+
+// Stale index is compiled again
+std::ofstream(hostsPath, std::ios::app) << "10.0.0.2 new.internal\n";
+LocalTable updated;
+ASSERT_TRUE(updated.add(hostsPath, error));
+ASSERT_EQ(updated.records(), 7);
+
+std::ofstream(hostsPath) << "999.0.0.1 broken\n";
+ASSERT_FALSE(updated.add(hostsPath, error));
+ASSERT_NE(error.find("line 1"), std::string::npos);
+}
+
+TEST(LocalTableSuite, BulkPrecedence)
+{
+const char *hostsPath = "/tmp/dns-local-precedence.hosts";
+unlink((std::string(hostsPath) + LOCAL_INDEX_SUFFIX).c_str());
+std::ofstream(hostsPath) << "10.1.1.1 github.com\n10.2.2.2 nope.github.com\n";
+std::shared_ptr<LocalTable> table = std::make_shared<LocalTable>();
+std::string error;
+ASSERT_TRUE(table->add(hostsPath, error)) << error;
+
+StubZone zone;
+std::istringstream input(stubZoneText);
+ASSERT_TRUE(zone.load(input, error));
+
+for (bool upstreamFirst : {false, true})
+{
+LoopbackTransport *loopback = new LoopbackTransport(
+    [&](const unsigned char *query, size_t len, unsigned char *out) { return zone.answer(query, len, out); });
+Args arguments;
+arguments.upstreamFirst = upstreamFirst;
+BulkResolver resolver(arguments, BULK_OPTIONS());
+resolver.useTransport(std::unique_ptr<Transport>(loopback));
+resolver.useLocalTable(table);
+
+std::map<std::string, BULK_RESULT> results;
+std::istringstream names("github.com\nnope.github.com\nwww.github.com\n");
+BULK_STATS stats = resolver.run(names, [&](const BULK_RESULT &result) { results[result.name] = result; });
+
+// NXDOMAIN of the server is always replaced, the existing name only when the local table wins
+ASSERT_EQ(results["nope.github.com"].rcode, RCODE_NOERROR);
+ASSERT_EQ(results["nope.github.com"].answers[0].value, "10.2.2.2");
+ASSERT_EQ(results["github.com"].answers[0].value, upstreamFirst ? "140.82.121.4" : "10.1.1.1");
+ASSERT_EQ(stats.local, upstreamFirst ? 1 : 2);
+ASSERT_EQ(loopback->sent(), upstreamFirst ? 3 : 1);
+}
+}
+
+TEST(PacketLogSuite, RingAcrossThreads)
+{
+SpscRing ring(1000); // Rounded to 1024, frames wrap around many times
+const uint32_t frames = 100000;
+
+std::thread producer([&]() {
+    for (uint32_t i = 0; i < frames; i++)
+    {
+        std::vector<unsigned char> payload(i % 50, (unsigned char)i);
+        while (!ring.push(&i, sizeof(i), payload.data(), payload.size()))
+            std::this_thread::yield();
+    }
+});
+
+std::vector<unsigned char> frame;
+for (uint32_t expected = 0; expected < frames;)
+{
+    if (!ring.pop(frame))
+    {
+        std::this_thread::yield();
+        continue;
+    }
+    uint32_t value;
+    ASSERT_EQ(frame.size(), sizeof(value) + expected % 50);
+    memcpy(&value, frame.data(), sizeof(value));
+    ASSERT_EQ(value, expected);
+    for (size_t i = sizeof(value); i < frame.size(); i++)
+        ASSERT_EQ(frame[i], (unsigned char)expected);
+    expected++;
+}
+producer.join();
+ASSERT_FALSE(ring.pop(frame));
+}
+
+TEST(PacketLogSuite, LogAndDecode)
+{
+const char *path = "/tmp/dns-packet-log-test.bin";
+unlink(path);
+
+StubZone zone;
+std::string error;
+std::istringstream input(stubZoneText);
+ASSERT_TRUE(zone.load(input, error));
+
+Args arguments;
+arguments.server = (char *)"127.0.0.1";
+arguments.port = 5300;
+arguments.domain = "www.github.com";
+{
+LoopbackTransport *loopback = new LoopbackTransport(
+    [&](const unsigned char *query, size_t len, unsigned char *out) { return zone.answer(query, len, out); });
+std::shared_ptr<PacketLogger> logger = std::make_shared<PacketLogger>(path);
+DnsResolver dnsResolver(arguments);
+dnsResolver.useTransport(std::unique_ptr<Transport>(
+    new LoggingTransport(std::unique_ptr<Transport>(loopback), logger, arguments, SOCK_DGRAM)));
+dnsResolver.query();
+ASSERT_EQ(dnsResolver.getAnswer().ancount, 2);
+}
+
+std::vector<PACKET_LOG_ENTRY> entries;
+std::vector<DNS_INFO> messages;
+ASSERT_TRUE(readPacketLog(path, [&](const PACKET_LOG_ENTRY &entry, const unsigned char *msg, size_t len) {
+    entries.push_back(entry);
+    DnsResolver decoder((Args()));
+    ASSERT_TRUE(decoder.useMessage(msg, len));
+    messages.push_back(decoder.getAnswer());
+}, error)) << error;
+
+ASSERT_EQ(entries.size(), 2);
+ASSERT_EQ(entries[0].kind, LOG_QUERY);
+ASSERT_EQ(entries[1].kind, LOG_RESPONSE);
+ASSERT_EQ(entries[1].port, 5300);
+ASSERT_EQ(entries[1].family, AF_INET);
+ASSERT_EQ(memcmp(entries[1].address, "\x7f\x00\x00\x01", 4), 0);
+ASSERT_LE(entries[0].time, entries[1].time);
+ASSERT_EQ(messages[0].ancount, 0);
+ASSERT_EQ(messages[1].answers[1].value, "140.82.121.4");
+
+// Truncated tail is reported, the complete frames are still decoded
+FILE *file = fopen(path, "ab");
+fwrite("\x00\x00\x01\x00", 1, 4, file);
+fclose(file);
+size_t count = 0;
+ASSERT_FALSE(readPacketLog(path, [&](const PACKET_LOG_ENTRY &, const unsigned char *, size_t) { count++; }, error));
+ASSERT_EQ(count, 2);
+unlink(path);
+}
+
+TEST(PacketLogSuite, SharedByUpstreams)
+{
+const char *path = "/tmp/dns-packet-log-upstreams.bin";
+const char *capturePath = "/tmp/dns-capture-upstreams.bin";
+unlink(path);
+unlink(capturePath);
+
+StubZone zone;
+std::string error;
+std::istringstream input(stubZoneText);
+ASSERT_TRUE(zone.load(input, error));
+StubUdpServer server(zone);
+
+// Second upstream never answers, its names move to the first one
+Args arguments;
+arguments.server = (char *)"127.0.0.1";
+arguments.port = server.start();
+arguments.upstreams = {"127.0.0.2"};
+arguments.log = path;
+arguments.capture = capturePath;
+BULK_OPTIONS options;
+options.shard = SHARD_NAME;
+options.timeout = 50;
+{
+    BulkResolver resolver(arguments, options);
+    resolver.connectToDNSServer();
+    std::string names;
+    for (int i = 0; i < 100; i++)
+        names += "n" + std::to_string(i) + ".github.com\n";
+    std::istringstream stream(names);
+    size_t answered = 0;
+    resolver.run(stream, [&](const BULK_RESULT &result) { answered += result.rcode == RCODE_NXDOMAIN; });
+    ASSERT_EQ(answered, 100);
+}
+
+// One log of both upstreams, each frame has the address of its own upstream
+std::map<int, size_t> queries;
+size_t responses = 0;
+ASSERT_TRUE(readPacketLog(path, [&](const PACKET_LOG_ENTRY &entry, const unsigned char *, size_t) {
+    ASSERT_EQ(entry.family, AF_INET);
+    ASSERT_EQ(memcmp(entry.address, "\x7f\x00\x00", 3), 0);
+    if (entry.kind == LOG_QUERY)
+        queries[entry.address[3]]++;
+    else
+    {
+        ASSERT_EQ(entry.address[3], 1);
+        responses++;
+    }
+}, error)) << error;
+ASSERT_EQ(queries.size(), 2);
+ASSERT_EQ(responses, 100);
+
+ReplayTransport replay(capturePath);
+ASSERT_EQ(replay.responses(), 100);
+unlink(path);
+unlink(capturePath);
+}
+
+TEST(AsyncSuite, ThousandsOfFutures)
+{
+StubZone zone;
+std::string error;
+std::istringstream input(stubZoneText);
+ASSERT_TRUE(zone.load(input, error));
+StubUdpServer server(zone);
+
+Args arguments;
+arguments.server = (char *)"127.0.0.1";
+arguments.port = server.start();
+AsyncResolver resolver(arguments);
+ASSERT_TRUE(resolver.open(error)) << error;
+resolver.start();
+
+// One thread of the loop for all of them
+std::vector<std::future<BULK_RESULT>> futures;
+for (int i = 0; i < 3000; i++)
+    futures.push_back(resolver.resolve(i % 3 ? "github.com" : "nope.github.com", T_A));
+for (int i = 0; i < 3000; i++)
+{
+    BULK_RESULT result = futures[i].get();
+    if (i % 3)
+    {
+        ASSERT_EQ(result.rcode, RCODE_NOERROR);
+        ASSERT_EQ(result.addresses.size(), 1);
+        ASSERT_EQ(result.ttl, 60);
+    }
+    else
+        ASSERT_EQ(result.rcode, RCODE_NXDOMAIN);
+}
+resolver.stop();
+ASSERT_EQ(resolver.inFlight(), 0);
+}
+
+TEST(AsyncSuite, ApplicationLoopAndErrors)
+{
+StubZone zone;
+std::string error;
+std::istringstream input(stubZoneText);
+ASSERT_TRUE(zone.load(input, error));
+StubUdpServer server(zone);
+
+Args arguments;
+arguments.server = (char *)"127.0.0.1";
+arguments.port = server.start();
+AsyncResolver resolver(arguments);
+ASSERT_TRUE(resolver.open(error));
+ASSERT_GE(resolver.fd(), 0);
+
+// Callback queues the next query, the application owns the loop
+std::vector<BULK_RESULT> results;
+resolver.resolve("www.github.com.", T_A, [&](const BULK_RESULT &result) {
+    results.push_back(result);
+    resolver.resolve(result.answers.back().value, T_A, [&](const BULK_RESULT &next) { results.push_back(next); });
+});
+resolver.resolve("bad..name", T_A, [&](const BULK_RESULT &result) { results.push_back(result); });
+for (int i = 0; i < 100 && results.size() < 3; i++)
+    resolver.poll(100);
+
+ASSERT_EQ(results.size(), 3);
+ASSERT_EQ(results[0].rcode, RCODE_INVALID);
+ASSERT_EQ(results[1].answers[0].type, "CNAME");
+ASSERT_EQ(results[2].name, "140.82.121.4");
+ASSERT_EQ(resolver.nextTimeout(), -1);
+
+// Lost queries end with TIMEOUT after all tries, the destructor cancels the rest
+server.stop();
+arguments.timeout = 30;
+arguments.tries = 2;
+AsyncResolver silent(arguments);
+ASSERT_TRUE(silent.open(error));
+std::future<BULK_RESULT> lost = silent.resolve("github.com", T_A);
+for (int i = 0; i < 20 && lost.wait_for(std::chrono::seconds(0)) != std::future_status::ready; i++)
+    silent.poll(50);
+ASSERT_EQ(lost.get().rcode, RCODE_TIMEOUT);
+ASSERT_EQ(silent.errors(), 0); // Refused datagrams are lost answers, not errors of the loop
+
+// Token cancelled when the deadline inside the try is over, the deadline is reported as cancelled too
+arguments.timeout = 1000;
+AsyncResolver patient(arguments);
+ASSERT_TRUE(patient.open(error));
+CancelToken token;
+std::future<BULK_RESULT> late = patient.resolve("github.com", T_A, Deadline::after(20, token));
+patient.poll(0);
+std::this_thread::sleep_for(std::chrono::milliseconds(30));
+token.cancel();
+patient.poll(0);
+ASSERT_EQ(late.get().rcode, RCODE_CANCELLED);
+ASSERT_EQ(patient.lastError(), 0);
+
+std::future<BULK_RESULT> cancelled;
+{
+AsyncResolver stopped(arguments);
+ASSERT_TRUE(stopped.open(error));
+cancelled = stopped.resolve("github.com", T_A);
+stopped.poll(0);
+}
+ASSERT_EQ(cancelled.get().rcode, RCODE_CANCELLED);
+
+Args nowhere;
+AsyncResolver unusable(nowhere);
+ASSERT_FALSE(unusable.open(error));
+ASSERT_FALSE(error.empty());
+}
+
+TEST(SessionSuite, ReusesSocketAndReconnects)
+{
+StubZone zone;
+std::string error;
+std::istringstream input(stubZoneText);
+ASSERT_TRUE(zone.load(input, error));
+StubUdpServer server(zone);
+
+Args arguments;
+arguments.server = (char *)"127.0.0.1";
+arguments.port = server.start();
+arguments.timeout = 100;
+arguments.tries = 1;
+ResolverSession session(arguments);
+
+for (int i = 0; i < 200; i++)
+{
+    BULK_RESULT result = session.resolve(i % 2 ? "github.com." : "fit.vut.cz", i % 2 ? T_A : T_AAAA);
+    ASSERT_EQ(result.rcode, RCODE_NOERROR);
+    ASSERT_EQ(result.addresses.size(), 1);
+}
+ASSERT_EQ(session.resolve("nope.github.com", T_A).rcode, RCODE_NXDOMAIN);
+ASSERT_EQ(session.resolve("bad..name", T_A).rcode, RCODE_INVALID);
+ASSERT_EQ(session.reconnects(), 0);
+ASSERT_EQ(session.queries(), 202);
+
+// Restarted server is reached through new socket without any action of the caller
+server.stop();
+ASSERT_EQ(session.resolve("github.com", T_A).rcode, RCODE_TIMEOUT);
+ASSERT_EQ(session.reconnects(), 1);
+StubUdpServer restarted(zone);
+ASSERT_EQ(restarted.start(arguments.port), arguments.port);
+BULK_RESULT result = session.resolve("www.github.com", T_A);
+ASSERT_EQ(result.rcode, RCODE_NOERROR);
+ASSERT_EQ(result.answers.size(), 2);
+
+Args nowhere;
+ASSERT_THROW(ResolverSession unusable(nowhere), TransportError);
+}
+
+TEST(NameInputSuite, NewlineScan)
+{
+std::mt19937 random(7);
+std::string data;
+for (int i = 0; i < 5000; i++)
+    data += random() % 5 == 0 ? '\n' : (char)('a' + random() % 26);
+
+// Every length checks the tails of the blocks
+for (size_t length : {0, 1, 15, 16, 17, 31, 32, 33, 63, 64, 65, 200, 5000})
+{
+    std::vector<uint32_t> expected, offsets;
+    findNewlinesScalar(data.data(), length, expected);
+    findNewlines(data.data(), length, offsets);
+    ASSERT_EQ(offsets, expected) << length;
+}
+
+NAME_VIEW name;
+ASSERT_TRUE(normalizeLine(" \tWWW.github.com.\r", 18, name));
+ASSERT_EQ(std::string(name.data, name.length), "WWW.github.com");
+ASSERT_FALSE(normalizeLine("  # comment", 11, name));
+ASSERT_FALSE(normalizeLine(" \r", 2, name));
+}
+
+TEST(NameInputSuite, MappedFileMatchesStream)
+{
+// Several windows of two threads, CRLF, comments and the last line without newline
+std::ostringstream text;
+for (int i = 0; i < 200000; i++)
+{
+    text << (i % 3 == 0 ? "Host" : "host") << i % 150000 << ".Example.com" << (i % 2 ? "." : "") << (i % 7 ? "\n" : "\r\n");
+    if (i % 1000 == 0)
+        text << "# comment\n\n";
+}
+text << "last.example.com";
+const char *path = "/tmp/dns-test-names.txt";
+std::ofstream(path) << text.str();
+
+for (bool unique : {false, true})
+{
+    std::istringstream input(text.str());
+    StreamNameSource stream(input, unique);
+    MappedNameSource mapped(path, unique, 2);
+    std::string error, expected, name;
+    ASSERT_TRUE(mapped.opened(error));
+
+    size_t count = 0;
+    while (stream.next(expected))
+    {
+        ASSERT_TRUE(mapped.next(name));
+        ASSERT_EQ(name, expected);
+        count++;
+    }
+    ASSERT_FALSE(mapped.next(name));
+    ASSERT_EQ(name, "last.example.com");
+    ASSERT_EQ(count, unique ? 150001 : 200001);
+    ASSERT_EQ(mapped.duplicates(), unique ? 50000 : 0);
+    ASSERT_EQ(stream.duplicates(), mapped.duplicates());
+}
+
+std::string error;
+std::ofstream(path).close();
+std::unique_ptr<NameSource> empty = openNameSource(path, true, error);
+std::string name;
+ASSERT_TRUE(empty != nullptr);
+ASSERT_FALSE(empty->next(name));
+unlink(path);
+ASSERT_TRUE(openNameSource(path, false, error) == nullptr);
+ASSERT_FALSE(error.empty());
+}
+
+TEST(WatchSuite, ReportsOnlyChanges)
+{
+StubZone zone, changed;
+std::string error;
+std::istringstream input(stubZoneText);
+ASSERT_TRUE(zone.load(input, error));
+std::istringstream changedInput("$ORIGIN github.com.\n"
+                                "@     SOA  ns1 hostmaster 2 3600 600 86400 300\n"
+                                "@  60 A    140.82.121.3\n"
+                                "www 7 CNAME github.com.\n"
+                                "nope A 10.0.0.1\n"
+                                "$ORIGIN vut.cz.\n"
+                                "fit   AAAA 2001:67c:1220:8090::93e5:91a0\n");
+ASSERT_TRUE(changed.load(changedInput, error));
+StubUdpServer server(zone);
+
+Args arguments;
+arguments.server = (char *)"127.0.0.1";
+arguments.port = server.start();
+arguments.timeout = 100;
+WATCH_OPTIONS options;
+options.minInterval = 0.02; // TTLs of the zone are clamped, so the names are queried several times
+options.maxInterval = options.negativeInterval = options.errorInterval = 0.05;
+options.duration = 0.3;
+NameWatcher watcher(arguments, options);
+ASSERT_TRUE(watcher.open(error));
+watcher.add("www.github.com", T_A);
+watcher.add("fit.vut.cz", T_AAAA);
+watcher.add("nope.github.com", T_A);
+
+std::vector<std::string> changes;
+auto collect = [&](const WATCH_CHANGE &change) { changes.push_back(formatChange(change)); };
+WATCH_STATS stats = watcher.run(collect);
+ASSERT_GE(stats.queries, 9);
+std::vector<std::string> expected = {"+ www.github.com., CNAME, IN, 3600, github.com",
+                                     "+ github.com., A, IN, 60, 140.82.121.4",
+                                     "+ fit.vut.cz., AAAA, IN, 3600, 2001:67c:1220:8090::93e5:91a0",
+                                     "! nope.github.com., A, NONE -> NXDOMAIN"};
+std::vector<std::string> sorted = changes;
+std::sort(sorted.begin(), sorted.end());
+std::sort(expected.begin(), expected.end());
+ASSERT_EQ(sorted, expected);
+
+// The same port answers from the changed zone now
+server.stop();
+StubUdpServer restarted(changed);
+ASSERT_EQ(restarted.start(arguments.port), arguments.port);
+changes.clear();
+stats = watcher.run(collect);
+sorted = changes;
+std::sort(sorted.begin(), sorted.end());
+expected = {"! nope.github.com., A, NXDOMAIN -> NOERROR", "+ github.com., A, IN, 60, 140.82.121.3",
+            "+ nope.github.com., A, IN, 3600, 10.0.0.1", "- github.com., A, IN, 60, 140.82.121.4",
+            "~ www.github.com., CNAME, IN, 3600 -> 7, github.com"};
+ASSERT_EQ(sorted, expected);
+ASSERT_EQ(stats.changes, 9);
+ASSERT_EQ(stats.errors, 0);
+}
+
+#ifdef __cpp_impl_coroutine
+struct DETACHED_TASK {
+    struct promise_type {
+        DETACHED_TASK get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+static DETACHED_TASK lookupBoth(AsyncResolver &resolver, std::vector<BULK_RESULT> &results)
+{
+    results.push_back(co_await resolver.lookup("github.com", T_A));
+    results.push_back(co_await resolver.lookup("fit.vut.cz", T_AAAA));
+}
+
+TEST(AsyncSuite, Coroutines)
+{
+StubZone zone;
+std::string error;
+std::istringstream input(stubZoneText);
+ASSERT_TRUE(zone.load(input, error));
+StubUdpServer server(zone);
+
+Args arguments;
+arguments.server = (char *)"127.0.0.1";
+arguments.port = server.start();
+AsyncResolver resolver(arguments);
+ASSERT_TRUE(resolver.open(error));
+
+std::vector<BULK_RESULT> results;
+lookupBoth(resolver, results);
+for (int i = 0; i < 100 && results.size() < 2; i++)
+    resolver.poll(100);
+ASSERT_EQ(results.size(), 2);
+ASSERT_EQ(results[1].addresses.size(), 1);
+}
+#endif
+
 int main()
 {
     testing::InitGoogleTest();
@@ -0,0 +1,170 @@
+/**
+ * @author Rostislav Kral
+ * @brief Implementation of the Tracer class.
+ * @file trace.cpp
+ * */
+
+#include "trace.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <unistd.h>
+#include <vector>
+
+#define TRACE_INITIAL_EVENTS 4096 // Reserved events of the new thread buffer
+
+/**
+ * @brief Events of one thread, only the thread itself appends to them
+ * */
+struct THREAD_BUFFER {
+    uint32_t tid;
+    std::vector<TRACE_EVENT> events;
+    uint64_t dropped = 0;
+};
+
+std::atomic<bool> Tracer::active(false);
+
+// Buffers outlive their threads and reset() only empties them, so the pointer of the thread never dangles
+static std::mutex registryLock;
+static std::vector<std::unique_ptr<THREAD_BUFFER>> registry;
+static thread_local THREAD_BUFFER *current = nullptr;
+
+static THREAD_BUFFER *threadBuffer()
+{
+    if (current == nullptr)
+    {
+        std::lock_guard<std::mutex> lock(registryLock);
+        registry.emplace_back(new THREAD_BUFFER());
+        current = registry.back().get();
+        current->tid = registry.size();
+        current->events.reserve(TRACE_INITIAL_EVENTS);
+    }
+    return current;
+}
+
+void Tracer::enable()
+{
+    active = true;
+}
+
+void Tracer::record(const char *name, char phase, uint64_t id, uint64_t start, uint64_t end)
+{
+    if (!enabled())
+        return;
+    THREAD_BUFFER *buffer = threadBuffer();
+    if (buffer->events.size() >= TRACE_MAX_EVENTS)
+    {
+        buffer->dropped++;
+        return;
+    }
+    buffer->events.push_back(TRACE_EVENT{name, phase, start, end, id});
+}
+
+uint64_t Tracer::events()
+{
+    std::lock_guard<std::mutex> lock(registryLock);
+    uint64_t count = 0;
+    for (const std::unique_ptr<THREAD_BUFFER> &buffer : registry)
+        count += buffer->events.size();
+    return count;
+}
+
+uint64_t Tracer::dropped()
+{
+    std::lock_guard<std::mutex> lock(registryLock);
+    uint64_t count = 0;
+    for (const std::unique_ptr<THREAD_BUFFER> &buffer : registry)
+        count += buffer->dropped;
+    return count;
+}
+
+void Tracer::reset()
+{
+    active = false;
+    std::lock_guard<std::mutex> lock(registryLock);
+    for (const std::unique_ptr<THREAD_BUFFER> &buffer : registry)
+    {
+        buffer->events.clear();
+        buffer->dropped = 0;
+    }
+}
+
+bool Tracer::write(const std::string &path, std::string &error)
+{
+    FILE *file = fopen(path.c_str(), "w");
+    if (file == nullptr)
+    {
+        error = "Cannot open " + path + ": " + strerror(errno);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(registryLock);
+    int pid = getpid();
+
+    // Timestamps are in us from the first event, the viewers don't need the steady clock epoch
+    uint64_t base = UINT64_MAX;
+    for (const std::unique_ptr<THREAD_BUFFER> &buffer : registry)
+    {
+        for (const TRACE_EVENT &event : buffer->events)
+            base = std::min(base, event.start);
+    }
+
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    bool first = true;
+    for (const std::unique_ptr<THREAD_BUFFER> &buffer : registry)
+    {
+        if (buffer->events.empty())
+            continue;
+        fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}",
+                first ? "" : ",\n", pid, buffer->tid, buffer->tid);
+        first = false;
+
+        for (const TRACE_EVENT &event : buffer->events)
+        {
+            double start = (event.start - base) / 1000.0, end = (event.end - base) / 1000.0;
+            if (event.phase == TRACE_COMPLETE)
+                fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"dns\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u,"
+                        "\"args\":{\"query\":%llu}}",
+                        event.name, start, end - start, pid, buffer->tid, (unsigned long long)event.id);
+            else if (event.phase == TRACE_ASYNC)
+            {
+                // Async events of one id nest by time, the query span contains its tries
+                fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"query\",\"ph\":\"b\",\"id\":%llu,\"ts\":%.3f,\"pid\":%d,\"tid\":%u}",
+                        event.name, (unsigned long long)event.id, start, pid, buffer->tid);
+                fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"query\",\"ph\":\"e\",\"id\":%llu,\"ts\":%.3f,\"pid\":%d,\"tid\":%u}",
+                        event.name, (unsigned long long)event.id, end, pid, buffer->tid);
+            }
+            else
+                fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"dns\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":%d,\"tid\":%u,"
+                        "\"args\":{\"query\":%llu}}",
+                        event.name, start, pid, buffer->tid, (unsigned long long)event.id);
+        }
+    }
+    fprintf(file, "\n]}\n");
+
+    bool failed = ferror(file) != 0;
+    if (fclose(file) != 0 || failed)
+    {
+        error = "Cannot write " + path;
+        return false;
+    }
+    return true;
+}
+
+TraceFile::TraceFile(const std::string &path) : path(path)
+{
+    Tracer::enable();
+}
+
+TraceFile::~TraceFile()
+{
+    std::string error;
+    if (!Tracer::write(path, error))
+        std::cerr << error << std::endl;
+    else if (Tracer::dropped() > 0)
+        std::cerr << "Trace: " << Tracer::dropped() << " events dropped, the thread buffers were full" << std::endl;
+}
@@ -0,0 +1,149 @@
+/**
+ * @author Rostislav Kral
+ * @brief Contains the tracer of the query lifecycle. Every thread appends the spans to its own buffer without any
+ * lock, the buffers are written as Chrome trace-event JSON (chrome://tracing, ui.perfetto.dev) at the end.
+ *
+ * Spans of the thread (encode, send, poll, receive, parse, cache, format) are complete events, the time the query
+ * spends in flight is an async span per try ("wait") nested in the span of the whole query, so queueing behind other
+ * queries is visible in the timeline. Retries and hedges are instant events of the query.
+ * @file trace.h
+ * */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#define TRACE_MAX_EVENTS (1 << 22) // Events of one thread, later events are dropped and counted
+
+#define TRACE_COMPLETE 'X' // Span of the thread
+#define TRACE_ASYNC 'b' // Span of the query in flight, written as begin and end
+#define TRACE_INSTANT 'i'
+
+/**
+ * @brief Recorded event, the name must be a string literal (only the pointer is kept)
+ * */
+struct TRACE_EVENT {
+    const char *name;
+    char phase; // TRACE_COMPLETE, TRACE_ASYNC or TRACE_INSTANT
+    uint64_t start; // ns of the steady clock
+    uint64_t end; // Same as start for instant events
+    uint64_t id; // Query the event belongs to, 0 = none
+};
+
+class Tracer {
+public:
+    /**
+     * @brief Starts recording, until then every call is only one relaxed load
+     * @return
+     * */
+    static void enable();
+
+    static bool enabled() { return active.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Time of the steady clock in ns
+     * @return uint64_t
+     * */
+    static uint64_t now() { return at(std::chrono::steady_clock::now()); }
+
+    static uint64_t at(std::chrono::steady_clock::time_point time)
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+    }
+
+    /**
+     * @brief Records the event to the buffer of the calling thread
+     * @param name String literal
+     * @param phase TRACE_COMPLETE, TRACE_ASYNC or TRACE_INSTANT
+     * @param id Query, async spans with the same id and name nest
+     * @param start ns
+     * @param end ns
+     * @return
+     * */
+    static void record(const char *name, char phase, uint64_t id, uint64_t start, uint64_t end);
+
+    static void instant(const char *name, uint64_t id)
+    {
+        if (enabled())
+        {
+            uint64_t time = now();
+            record(name, TRACE_INSTANT, id, time, time);
+        }
+    }
+
+    /**
+     * @brief Writes the events of all threads as JSON object with traceEvents, the threads must not record meanwhile
+     * @param path
+     * @param error Output, reason of the failure
+     * @return false if the file can't be written
+     * */
+    static bool write(const std::string &path, std::string &error);
+
+    /**
+     * @brief Number of the recorded events and the dropped ones
+     * @return uint64_t
+     * */
+    static uint64_t events();
+
+    static uint64_t dropped();
+
+    /**
+     * @brief Stops recording and forgets the events, the threads must not record meanwhile
+     * @return
+     * */
+    static void reset();
+
+private:
+    static std::atomic<bool> active;
+};
+
+/**
+ * @brief Id of the query of one type of the name in the bulk run
+ * @param index Position of the name in the input
+ * @param qtype
+ * @return uint64_t
+ * */
+inline uint64_t traceId(uint64_t index, uint16_t qtype) { return index << 16 | qtype; }
+
+/**
+ * @brief Complete event from the construction to the destruction, nothing is recorded when the tracer is off
+ * */
+class TraceSpan {
+public:
+    explicit TraceSpan(const char *name, uint64_t id = 0) : name(name), id(id), start(Tracer::enabled() ? Tracer::now() : 0)
+    {
+    }
+
+    ~TraceSpan()
+    {
+        if (start != 0)
+            Tracer::record(name, TRACE_COMPLETE, id, start, Tracer::now());
+    }
+
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+
+private:
+    const char *name;
+    uint64_t id;
+    uint64_t start;
+};
+
+/**
+ * @brief Enables the tracer for the lifetime of the object and writes the file at its end, failure goes to stderr
+ * */
+class TraceFile {
+public:
+    explicit TraceFile(const std::string &path);
+
+    ~TraceFile();
+
+private:
+    std::string path;
+};
+
+#endif // TRACE_H
@@ -0,0 +1,367 @@
+/**
+ * @author Rostislav Kral
+ * @brief Implementation of the transports.
+ * @file transport.cpp
+ * */
+
+#include "transport.h"
+#include "name-utils.h"
+#include "packet-log.h"
+#include <cerrno>
+#include <poll.h>
+#include <thread>
+
+static std::string systemError(const std::string &message)
+{
+    return message + ": " + strerror(errno);
+}
+
+int connectSocket(const Args &args, int type)
+{
+    struct addrinfo hints, *result, *tmp;
+    int sock = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = type;
+    // Trying to get addresses of the DNS server
+    if (args.server == nullptr || getaddrinfo(args.server, std::to_string(args.port).c_str(), &hints, &result) != 0)
+        throw TransportError("Cannot fetch given dns server!");
+
+    tmp = result;
+
+    while (result != NULL)
+    {
+        if (result->ai_family == AF_INET || result->ai_family == AF_INET6)
+        {
+            if ((sock = socket(result->ai_family, type, 0)) == -1)
+            {
+                freeaddrinfo(tmp);
+                throw TransportError(systemError("Socket creation failed"));
+            }
+            if ((connect(sock, result->ai_addr, result->ai_addrlen)) == -1)
+            {
+                std::string error = systemError("DNS server unreachable");
+                close(sock);
+                freeaddrinfo(tmp);
+                throw TransportError(error);
+            }
+
+            break;
+        }
+        result = result->ai_next;
+    }
+
+    freeaddrinfo(tmp);
+    if (sock == -1)
+        throw TransportError("DNS server not found");
+
+    return sock;
+}
+
+static bool pollSocket(int sock, int timeout)
+{
+    struct pollfd pfd = {sock, POLLIN, 0};
+    int ready;
+
+    while ((ready = poll(&pfd, 1, timeout)) == -1 && errno == EINTR)
+        ;
+    return ready > 0;
+}
+
+bool waitAny(const std::vector<std::unique_ptr<Transport>> &transports, int timeout)
+{
+    std::vector<struct pollfd> sockets;
+
+    // Transports without socket have their messages already, or get none while we wait
+    for (const std::unique_ptr<Transport> &transport : transports)
+    {
+        if (transport->descriptor() == -1)
+        {
+            if (transport->wait(0))
+                return true;
+        }
+        else
+            sockets.push_back({transport->descriptor(), POLLIN, 0});
+    }
+
+    if (sockets.empty())
+    {
+        if (timeout > 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(timeout));
+        return false;
+    }
+
+    int ready;
+    while ((ready = poll(sockets.data(), sockets.size(), timeout)) == -1 && errno == EINTR)
+        ;
+    return ready > 0;
+}
+
+// ---------------------------------------------------------- UDP ----------------------------------------------------------
+
+UdpTransport::UdpTransport(const Args &args)
+{
+    sock = connectSocket(args, SOCK_DGRAM);
+
+    // Many answers can arrive at once, bigger buffer means fewer drops in the kernel
+    int bufferSize = 4 * 1024 * 1024;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+}
+
+UdpTransport::~UdpTransport()
+{
+    close(sock);
+}
+
+void UdpTransport::send(const unsigned char *msg, size_t len)
+{
+    // Full buffer or ICMP unreachable from the previous datagram only lose this datagram
+    if (::send(sock, msg, len, 0) < 0 && errno != EAGAIN && errno != ECONNREFUSED)
+        throw TransportError(systemError("Send failed"));
+}
+
+bool UdpTransport::wait(int timeout)
+{
+    return pollSocket(sock, timeout);
+}
+
+size_t UdpTransport::receive(unsigned char *buf, size_t size)
+{
+    ssize_t received;
+
+    while ((received = recv(sock, buf, size, MSG_DONTWAIT)) < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        if (errno != ECONNREFUSED && errno != EINTR)
+            throw TransportError(systemError("Failed to receive"));
+    }
+    return received;
+}
+
+// ---------------------------------------------------------- TCP ----------------------------------------------------------
+
+TcpTransport::TcpTransport(const Args &args) : message(MAX_TCP_DNS_SIZE)
+{
+    sock = connectSocket(args, SOCK_STREAM);
+}
+
+TcpTransport::~TcpTransport()
+{
+    close(sock);
+}
+
+void TcpTransport::send(const unsigned char *msg, size_t len)
+{
+    unsigned char prefix[2] = {(unsigned char)(len >> 8), (unsigned char)(len & 0xFF)};
+    struct iovec parts[2] = {{prefix, 2}, {const_cast<unsigned char *>(msg), len}};
+    struct msghdr header;
+
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = parts;
+    header.msg_iovlen = 2;
+    if (len > MAX_TCP_DNS_SIZE || sendmsg(sock, &header, MSG_NOSIGNAL) != (ssize_t)(len + 2))
+        throw TransportError(systemError("Send failed"));
+}
+
+bool TcpTransport::wait(int timeout)
+{
+    return pollSocket(sock, timeout);
+}
+
+// Reads exactly len bytes, the message is already arriving so blocking is fine
+static void readFull(int sock, unsigned char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t received = recv(sock, buf, len, 0);
+        if (received == 0)
+            throw TransportError("Connection closed by the server");
+        if (received < 0 && errno != EINTR)
+            throw TransportError(systemError("Failed to receive"));
+        if (received > 0)
+        {
+            buf += received;
+            len -= received;
+        }
+    }
+}
+
+size_t TcpTransport::receive(unsigned char *buf, size_t size)
+{
+    unsigned char prefix[2];
+
+    if (!pollSocket(sock, 0))
+        return 0;
+
+    readFull(sock, prefix, 2);
+    size_t length = (prefix[0] << 8) | prefix[1];
+    readFull(sock, message.data(), length);
+
+    length = std::min(length, size);
+    memcpy(buf, message.data(), length);
+    return length;
+}
+
+// ---------------------------------------------------------- LOOPBACK ----------------------------------------------------------
+
+LoopbackTransport::LoopbackTransport(Handler handler) : handler(handler), scratch(MAX_TCP_DNS_SIZE)
+{
+}
+
+void LoopbackTransport::send(const unsigned char *msg, size_t len)
+{
+    sentCount++;
+    size_t length = handler(msg, len, scratch.data());
+    if (length > 0)
+        pending.emplace_back(scratch.begin(), scratch.begin() + length);
+}
+
+bool LoopbackTransport::wait(int timeout)
+{
+    if (pending.empty() && timeout > 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(timeout));
+    return !pending.empty();
+}
+
+size_t LoopbackTransport::receive(unsigned char *buf, size_t size)
+{
+    if (pending.empty())
+        return 0;
+
+    size_t length = std::min(size, pending.front().size());
+    memcpy(buf, pending.front().data(), length);
+    pending.pop_front();
+    return length;
+}
+
+// ---------------------------------------------------------- REPLAY ----------------------------------------------------------
+
+// Lowercase question name and type, empty for message without question
+static std::string questionKey(const unsigned char *msg, size_t len)
+{
+    size_t pos = sizeof(DNS_HEADER);
+    std::string name;
+
+    if (len < sizeof(DNS_HEADER) || ntohs(reinterpret_cast<const DNS_HEADER *>(msg)->qdcount) == 0 ||
+        !readName(msg, len, pos, name) || pos + sizeof(QUESTION) > len)
+        return "";
+    return nameToLower(name) + "/" + std::to_string((msg[pos] << 8) | msg[pos + 1]);
+}
+
+ReplayTransport::ReplayTransport(const std::string &path)
+    : LoopbackTransport([this](const unsigned char *query, size_t len, unsigned char *out) { return answer(query, len, out); })
+{
+    FILE *file = fopen(path.c_str(), "rb");
+    unsigned char prefix[2];
+    std::vector<unsigned char> message;
+
+    if (file == nullptr)
+        throw TransportError(systemError("Cannot open the replay file"));
+
+    while (fread(prefix, 1, 2, file) == 2)
+    {
+        message.resize((prefix[0] << 8) | prefix[1]);
+        if (fread(message.data(), 1, message.size(), file) != message.size())
+            break;
+
+        std::string key = questionKey(message.data(), message.size());
+        if (!key.empty())
+        {
+            recorded[key].push_back(message);
+            count++;
+        }
+    }
+    fclose(file);
+}
+
+size_t ReplayTransport::answer(const unsigned char *query, size_t len, unsigned char *out)
+{
+    auto responses = recorded.find(questionKey(query, len));
+    if (responses == recorded.end())
+        return 0; // Never recorded, looks like lost query
+
+    size_t &index = next[responses->first];
+    const std::vector<unsigned char> &response = responses->second[index];
+    index = (index + 1) % responses->second.size();
+
+    memcpy(out, response.data(), response.size());
+    memcpy(out, query, 2); // ID of the query
+    return response.size();
+}
+
+// ---------------------------------------------------------- RECORDING ----------------------------------------------------------
+
+std::shared_ptr<FILE> openCaptureFile(const std::string &path)
+{
+    FILE *file = fopen(path.c_str(), "ab");
+    if (file == nullptr)
+        throw TransportError(systemError("Cannot create the capture file"));
+    return std::shared_ptr<FILE>(file, fclose);
+}
+
+RecordingTransport::RecordingTransport(std::unique_ptr<Transport> inner, const std::string &path)
+    : inner(std::move(inner)), file(openCaptureFile(path))
+{
+}
+
+RecordingTransport::RecordingTransport(std::unique_ptr<Transport> inner, std::shared_ptr<FILE> file)
+    : inner(std::move(inner)), file(std::move(file))
+{
+}
+
+void RecordingTransport::send(const unsigned char *msg, size_t len)
+{
+    inner->send(msg, len);
+}
+
+bool RecordingTransport::wait(int timeout)
+{
+    return inner->wait(timeout);
+}
+
+size_t RecordingTransport::receive(unsigned char *buf, size_t size)
+{
+    size_t length = inner->receive(buf, size);
+    if (length > 0)
+    {
+        unsigned char prefix[2] = {(unsigned char)(length >> 8), (unsigned char)(length & 0xFF)};
+        fwrite(prefix, 1, 2, file.get());
+        fwrite(buf, 1, length, file.get());
+    }
+    return length;
+}
+
+std::unique_ptr<Transport> openTransport(const Args &args, int type)
+{
+    TRANSPORT_SINKS sinks;
+    return openTransport(args, type, sinks);
+}
+
+std::unique_ptr<Transport> openTransport(const Args &args, int type, TRANSPORT_SINKS &sinks)
+{
+    std::unique_ptr<Transport> transport;
+
+    if (!args.replay.empty())
+        return std::unique_ptr<Transport>(new ReplayTransport(args.replay));
+
+    if (type == SOCK_STREAM)
+        transport.reset(new TcpTransport(args));
+    else
+        transport.reset(new UdpTransport(args));
+
+    if (!args.capture.empty())
+    {
+        if (!sinks.capture)
+            sinks.capture = openCaptureFile(args.capture);
+        transport.reset(new RecordingTransport(std::move(transport), sinks.capture));
+    }
+    if (!args.log.empty())
+    {
+        if (!sinks.logger)
+            sinks.logger = std::make_shared<PacketLogger>(args.log);
+        transport.reset(new LoggingTransport(std::move(transport), sinks.logger, args, type));
+    }
+    return transport;
+}
@@ -0,0 +1,229 @@
+/**
+ * @author Rostislav Kral
+ * @brief Contains transports of DNS messages, UDP and TCP sockets, in-memory loopback and replay of recorded responses.
+ * @file transport.h
+ * */
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include "dns-resolver.h"
+
+/**
+ * @brief Failure of the transport, thrown instead of exiting so the caller decides what to do
+ * */
+class TransportError : public std::runtime_error {
+public:
+    explicit TransportError(const std::string &message) : std::runtime_error(message) {}
+};
+
+/**
+ * @brief Sends and receives whole DNS messages, the framing of the stream transports is hidden
+ * */
+class Transport {
+public:
+    virtual ~Transport() {}
+
+    /**
+     * @brief Sends one message, lost UDP datagrams are not an error
+     * @param msg
+     * @param len
+     * @return
+     * */
+    virtual void send(const unsigned char *msg, size_t len) = 0;
+
+    /**
+     * @brief Waits until a message can be received
+     * @param timeout Milliseconds, 0 only checks, -1 waits forever
+     * @return bool true if receive() returns a message now
+     * */
+    virtual bool wait(int timeout) = 0;
+
+    /**
+     * @brief Receives one message without waiting
+     * @param buf Output buffer
+     * @param size Size of the buffer, longer messages are truncated
+     * @return size_t length of the message, 0 if none is pending
+     * */
+    virtual size_t receive(unsigned char *buf, size_t size) = 0;
+
+    /**
+     * @brief Socket to wait on together with other transports
+     * @return int -1 when the transport has none, its messages are ready right after send()
+     * */
+    virtual int descriptor() const { return -1; }
+};
+
+/**
+ * @brief Waits until any of the transports can receive
+ * @param transports
+ * @param timeout Milliseconds, 0 only checks, -1 waits forever
+ * @return bool true if at least one of them has a message now
+ * */
+bool waitAny(const std::vector<std::unique_ptr<Transport>> &transports, int timeout);
+
+/**
+ * @brief Resolves args.server and connects new socket of the given type to it
+ * @param args Server and port
+ * @param type SOCK_DGRAM or SOCK_STREAM
+ * @return int connected socket, TransportError is thrown on failure
+ * */
+int connectSocket(const Args &args, int type);
+
+class UdpTransport : public Transport {
+public:
+    explicit UdpTransport(const Args &args);
+
+    ~UdpTransport();
+
+    void send(const unsigned char *msg, size_t len) override;
+
+    bool wait(int timeout) override;
+
+    size_t receive(unsigned char *buf, size_t size) override;
+
+    int descriptor() const override { return sock; }
+
+private:
+    int sock;
+};
+
+/**
+ * @brief Messages over one TCP connection, each with 2 byte length prefix (RFC 1035 4.2.2)
+ * */
+class TcpTransport : public Transport {
+public:
+    explicit TcpTransport(const Args &args);
+
+    ~TcpTransport();
+
+    void send(const unsigned char *msg, size_t len) override;
+
+    bool wait(int timeout) override;
+
+    size_t receive(unsigned char *buf, size_t size) override;
+
+    int descriptor() const override { return sock; }
+
+private:
+    int sock;
+    std::vector<unsigned char> message;
+};
+
+/**
+ * @brief In-memory server, every sent query is answered synchronously by the handler, no socket is opened
+ * */
+class LoopbackTransport : public Transport {
+public:
+    /**
+     * @brief Writes the answer to out (MAX_TCP_DNS_SIZE bytes), returns its length or 0 to drop the query
+     * */
+    typedef std::function<size_t(const unsigned char *query, size_t len, unsigned char *out)> Handler;
+
+    explicit LoopbackTransport(Handler handler);
+
+    void send(const unsigned char *msg, size_t len) override;
+
+    /**
+     * @brief Nothing can arrive later, so empty queue means sleeping for the whole timeout like a lost datagram
+     * */
+    bool wait(int timeout) override;
+
+    size_t receive(unsigned char *buf, size_t size) override;
+
+    uint64_t sent() const { return sentCount; }
+
+private:
+    Handler handler;
+    std::vector<unsigned char> scratch;
+    std::deque<std::vector<unsigned char>> pending;
+    uint64_t sentCount = 0;
+};
+
+/**
+ * @brief Answers from the file written by RecordingTransport, the response is matched by the question and gets the ID
+ * of the query, repeated questions get the recorded responses in turn
+ * */
+class ReplayTransport : public LoopbackTransport {
+public:
+    explicit ReplayTransport(const std::string &path);
+
+    size_t responses() const { return count; }
+
+private:
+    size_t answer(const unsigned char *query, size_t len, unsigned char *out);
+
+    std::map<std::string, std::vector<std::vector<unsigned char>>> recorded;
+    std::map<std::string, size_t> next;
+    size_t count = 0;
+};
+
+/**
+ * @brief Opens the capture file for appending, TransportError is thrown when it can't be opened
+ * @param path
+ * @return std::shared_ptr<FILE> closed when the last transport using it is gone
+ * */
+std::shared_ptr<FILE> openCaptureFile(const std::string &path);
+
+/**
+ * @brief Passes everything to the inner transport and appends received messages to the file, length prefixed like TCP
+ * */
+class RecordingTransport : public Transport {
+public:
+    RecordingTransport(std::unique_ptr<Transport> inner, const std::string &path);
+
+    /**
+     * @brief Constructor of the RecordingTransport appending to the file shared with other transports of one thread
+     * @param inner
+     * @param file From openCaptureFile()
+     * */
+    RecordingTransport(std::unique_ptr<Transport> inner, std::shared_ptr<FILE> file);
+
+    void send(const unsigned char *msg, size_t len) override;
+
+    bool wait(int timeout) override;
+
+    size_t receive(unsigned char *buf, size_t size) override;
+
+    int descriptor() const override { return inner->descriptor(); }
+
+private:
+    std::unique_ptr<Transport> inner;
+    std::shared_ptr<FILE> file;
+};
+
+class PacketLogger;
+
+/**
+ * @brief Capture file and packet log shared by all transports of one run, openTransport() opens them on first use
+ * */
+struct TRANSPORT_SINKS {
+    std::shared_ptr<FILE> capture;
+    std::shared_ptr<PacketLogger> logger;
+};
+
+/**
+ * @brief Opens the transport selected by the arguments, replay file replaces the server, capture file wraps the socket
+ * @param args
+ * @param type SOCK_DGRAM or SOCK_STREAM
+ * @return std::unique_ptr<Transport>
+ * */
+std::unique_ptr<Transport> openTransport(const Args &args, int type);
+
+/**
+ * @brief Opens the transport selected by the arguments, the capture file and the packet log come from sinks, so
+ * the transports of more upstreams write to one file each (they have to be used by one thread, the log is SPSC)
+ * @param args Arguments of the upstream, its server is recorded in the log
+ * @param type SOCK_DGRAM or SOCK_STREAM
+ * @param sinks Shared files, the missing ones are opened
+ * @return std::unique_ptr<Transport>
+ * */
+std::unique_ptr<Transport> openTransport(const Args &args, int type, TRANSPORT_SINKS &sinks);
+
+#endif // TRANSPORT_H
@@ -0,0 +1,151 @@
+/**
+ * @author Rostislav Kral
+ * @brief Implementation of the UpstreamRing class.
+ * @file upstream-ring.cpp
+ * */
+
+#include "upstream-ring.h"
+#include "name-utils.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// Second level labels under which the countries register the domains (co.uk, com.au, ac.jp, ...)
+static const char *countrySecondLevel[] = {"ac", "co", "com", "edu", "go", "gov", "mil", "ne", "net", "or", "org"};
+
+size_t registrableSuffix(const char *name, size_t len)
+{
+    size_t dots[3] = {len, len, len}; // Positions of the last three dots, len = missing
+    int found = 0;
+
+    for (size_t i = len; i > 0 && found < 3; i--)
+    {
+        if (name[i - 1] == '.')
+            dots[found++] = i - 1;
+    }
+    if (found < 2)
+        return 0; // Two labels or less, the name is the suffix
+
+    // Label between the second and the first dot from the end
+    const char *second = name + dots[1] + 1;
+    size_t secondLength = dots[0] - dots[1] - 1;
+    bool country = len - dots[0] - 1 == 2;
+    if (country)
+    {
+        for (const char *label : countrySecondLevel)
+        {
+            if (strlen(label) == secondLength && nameEquals(label, secondLength, second, secondLength))
+                return found == 3 ? dots[2] + 1 : 0;
+        }
+    }
+    return dots[1] + 1;
+}
+
+uint64_t shardHash(const std::string &name, int mode)
+{
+    size_t offset = mode == SHARD_SUFFIX ? registrableSuffix(name.data(), name.size()) : 0;
+    return nameHash(name.data() + offset, name.size() - offset);
+}
+
+// splitmix64, the points of one upstream are spread over the whole ring
+static uint64_t mix(uint64_t value)
+{
+    value += 0x9e3779b97f4a7c15ULL;
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+    return value ^ (value >> 31);
+}
+
+UpstreamRing::UpstreamRing(size_t upstreams, double loadFactor)
+    : upstreams(upstreams), loadFactor(std::max(1.0, loadFactor))
+{
+    // Points depend only on the index, so the names keep their upstreams between runs
+    for (size_t upstream = 0; upstream < upstreams; upstream++)
+    {
+        for (size_t replica = 0; replica < UPSTREAM_RING_REPLICAS; replica++)
+            points.push_back(POINT{mix(upstream * UPSTREAM_RING_REPLICAS + replica), upstream});
+    }
+    std::sort(points.begin(), points.end());
+}
+
+size_t UpstreamRing::acquire(uint64_t hash, Clock::time_point now, bool &remapped)
+{
+    size_t up = 0;
+    for (UPSTREAM &upstream : upstreams)
+    {
+        if (upstream.down && now >= upstream.retry)
+        {
+            upstream.down = false;
+            upstream.losses = UPSTREAM_DOWN_LOSSES - 1; // Probation, one more timeout and it is down again
+        }
+        up += !upstream.down;
+    }
+    bool all = up == 0; // Nothing better is left, the down ones are used as if they were up
+    if (all)
+        up = upstreams.size();
+
+    // Average load including this query times the factor, some upstream is always under it
+    size_t cap = (size_t)std::ceil(loadFactor * (total + 1) / up);
+
+    size_t start = std::upper_bound(points.begin(), points.end(), POINT{hash, 0}) - points.begin();
+    size_t home = points[start % points.size()].upstream;
+    for (size_t i = 0; i < points.size(); i++)
+    {
+        size_t index = points[(start + i) % points.size()].upstream;
+        UPSTREAM &upstream = upstreams[index];
+        if ((upstream.down && !all) || upstream.load >= cap)
+            continue;
+        upstream.load++;
+        total++;
+        remapped = index != home;
+        return index;
+    }
+
+    // Unreachable, the cap leaves room in at least one upstream
+    remapped = false;
+    upstreams[home].load++;
+    total++;
+    return home;
+}
+
+size_t UpstreamRing::next(uint64_t hash, size_t upstream) const
+{
+    size_t start = std::upper_bound(points.begin(), points.end(), POINT{hash, 0}) - points.begin();
+    for (size_t i = 0; i < points.size(); i++)
+    {
+        size_t index = points[(start + i) % points.size()].upstream;
+        if (index != upstream && !upstreams[index].down)
+            return index;
+    }
+    return upstream;
+}
+
+void UpstreamRing::hold(size_t upstream)
+{
+    upstreams[upstream].load++;
+    total++;
+}
+
+void UpstreamRing::release(size_t upstream)
+{
+    if (upstreams[upstream].load > 0)
+    {
+        upstreams[upstream].load--;
+        total--;
+    }
+}
+
+void UpstreamRing::answered(size_t upstream)
+{
+    upstreams[upstream].losses = 0;
+}
+
+bool UpstreamRing::lost(size_t upstream, Clock::time_point now)
+{
+    UPSTREAM &state = upstreams[upstream];
+    if (state.down || ++state.losses < UPSTREAM_DOWN_LOSSES)
+        return false;
+    state.down = true;
+    state.retry = now + std::chrono::milliseconds(UPSTREAM_DOWN_MS);
+    return true;
+}
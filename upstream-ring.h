@@ -0,0 +1,129 @@
+/**
+ * @author Rostislav Kral
+ * @brief Contains UpstreamRing class, consistent hashing of the names onto the upstreams with bounded load, so
+ * every name is asked at the same upstream and the caches of the upstreams add up instead of repeating each other.
+ * @file upstream-ring.h
+ * */
+
+#ifndef UPSTREAM_RING_H
+#define UPSTREAM_RING_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#define UPSTREAM_RING_REPLICAS 160 // Points of one upstream on the ring, more points = more even shares
+#define UPSTREAM_LOAD_FACTOR 1.25 // Upstream takes at most this multiple of the average load in flight
+#define UPSTREAM_DOWN_LOSSES 8 // Timeouts in a row without any answer that mark the upstream down
+#define UPSTREAM_DOWN_MS 5000 // Down upstream gets queries again after this time, one more timeout marks it down again
+
+#define SHARD_NONE 0 // Queries go to the first upstream
+#define SHARD_NAME 1 // Whole queried name is hashed
+#define SHARD_SUFFIX 2 // Registrable suffix is hashed, names of one domain share the upstream
+
+/**
+ * @brief Finds the registrable suffix without the public suffix list: the last two labels, or three when the second
+ * to last label looks like a second level public suffix of a country (co.uk, com.au)
+ * @param name Without the trailing dot
+ * @param len
+ * @return size_t Offset of the suffix in the name
+ * */
+size_t registrableSuffix(const char *name, size_t len);
+
+/**
+ * @brief Hash of the name for the ring, case insensitive
+ * @param name
+ * @param mode SHARD_NAME or SHARD_SUFFIX
+ * @return uint64_t
+ * */
+uint64_t shardHash(const std::string &name, int mode);
+
+class UpstreamRing {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    /**
+     * @brief Constructor of the UpstreamRing
+     * @param upstreams Number of the upstreams, indexes of the transports
+     * @param loadFactor Bound of the load relative to the average, at least 1
+     * */
+    explicit UpstreamRing(size_t upstreams = 0, double loadFactor = UPSTREAM_LOAD_FACTOR);
+
+    /**
+     * @brief Picks the upstream of the hash and counts the query to its load. The first upstream clockwise from the
+     * hash is taken unless it is down or full, then the next one, so only the names of that upstream move.
+     * @param hash
+     * @param now Down upstreams whose time elapsed are tried again
+     * @param remapped Output, true when the home upstream of the hash was skipped
+     * @return size_t Index of the upstream
+     * */
+    size_t acquire(uint64_t hash, Clock::time_point now, bool &remapped);
+
+    /**
+     * @brief Picks the upstream for the hedge of the query sent to the given one: the first other upstream clockwise
+     * from the hash which isn't down, so the hedges of a name go where its queries would move
+     * @param hash
+     * @param upstream Upstream of the query
+     * @return size_t Index of the upstream, the given one when all others are down
+     * */
+    size_t next(uint64_t hash, size_t upstream) const;
+
+    /**
+     * @brief Counts one more query in flight to the load of the upstream, release() takes it back
+     * @param upstream
+     * @return
+     * */
+    void hold(size_t upstream);
+
+    /**
+     * @brief Query of the upstream is answered or lost, its load decreases
+     * @param upstream
+     * @return
+     * */
+    void release(size_t upstream);
+
+    /**
+     * @brief Upstream answered, the count of its losses starts again
+     * @param upstream
+     * @return
+     * */
+    void answered(size_t upstream);
+
+    /**
+     * @brief Query of the upstream timed out
+     * @param upstream
+     * @param now
+     * @return true if the upstream was marked down by this loss
+     * */
+    bool lost(size_t upstream, Clock::time_point now);
+
+    bool down(size_t upstream) const { return upstreams[upstream].down; }
+
+    size_t load(size_t upstream) const { return upstreams[upstream].load; }
+
+    size_t size() const { return upstreams.size(); }
+
+private:
+    struct POINT {
+        uint64_t hash;
+        size_t upstream;
+
+        bool operator<(const POINT &other) const { return hash < other.hash; }
+    };
+
+    struct UPSTREAM {
+        size_t load = 0; // Queries in flight
+        int losses = 0; // Timeouts since the last answer
+        bool down = false;
+        Clock::time_point retry; // Down until this time
+    };
+
+    std::vector<POINT> points; // Sorted by the hash
+    std::vector<UPSTREAM> upstreams;
+    double loadFactor;
+    size_t total = 0; // Load of all upstreams
+};
+
+#endif // UPSTREAM_RING_H
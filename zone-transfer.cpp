@@ -0,0 +1,267 @@
+/**
+ * @author Rostislav Kral
+ * @brief Implementation of the AXFR/IXFR client and of the incremental parser of the TCP stream.
+ * @file zone-transfer.cpp
+ * */
+
+#include "zone-transfer.h"
+#include "transport.h"
+#include <poll.h>
+
+#define XFR_RECV_CHUNK 16384 // Bytes read from the socket at once
+
+// Serial is the first 32 bit field after MNAME and RNAME
+static bool readSerial(const unsigned char *msg, size_t len, size_t rdata, uint32_t &serial)
+{
+    std::string name;
+
+    if (!readName(msg, len, rdata, name) || !readName(msg, len, rdata, name) || rdata + 4 > len)
+        return false;
+
+    serial = ((uint32_t)msg[rdata] << 24) | (msg[rdata + 1] << 16) | (msg[rdata + 2] << 8) | msg[rdata + 3];
+    return true;
+}
+
+XfrStreamParser::XfrStreamParser(uint16_t id, int qtype, RecordCallback callback, uint32_t clientSerial)
+    : id(id), qtype(qtype), callback(callback), msg(MAX_TCP_DNS_SIZE), clientSerial(clientSerial)
+{
+}
+
+bool XfrStreamParser::endOfStream()
+{
+    if (!done && qtype == T_IXFR && recordIndex == 1 && prefixRead == 0)
+        done = true;
+    return done;
+}
+
+bool XfrStreamParser::fail(const std::string &message)
+{
+    errorMessage = message;
+    return false;
+}
+
+bool XfrStreamParser::feed(const unsigned char *data, size_t len)
+{
+    counters.bytes += len;
+
+    while (len > 0 && !done)
+    {
+        // Every message is prefixed by its length in two bytes (RFC 1035 4.2.2)
+        if (prefixRead < 2)
+        {
+            prefix[prefixRead++] = *data++;
+            len--;
+            if (prefixRead == 2)
+            {
+                msgLength = (prefix[0] << 8) | prefix[1];
+                msgRead = 0;
+                if (msgLength < sizeof(DNS_HEADER))
+                    return fail("Message shorter than DNS header");
+            }
+            continue;
+        }
+
+        size_t chunk = std::min(len, msgLength - msgRead);
+        memcpy(msg.data() + msgRead, data, chunk);
+        msgRead += chunk;
+        data += chunk;
+        len -= chunk;
+
+        if (msgRead == msgLength)
+        {
+            prefixRead = 0;
+            if (!processMessage())
+                return false;
+        }
+    }
+
+    return true;
+}
+
+bool XfrStreamParser::processMessage()
+{
+    const unsigned char *buf = msg.data();
+    const DNS_HEADER *header = reinterpret_cast<const DNS_HEADER *>(buf);
+    size_t pos = sizeof(DNS_HEADER);
+
+    counters.messages++;
+
+    if (ntohs(header->id) != id || !header->qr)
+        return fail("Unexpected message in the transfer stream");
+    if (header->rcode != 0)
+        return fail("Server refused the transfer, RCODE " + std::to_string(header->rcode));
+
+    // Skip the question section, it is present only in the first message
+    std::string name;
+    for (int i = 0; i < ntohs(header->qdcount); i++)
+    {
+        if (!readName(buf, msgLength, pos, name) || pos + sizeof(QUESTION) > msgLength)
+            return fail("Malformed question section");
+        pos += sizeof(QUESTION);
+    }
+
+    uint16_t ancount = ntohs(header->ancount);
+    for (int i = 0; i < ancount && !done; i++)
+    {
+        DNS_REC record;
+        uint16_t type;
+        size_t rdata;
+        uint32_t serial = 0;
+
+        if (!decodeRecord(buf, msgLength, pos, record, &type, &rdata))
+            return fail("Malformed record in the transfer");
+
+        counters.records++;
+
+        if (type == T_SOA && !readSerial(buf, msgLength, rdata, serial))
+            return fail("Malformed SOA record");
+
+        if (recordIndex == 0)
+        {
+            if (type != T_SOA)
+                return fail("Transfer doesn't start with SOA record");
+            newSerial = serial;
+            callback(record, false);
+        }
+        else if (type == T_SOA && recordIndex == 1 && qtype == T_IXFR && serial != newSerial)
+        {
+            // Second SOA with older serial, the server is sending differences (RFC 1995 4)
+            incremental = true;
+            removing = true;
+            callback(record, true);
+        }
+        else if (type == T_SOA && !removing && serial == newSerial)
+        {
+            // Closing SOA, for IXFR the SOA of the last difference comes in the deleted part so it can't get here
+            done = true;
+        }
+        else if (type == T_SOA && incremental)
+        {
+            // SOA switches between the deleted and the added part of the difference
+            removing = !removing;
+            callback(record, removing);
+        }
+        else
+            callback(record, removing);
+
+        recordIndex++;
+    }
+
+    // Up to date IXFR answer contains the single SOA record only, its serial isn't newer than ours (RFC 1982
+    // arithmetic). Newer serial can be the first record of a transfer sent one record per message, so it goes on.
+    if (!done && qtype == T_IXFR && recordIndex == 1 && (int32_t)(newSerial - clientSerial) <= 0)
+        done = true;
+
+    return true;
+}
+
+ZoneTransfer::ZoneTransfer(Args args)
+{
+    this->args = args;
+}
+
+ZoneTransfer::~ZoneTransfer()
+{
+    if (sock >= 0)
+        close(sock);
+}
+
+void ZoneTransfer::connectToDNSServer()
+{
+    sock = connectSocket(args, SOCK_STREAM);
+}
+
+uint16_t ZoneTransfer::sendQuery()
+{
+    unsigned char buf[2 + 2 * MAX_DNS_SIZE]; // IXFR query repeats the zone name in the authority section
+    uint16_t id = (uint16_t)getpid();
+
+    size_t length = buildQuery(buf + 2, id, args.domain, args.xfr, false);
+    if (length == 0)
+        throw TransportError("Invalid zone name!");
+
+    if (args.xfr == T_IXFR)
+    {
+        // Authority section carries the SOA of the version we have, only the serial matters (RFC 1995 3)
+        DNS_HEADER *header = reinterpret_cast<DNS_HEADER *>(buf + 2);
+        header->nscount = htons(1);
+
+        size_t nameLength = encodeName(args.domain, buf + 2 + length);
+        unsigned char *rr = buf + 2 + length + nameLength;
+        const unsigned char fixed[] = {
+            0, T_SOA, 0, 1, // TYPE, CLASS
+            0, 0, 0, 0, // TTL
+            0, 22, // RDLENGTH
+            0, 0, // MNAME and RNAME are the root
+        };
+        memcpy(rr, fixed, sizeof(fixed));
+        rr += sizeof(fixed);
+        uint32_t serial = htonl(args.xfrSerial);
+        memcpy(rr, &serial, sizeof(serial));
+        memset(rr + 4, 0, 16); // REFRESH, RETRY, EXPIRE, MINIMUM
+        length += nameLength + sizeof(fixed) + 20;
+    }
+
+    buf[0] = length >> 8;
+    buf[1] = length & 0xFF;
+
+    if (send(sock, buf, length + 2, MSG_NOSIGNAL) < 0)
+        throw TransportError(std::string("Send failed: ") + strerror(errno));
+
+    return id;
+}
+
+XFR_STATS ZoneTransfer::transfer(XfrStreamParser::RecordCallback callback)
+{
+    return transfer(callback, Deadline::after(args.budget));
+}
+
+XFR_STATS ZoneTransfer::transfer(XfrStreamParser::RecordCallback callback, const Deadline &deadline)
+{
+    typedef std::chrono::steady_clock Clock;
+    auto start = Clock::now();
+    auto lastData = start;
+    unsigned char chunk[XFR_RECV_CHUNK];
+    XfrStreamParser parser(sendQuery(), args.xfr, callback, args.xfrSerial);
+
+    while (!parser.finished())
+    {
+        // The wait is sliced by the deadline, the stream is stalled only after args.timeout without any data
+        auto now = Clock::now();
+        if (deadline.expired(now))
+            throw TransportError(deadline.cancelled() ? "Zone transfer cancelled" : "Zone transfer didn't end within the budget");
+        if (args.timeout >= 0 && now - lastData >= std::chrono::milliseconds(args.timeout))
+            throw TransportError("No data from the server for " + std::to_string(args.timeout) + " ms, transfer stalled");
+
+        int wait = args.timeout < 0 ? -1 : args.timeout - std::chrono::duration_cast<std::chrono::milliseconds>(now - lastData).count();
+        struct pollfd fd = {sock, POLLIN, 0};
+        int ready = poll(&fd, 1, deadline.limit(wait, now));
+        if (ready < 0 && errno != EINTR)
+            throw TransportError(std::string("Failed to receive: ") + strerror(errno));
+        if (ready <= 0)
+            continue;
+
+        ssize_t received = recv(sock, chunk, sizeof(chunk), MSG_DONTWAIT);
+        if (received < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                continue;
+            throw TransportError(std::string("Failed to receive: ") + strerror(errno));
+        }
+        if (received == 0 && parser.endOfStream())
+            break;
+        if (received == 0)
+            throw TransportError("Server closed the connection before the end of the transfer");
+        if (!parser.feed(chunk, received))
+            throw TransportError(parser.error());
+        lastData = Clock::now();
+    }
+
+    close(sock);
+    sock = -1;
+
+    XFR_STATS stats = parser.stats();
+    stats.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    return stats;
+}
@@ -0,0 +1,137 @@
+/**
+ * @author Rostislav Kral
+ * @brief Contains AXFR/IXFR client, the TCP stream is parsed incrementally so the zone is never held in memory.
+ * @file zone-transfer.h
+ * */
+
+#ifndef ZONE_TRANSFER_H
+#define ZONE_TRANSFER_H
+
+#include <functional>
+#include <chrono>
+#include "dns-resolver.h"
+
+/**
+ * @brief Counters of the zone transfer
+ * */
+struct XFR_STATS {
+    uint64_t messages = 0;
+    uint64_t records = 0;
+    uint64_t bytes = 0; // including the TCP length prefixes
+    double seconds = 0;
+
+    double recordsPerSecond() const { return seconds > 0 ? records / seconds : 0; }
+
+    double bytesPerSecond() const { return seconds > 0 ? bytes / seconds : 0; }
+};
+
+/**
+ * @brief State machine which is fed with bytes of the TCP stream as they arrive. Each complete message is decoded
+ * and its records are handed over to the callback, only one message (max. 64 KiB) is buffered at any time.
+ * */
+class XfrStreamParser {
+public:
+    /**
+     * @brief Callback for every record of the transfer, removed is true for records deleted by IXFR difference
+     * */
+    typedef std::function<void(const DNS_REC &record, bool removed)> RecordCallback;
+
+    /**
+     * @brief Constructor of the parser
+     * @param id ID of the query, all messages of the response must carry it
+     * @param qtype T_AXFR or T_IXFR
+     * @param callback Receiver of the records
+     * @param clientSerial Serial sent in the IXFR query, the single SOA not newer than it means up to date
+     * */
+    XfrStreamParser(uint16_t id, int qtype, RecordCallback callback, uint32_t clientSerial = 0);
+
+    /**
+     * @brief Consumes next part of the stream, the data may end anywhere (even inside of the length prefix)
+     * @param data Received bytes
+     * @param len Number of received bytes
+     * @return false if the stream is malformed or the server refused the transfer, see error()
+     * */
+    bool feed(const unsigned char *data, size_t len);
+
+    /**
+     * @brief Whether the closing SOA record was seen
+     * @return bool
+     * */
+    bool finished() const { return done; }
+
+    /**
+     * @brief Server closed the stream, after the single SOA of IXFR it means up to date (RFC 1995 4)
+     * @return bool finished()
+     * */
+    bool endOfStream();
+
+    const XFR_STATS &stats() const { return counters; }
+
+    const std::string &error() const { return errorMessage; }
+
+private:
+    bool processMessage();
+
+    bool fail(const std::string &message);
+
+    uint16_t id;
+    int qtype;
+    RecordCallback callback;
+
+    std::vector<unsigned char> msg; // Allocated once to MAX_TCP_DNS_SIZE
+    unsigned char prefix[2];
+    size_t prefixRead = 0;
+    size_t msgLength = 0;
+    size_t msgRead = 0;
+
+    size_t recordIndex = 0; // Index of the record in the whole transfer
+    uint32_t clientSerial;
+    uint32_t newSerial = 0; // Serial from the opening SOA
+    bool incremental = false; // IXFR answered with differences, not with the whole zone
+    bool removing = false; // Inside the deletion part of IXFR difference
+    bool done = false;
+
+    XFR_STATS counters;
+    std::string errorMessage;
+};
+
+class ZoneTransfer {
+public:
+    /**
+     * @brief Constructor of the ZoneTransfer, args.domain is the zone and args.xfr the type of the transfer
+     * @param args
+     * */
+    explicit ZoneTransfer(Args args);
+
+    ~ZoneTransfer();
+
+    /**
+     * @brief Establishing the TCP connection to the DNS server, TransportError is thrown on failure
+     * @return
+     * */
+    void connectToDNSServer();
+
+    /**
+     * @brief Sending the AXFR/IXFR query and streaming the records of the response to the callback. TransportError
+     * is thrown when the stream is malformed, closed early, silent for args.timeout or longer than args.budget.
+     * @param callback Receiver of the records
+     * @return XFR_STATS
+     * */
+    XFR_STATS transfer(XfrStreamParser::RecordCallback callback);
+
+    /**
+     * @brief transfer() ending at the deadline or its cancellation, whichever comes first
+     * @param callback
+     * @param deadline
+     * @return XFR_STATS
+     * */
+    XFR_STATS transfer(XfrStreamParser::RecordCallback callback, const Deadline &deadline);
+
+private:
+    uint16_t sendQuery();
+
+    int sock = -1;
+    Args args;
+};
+
+#endif // ZONE_TRANSFER_H